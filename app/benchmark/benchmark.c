@@ -34,12 +34,14 @@
 #include <signal.h>
 #include <time.h>
 #include <poll.h>
+#include <pthread.h>
 
 #define MBUS_DEBUG_NAME	"app-benchmark"
 
 #include "mbus/debug.h"
 #include "mbus/json.h"
 #include "mbus/clock.h"
+#include "mbus/compress.h"
 #include "mbus/method.h"
 #include "mbus/tailq.h"
 #include "mbus/client.h"
@@ -100,6 +102,8 @@ struct client {
 #define OPTION_PUBLISH                  'p'
 #define OPTION_REGISTER                 'r'
 #define OPTION_KEEPALIVE                'k'
+#define OPTION_LATENCY                  'l'
+#define OPTION_COMPRESS                 'z'
 static struct option longopts[] = {
         { "help",       no_argument,            NULL,   OPTION_HELP },
         { "clients",    required_argument,      NULL,   OPTION_CLIENTS },
@@ -107,9 +111,35 @@ static struct option longopts[] = {
         { "publish",    required_argument,      NULL,   OPTION_PUBLISH },
         { "register",   required_argument,      NULL,   OPTION_REGISTER },
         { "keepalive",  required_argument,      NULL,   OPTION_KEEPALIVE },
+        { "latency",    required_argument,      NULL,   OPTION_LATENCY },
+        { "compress",   required_argument,      NULL,   OPTION_COMPRESS },
         { NULL,         0,                      NULL,   0 },
 };
 
+#define PROBE_COMMAND                   "org.mbus.benchmark.probe"
+
+#define COMPRESS_SAMPLE                 "{\"source\": \"org.mbus.benchmark\", \"event\": \"org.mbus.benchmark.event\", \"payload\": {\"temperature\": 21.5, \"humidity\": 48, \"status\": \"online\", \"uptime\": 86400}}"
+
+/*
+ * probe client for --latency, calls PROBE_COMMAND on itself through the
+ * broker one at a time, and reports the command round trip time.
+ */
+struct probe {
+        pthread_t thread;
+        int started;
+        int interval;
+        int nclients;
+        struct mbus_client *client;
+        int inflight;
+        unsigned long long sent_at;
+        unsigned long long reported_at;
+        unsigned long long count;
+        unsigned long long failed;
+        unsigned long long total;
+        unsigned long long min;
+        unsigned long long max;
+};
+
 static volatile int g_running;
 
 static void mbus_client_callback_connect (struct mbus_client *mbus_client, void *context, enum mbus_client_connect_status status)
@@ -566,6 +596,384 @@ bail:   if (command != NULL) {
         return NULL;
 }
 
+static unsigned long long probe_clock_usec (void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((unsigned long long) ts.tv_sec) * 1000000ULL + ((unsigned long long) ts.tv_nsec) / 1000ULL;
+}
+
+static void probe_callback_connect (struct mbus_client *mbus_client, void *context, enum mbus_client_connect_status status)
+{
+        int rc;
+        struct mbus_client_register_options register_options;
+        (void) context;
+        if (status != mbus_client_connect_status_success) {
+                fprintf(stderr, "probe connect: %s\n", mbus_client_connect_status_string(status));
+                return;
+        }
+        rc = mbus_client_register_options_default(&register_options);
+        if (rc != 0) {
+                fprintf(stderr, "can not get default register options\n");
+                return;
+        }
+        register_options.command = PROBE_COMMAND;
+        rc = mbus_client_register_with_options(mbus_client, &register_options);
+        if (rc != 0) {
+                fprintf(stderr, "can not register probe command\n");
+                return;
+        }
+}
+
+static int probe_callback_routine (struct mbus_client *mbus_client, void *context, struct mbus_client_message_routine *message)
+{
+        (void) mbus_client;
+        (void) context;
+        (void) message;
+        return 0;
+}
+
+static void probe_callback_command (struct mbus_client *mbus_client, void *context, struct mbus_client_message_command *message, enum mbus_client_command_status status)
+{
+        unsigned long long rtt;
+        struct probe *probe = context;
+        (void) mbus_client;
+        probe->inflight = 0;
+        if (status != mbus_client_command_status_success ||
+            mbus_client_message_command_response_status(message) != 0) {
+                probe->failed += 1;
+                return;
+        }
+        rtt = probe_clock_usec() - probe->sent_at;
+        probe->count += 1;
+        probe->total += rtt;
+        probe->min = (probe->count == 1) ? rtt : MIN(probe->min, rtt);
+        probe->max = MAX(probe->max, rtt);
+}
+
+static void * probe_worker (void *arg)
+{
+        int rc;
+        unsigned long long current;
+        struct probe *probe = arg;
+
+        rc = mbus_client_connect(probe->client);
+        if (rc != 0) {
+                fprintf(stderr, "probe connect failed\n");
+                return NULL;
+        }
+        probe->reported_at = probe_clock_usec();
+        while (g_running) {
+                rc = mbus_client_run(probe->client, MIN(mbus_client_get_run_timeout(probe->client), 10));
+                if (rc != 0) {
+                        fprintf(stderr, "probe run failed\n");
+                        break;
+                }
+                if (mbus_client_get_state(probe->client) != mbus_client_state_connected) {
+                        continue;
+                }
+                current = probe_clock_usec();
+                if (probe->inflight == 0) {
+                        probe->inflight = 1;
+                        probe->sent_at = current;
+                        rc = mbus_client_command(probe->client, mbus_client_get_identifier(probe->client), PROBE_COMMAND, NULL, probe_callback_command, probe);
+                        if (rc != 0) {
+                                fprintf(stderr, "can not call probe command\n");
+                                probe->inflight = 0;
+                        }
+                }
+                if (current - probe->reported_at >= (unsigned long long) probe->interval * 1000ULL) {
+                        fprintf(stdout, "probe: clients: %d, calls: %llu, failed: %llu, rtt (usec): avg: %llu, min: %llu, max: %llu\n",
+                                        probe->nclients,
+                                        probe->count,
+                                        probe->failed,
+                                        (probe->count > 0) ? (probe->total / probe->count) : 0,
+                                        probe->min,
+                                        probe->max);
+                        fflush(stdout);
+                        probe->count = 0;
+                        probe->failed = 0;
+                        probe->total = 0;
+                        probe->min = 0;
+                        probe->max = 0;
+                        probe->reported_at = current;
+                }
+        }
+        return NULL;
+}
+
+static void probe_destroy (struct probe *probe)
+{
+        if (probe == NULL) {
+                return;
+        }
+        if (probe->started) {
+                pthread_join(probe->thread, NULL);
+        }
+        if (probe->client != NULL) {
+                mbus_client_destroy(probe->client);
+        }
+        free(probe);
+}
+
+static struct probe * probe_create (const struct mbus_client_options *_options, int interval, int nclients)
+{
+        int rc;
+        struct probe *probe;
+        struct mbus_client_options options;
+        probe = malloc(sizeof(struct probe));
+        if (probe == NULL) {
+                fprintf(stderr, "can not allocate memory\n");
+                goto bail;
+        }
+        memset(probe, 0, sizeof(struct probe));
+        probe->interval = interval;
+        probe->nclients = nclients;
+        memcpy(&options, _options, sizeof(struct mbus_client_options));
+        memset(&options.callbacks, 0, sizeof(options.callbacks));
+        options.identifier          = NULL;
+        options.callbacks.connect   = probe_callback_connect;
+        options.callbacks.routine   = probe_callback_routine;
+        options.callbacks.context   = probe;
+        probe->client = mbus_client_create(&options);
+        if (probe->client == NULL) {
+                fprintf(stderr, "can not create probe client\n");
+                goto bail;
+        }
+        rc = pthread_create(&probe->thread, NULL, probe_worker, probe);
+        if (rc != 0) {
+                fprintf(stderr, "can not create probe thread\n");
+                goto bail;
+        }
+        probe->started = 1;
+        return probe;
+bail:   if (probe != NULL) {
+                probe_destroy(probe);
+        }
+        return NULL;
+}
+
+static unsigned long long compress_clock_usec (void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ((unsigned long long) ts.tv_sec) * 1000000ULL + ((unsigned long long) ts.tv_nsec) / 1000ULL;
+}
+
+/*
+ * compresses every sample with the given method, then uncompresses
+ * them back, rounds times, and reports the ratio and the process cpu
+ * time spent per message for both directions. stream methods keep one
+ * context per direction alive across all messages, the same way a
+ * connection does, so the ratio includes the history they build up.
+ */
+static int compress_measure (const char *name, enum mbus_compress_method compression, struct mbus_compress_dictionary *dictionary, const char **samples, int nsamples, int rounds)
+{
+        int i;
+        int r;
+        int rc;
+        int length;
+        int maxlength;
+        void **compressed;
+        int *compressedlen;
+        char *uncompressed;
+        struct mbus_compress_stream *encoder;
+        struct mbus_compress_stream *decoder;
+        unsigned long long start;
+        unsigned long long compress_time;
+        unsigned long long uncompress_time;
+        unsigned long long raw_bytes;
+        unsigned long long compressed_bytes;
+
+        encoder = NULL;
+        decoder = NULL;
+        uncompressed = NULL;
+        compress_time = 0;
+        uncompress_time = 0;
+        raw_bytes = 0;
+        compressed_bytes = 0;
+
+        compressed = malloc(sizeof(void *) * nsamples);
+        compressedlen = malloc(sizeof(int) * nsamples);
+        if (compressed == NULL ||
+            compressedlen == NULL) {
+                fprintf(stderr, "can not allocate memory\n");
+                goto bail;
+        }
+        memset(compressed, 0, sizeof(void *) * nsamples);
+        maxlength = 0;
+        for (i = 0; i < nsamples; i++) {
+                maxlength = MAX(maxlength, (int) strlen(samples[i]));
+        }
+        uncompressed = malloc(maxlength);
+        if (uncompressed == NULL) {
+                fprintf(stderr, "can not allocate memory\n");
+                goto bail;
+        }
+        if (dictionary != NULL) {
+                encoder = mbus_compress_stream_create_with_dictionary(dictionary);
+                decoder = mbus_compress_stream_create_with_dictionary(dictionary);
+        } else if (mbus_compress_method_is_stream(compression)) {
+                encoder = mbus_compress_stream_create(compression);
+                decoder = mbus_compress_stream_create(compression);
+        }
+        if ((dictionary != NULL || mbus_compress_method_is_stream(compression)) &&
+            (encoder == NULL || decoder == NULL)) {
+                fprintf(stderr, "can not create compress stream\n");
+                goto bail;
+        }
+
+        for (r = 0; r < rounds; r++) {
+                start = compress_clock_usec();
+                for (i = 0; i < nsamples; i++) {
+                        if (encoder != NULL) {
+                                rc = mbus_compress_stream_data(encoder, &compressed[i], &compressedlen[i], samples[i], strlen(samples[i]));
+                        } else {
+                                rc = mbus_compress_data(compression, &compressed[i], &compressedlen[i], samples[i], strlen(samples[i]));
+                        }
+                        if (rc != 0) {
+                                if (r == 0 && i == 0) {
+                                        fprintf(stdout, "compress: method: %-16s, not supported\n", name);
+                                        goto out;
+                                }
+                                fprintf(stderr, "can not compress sample\n");
+                                goto bail;
+                        }
+                }
+                compress_time += compress_clock_usec() - start;
+
+                start = compress_clock_usec();
+                for (i = 0; i < nsamples; i++) {
+                        length = maxlength;
+                        if (decoder != NULL) {
+                                rc = mbus_uncompress_stream_data_to(decoder, uncompressed, &length, compressed[i], compressedlen[i]);
+                        } else {
+                                rc = mbus_uncompress_data_to(compression, uncompressed, &length, compressed[i], compressedlen[i]);
+                        }
+                        if (rc != 0 ||
+                            length != (int) strlen(samples[i])) {
+                                fprintf(stderr, "can not uncompress sample\n");
+                                goto bail;
+                        }
+                }
+                uncompress_time += compress_clock_usec() - start;
+
+                for (i = 0; i < nsamples; i++) {
+                        raw_bytes += strlen(samples[i]);
+                        compressed_bytes += compressedlen[i];
+                        free(compressed[i]);
+                        compressed[i] = NULL;
+                }
+        }
+
+        fprintf(stdout, "compress: method: %-16s, messages: %d, bytes: %llu -> %llu, ratio: %.3f, cpu (usec/msg): compress: %.3f, uncompress: %.3f\n",
+                        name,
+                        nsamples * rounds,
+                        raw_bytes,
+                        compressed_bytes,
+                        (double) compressed_bytes / (double) raw_bytes,
+                        (double) compress_time / (double) (nsamples * rounds),
+                        (double) uncompress_time / (double) (nsamples * rounds));
+out:    for (i = 0; i < nsamples; i++) {
+                if (compressed[i] != NULL) {
+                        free(compressed[i]);
+                }
+        }
+        mbus_compress_stream_destroy(encoder);
+        mbus_compress_stream_destroy(decoder);
+        free(uncompressed);
+        free(compressedlen);
+        free(compressed);
+        return 0;
+bail:   if (compressed != NULL) {
+                for (i = 0; i < nsamples; i++) {
+                        if (compressed[i] != NULL) {
+                                free(compressed[i]);
+                        }
+                }
+                free(compressed);
+        }
+        if (compressedlen != NULL) {
+                free(compressedlen);
+        }
+        if (uncompressed != NULL) {
+                free(uncompressed);
+        }
+        if (encoder != NULL) {
+                mbus_compress_stream_destroy(encoder);
+        }
+        if (decoder != NULL) {
+                mbus_compress_stream_destroy(decoder);
+        }
+        return -1;
+}
+
+static int compress_report (struct publishs *publishs, const char *zstd_dictionary, int rounds)
+{
+        int rc;
+        int nsamples;
+        const char **samples;
+        struct publish *publish;
+        struct mbus_compress_dictionary *dictionary;
+        static const enum mbus_compress_method methods[] = {
+                mbus_compress_method_zlib,
+                mbus_compress_method_zlib_stream,
+                mbus_compress_method_lz4,
+                mbus_compress_method_zstd,
+        };
+        unsigned int i;
+
+        samples = NULL;
+        dictionary = NULL;
+
+        nsamples = 0;
+        TAILQ_FOREACH(publish, publishs, list) {
+                nsamples += 1;
+        }
+        samples = malloc(sizeof(char *) * MAX(nsamples, 1));
+        if (samples == NULL) {
+                fprintf(stderr, "can not allocate memory\n");
+                goto bail;
+        }
+        nsamples = 0;
+        TAILQ_FOREACH(publish, publishs, list) {
+                samples[nsamples++] = publish->payload;
+        }
+        if (nsamples == 0) {
+                samples[nsamples++] = COMPRESS_SAMPLE;
+        }
+
+        for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+                rc = compress_measure(mbus_compress_method_string(methods[i]), methods[i], NULL, samples, nsamples, rounds);
+                if (rc != 0) {
+                        fprintf(stderr, "can not measure compression\n");
+                        goto bail;
+                }
+        }
+        if (zstd_dictionary != NULL) {
+                dictionary = mbus_compress_dictionary_create_from_file(mbus_compress_method_zstd, zstd_dictionary);
+                if (dictionary == NULL) {
+                        fprintf(stderr, "can not load zstd dictionary: %s\n", zstd_dictionary);
+                        goto bail;
+                }
+                rc = compress_measure("zstd-dictionary", mbus_compress_method_zstd, dictionary, samples, nsamples, rounds);
+                if (rc != 0) {
+                        fprintf(stderr, "can not measure compression\n");
+                        goto bail;
+                }
+                mbus_compress_dictionary_destroy(dictionary);
+        }
+        free(samples);
+        return 0;
+bail:   if (dictionary != NULL) {
+                mbus_compress_dictionary_destroy(dictionary);
+        }
+        if (samples != NULL) {
+                free(samples);
+        }
+        return -1;
+}
+
 static void signal_handler (int signal)
 {
 	(void) signal;
@@ -588,6 +996,11 @@ static void usage (void)
         fprintf(stdout, "                    -1 : all of clients\n");
         fprintf(stdout, "                    0  : none of clients\n");
         fprintf(stdout, "                    > 0: n of clients\n");
+        fprintf(stdout, "  -l, --latency   : report command round trip time of a probe client every n milliseconds (default: 0)\n");
+        fprintf(stdout, "                    the probe calls a command on itself through the broker, this is end to end latency,\n");
+        fprintf(stdout, "                    not the broker loop cost, compare it between runs with different number of clients\n");
+        fprintf(stdout, "  -z, --compress  : compress publish payloads n times with every compression method, report ratio and cpu time, and exit (default: 0)\n");
+        fprintf(stdout, "                    a built-in sample is used when there is no publish, zstd dictionary is set with --mbus-client-zstd-dictionary\n");
 	fprintf(stdout, "  -h, --help      : this text\n");
 	fprintf(stdout, "  --mbus-help     : mbus help text\n");
 	mbus_client_usage();
@@ -619,15 +1032,22 @@ int main (int argc, char *argv[])
 	struct clients clients;
 	struct mbus_client_options mbus_client_options;
 
+        struct probe *probe;
+
 	int i;
 	int nclients;
 	int keepalive;
+        int latency;
+        int compress;
 	int timeout;
 	struct pollfd *pollfds;
 
 	pollfds   = NULL;
 	nclients  = 1;
 	keepalive = -1;
+        latency   = 0;
+        compress  = 0;
+        probe     = NULL;
 	TAILQ_INIT(&clients);
         TAILQ_INIT(&commands);
         TAILQ_INIT(&publishs);
@@ -651,7 +1071,7 @@ int main (int argc, char *argv[])
 		_argv[_argc] = argv[_argc];
 	}
 
-	while ((c = getopt_long(_argc, _argv, ":c:s:p:r:k:h", longopts, NULL)) != -1) {
+	while ((c = getopt_long(_argc, _argv, ":c:s:p:r:k:l:z:h", longopts, NULL)) != -1) {
 		switch (c) {
 			case OPTION_CLIENTS:
 				nclients = atoi(optarg);
@@ -683,6 +1103,12 @@ int main (int argc, char *argv[])
                         case OPTION_KEEPALIVE:
                                 keepalive = atoi(optarg);
                                 break;
+                        case OPTION_LATENCY:
+                                latency = atoi(optarg);
+                                break;
+                        case OPTION_COMPRESS:
+                                compress = atoi(optarg);
+                                break;
 			case OPTION_HELP:
 				usage();
 				goto bail;
@@ -700,6 +1126,8 @@ int main (int argc, char *argv[])
         }
         fprintf(stdout, "clients      : %d\n", nclients);
         fprintf(stdout, "keepalive    : %d\n", keepalive);
+        fprintf(stdout, "latency      : %d\n", latency);
+        fprintf(stdout, "compress     : %d\n", compress);
         fprintf(stdout, "publishs     :\n");
         TAILQ_FOREACH(publish, &publishs, list) {
                 fprintf(stderr, "  interval: %d, event: '%s', payload: '%s'\n", publish->interval, publish->event, publish->payload);
@@ -723,6 +1151,14 @@ int main (int argc, char *argv[])
 		fprintf(stderr, "can not parse options\n");
 		goto bail;
 	}
+        if (compress > 0) {
+                rc = compress_report(&publishs, mbus_client_options.zstd_dictionary, compress);
+                if (rc != 0) {
+                        fprintf(stderr, "can not report compression\n");
+                        goto bail;
+                }
+                goto out;
+        }
 	for (i = 0; i < nclients; i++) {
 		client = client_create(&mbus_client_options, (i < keepalive), &subscriptions, &publishs, &commands);
 		if (client == NULL) {
@@ -738,7 +1174,15 @@ int main (int argc, char *argv[])
 		goto bail;
 	}
 
-	while (1) {
+        if (latency > 0) {
+                probe = probe_create(&mbus_client_options, latency, nclients);
+                if (probe == NULL) {
+                        fprintf(stderr, "can not create probe\n");
+                        goto bail;
+                }
+        }
+
+	while (g_running) {
 		i = 0;
 		timeout = 1000;
                 TAILQ_FOREACH(client, &clients, list) {
@@ -777,7 +1221,7 @@ int main (int argc, char *argv[])
 		}
 	}
 
-        TAILQ_FOREACH_SAFE(command, &commands, list, ncommand) {
+out:    TAILQ_FOREACH_SAFE(command, &commands, list, ncommand) {
                 TAILQ_REMOVE(&commands, command, list);
                 command_destroy(command);
         }
@@ -789,6 +1233,9 @@ int main (int argc, char *argv[])
                 TAILQ_REMOVE(&subscriptions, subscription, list);
                 subscription_destroy(subscription);
         }
+        if (probe != NULL) {
+                probe_destroy(probe);
+        }
 	TAILQ_FOREACH_SAFE(client, &clients, list, nclient) {
 		TAILQ_REMOVE(&clients, client, list);
 		client_destroy(client);
@@ -796,7 +1243,11 @@ int main (int argc, char *argv[])
 	free(pollfds);
 	free(_argv);
 	return 0;
-bail:	TAILQ_FOREACH_SAFE(command, &commands, list, ncommand) {
+bail:	g_running = 0;
+        if (probe != NULL) {
+                probe_destroy(probe);
+        }
+        TAILQ_FOREACH_SAFE(command, &commands, list, ncommand) {
                 TAILQ_REMOVE(&commands, command, list);
                 command_destroy(command);
         }
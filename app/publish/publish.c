@@ -44,12 +44,14 @@
 #define OPTION_EVENT		'e'
 #define OPTION_PAYLOAD		'p'
 #define OPTION_FLOOD		'f'
+#define OPTION_PRIORITY		'r'
 static struct option longopts[] = {
 	{ "help",		no_argument,		NULL,	OPTION_HELP },
 	{ "destination",	required_argument,	NULL,	OPTION_DESTINATION },
 	{ "event",		required_argument,	NULL,	OPTION_EVENT },
 	{ "payload",		required_argument,	NULL,	OPTION_PAYLOAD },
 	{ "flood",		required_argument,	NULL,	OPTION_FLOOD },
+	{ "priority",		required_argument,	NULL,	OPTION_PRIORITY },
 	{ NULL,			0,			NULL,	0 },
 };
 
@@ -60,6 +62,7 @@ static void usage (void)
 	fprintf(stdout, "  -e, --event              : event identifier (default: null)\n");
 	fprintf(stdout, "  -p, --payload            : payload json (default: null)\n");
 	fprintf(stdout, "  -f, --flood              : flood event n times (default: 1)\n");
+	fprintf(stdout, "  -r, --priority           : control, command or bulk (default: default)\n");
 	fprintf(stdout, "  -h, --help               : this text\n");
 	fprintf(stdout, "  --mbus-help              : mbus help text\n");
 	mbus_client_usage();
@@ -70,6 +73,7 @@ struct arg {
 	const char *event;
 	struct mbus_json *payload;
 	int flood;
+	enum mbus_client_priority priority;
 	int published;
 	int finished;
 	int result;
@@ -111,6 +115,7 @@ static void mbus_client_callback_connect (struct mbus_client *client, void *cont
 			publish_options.event = arg->event;
 			publish_options.payload = arg->payload;
 			publish_options.qos = mbus_client_qos_at_least_once;
+			publish_options.priority = arg->priority;
 			rc = mbus_client_publish_with_options(client, &publish_options);
 			if (rc != 0) {
 				break;
@@ -156,7 +161,7 @@ int main (int argc, char *argv[])
 		_argv[_argc] = argv[_argc];
 	}
 
-	while ((c = getopt_long(_argc, _argv, ":d:e:p:f:h", longopts, NULL)) != -1) {
+	while ((c = getopt_long(_argc, _argv, ":d:e:p:f:r:h", longopts, NULL)) != -1) {
 		switch (c) {
 			case OPTION_DESTINATION:
 				arg.destination = optarg;
@@ -178,6 +183,18 @@ int main (int argc, char *argv[])
 					goto bail;
 				}
 				break;
+			case OPTION_PRIORITY:
+				if (strcmp(optarg, "control") == 0) {
+					arg.priority = mbus_client_priority_control;
+				} else if (strcmp(optarg, "command") == 0) {
+					arg.priority = mbus_client_priority_command;
+				} else if (strcmp(optarg, "bulk") == 0) {
+					arg.priority = mbus_client_priority_bulk;
+				} else {
+					fprintf(stderr, "invalid priority\n");
+					goto bail;
+				}
+				break;
 			case OPTION_HELP:
 				usage();
 				goto bail;
@@ -38,7 +38,15 @@
 #include "mbus/compress.h"
 #include "buffer.h"
 
+/*
+ * data lives in buffer[offset, offset + length). shift only advances the
+ * offset, the live data is moved back to the start of the allocation only
+ * when a reserve would not fit after it, so consuming frames one by one
+ * does not memmove the remainder each time.
+ */
+
 struct mbus_buffer {
+	unsigned int offset;
 	unsigned int length;
 	unsigned int size;
 	uint8_t *buffer;
@@ -76,13 +84,14 @@ int mbus_buffer_reset (struct mbus_buffer *buffer)
 	if (buffer == NULL) {
 		return -1;
 	}
+	buffer->offset = 0;
 	buffer->length = 0;
 	return 0;
 }
 
 unsigned int mbus_buffer_get_size (struct mbus_buffer *buffer)
 {
-	return buffer->size;
+	return buffer->size - buffer->offset;
 }
 
 unsigned int mbus_buffer_get_length (struct mbus_buffer *buffer)
@@ -92,7 +101,7 @@ unsigned int mbus_buffer_get_length (struct mbus_buffer *buffer)
 
 int mbus_buffer_set_length (struct mbus_buffer *buffer, unsigned int length)
 {
-	if (length > buffer->size) {
+	if (length > buffer->size - buffer->offset) {
 		return -1;
 	}
 	buffer->length = length;
@@ -101,15 +110,25 @@ int mbus_buffer_set_length (struct mbus_buffer *buffer, unsigned int length)
 
 uint8_t * mbus_buffer_get_base (struct mbus_buffer *buffer)
 {
-	return buffer->buffer;
+	if (buffer->buffer == NULL) {
+		return NULL;
+	}
+	return buffer->buffer + buffer->offset;
 }
 
 int mbus_buffer_reserve (struct mbus_buffer *buffer, unsigned int length)
 {
 	uint8_t *tmp;
-	if (buffer->size >= length) {
+	if (buffer->size - buffer->offset >= length) {
 		return 0;
 	}
+	if (buffer->offset > 0) {
+		memmove(buffer->buffer, buffer->buffer + buffer->offset, buffer->length);
+		buffer->offset = 0;
+		if (buffer->size >= length) {
+			return 0;
+		}
+	}
 	while (buffer->size < length) {
 		buffer->size += 4096;
 	}
@@ -135,65 +154,226 @@ int mbus_buffer_push (struct mbus_buffer *buffer, const void *data, unsigned int
 		mbus_errorf("can not reserve buffer");
 		return -1;
 	}
-	memcpy(buffer->buffer + buffer->length, data, length);
+	memcpy(buffer->buffer + buffer->offset + buffer->length, data, length);
 	buffer->length += length;
 	return 0;
 }
 
-int mbus_buffer_push_string (struct mbus_buffer *buffer, enum mbus_compress_method compression, const char *string)
+int mbus_buffer_push_data (struct mbus_buffer *buffer, enum mbus_compress_method compression, const void *data, unsigned int length)
 {
 	int rc;
 	void *compressed;
 	int compressedlength;
-	uint32_t length;
+	uint32_t header[2];
 	compressed = NULL;
-	if (string == NULL) {
-		mbus_errorf("string is invalid");
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
 		goto bail;
 	}
-	if (compression != mbus_compress_method_none) {
-		rc = mbus_compress_data(compression, &compressed, &compressedlength, string, strlen(string));
+	if (compression == mbus_compress_method_none) {
+		header[0] = htonl(length);
+		rc  = mbus_buffer_push(buffer, header, sizeof(header[0]));
+		rc |= mbus_buffer_push(buffer, data, length);
 		if (rc != 0) {
-			mbus_errorf("can not compress data");
+			mbus_errorf("can not push data");
 			goto bail;
 		}
-		length = compressedlength + sizeof(length);
-	} else {
-		compressed = (void *) string;
-		compressedlength = strlen(compressed);
-		length = compressedlength;
-	}
-	length = htonl(length);
-	rc = mbus_buffer_push(buffer, &length, sizeof(length));
+		return 0;
+	}
+	rc = mbus_compress_data(compression, &compressed, &compressedlength, data, length);
 	if (rc != 0) {
-		mbus_errorf("can not push length");
+		mbus_errorf("can not compress data");
 		goto bail;
 	}
-	if (compression != mbus_compress_method_none) {
-		length = htonl(strlen(string));
-		rc = mbus_buffer_push(buffer, &length, sizeof(length));
-		if (rc != 0) {
-			mbus_errorf("can not push length");
-			goto bail;
-		}
-	}
-	rc = mbus_buffer_push(buffer, compressed, compressedlength);
+	header[0] = htonl(compressedlength + sizeof(header[1]));
+	header[1] = htonl(length);
+	rc  = mbus_buffer_push(buffer, header, sizeof(header));
+	rc |= mbus_buffer_push(buffer, compressed, compressedlength);
 	if (rc != 0) {
-		mbus_errorf("can not push string");
+		mbus_errorf("can not push data");
 		goto bail;
 	}
-	if (compressed != NULL &&
-	    compressed != string) {
+	free(compressed);
+	return 0;
+bail:	if (compressed != NULL) {
 		free(compressed);
 	}
+	return -1;
+}
+
+int mbus_buffer_push_string (struct mbus_buffer *buffer, enum mbus_compress_method compression, const char *string)
+{
+	if (string == NULL) {
+		mbus_errorf("string is invalid");
+		return -1;
+	}
+	return mbus_buffer_push_data(buffer, compression, string, strlen(string));
+}
+
+/*
+ * a frame on a compressed connection that is sent as is, the high bit of
+ * the uncompressed length tells the peer to skip uncompressing it. only
+ * valid when both ends agreed on it in command.create.
+ */
+
+int mbus_buffer_push_uncompressed (struct mbus_buffer *buffer, const void *data, unsigned int length)
+{
+	int rc;
+	uint32_t header[2];
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		return -1;
+	}
+	if (length & MBUS_BUFFER_UNCOMPRESSED) {
+		mbus_errorf("length is invalid");
+		return -1;
+	}
+	header[0] = htonl(length + sizeof(header[1]));
+	header[1] = htonl(length | MBUS_BUFFER_UNCOMPRESSED);
+	rc  = mbus_buffer_push(buffer, header, sizeof(header));
+	rc |= mbus_buffer_push(buffer, data, length);
+	if (rc != 0) {
+		mbus_errorf("can not push data");
+		return -1;
+	}
+	return 0;
+}
+
+int mbus_buffer_push_stream (struct mbus_buffer *buffer, struct mbus_compress_stream *stream, const void *data, unsigned int length)
+{
+	int rc;
+	void *compressed;
+	int compressedlength;
+	uint32_t header[2];
+	compressed = NULL;
+	if (stream == NULL) {
+		mbus_errorf("stream is invalid");
+		goto bail;
+	}
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		goto bail;
+	}
+	rc = mbus_compress_stream_data(stream, &compressed, &compressedlength, data, length);
+	if (rc != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	header[0] = htonl(compressedlength + sizeof(header[1]));
+	header[1] = htonl(length);
+	rc  = mbus_buffer_push(buffer, header, sizeof(header));
+	rc |= mbus_buffer_push(buffer, compressed, compressedlength);
+	if (rc != 0) {
+		mbus_errorf("can not push data");
+		goto bail;
+	}
+	free(compressed);
 	return 0;
-bail:	if (compressed != NULL &&
-	    compressed != string) {
+bail:	if (compressed != NULL) {
 		free(compressed);
 	}
 	return -1;
 }
 
+int mbus_buffer_push_fragment (struct mbus_buffer *buffer, struct mbus_buffer *fragments, unsigned int *remaining, unsigned int size)
+{
+	int rc;
+	uint32_t header;
+	uint32_t expected;
+	unsigned int length;
+	if (fragments == NULL) {
+		mbus_errorf("fragments is invalid");
+		return -1;
+	}
+	if (remaining == NULL) {
+		mbus_errorf("remaining is invalid");
+		return -1;
+	}
+	if (size == 0 || (size & MBUS_BUFFER_FRAGMENT)) {
+		mbus_errorf("size is invalid");
+		return -1;
+	}
+	if (fragments->length == 0) {
+		return 0;
+	}
+	if (*remaining == 0) {
+		if (fragments->length < sizeof(expected)) {
+			mbus_errorf("fragments is invalid");
+			return -1;
+		}
+		memcpy(&expected, fragments->buffer + fragments->offset, sizeof(expected));
+		*remaining = sizeof(expected) + ntohl(expected);
+	}
+	if (*remaining > fragments->length) {
+		mbus_errorf("fragments is invalid");
+		return -1;
+	}
+	/* a fragment never spans two frames, so the peer assembles one at a time */
+	length = (*remaining < size) ? *remaining : size;
+	header = htonl(length | MBUS_BUFFER_FRAGMENT);
+	rc  = mbus_buffer_push(buffer, &header, sizeof(header));
+	rc |= mbus_buffer_push(buffer, fragments->buffer + fragments->offset, length);
+	if (rc != 0) {
+		mbus_errorf("can not push data");
+		return -1;
+	}
+	*remaining -= length;
+	return mbus_buffer_shift(fragments, length);
+}
+
+int mbus_buffer_assemble_fragment (struct mbus_buffer *buffer, struct mbus_buffer *fragments, struct mbus_buffer **frame)
+{
+	int rc;
+	uint32_t expected;
+	if (frame == NULL) {
+		mbus_errorf("frame is invalid");
+		return -1;
+	}
+	*frame = NULL;
+	if (fragments == NULL) {
+		mbus_errorf("fragments is invalid");
+		return -1;
+	}
+	while (1) {
+		if (fragments->length >= sizeof(expected)) {
+			memcpy(&expected, fragments->buffer + fragments->offset, sizeof(expected));
+			expected = ntohl(expected);
+			if (expected & MBUS_BUFFER_FRAGMENT) {
+				mbus_errorf("fragments is invalid");
+				return -1;
+			}
+			if (fragments->length - sizeof(expected) >= expected) {
+				*frame = fragments;
+				return 0;
+			}
+		}
+		if (buffer->length < sizeof(expected)) {
+			return 0;
+		}
+		memcpy(&expected, buffer->buffer + buffer->offset, sizeof(expected));
+		expected = ntohl(expected);
+		if ((expected & MBUS_BUFFER_FRAGMENT) == 0) {
+			if (buffer->length - sizeof(expected) >= expected) {
+				*frame = buffer;
+			}
+			return 0;
+		}
+		expected &= ~MBUS_BUFFER_FRAGMENT;
+		if (buffer->length - sizeof(expected) < expected) {
+			return 0;
+		}
+		rc = mbus_buffer_push(fragments, buffer->buffer + buffer->offset + sizeof(expected), expected);
+		if (rc != 0) {
+			mbus_errorf("can not push data");
+			return -1;
+		}
+		rc = mbus_buffer_shift(buffer, sizeof(expected) + expected);
+		if (rc != 0) {
+			return -1;
+		}
+	}
+}
+
 int mbus_buffer_shift (struct mbus_buffer *buffer, unsigned int length)
 {
 	if (length == 0) {
@@ -203,8 +383,11 @@ int mbus_buffer_shift (struct mbus_buffer *buffer, unsigned int length)
 		mbus_errorf("invalid length");
 		return -1;
 	}
-	memmove(buffer->buffer, buffer->buffer + length, buffer->length - length);
+	buffer->offset += length;
 	buffer->length -= length;
+	if (buffer->length == 0) {
+		buffer->offset = 0;
+	}
 	return 0;
 }
 
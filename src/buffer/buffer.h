@@ -26,6 +26,14 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define MBUS_BUFFER_UNCOMPRESSED	0x80000000
+
+/*
+ * set in the length of a frame that carries a chunk of a larger frame,
+ * chunks are appended in order until the inner frame is complete.
+ */
+#define MBUS_BUFFER_FRAGMENT		0x80000000
+
 struct mbus_buffer;
 
 struct mbus_buffer * mbus_buffer_create (void);
@@ -37,5 +45,10 @@ int mbus_buffer_set_length (struct mbus_buffer *buffer, unsigned int length);
 uint8_t * mbus_buffer_get_base (struct mbus_buffer *buffer);
 int mbus_buffer_reserve (struct mbus_buffer *buffer, unsigned int length);
 int mbus_buffer_push (struct mbus_buffer *buffer, const void *data, unsigned int length);
+int mbus_buffer_push_data (struct mbus_buffer *buffer, enum mbus_compress_method compression, const void *data, unsigned int length);
 int mbus_buffer_push_string (struct mbus_buffer *buffer, enum mbus_compress_method compression, const char *string);
+int mbus_buffer_push_stream (struct mbus_buffer *buffer, struct mbus_compress_stream *stream, const void *data, unsigned int length);
+int mbus_buffer_push_uncompressed (struct mbus_buffer *buffer, const void *data, unsigned int length);
+int mbus_buffer_push_fragment (struct mbus_buffer *buffer, struct mbus_buffer *fragments, unsigned int *remaining, unsigned int size);
+int mbus_buffer_assemble_fragment (struct mbus_buffer *buffer, struct mbus_buffer *fragments, struct mbus_buffer **frame);
 int mbus_buffer_shift (struct mbus_buffer *buffer, unsigned int length);
@@ -51,6 +51,8 @@
 #include "mbus/buffer.h"
 #include "mbus/clock.h"
 #include "mbus/tailq.h"
+#include "mbus/hash.h"
+#include "mbus/timer.h"
 #include "mbus/method.h"
 #include "mbus/socket.h"
 #include "mbus/server.h"
@@ -86,6 +88,14 @@
 #define OPTION_PING_TIMEOUT		0x601
 #define OPTION_PING_THRESHOLD		0x602
 
+#define OPTION_COMPRESSION		0x700
+#define OPTION_COMPRESS_MINIMUM		0x701
+#define OPTION_ZSTD_DICTIONARY		0x702
+
+#define OPTION_ENCODING			0x800
+
+#define OPTION_FRAGMENT_SIZE		0x900
+
 static struct option longopts[] = {
 	{ "mbus-help",				no_argument,		NULL,	OPTION_HELP },
 	{ "mbus-debug-level",			required_argument,	NULL,	OPTION_DEBUG_LEVEL },
@@ -103,9 +113,33 @@ static struct option longopts[] = {
 	{ "mbus-client-ping-interval",		required_argument,	NULL,	OPTION_PING_INTERVAL },
 	{ "mbus-client-ping-timeout",		required_argument,	NULL,	OPTION_PING_TIMEOUT },
 	{ "mbus-client-ping-threshold",		required_argument,	NULL,	OPTION_PING_THRESHOLD },
+	{ "mbus-client-compression",		required_argument,	NULL,	OPTION_COMPRESSION },
+	{ "mbus-client-compress-minimum",	required_argument,	NULL,	OPTION_COMPRESS_MINIMUM },
+	{ "mbus-client-zstd-dictionary",	required_argument,	NULL,	OPTION_ZSTD_DICTIONARY },
+	{ "mbus-client-encoding",		required_argument,	NULL,	OPTION_ENCODING },
+	{ "mbus-client-fragment-size",		required_argument,	NULL,	OPTION_FRAGMENT_SIZE },
 	{ NULL,					0,			NULL,	0 },
 };
 
+static const char *compression_methods[] = {
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	"zlib",
+	"zlib-stream",
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	"lz4",
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	"zstd",
+#endif
+	"none",
+};
+
+static const char *encoding_methods[] = {
+	"binary",
+	"json",
+};
+
 enum wakeup_reason {
 	wakeup_reason_break,
 	wakeup_reason_connect,
@@ -116,12 +150,19 @@ enum wakeup_reason {
 TAILQ_HEAD(requests, request);
 struct request {
 	TAILQ_ENTRY(request) requests;
-	char *string;
+	void *data;
+	int length;
+	enum mbus_method_encoding encoding;
 	struct mbus_json *json;
+	struct mbus_method_attachment *attachments;
+	int nattachments;
 	void (*callback) (struct mbus_client *client, void *context, struct mbus_client_message_command *message, enum mbus_client_command_status status);
 	void *context;
+	int sequence;
+	int pending;
 	unsigned long long created_at;
 	int timeout;
+	struct mbus_timer timer;
 };
 
 TAILQ_HEAD(routines, routine);
@@ -147,12 +188,16 @@ struct mbus_client {
 	struct mbus_socket *socket;
 	struct requests requests;
 	struct requests pendings;
+	struct mbus_hash *pending_index;
+	struct mbus_timers *timers;
 	struct routines routines;
 	struct subscriptions subscriptions;
 	struct mbus_buffer *incoming;
 	struct mbus_buffer *outgoing;
+	struct mbus_buffer *scratch;
 	char *identifier;
 	unsigned long long connect_tsms;
+	unsigned long long incoming_tsms;
 	int ping_interval;
 	int ping_timeout;
 	int ping_threshold;
@@ -161,8 +206,19 @@ struct mbus_client {
 	int ping_wait_pong;
 	int pong_missed_count;
 	enum mbus_compress_method compression;
+	struct mbus_compress_stream *stream;
+	struct mbus_compress_dictionary *dictionary;
+	int uncompressed;
+	enum mbus_method_encoding encoding;
+	struct {
+		int size;
+		unsigned int remaining;
+		struct mbus_buffer *out;
+		struct mbus_buffer *in;
+	} fragment;
 	int socket_connected;
 	int sequence;
+	int sequence_end;
 	int wakeup[2];
 	pthread_mutex_t mutex;
 #if defined(SSL_ENABLE) && (SSL_ENABLE == 1)
@@ -178,6 +234,8 @@ struct mbus_client {
 
 struct mbus_client_message_event {
 	const struct mbus_json *payload;
+	const struct mbus_method_attachment *attachments;
+	int nattachments;
 };
 
 struct mbus_client_message_command {
@@ -187,32 +245,12 @@ struct mbus_client_message_command {
 
 struct mbus_client_message_routine {
 	const struct mbus_json *request;
+	const struct mbus_method_attachment *attachments;
+	int nattachments;
+	unsigned long long deadline;
 	struct mbus_json *response;
 };
 
-static size_t _strnlen (const char *s, size_t maxlen)
-{
-	 size_t len;
-	for (len = 0; len < maxlen; len++, s++) {
-		if (!*s) {
-			break;
-		}
-	}
-	return (len);
-}
-
-static char * _strndup (const char *s, size_t n)
-{
-	char *result;
-	size_t len = _strnlen(s, n);
-	result = (char *) malloc(len + 1);
-	if (result == NULL) {
-		return NULL;
-	}
-	result[len] = '\0';
-	return (char *) memcpy(result, s, len);
-}
-
 static void * routine_get_context (const struct routine *routine)
 {
 	if (routine == NULL) {
@@ -362,7 +400,7 @@ static int request_get_sequence (const struct request *request)
 	if (request == NULL) {
 		return -1;
 	}
-	return mbus_json_get_int_value(request->json, MBUS_METHOD_TAG_SEQUENCE, -1);
+	return request->sequence;
 }
 
 static const char * request_get_type (const struct request *request)
@@ -421,12 +459,27 @@ static int request_get_timeout (const struct request *request)
 	return request->timeout;
 }
 
-static const char * request_get_string (const struct request *request)
+static const void * request_get_data (struct request *request, enum mbus_method_encoding encoding, int *length)
 {
+	int rc;
 	if (request == NULL) {
 		return NULL;
 	}
-	return request->string;
+	if (request->data == NULL ||
+	    request->encoding != encoding) {
+		if (request->data != NULL) {
+			free(request->data);
+			request->data = NULL;
+		}
+		rc = mbus_method_encode_with_attachments(encoding, request->json, NULL, 0, request->attachments, request->nattachments, &request->data, &request->length);
+		if (rc != 0) {
+			mbus_errorf("can not encode request");
+			return NULL;
+		}
+		request->encoding = encoding;
+	}
+	*length = request->length;
+	return request->data;
 }
 
 static void * request_get_context (const struct request *request)
@@ -450,15 +503,69 @@ static void request_destroy (struct request *request)
 	if (request == NULL) {
 		return;
 	}
-	if (request->string != NULL) {
-		free(request->string);
+	if (request->data != NULL) {
+		free(request->data);
 	}
 	if (request->json != NULL) {
 		mbus_json_delete(request->json);
 	}
+	if (request->attachments != NULL) {
+		free(request->attachments);
+	}
 	free(request);
 }
 
+static int request_set_attachments (struct request *request, const struct mbus_client_attachment *attachments, int nattachments)
+{
+	int i;
+	int size;
+	uint8_t *ptr;
+	if (request == NULL) {
+		return -1;
+	}
+	if (nattachments <= 0) {
+		return 0;
+	}
+	if (attachments == NULL) {
+		mbus_errorf("attachments is invalid");
+		return -1;
+	}
+	size = sizeof(struct mbus_method_attachment) * nattachments;
+	for (i = 0; i < nattachments; i++) {
+		if (attachments[i].length < 0 ||
+		    (attachments[i].length > 0 && attachments[i].data == NULL)) {
+			mbus_errorf("attachment: %d is invalid", i);
+			return -1;
+		}
+		size += attachments[i].length;
+	}
+	request->attachments = malloc(size);
+	if (request->attachments == NULL) {
+		mbus_errorf("can not allocate memory");
+		return -1;
+	}
+	ptr = (uint8_t *) (request->attachments + nattachments);
+	for (i = 0; i < nattachments; i++) {
+		memcpy(ptr, attachments[i].data, attachments[i].length);
+		request->attachments[i].data = ptr;
+		request->attachments[i].length = attachments[i].length;
+		ptr += attachments[i].length;
+	}
+	request->nattachments = nattachments;
+	return 0;
+}
+
+static int request_set_priority (struct request *request, int priority)
+{
+	if (request == NULL) {
+		return -1;
+	}
+	if (priority < 0) {
+		return 0;
+	}
+	return mbus_json_add_number_to_object_cs(request->json, MBUS_METHOD_TAG_PRIORITY, priority);
+}
+
 static struct request * request_create (const char *type, const char *destination, const char *identifier, int sequence, const struct mbus_json *payload, void (*callback) (struct mbus_client *client, void *context, struct mbus_client_message_command *message, enum mbus_client_command_status status), void *context, int timeout)
 {
 	int rc;
@@ -477,7 +584,7 @@ static struct request * request_create (const char *type, const char *destinatio
 		goto bail;
 	}
 	if (sequence < MBUS_METHOD_SEQUENCE_START ||
-	    sequence >= MBUS_METHOD_SEQUENCE_END) {
+	    sequence >= MBUS_METHOD_SEQUENCE_WIDE_END) {
 		mbus_errorf("sequence is invalid");
 		goto bail;
 	}
@@ -548,13 +655,9 @@ static struct request * request_create (const char *type, const char *destinatio
 			goto bail;
 		}
 	}
-	request->string = mbus_json_print_unformatted(request->json);
-	if (request->string == NULL) {
-		mbus_errorf("can not print json object");
-		goto bail;
-	}
 	request->callback = callback;
 	request->context = context;
+	request->sequence = sequence;
 	request->created_at = mbus_clock_monotonic();
 	request->timeout = timeout;
 	return request;
@@ -658,6 +761,73 @@ static void mbus_client_notify_connectionfd (struct mbus_client *client, enum mb
         }
 }
 
+/*
+ * requests with a timeout are kept in the timers heap ordered by their
+ * deadline, timer context points back to the request.
+ */
+
+static int mbus_client_push_request (struct mbus_client *client, struct request *request)
+{
+	int rc;
+	if (request_get_timeout(request) >= 0) {
+		request->timer.context = request;
+		rc = mbus_timers_add(client->timers, &request->timer, request_get_created_at(request) + request_get_timeout(request));
+		if (rc != 0) {
+			mbus_errorf("can not add request deadline");
+			return -1;
+		}
+	}
+	TAILQ_INSERT_TAIL(&client->requests, request, requests);
+	return 0;
+}
+
+/*
+ * results are matched by sequence, pendings keep their send order and
+ * the index finds them in constant time.
+ */
+
+static struct request * mbus_client_find_pending (struct mbus_client *client, int sequence)
+{
+	return mbus_hash_get(client->pending_index, &sequence, sizeof(sequence));
+}
+
+static int mbus_client_push_pending (struct mbus_client *client, struct request *request)
+{
+	int rc;
+	int sequence;
+	sequence = request_get_sequence(request);
+	rc = mbus_hash_put(client->pending_index, &sequence, sizeof(sequence), request);
+	if (rc != 0) {
+		mbus_errorf("can not index request");
+		return -1;
+	}
+	TAILQ_INSERT_TAIL(&client->pendings, request, requests);
+	request->pending = 1;
+	return 0;
+}
+
+static void mbus_client_remove_pending (struct mbus_client *client, struct request *request)
+{
+	int sequence;
+	TAILQ_REMOVE(&client->pendings, request, requests);
+	request->pending = 0;
+	sequence = request_get_sequence(request);
+	if (mbus_client_find_pending(client, sequence) == request) {
+		mbus_hash_del(client->pending_index, &sequence, sizeof(sequence));
+	}
+}
+
+static void mbus_client_next_sequence (struct mbus_client *client)
+{
+	do {
+		client->sequence += 1;
+		if (client->sequence >= client->sequence_end) {
+			client->sequence = MBUS_METHOD_SEQUENCE_START;
+		}
+	} while (mbus_client_find_pending(client, client->sequence) != NULL &&
+		 (unsigned int) client->pendings.count < (unsigned int) (client->sequence_end - MBUS_METHOD_SEQUENCE_START));
+}
+
 static void mbus_client_reset (struct mbus_client *client)
 {
 	int i;
@@ -690,11 +860,22 @@ static void mbus_client_reset (struct mbus_client *client)
 	if (client->outgoing != NULL) {
 		mbus_buffer_reset(client->outgoing);
 	}
+	if (client->fragment.out != NULL) {
+		mbus_buffer_reset(client->fragment.out);
+	}
+	if (client->fragment.in != NULL) {
+		mbus_buffer_reset(client->fragment.in);
+	}
 	requests[0] = &client->requests;
 	requests[1] = &client->pendings;
 	for (i = 0; i < (int) (sizeof(requests) / sizeof(requests[0])); i++) {
 		TAILQ_FOREACH_SAFE(request, requests[i], requests, nrequest) {
-			TAILQ_REMOVE(requests[i], request, requests);
+			if (requests[i] == &client->pendings) {
+				mbus_client_remove_pending(client, request);
+			} else {
+				TAILQ_REMOVE(requests[i], request, requests);
+			}
+			mbus_timers_del(client->timers, &request->timer);
 			if (strcmp(request_get_type(request), MBUS_METHOD_TYPE_EVENT) == 0) {
 				if (strcmp(MBUS_SERVER_IDENTIFIER, request_get_destination(request)) != 0 &&
 				    strcmp(MBUS_SERVER_EVENT_PING, request_get_identifier(request)) != 0) {
@@ -761,7 +942,16 @@ static void mbus_client_reset (struct mbus_client *client)
 	client->ping_wait_pong = 0;
 	client->pong_missed_count = 0;
 	client->sequence = MBUS_METHOD_SEQUENCE_START;
+	client->sequence_end = MBUS_METHOD_SEQUENCE_END;
 	client->compression = mbus_compress_method_none;
+	if (client->stream != NULL) {
+		mbus_compress_stream_destroy(client->stream);
+		client->stream = NULL;
+	}
+	client->uncompressed = 0;
+	client->encoding = mbus_method_encoding_json;
+	client->fragment.size = 0;
+	client->fragment.remaining = 0;
 	client->socket_connected = 0;
 }
 
@@ -946,6 +1136,43 @@ static void mbus_client_command_create_response (struct mbus_client *client, voi
 		const char *compression;
 		compression = mbus_json_get_string_value(response, "compression", "none");
 		client->compression = mbus_compress_method_value(compression);
+		client->uncompressed = mbus_json_get_bool_value(response, "uncompressed", 0);
+		if (client->compression == mbus_compress_method_zstd &&
+		    client->dictionary != NULL &&
+		    (unsigned int) mbus_json_get_number_value(response, "dictionary", 0) == mbus_compress_dictionary_get_id(client->dictionary)) {
+			client->stream = mbus_compress_stream_create_with_dictionary(client->dictionary);
+			if (client->stream == NULL) {
+				mbus_errorf("can not create compress stream");
+				mbus_client_notify_connect(client, mbus_client_connect_status_internal_error);
+				goto bail;
+			}
+		} else if (mbus_compress_method_is_stream(client->compression)) {
+			client->stream = mbus_compress_stream_create(client->compression);
+			if (client->stream == NULL) {
+				mbus_errorf("can not create compress stream");
+				mbus_client_notify_connect(client, mbus_client_connect_status_internal_error);
+				goto bail;
+			}
+		}
+	}
+	{
+		const char *encoding;
+		encoding = mbus_json_get_string_value(response, "encoding", "json");
+		client->encoding = mbus_method_encoding_value(encoding);
+	}
+	{
+		client->fragment.size = mbus_json_get_int_value(response, "fragment", 0);
+		if (client->fragment.size < 0 ||
+		    client->fragment.size > client->options->fragment_size) {
+			client->fragment.size = 0;
+		}
+	}
+	{
+		client->sequence_end = mbus_json_get_int_value(response, "sequence", MBUS_METHOD_SEQUENCE_END);
+		if (client->sequence_end <= MBUS_METHOD_SEQUENCE_START ||
+		    client->sequence_end > MBUS_METHOD_SEQUENCE_WIDE_END) {
+			client->sequence_end = MBUS_METHOD_SEQUENCE_END;
+		}
 	}
 	{
 		client->ping_interval = mbus_json_get_int_value(response, "ping/interval", -1);
@@ -955,6 +1182,8 @@ static void mbus_client_command_create_response (struct mbus_client *client, voi
 	mbus_infof("created");
 	mbus_infof("  identifier : %s", client->identifier);
 	mbus_infof("  compression: %s", mbus_compress_method_string(client->compression));
+	mbus_infof("  encoding   : %s", mbus_method_encoding_string(client->encoding));
+	mbus_infof("  fragment   : %d", client->fragment.size);
 	mbus_infof("  ping");
 	mbus_infof("    interval : %d", client->ping_interval);
 	mbus_infof("    timeout  : %d", client->ping_timeout);
@@ -980,10 +1209,12 @@ static int mbus_client_command_create_request (struct mbus_client *client)
 	struct mbus_json *payload;
 	struct mbus_json *payload_ping;
 	struct mbus_json *payload_compressions;
+	struct mbus_json *payload_encodings;
 
 	payload = NULL;
 	payload_ping = NULL;
 	payload_compressions = NULL;
+	payload_encodings = NULL;
 
 	payload = mbus_json_create_object();
 	if (payload == NULL) {
@@ -1040,24 +1271,80 @@ static int mbus_client_command_create_request (struct mbus_client *client)
 		mbus_errorf("can not create json array");
 		goto bail;
 	}
-	rc = mbus_json_add_item_to_array(payload_compressions, mbus_json_create_string("none"));
+	{
+		unsigned int i;
+		for (i = 0; i < sizeof(compression_methods) / sizeof(compression_methods[0]); i++) {
+			if (client->options->compression != NULL &&
+			    strcmp(client->options->compression, compression_methods[i]) != 0 &&
+			    strcmp("none", compression_methods[i]) != 0) {
+				continue;
+			}
+			rc = mbus_json_add_item_to_array(payload_compressions, mbus_json_create_string(compression_methods[i]));
+			if (rc != 0) {
+				mbus_errorf("can not add item to json array");
+				goto bail;
+			}
+		}
+	}
+	rc = mbus_json_add_item_to_object_cs(payload, "compressions", payload_compressions);
 	if (rc != 0) {
 		mbus_errorf("can not add item to json array");
 		goto bail;
 	}
-#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
-	rc = mbus_json_add_item_to_array(payload_compressions, mbus_json_create_string("zlib"));
+	payload_compressions = NULL;
+	if (client->dictionary != NULL) {
+		rc = mbus_json_add_number_to_object_cs(payload, "dictionary", mbus_compress_dictionary_get_id(client->dictionary));
+		if (rc != 0) {
+			mbus_errorf("can not add number to json object");
+			goto bail;
+		}
+	}
+	rc = mbus_json_add_bool_to_object_cs(payload, "uncompressed", 1);
 	if (rc != 0) {
-		mbus_errorf("can not add item to json array");
+		mbus_errorf("can not add bool to json object");
 		goto bail;
 	}
-#endif
-	rc = mbus_json_add_item_to_object_cs(payload, "compressions", payload_compressions);
+
+	payload_encodings = mbus_json_create_array();
+	if (payload_encodings == NULL) {
+		mbus_errorf("can not create json array");
+		goto bail;
+	}
+	{
+		unsigned int i;
+		for (i = 0; i < sizeof(encoding_methods) / sizeof(encoding_methods[0]); i++) {
+			if (client->options->encoding != NULL &&
+			    strcmp(client->options->encoding, encoding_methods[i]) != 0 &&
+			    strcmp("json", encoding_methods[i]) != 0) {
+				continue;
+			}
+			rc = mbus_json_add_item_to_array(payload_encodings, mbus_json_create_string(encoding_methods[i]));
+			if (rc != 0) {
+				mbus_errorf("can not add item to json array");
+				goto bail;
+			}
+		}
+	}
+	rc = mbus_json_add_item_to_object_cs(payload, "encodings", payload_encodings);
 	if (rc != 0) {
-		mbus_errorf("can not add item to json array");
+		mbus_errorf("can not add item to json object");
+		goto bail;
+	}
+	payload_encodings = NULL;
+
+	if (client->options->fragment_size > 0) {
+		rc = mbus_json_add_number_to_object_cs(payload, "fragment", client->options->fragment_size);
+		if (rc != 0) {
+			mbus_errorf("can not add number to json object");
+			goto bail;
+		}
+	}
+
+	rc = mbus_json_add_number_to_object_cs(payload, "sequence", MBUS_METHOD_SEQUENCE_WIDE_END);
+	if (rc != 0) {
+		mbus_errorf("can not add number to json object");
 		goto bail;
 	}
-	payload_compressions = NULL;
 
 	rc = mbus_client_command_unlocked(client, MBUS_SERVER_IDENTIFIER, MBUS_SERVER_COMMAND_CREATE, payload, mbus_client_command_create_response, NULL);
 	if (rc != 0) {
@@ -1076,6 +1363,9 @@ bail:	if (payload != NULL) {
 	if (payload_compressions != NULL) {
 		mbus_json_delete(payload_compressions);
 	}
+	if (payload_encodings != NULL) {
+		mbus_json_delete(payload_encodings);
+	}
 	return -1;
 }
 
@@ -1256,27 +1546,27 @@ static int mbus_client_handle_result (struct mbus_client *client, const struct m
 {
 	int sequence;
 	struct request *request;
-	struct request *nrequest;
 
 	sequence = mbus_json_get_int_value(json, MBUS_METHOD_TAG_SEQUENCE, -1);
 
-	TAILQ_FOREACH_SAFE(request, &client->pendings, requests, nrequest) {
-		if (request_get_sequence(request) == sequence) {
-			TAILQ_REMOVE(&client->pendings, request, requests);
-			break;
-		}
-	}
+	request = mbus_client_find_pending(client, sequence);
 	if (request == NULL) {
 		mbus_errorf("sequence: %d is invalid", sequence);
 		goto out;
 	}
+	mbus_client_remove_pending(client, request);
+	mbus_timers_del(client->timers, &request->timer);
 
-	mbus_client_notify_command(client, request, json, mbus_client_command_status_success);
+	if (mbus_json_get_int_value(json, MBUS_METHOD_TAG_EXPIRED, 0) != 0) {
+		mbus_client_notify_command(client, request, NULL, mbus_client_command_status_timeout);
+	} else {
+		mbus_client_notify_command(client, request, json, mbus_client_command_status_success);
+	}
 	request_destroy(request);
 out:	return 0;
 }
 
-static int mbus_client_handle_event (struct mbus_client *client, const struct mbus_json *json)
+static int mbus_client_handle_event (struct mbus_client *client, const struct mbus_json *json, const struct mbus_method_attachment *attachments, int nattachments)
 {
 	const char *source;
 	const char *identifier;
@@ -1320,6 +1610,8 @@ static int mbus_client_handle_event (struct mbus_client *client, const struct mb
 		}
 		if (callback != NULL) {
 			message.payload = json;
+			message.attachments = attachments;
+			message.nattachments = nattachments;
 			mbus_client_unlock(client);
 			callback(client, callback_context, &message);
 			mbus_client_lock(client);
@@ -1330,7 +1622,7 @@ static int mbus_client_handle_event (struct mbus_client *client, const struct mb
 bail:	return -1;
 }
 
-static int mbus_client_handle_command (struct mbus_client *client, const struct mbus_json *json)
+static int mbus_client_handle_command (struct mbus_client *client, const struct mbus_json *json, const struct mbus_method_attachment *attachments, int nattachments)
 {
 	int rc;
 	int status;
@@ -1379,6 +1671,13 @@ static int mbus_client_handle_command (struct mbus_client *client, const struct
 		}
 		if (callback != NULL) {
 			message.request = json;
+			message.attachments = attachments;
+			message.nattachments = nattachments;
+			message.deadline = 0;
+			if (mbus_json_get_int_value(json, MBUS_METHOD_TAG_TIMEOUT, -1) > 0) {
+				/* the budget was stamped by the server, count from when it was read */
+				message.deadline = client->incoming_tsms + mbus_json_get_int_value(json, MBUS_METHOD_TAG_TIMEOUT, -1);
+			}
 			message.response = NULL;
 			mbus_client_unlock(client);
 			status = callback(client, callback_context, &message);
@@ -1456,6 +1755,15 @@ static void mbus_client_options_destroy (struct mbus_client_options *options)
         if (options->password != NULL) {
                 free(options->password);
         }
+	if (options->compression != NULL) {
+		free(options->compression);
+	}
+	if (options->zstd_dictionary != NULL) {
+		free(options->zstd_dictionary);
+	}
+	if (options->encoding != NULL) {
+		free(options->encoding);
+	}
 	free(options);
 }
 
@@ -1515,6 +1823,29 @@ static struct mbus_client_options * mbus_client_options_duplicate (const struct
 		duplicate->ping_interval = options->ping_interval;
 		duplicate->ping_timeout = options->ping_timeout;
 		duplicate->ping_threshold = options->ping_threshold;
+		if (options->compression != NULL) {
+			duplicate->compression = strdup(options->compression);
+			if (duplicate->compression == NULL) {
+				mbus_errorf("can not allocate memory");
+				goto bail;
+			}
+		}
+		duplicate->compress_minimum = options->compress_minimum;
+		duplicate->fragment_size = options->fragment_size;
+		if (options->zstd_dictionary != NULL) {
+			duplicate->zstd_dictionary = strdup(options->zstd_dictionary);
+			if (duplicate->zstd_dictionary == NULL) {
+				mbus_errorf("can not allocate memory");
+				goto bail;
+			}
+		}
+		if (options->encoding != NULL) {
+			duplicate->encoding = strdup(options->encoding);
+			if (duplicate->encoding == NULL) {
+				mbus_errorf("can not allocate memory");
+				goto bail;
+			}
+		}
 		memcpy(&duplicate->callbacks, &options->callbacks, sizeof(options->callbacks));
 	}
 	return duplicate;
@@ -1552,6 +1883,13 @@ void mbus_client_usage (void)
 	fprintf(stdout, "  --mbus-client-ping-interval    : ping interval (default: %d)\n", MBUS_CLIENT_DEFAULT_PING_INTERVAL);
 	fprintf(stdout, "  --mbus-client-ping-timeout     : ping timeout (default: %d)\n", MBUS_CLIENT_DEFAULT_PING_TIMEOUT);
 	fprintf(stdout, "  --mbus-client-ping-threshold   : ping threshold (default: %d)\n", MBUS_CLIENT_DEFAULT_PING_THRESHOLD);
+	fprintf(stdout, "  --mbus-client-compression      : only offer this compression method, offers all if not set (default: %s)\n", "(null)");
+	fprintf(stdout, "  --mbus-client-compress-minimum : requests smaller than this are sent uncompressed (default: %d)\n", MBUS_CLIENT_DEFAULT_COMPRESS_MINIMUM);
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	fprintf(stdout, "  --mbus-client-zstd-dictionary  : trained zstd dictionary file (default: %s)\n", "(null)");
+#endif
+	fprintf(stdout, "  --mbus-client-encoding         : only offer this method encoding besides json, offers all if not set (default: %s)\n", "(null)");
+	fprintf(stdout, "  --mbus-client-fragment-size    : larger messages are sent in chunks of this size, negative to disable (default: %d)\n", MBUS_CLIENT_DEFAULT_FRAGMENT_SIZE);
 	fprintf(stdout, "  --mbus-help                    : this text\n");
 }
 
@@ -1635,6 +1973,21 @@ int mbus_client_options_from_argv (struct mbus_client_options *options, int argc
 			case OPTION_PING_THRESHOLD:
 				options->ping_threshold = atoi(optarg);
 				break;
+			case OPTION_COMPRESSION:
+				options->compression = optarg;
+				break;
+			case OPTION_COMPRESS_MINIMUM:
+				options->compress_minimum = atoi(optarg);
+				break;
+			case OPTION_ZSTD_DICTIONARY:
+				options->zstd_dictionary = optarg;
+				break;
+			case OPTION_ENCODING:
+				options->encoding = optarg;
+				break;
+			case OPTION_FRAGMENT_SIZE:
+				options->fragment_size = atoi(optarg);
+				break;
 			case OPTION_HELP:
 				mbus_client_usage();
 				goto bail;
@@ -1709,6 +2062,10 @@ struct mbus_client * mbus_client_create (const struct mbus_client_options *_opti
 		options.ping_timeout = options.ping_interval;
 	}
 
+	if (options.fragment_size == 0) {
+		options.fragment_size = MBUS_CLIENT_DEFAULT_FRAGMENT_SIZE;
+	}
+
 	if (strcmp(options.server_protocol, MBUS_SERVER_TCP_PROTOCOL) == 0) {
 		if (options.server_port <= 0) {
 			options.server_port = MBUS_SERVER_TCP_PORT;
@@ -1760,6 +2117,16 @@ struct mbus_client * mbus_client_create (const struct mbus_client_options *_opti
 	TAILQ_INIT(&client->pendings);
 	TAILQ_INIT(&client->routines);
 	TAILQ_INIT(&client->subscriptions);
+	client->pending_index = mbus_hash_create();
+	if (client->pending_index == NULL) {
+		mbus_errorf("can not create pending index");
+		goto bail;
+	}
+	client->timers = mbus_timers_create();
+	if (client->timers == NULL) {
+		mbus_errorf("can not create timers");
+		goto bail;
+	}
 
 	client->options = mbus_client_options_duplicate(&options);
 	if (client->options == NULL) {
@@ -1776,8 +2143,31 @@ struct mbus_client * mbus_client_create (const struct mbus_client_options *_opti
 		mbus_errorf("can not create outgoing buffer");
 		goto bail;
 	}
+	client->fragment.out = mbus_buffer_create();
+	if (client->fragment.out == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
+	client->fragment.in = mbus_buffer_create();
+	if (client->fragment.in == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
+	client->scratch = mbus_buffer_create();
+	if (client->scratch == NULL) {
+		mbus_errorf("can not create scratch buffer");
+		goto bail;
+	}
 	client->sequence = MBUS_METHOD_SEQUENCE_START;
+	client->sequence_end = MBUS_METHOD_SEQUENCE_END;
 	client->compression = mbus_compress_method_none;
+	if (client->options->zstd_dictionary != NULL) {
+		client->dictionary = mbus_compress_dictionary_create_from_file(mbus_compress_method_zstd, client->options->zstd_dictionary);
+		if (client->dictionary == NULL) {
+			mbus_errorf("can not load zstd dictionary: %s", client->options->zstd_dictionary);
+			goto bail;
+		}
+	}
 
 	rc = pipe(client->wakeup);
 	if (rc != 0) {
@@ -1810,12 +2200,30 @@ void mbus_client_destroy (struct mbus_client *client)
 		mbus_client_notify_disconnect(client, mbus_client_disconnect_status_canceled);
 	}
 	mbus_client_reset(client);
+	if (client->pending_index != NULL) {
+		mbus_hash_destroy(client->pending_index);
+	}
+	if (client->timers != NULL) {
+		mbus_timers_destroy(client->timers);
+	}
 	if (client->incoming != NULL) {
 		mbus_buffer_destroy(client->incoming);
 	}
 	if (client->outgoing != NULL) {
 		mbus_buffer_destroy(client->outgoing);
 	}
+	if (client->fragment.out != NULL) {
+		mbus_buffer_destroy(client->fragment.out);
+	}
+	if (client->fragment.in != NULL) {
+		mbus_buffer_destroy(client->fragment.in);
+	}
+	if (client->scratch != NULL) {
+		mbus_buffer_destroy(client->scratch);
+	}
+	if (client->dictionary != NULL) {
+		mbus_compress_dictionary_destroy(client->dictionary);
+	}
 	if (client->options != NULL) {
 		mbus_client_options_destroy(client->options);
 	}
@@ -2046,7 +2454,8 @@ int mbus_client_has_pending_unlocked (struct mbus_client *client)
 	if (client->requests.count > 0 ||
 	    client->pendings.count > 0 ||
 	    mbus_buffer_get_length(client->incoming) > 0 ||
-	    mbus_buffer_get_length(client->outgoing) > 0) {
+	    mbus_buffer_get_length(client->outgoing) > 0 ||
+	    mbus_buffer_get_length(client->fragment.out) > 0) {
 		rc = 1;
 	} else {
 		rc = 0;
@@ -2485,6 +2894,55 @@ int mbus_client_publish_unlocked (struct mbus_client *client, const char *event,
 bail:	return -1;
 }
 
+int mbus_client_publish_with_attachment (struct mbus_client *client, const char *event, const struct mbus_json *payload, const void *data, int length)
+{
+	int rc;
+	if (client == NULL) {
+		mbus_errorf("client is invalid");
+		goto bail;
+	}
+	if (event == NULL) {
+		mbus_errorf("event is invalid");
+		goto bail;
+	}
+	mbus_client_lock(client);
+	rc = mbus_client_publish_with_attachment_unlocked(client, event, payload, data, length);
+	mbus_client_unlock(client);
+	return rc;
+bail:	if (client != NULL) {
+		mbus_client_unlock(client);
+	}
+	return -1;
+}
+
+int mbus_client_publish_with_attachment_unlocked (struct mbus_client *client, const char *event, const struct mbus_json *payload, const void *data, int length)
+{
+	int rc;
+	struct mbus_client_attachment attachment;
+	struct mbus_client_publish_options options;
+	if (client == NULL) {
+		mbus_errorf("client is invalid");
+		goto bail;
+	}
+	if (event == NULL) {
+		mbus_errorf("event is invalid");
+		goto bail;
+	}
+	rc = mbus_client_publish_options_default(&options);
+	if (rc != 0) {
+		mbus_errorf("can not get default options");
+		goto bail;
+	}
+	attachment.data = data;
+	attachment.length = length;
+	options.event = event;
+	options.payload = payload;
+	options.attachments = &attachment;
+	options.nattachments = 1;
+	return mbus_client_publish_with_options_unlocked(client, &options);
+bail:	return -1;
+}
+
 int mbus_client_publish_options_default (struct mbus_client_publish_options *options)
 {
 	if (options == NULL) {
@@ -2518,9 +2976,21 @@ bail:	if (client != NULL) {
 	return -1;
 }
 
+static int publish_priority_value (enum mbus_client_priority priority)
+{
+	switch (priority) {
+		case mbus_client_priority_control:				return MBUS_METHOD_PRIORITY_CONTROL;
+		case mbus_client_priority_command:				return MBUS_METHOD_PRIORITY_COMMAND;
+		case mbus_client_priority_bulk:					return MBUS_METHOD_PRIORITY_BULK;
+		case mbus_client_priority_default:				return -1;
+	}
+	return -1;
+}
+
 int mbus_client_publish_with_options_unlocked (struct mbus_client *client, struct mbus_client_publish_options *options)
 {
 	int rc;
+	int priority;
 	struct request *request;
 	struct mbus_json *jdata;
 	struct mbus_json *jpayload;
@@ -2552,17 +3022,32 @@ int mbus_client_publish_with_options_unlocked (struct mbus_client *client, struc
 		mbus_debugf("timeout is invalid, using: %d", client->options->publish_timeout);
 		options->timeout = client->options->publish_timeout;
 	}
+	priority = publish_priority_value(options->priority);
 	if (options->qos == mbus_client_qos_at_most_once) {
 		request = request_create(MBUS_METHOD_TYPE_EVENT, options->destination, options->event, client->sequence, options->payload, NULL, NULL, options->timeout);
 		if (request == NULL) {
 			mbus_errorf("can not create request");
 			goto bail;
 		}
-		client->sequence += 1;
-		if (client->sequence >= MBUS_METHOD_SEQUENCE_END) {
-			client->sequence = MBUS_METHOD_SEQUENCE_START;
+		rc = request_set_attachments(request, options->attachments, options->nattachments);
+		if (rc != 0) {
+			mbus_errorf("can not set request attachments");
+			request_destroy(request);
+			goto bail;
+		}
+		rc = request_set_priority(request, priority);
+		if (rc != 0) {
+			mbus_errorf("can not set request priority");
+			request_destroy(request);
+			goto bail;
+		}
+		mbus_client_next_sequence(client);
+		rc = mbus_client_push_request(client, request);
+		if (rc != 0) {
+			mbus_errorf("can not push request");
+			request_destroy(request);
+			goto bail;
 		}
-		TAILQ_INSERT_TAIL(&client->requests, request, requests);
 	} else if (options->qos == mbus_client_qos_at_least_once) {
 		if (options->payload == NULL) {
 			jdata = mbus_json_create_object();
@@ -2588,6 +3073,13 @@ int mbus_client_publish_with_options_unlocked (struct mbus_client *client, struc
 			mbus_errorf("can not add identifier");
 			goto bail;
 		}
+		if (priority >= 0) {
+			rc = mbus_json_add_number_to_object_cs(jpayload, MBUS_METHOD_TAG_PRIORITY, priority);
+			if (rc != 0) {
+				mbus_errorf("can not add priority");
+				goto bail;
+			}
+		}
 		rc = mbus_json_add_item_to_object_cs(jpayload, MBUS_METHOD_TAG_PAYLOAD, jdata);
 		if (rc != 0) {
 			mbus_errorf("can not add payload");
@@ -2602,6 +3094,8 @@ int mbus_client_publish_with_options_unlocked (struct mbus_client *client, struc
 		command_options.destination = MBUS_SERVER_IDENTIFIER;
 		command_options.command = MBUS_SERVER_COMMAND_EVENT;
 		command_options.payload = jpayload;
+		command_options.attachments = options->attachments;
+		command_options.nattachments = options->nattachments;
 		command_options.callback = mbus_client_command_event_response;
 		command_options.context = NULL;
 		command_options.timeout = options->timeout;
@@ -3022,6 +3516,7 @@ bail:	if (client != NULL) {
 
 int mbus_client_command_with_options_unlocked (struct mbus_client *client, struct mbus_client_command_options *options)
 {
+	int rc;
 	struct request *request;
 	request = NULL;
 	if (client == NULL) {
@@ -3060,11 +3555,19 @@ int mbus_client_command_with_options_unlocked (struct mbus_client *client, struc
 		mbus_errorf("can not create request");
 		goto bail;
 	}
-	client->sequence += 1;
-	if (client->sequence >= MBUS_METHOD_SEQUENCE_END) {
-		client->sequence = MBUS_METHOD_SEQUENCE_START;
+	rc = request_set_attachments(request, options->attachments, options->nattachments);
+	if (rc != 0) {
+		mbus_errorf("can not set request attachments");
+		request_destroy(request);
+		goto bail;
+	}
+	mbus_client_next_sequence(client);
+	rc = mbus_client_push_request(client, request);
+	if (rc != 0) {
+		mbus_errorf("can not push request");
+		request_destroy(request);
+		goto bail;
 	}
-	TAILQ_INSERT_TAIL(&client->requests, request, requests);
 	return 0;
 bail:	return -1;
 }
@@ -3073,7 +3576,7 @@ int mbus_client_get_run_timeout_unlocked (struct mbus_client *client)
 {
 	int timeout;
 	unsigned long long current;
-	struct request *request;
+	struct mbus_timer *timer;
 	timeout = MBUS_CLIENT_DEFAULT_RUN_TIMEOUT;
 	current = mbus_clock_monotonic();
 	if (client == NULL) {
@@ -3102,22 +3605,15 @@ int mbus_client_get_run_timeout_unlocked (struct mbus_client *client)
                                 timeout = 0;
 			}
 		}
-		TAILQ_FOREACH(request, &client->requests, requests) {
-			if (request_get_timeout(request) >= 0) {
-				if (mbus_clock_before(current, request_get_created_at(request) + request_get_timeout(request))) {
-                                        timeout = MIN(timeout, (long long) ((request_get_created_at(request) + request_get_timeout(request)) - (current)));
-				} else {
-                                        timeout = 0;
-				}
-			}
+		if (client->requests.tqh_first != NULL) {
+			timeout = 0;
 		}
-		TAILQ_FOREACH(request, &client->pendings, requests) {
-			if (request_get_timeout(request) >= 0) {
-				if (mbus_clock_before(current, request_get_created_at(request) + request_get_timeout(request))) {
-                                        timeout = MIN(timeout, (long long) ((request_get_created_at(request) + request_get_timeout(request)) - (current)));
-				} else {
-                                        timeout = 0;
-				}
+		timer = mbus_timers_peek(client->timers);
+		if (timer != NULL) {
+			if (mbus_clock_before(current, timer->expires)) {
+                                timeout = MIN(timeout, (long long) (timer->expires - (current)));
+			} else {
+                                timeout = 0;
 			}
 		}
 	} else if (client->state == mbus_client_state_disconnecting) {
@@ -3187,6 +3683,12 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 
 	struct request *request;
 	struct request *nrequest;
+	struct mbus_timer *timer;
+
+	const void *data;
+	int length;
+	int skip_compression;
+	struct mbus_buffer *outgoing;
 
 	int read_rc;
 	int write_rc;
@@ -3363,6 +3865,7 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 				mbus_errorf("can not set buffer length: %d + %d / %d", mbus_buffer_get_length(client->incoming), read_rc, mbus_buffer_get_size(client->incoming));
 				goto bail;
 			}
+			client->incoming_tsms = mbus_clock_monotonic();
 		}
 	}
 
@@ -3498,16 +4001,37 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 		uint32_t expected;
 		uint32_t uncompressed;
 
-		char *string;
+		uint8_t sentinel;
 		struct mbus_json *json;
+		struct mbus_method_attachment *attachments;
+		int nattachments;
 		const char *type;
+		struct mbus_buffer *source;
 
 		while (mbus_buffer_get_length(client->incoming) >= 4) {
 			json = NULL;
-			string = NULL;
-			mbus_debugf("incoming size: %d, length: %d", mbus_buffer_get_size(client->incoming), mbus_buffer_get_length(client->incoming));
-			ptr = mbus_buffer_get_base(client->incoming);
-			end = ptr + mbus_buffer_get_length(client->incoming);
+			attachments = NULL;
+			nattachments = 0;
+			rc = mbus_buffer_assemble_fragment(client->incoming, client->fragment.in, &source);
+			if (rc != 0) {
+				mbus_errorf("can not assemble fragments");
+				goto incoming_bail;
+			}
+			if (source == NULL) {
+				break;
+			}
+			/*
+			 * frames are parsed in place, keep one spare byte after the
+			 * data so the frame can be terminated for the json parser.
+			 */
+			rc = mbus_buffer_reserve(source, mbus_buffer_get_length(source) + 1);
+			if (rc != 0) {
+				mbus_errorf("can not reserve incoming buffer");
+				goto incoming_bail;
+			}
+			mbus_debugf("incoming size: %d, length: %d", mbus_buffer_get_size(source), mbus_buffer_get_length(source));
+			ptr = mbus_buffer_get_base(source);
+			end = ptr + mbus_buffer_get_length(source);
 			if (end - ptr < 4) {
 				break;
 			}
@@ -3517,13 +4041,33 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 			if (end - ptr < (int32_t) expected) {
 				break;
 			}
-			data = ptr;
 			if (client->compression != mbus_compress_method_none) {
-				int uncompressedlen;
 				memcpy(&uncompressed, ptr, sizeof(uncompressed));
 				uncompressed = ntohl(uncompressed);
+			}
+			if (client->compression != mbus_compress_method_none &&
+			    client->uncompressed &&
+			    (uncompressed & MBUS_BUFFER_UNCOMPRESSED)) {
+				uncompressed &= ~MBUS_BUFFER_UNCOMPRESSED;
+				if (uncompressed != expected - sizeof(uncompressed)) {
+					mbus_errorf("uncompressed length is invalid");
+					goto incoming_bail;
+				}
+				data = ptr + sizeof(uncompressed);
+			} else if (client->compression != mbus_compress_method_none) {
+				int uncompressedlen;
+				rc = mbus_buffer_reserve(client->scratch, uncompressed + 1);
+				if (rc != 0) {
+					mbus_errorf("can not reserve scratch buffer");
+					goto incoming_bail;
+				}
+				data = mbus_buffer_get_base(client->scratch);
 				uncompressedlen = uncompressed;
-				rc = mbus_uncompress_data(client->compression, (void **) &data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				if (client->stream != NULL) {
+					rc = mbus_uncompress_stream_data_to(client->stream, data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				} else {
+					rc = mbus_uncompress_data_to(client->compression, data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				}
 				if (rc != 0) {
 					mbus_errorf("can not uncompress data");
 					goto incoming_bail;
@@ -3536,22 +4080,20 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 				data = ptr;
 				uncompressed = expected;
 			}
-			mbus_debugf("message: %s, e: %d, u: %d, '%.*s'", mbus_compress_method_string(client->compression), expected, uncompressed, uncompressed, data);
-			string = _strndup((char *) data, uncompressed);
-			if (string == NULL) {
-				mbus_errorf("can not allocate memory");
+			mbus_debugf("message: %s, %s, e: %d, u: %d", mbus_compress_method_string(client->compression), mbus_method_encoding_string(client->encoding), expected, uncompressed);
+			sentinel = data[uncompressed];
+			data[uncompressed] = '\0';
+			json = mbus_method_decode(client->encoding, data, uncompressed, &attachments, &nattachments);
+			data[uncompressed] = sentinel;
+			if (json == NULL) {
+				mbus_errorf("can not decode message: %s, %d", mbus_method_encoding_string(client->encoding), (int) uncompressed);
 				goto incoming_bail;
 			}
-			rc = mbus_buffer_shift(client->incoming, sizeof(uint32_t) + expected);
+			rc = mbus_buffer_shift(source, sizeof(uint32_t) + expected);
 			if (rc != 0) {
 				mbus_errorf("can not shift in");
 				goto incoming_bail;
 			}
-			json = mbus_json_parse(string);
-			if (json == NULL) {
-				mbus_errorf("can not parse message: '%s'", string);
-				goto incoming_bail;
-			}
 			type = mbus_json_get_string_value(json, MBUS_METHOD_TAG_TYPE, NULL);
 			if (type == NULL) {
 				mbus_errorf("message type is invalid");
@@ -3564,13 +4106,13 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 					goto incoming_bail;
 				}
 			} else if (strcmp(type, MBUS_METHOD_TYPE_EVENT) == 0) {
-				rc = mbus_client_handle_event(client, json);
+				rc = mbus_client_handle_event(client, json, attachments, nattachments);
 				if (rc != 0) {
 					mbus_errorf("can not handle message event");
 					goto incoming_bail;
 				}
 			} else if (strcmp(type, MBUS_METHOD_TYPE_COMMAND) == 0) {
-				rc = mbus_client_handle_command(client, json);
+				rc = mbus_client_handle_command(client, json, attachments, nattachments);
 				if (rc != 0) {
 					mbus_errorf("can not handle message command");
 					goto incoming_bail;
@@ -3580,19 +4122,15 @@ int mbus_client_run (struct mbus_client *client, int timeout)
 				goto incoming_bail;
 			}
 			mbus_json_delete(json);
-			free(string);
-			if (data != ptr) {
-				free(data);
+			if (attachments != NULL) {
+				free(attachments);
 			}
 			continue;
 incoming_bail:		if (json != NULL) {
 				mbus_json_delete(json);
 			}
-			if (string != NULL) {
-				free(string);
-			}
-			if (data != ptr) {
-				free(data);
+			if (attachments != NULL) {
+				free(attachments);
 			}
 			goto bail;
 		}
@@ -3659,64 +4197,83 @@ out:
 		}
 	}
 
-	int i;
-	struct requests *requests[2];
-
-	requests[0] = &client->requests;
-	requests[1] = &client->pendings;
-	for (i = 0; i < (int) (sizeof(requests) / sizeof(requests[0])); i++) {
-		TAILQ_FOREACH_SAFE(request, requests[i], requests, nrequest) {
-			if (request_get_timeout(request) < 0 ||
-			    mbus_clock_before(current, request_get_created_at(request) + request_get_timeout(request))) {
-				continue;
+	while ((timer = mbus_timers_pop(client->timers, current)) != NULL) {
+		request = timer->context;
+		mbus_debugf("request timeout to server: %s, %s", request_get_type(request), request_get_identifier(request));
+		if (request->pending) {
+			mbus_client_remove_pending(client, request);
+		} else {
+			TAILQ_REMOVE(&client->requests, request, requests);
+		}
+		if (strcmp(request_get_type(request), MBUS_METHOD_TYPE_EVENT) == 0) {
+			if (strcmp(MBUS_SERVER_IDENTIFIER, request_get_destination(request)) != 0 &&
+			    strcmp(MBUS_SERVER_EVENT_PING, request_get_identifier(request)) != 0) {
+				mbus_client_notify_publish(client, request_get_json(request), mbus_client_publish_status_timeout);
 			}
-			mbus_debugf("request timeout to server: %s, %s", mbus_compress_method_string(client->compression), request_get_string(request));
-			TAILQ_REMOVE(requests[i], request, requests);
-			if (strcmp(request_get_type(request), MBUS_METHOD_TYPE_EVENT) == 0) {
-				if (strcmp(MBUS_SERVER_IDENTIFIER, request_get_destination(request)) != 0 &&
-				    strcmp(MBUS_SERVER_EVENT_PING, request_get_identifier(request)) != 0) {
-					mbus_client_notify_publish(client, request_get_json(request), mbus_client_publish_status_timeout);
-				}
-			} else if (strcmp(request_get_type(request), MBUS_METHOD_TYPE_COMMAND) == 0) {
-				if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_EVENT) == 0) {
-					mbus_client_notify_publish(client, request_get_payload(request), mbus_client_publish_status_timeout);
-				} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_SUBSCRIBE) == 0) {
-					struct subscription *subscription;
-					mbus_client_notify_subscribe(client,
-								mbus_json_get_string_value(request_get_payload(request), "source", NULL),
-								mbus_json_get_string_value(request_get_payload(request), "event", NULL),
-								mbus_client_subscribe_status_timeout);
-					subscription = request->context;
-					subscription_destroy(subscription);
-				} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_UNSUBSCRIBE) == 0) {
-					mbus_client_notify_unsubscribe(client,
-								mbus_json_get_string_value(request_get_payload(request), "source", NULL),
-								mbus_json_get_string_value(request_get_payload(request), "event", NULL),
-								mbus_client_unsubscribe_status_timeout);
-				} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_REGISTER) == 0) {
-					struct routine *routine;
-					mbus_client_notify_registered(client,
-								mbus_json_get_string_value(request_get_payload(request), "command", NULL),
-								mbus_client_register_status_timeout);
-					routine = request->context;
-					routine_destroy(routine);
-				} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_UNREGISTER) == 0) {
-					mbus_client_notify_unregistered(client,
-								mbus_json_get_string_value(request_get_payload(request), "command", NULL),
-								mbus_client_unregister_status_timeout);
-				} else {
-					mbus_client_notify_command(client, request, NULL, mbus_client_command_status_timeout);
-				}
+		} else if (strcmp(request_get_type(request), MBUS_METHOD_TYPE_COMMAND) == 0) {
+			if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_EVENT) == 0) {
+				mbus_client_notify_publish(client, request_get_payload(request), mbus_client_publish_status_timeout);
+			} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_SUBSCRIBE) == 0) {
+				struct subscription *subscription;
+				mbus_client_notify_subscribe(client,
+							mbus_json_get_string_value(request_get_payload(request), "source", NULL),
+							mbus_json_get_string_value(request_get_payload(request), "event", NULL),
+							mbus_client_subscribe_status_timeout);
+				subscription = request->context;
+				subscription_destroy(subscription);
+			} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_UNSUBSCRIBE) == 0) {
+				mbus_client_notify_unsubscribe(client,
+							mbus_json_get_string_value(request_get_payload(request), "source", NULL),
+							mbus_json_get_string_value(request_get_payload(request), "event", NULL),
+							mbus_client_unsubscribe_status_timeout);
+			} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_REGISTER) == 0) {
+				struct routine *routine;
+				mbus_client_notify_registered(client,
+							mbus_json_get_string_value(request_get_payload(request), "command", NULL),
+							mbus_client_register_status_timeout);
+				routine = request->context;
+				routine_destroy(routine);
+			} else if (strcmp(request_get_identifier(request), MBUS_SERVER_COMMAND_UNREGISTER) == 0) {
+				mbus_client_notify_unregistered(client,
+							mbus_json_get_string_value(request_get_payload(request), "command", NULL),
+							mbus_client_unregister_status_timeout);
+			} else {
+				mbus_client_notify_command(client, request, NULL, mbus_client_command_status_timeout);
 			}
-			request_destroy(request);
 		}
+		request_destroy(request);
 	}
 
 	TAILQ_FOREACH_SAFE(request, &client->requests, requests, nrequest) {
-		mbus_debugf("request to server: %s, %s", mbus_compress_method_string(client->compression), request_get_string(request));
-		rc = mbus_buffer_push_string(client->outgoing, client->compression, request_get_string(request));
+		data = request_get_data(request, client->encoding, &length);
+		if (data == NULL) {
+			mbus_errorf("can not encode request");
+			goto bail;
+		}
+		mbus_debugf("request to server: %s, %s, %s, %d", mbus_compress_method_string(client->compression), mbus_method_encoding_string(client->encoding), request_get_identifier(request), length);
+		skip_compression = (client->compression != mbus_compress_method_none &&
+				    client->uncompressed &&
+				    length < client->options->compress_minimum);
+		outgoing = client->outgoing;
+		if (client->fragment.size > 0) {
+			if (length > client->fragment.size) {
+				outgoing = client->fragment.out;
+			} else if (mbus_buffer_get_length(client->fragment.out) > 0 &&
+				   client->stream != NULL &&
+				   skip_compression == 0) {
+				/* stream state must be consumed in the order it was produced */
+				outgoing = client->fragment.out;
+			}
+		}
+		if (skip_compression) {
+			rc = mbus_buffer_push_uncompressed(outgoing, data, length);
+		} else if (client->stream != NULL) {
+			rc = mbus_buffer_push_stream(outgoing, client->stream, data, length);
+		} else {
+			rc = mbus_buffer_push_data(outgoing, client->compression, data, length);
+		}
 		if (rc != 0) {
-			mbus_errorf("can not push string to outgoing");
+			mbus_errorf("can not push data to outgoing");
 			goto bail;
 		}
 		TAILQ_REMOVE(&client->requests, request, requests);
@@ -3725,9 +4282,25 @@ out:
 			    strcmp(MBUS_SERVER_EVENT_PING, request_get_identifier(request)) != 0) {
 				mbus_client_notify_publish(client, request_get_json(request), mbus_client_publish_status_success);
 			}
+			mbus_timers_del(client->timers, &request->timer);
 			request_destroy(request);
 		} else {
-			TAILQ_INSERT_TAIL(&client->pendings, request, requests);
+			rc = mbus_client_push_pending(client, request);
+			if (rc != 0) {
+				mbus_errorf("can not push request to pendings");
+				mbus_timers_del(client->timers, &request->timer);
+				request_destroy(request);
+				goto bail;
+			}
+		}
+	}
+
+	while (mbus_buffer_get_length(client->fragment.out) > 0 &&
+	       mbus_buffer_get_length(client->outgoing) < (unsigned int) client->fragment.size) {
+		rc = mbus_buffer_push_fragment(client->outgoing, client->fragment.out, &client->fragment.remaining, client->fragment.size);
+		if (rc != 0) {
+			mbus_errorf("can not push fragment to outgoing");
+			goto bail;
 		}
 	}
 
@@ -3782,6 +4355,31 @@ const struct mbus_json * mbus_client_message_event_payload (struct mbus_client_m
 bail:	return NULL;
 }
 
+int mbus_client_message_event_attachments (struct mbus_client_message_event *message)
+{
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		goto bail;
+	}
+	return message->nattachments;
+bail:	return -1;
+}
+
+const void * mbus_client_message_event_attachment (struct mbus_client_message_event *message, int at, int *length)
+{
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		goto bail;
+	}
+	if (at < 0 || at >= message->nattachments) {
+		mbus_errorf("attachment: %d is invalid", at);
+		goto bail;
+	}
+	*length = message->attachments[at].length;
+	return message->attachments[at].data;
+bail:	return NULL;
+}
+
 const char * mbus_client_message_command_request_destination (struct mbus_client_message_command *message)
 {
 	if (message == NULL) {
@@ -3862,6 +4460,49 @@ const struct mbus_json * mbus_client_message_routine_request_payload (struct mbu
 bail:	return NULL;
 }
 
+int mbus_client_message_routine_request_attachments (struct mbus_client_message_routine *message)
+{
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		goto bail;
+	}
+	return message->nattachments;
+bail:	return -1;
+}
+
+const void * mbus_client_message_routine_request_attachment (struct mbus_client_message_routine *message, int at, int *length)
+{
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		goto bail;
+	}
+	if (at < 0 || at >= message->nattachments) {
+		mbus_errorf("attachment: %d is invalid", at);
+		goto bail;
+	}
+	*length = message->attachments[at].length;
+	return message->attachments[at].data;
+bail:	return NULL;
+}
+
+int mbus_client_message_routine_request_timeout (struct mbus_client_message_routine *message)
+{
+	unsigned long long current;
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		goto bail;
+	}
+	if (message->deadline == 0) {
+		return -1;
+	}
+	current = mbus_clock_monotonic();
+	if (!mbus_clock_after(message->deadline, current)) {
+		return 0;
+	}
+	return message->deadline - current;
+bail:	return -1;
+}
+
 int mbus_client_message_routine_set_response_payload (struct mbus_client_message_routine *message, const struct mbus_json *payload)
 {
 	if (message == NULL) {
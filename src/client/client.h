@@ -39,6 +39,10 @@
 #define MBUS_CLIENT_DEFAULT_PING_TIMEOUT	5000
 #define MBUS_CLIENT_DEFAULT_PING_THRESHOLD	2
 
+#define MBUS_CLIENT_DEFAULT_COMPRESS_MINIMUM	0
+
+#define MBUS_CLIENT_DEFAULT_FRAGMENT_SIZE	65536
+
 struct mbus_json;
 struct mbus_client;
 struct mbus_client_message_event;
@@ -137,6 +141,17 @@ enum mbus_client_qos {
 	mbus_client_qos_exactly_once
 };
 
+/* queue class of a published event in the server outbound queues of
+ * the receivers, default leaves it to the server (bulk). control is kept
+ * for the server's own frames, events asking for it are queued as bulk.
+ */
+enum mbus_client_priority {
+	mbus_client_priority_default,
+	mbus_client_priority_control,
+	mbus_client_priority_command,
+	mbus_client_priority_bulk
+};
+
 struct mbus_client_subscribe_options {
 	const char *source;
 	const char *event;
@@ -152,11 +167,19 @@ struct mbus_client_unsubscribe_options {
 	int timeout;
 };
 
+struct mbus_client_attachment {
+	const void *data;
+	int length;
+};
+
 struct mbus_client_publish_options {
 	const char *destination;
 	const char *event;
 	const struct mbus_json *payload;
+	const struct mbus_client_attachment *attachments;
+	int nattachments;
 	enum mbus_client_qos qos;
+	enum mbus_client_priority priority;
 	int timeout;
 };
 
@@ -176,6 +199,8 @@ struct mbus_client_command_options {
 	const char *destination;
 	const char *command;
 	const struct mbus_json *payload;
+	const struct mbus_client_attachment *attachments;
+	int nattachments;
 	void (*callback) (struct mbus_client *client, void *context, struct mbus_client_message_command *message, enum mbus_client_command_status status);
 	void *context;
 	int timeout;
@@ -196,6 +221,11 @@ struct mbus_client_options {
 	int ping_interval;
 	int ping_timeout;
 	int ping_threshold;
+	char *compression;
+	int compress_minimum;
+	char *zstd_dictionary;
+	char *encoding;
+	int fragment_size;
 	struct {
 		void (*connect) (struct mbus_client *client, void *context, enum mbus_client_connect_status status);
 		void (*disconnect) (struct mbus_client *client, void *context, enum mbus_client_disconnect_status status);
@@ -260,6 +290,9 @@ int mbus_client_unsubscribe_with_options_unlocked (struct mbus_client *client, s
 int mbus_client_publish (struct mbus_client *client, const char *event, const struct mbus_json *payload);
 int mbus_client_publish_unlocked (struct mbus_client *client, const char *event, const struct mbus_json *payload);
 
+int mbus_client_publish_with_attachment (struct mbus_client *client, const char *event, const struct mbus_json *payload, const void *data, int length);
+int mbus_client_publish_with_attachment_unlocked (struct mbus_client *client, const char *event, const struct mbus_json *payload, const void *data, int length);
+
 int mbus_client_publish_options_default (struct mbus_client_publish_options *options);
 int mbus_client_publish_with_options (struct mbus_client *client, struct mbus_client_publish_options *options);
 int mbus_client_publish_with_options_unlocked (struct mbus_client *client, struct mbus_client_publish_options *options);
@@ -294,6 +327,8 @@ const char * mbus_client_message_event_source (struct mbus_client_message_event
 const char * mbus_client_message_event_destination (struct mbus_client_message_event *message);
 const char * mbus_client_message_event_identifier (struct mbus_client_message_event *message);
 const struct mbus_json * mbus_client_message_event_payload (struct mbus_client_message_event *message);
+int mbus_client_message_event_attachments (struct mbus_client_message_event *message);
+const void * mbus_client_message_event_attachment (struct mbus_client_message_event *message, int at, int *length);
 
 const char * mbus_client_message_command_request_destination (struct mbus_client_message_command *message);
 const char * mbus_client_message_command_request_identifier (struct mbus_client_message_command *message);
@@ -304,6 +339,9 @@ int mbus_client_message_command_response_status (struct mbus_client_message_comm
 const char * mbus_client_message_routine_request_source (struct mbus_client_message_routine *message);
 const char * mbus_client_message_routine_request_identifier (struct mbus_client_message_routine *message);
 const struct mbus_json * mbus_client_message_routine_request_payload (struct mbus_client_message_routine *message);
+int mbus_client_message_routine_request_attachments (struct mbus_client_message_routine *message);
+const void * mbus_client_message_routine_request_attachment (struct mbus_client_message_routine *message, int at, int *length);
+int mbus_client_message_routine_request_timeout (struct mbus_client_message_routine *message);
 int mbus_client_message_routine_set_response_payload (struct mbus_client_message_routine *message, const struct mbus_json *payload);
 
 const char * mbus_client_state_string (enum mbus_client_state state);
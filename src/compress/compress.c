@@ -29,23 +29,654 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
 #include <zlib.h>
 #endif
 
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+#include <lz4.h>
+#endif
+
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+#include <zstd.h>
+#endif
+
 #include "mbus/debug.h"
 #include "compress.h"
 
+struct mbus_compress_dictionary {
+	enum mbus_compress_method compression;
+	unsigned int id;
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+#endif
+};
+
+/*
+ * a stream only borrows its dictionary, the dictionary is read only and
+ * shared by every stream created with it, so it must outlive them.
+ */
+
+struct mbus_compress_stream {
+	enum mbus_compress_method compression;
+	struct mbus_compress_dictionary *dictionary;
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	int deflating;
+	z_stream deflate;
+	int inflating;
+	z_stream inflate;
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#endif
+};
+
 #if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
 
-static int zlib_compress_data (void **dst, int *dstlen, const void *src, int srclen)
+static int zlib_compress_data (void **dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	Bytef *compressed;
+	uLongf compressedlen;
+	compressed = NULL;
+	compressedlen = 0;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	compressedlen = compressBound(srclen);
+	compressed = malloc(compressedlen);
+	if (compressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = compress2(compressed, &compressedlen, src, srclen, Z_DEFAULT_COMPRESSION);
+	if (rc != Z_OK) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	*dst = compressed;
+	*dstlen = compressedlen;
+	return 0;
+bail:	if (compressed != NULL) {
+		free(compressed);
+	}
+	return -1;
+}
+
+static int zlib_uncompress_data_to (void *dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	uLongf uncompressedlen;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	uncompressedlen = *dstlen;
+	rc = uncompress(dst, &uncompressedlen, src, srclen);
+	if (rc != Z_OK) {
+		mbus_errorf("can not uncompress data");
+		goto bail;
+	}
+	*dstlen = uncompressedlen;
+	return 0;
+bail:	return -1;
+}
+
+static int zlib_uncompress_data (void **dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	Bytef *uncompressed;
+	uncompressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	uncompressed = malloc(*dstlen);
+	if (uncompressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = zlib_uncompress_data_to(uncompressed, dstlen, src, srclen);
+	if (rc != 0) {
+		goto bail;
+	}
+	*dst = uncompressed;
+	return 0;
+bail:	if (uncompressed != NULL) {
+		free(uncompressed);
+	}
+	return -1;
+}
+
+/*
+ * prefix is a zlib header and a sync flushed, byte aligned deflate stream
+ * that is left open. suffix closes it with a final stored block and the
+ * adler32 trailer, so the tail of a shared frame can be patched for each
+ * recipient without compressing the whole frame again.
+ */
+
+static int zlib_compress_data_prefix (void **dst, int *dstlen, unsigned long *checksum, const void *src, int srclen)
+{
+	int rc;
+	z_stream stream;
+	Bytef *compressed;
+	uLong compressedlen;
+	compressed = NULL;
+	memset(&stream, 0, sizeof(z_stream));
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (checksum == NULL) {
+		mbus_errorf("checksum is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	rc = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+	if (rc != Z_OK) {
+		mbus_errorf("can not init deflate");
+		goto bail;
+	}
+	compressedlen = deflateBound(&stream, srclen) + 16;
+	compressed = malloc(compressedlen);
+	if (compressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	stream.next_in = (Bytef *) src;
+	stream.avail_in = srclen;
+	stream.next_out = compressed;
+	stream.avail_out = compressedlen;
+	rc = deflate(&stream, Z_SYNC_FLUSH);
+	if (rc != Z_OK || stream.avail_in != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	*dst = compressed;
+	*dstlen = compressedlen - stream.avail_out;
+	*checksum = stream.adler;
+	deflateEnd(&stream);
+	return 0;
+bail:	deflateEnd(&stream);
+	if (compressed != NULL) {
+		free(compressed);
+	}
+	return -1;
+}
+
+static int zlib_compress_data_suffix (void *dst, int *dstlen, unsigned long checksum, const void *src, int srclen)
+{
+	uint8_t *ptr;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (srclen < 0 || srclen > 0xffff) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	if (*dstlen < srclen + 9) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	checksum = adler32_combine(checksum, adler32(adler32(0, Z_NULL, 0), src, srclen), srclen);
+	ptr = dst;
+	*ptr++ = 0x01;
+	*ptr++ = (srclen >> 0) & 0xff;
+	*ptr++ = (srclen >> 8) & 0xff;
+	*ptr++ = (~srclen >> 0) & 0xff;
+	*ptr++ = (~srclen >> 8) & 0xff;
+	memcpy(ptr, src, srclen);
+	ptr += srclen;
+	*ptr++ = (checksum >> 24) & 0xff;
+	*ptr++ = (checksum >> 16) & 0xff;
+	*ptr++ = (checksum >> 8) & 0xff;
+	*ptr++ = (checksum >> 0) & 0xff;
+	*dstlen = ptr - (uint8_t *) dst;
+	return 0;
+bail:	return -1;
+}
+
+/*
+ * zlib-stream keeps one raw deflate stream per direction for the life of
+ * a connection, so each message is compressed against the history of the
+ * ones before it. every message ends with a sync flush, the 00 00 ff ff
+ * marker that closes it is stripped on the wire and fed back to inflate
+ * on receive.
+ */
+
+static const uint8_t zlib_stream_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+static int zlib_stream_compress_data (struct mbus_compress_stream *stream, void **dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	Bytef *tmp;
+	Bytef *compressed;
+	uLong compressedlen;
+	compressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	if (stream->deflating == 0) {
+		rc = deflateInit2(&stream->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		if (rc != Z_OK) {
+			mbus_errorf("can not init deflate");
+			goto bail;
+		}
+		stream->deflating = 1;
+	}
+	compressedlen = deflateBound(&stream->deflate, srclen) + 16;
+	compressed = malloc(compressedlen);
+	if (compressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	stream->deflate.next_in = (Bytef *) src;
+	stream->deflate.avail_in = srclen;
+	stream->deflate.next_out = compressed;
+	stream->deflate.avail_out = compressedlen;
+	while (1) {
+		rc = deflate(&stream->deflate, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR) {
+			mbus_errorf("can not compress data");
+			goto bail;
+		}
+		if (stream->deflate.avail_out != 0) {
+			break;
+		}
+		tmp = realloc(compressed, compressedlen * 2);
+		if (tmp == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		compressed = tmp;
+		stream->deflate.next_out = compressed + compressedlen;
+		stream->deflate.avail_out = compressedlen;
+		compressedlen *= 2;
+	}
+	if (stream->deflate.avail_in != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	compressedlen -= stream->deflate.avail_out;
+	if (compressedlen < sizeof(zlib_stream_tail) ||
+	    memcmp(compressed + compressedlen - sizeof(zlib_stream_tail), zlib_stream_tail, sizeof(zlib_stream_tail)) != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	*dst = compressed;
+	*dstlen = compressedlen - sizeof(zlib_stream_tail);
+	return 0;
+bail:	if (compressed != NULL) {
+		free(compressed);
+	}
+	return -1;
+}
+
+static int zlib_stream_uncompress_data_to (struct mbus_compress_stream *stream, void *dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	if (stream->inflating == 0) {
+		rc = inflateInit2(&stream->inflate, -15);
+		if (rc != Z_OK) {
+			mbus_errorf("can not init inflate");
+			goto bail;
+		}
+		stream->inflating = 1;
+	}
+	stream->inflate.next_out = dst;
+	stream->inflate.avail_out = *dstlen;
+	stream->inflate.next_in = (Bytef *) src;
+	stream->inflate.avail_in = srclen;
+	rc = inflate(&stream->inflate, Z_SYNC_FLUSH);
+	if ((rc != Z_OK && rc != Z_BUF_ERROR) || stream->inflate.avail_in != 0) {
+		mbus_errorf("can not uncompress data");
+		goto bail;
+	}
+	stream->inflate.next_in = (Bytef *) zlib_stream_tail;
+	stream->inflate.avail_in = sizeof(zlib_stream_tail);
+	rc = inflate(&stream->inflate, Z_SYNC_FLUSH);
+	if ((rc != Z_OK && rc != Z_BUF_ERROR) || stream->inflate.avail_in != 0) {
+		mbus_errorf("can not uncompress data");
+		goto bail;
+	}
+	*dstlen -= stream->inflate.avail_out;
+	return 0;
+bail:	return -1;
+}
+
+#endif
+
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+
+static int lz4_compress_data (void **dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	char *compressed;
+	int compressedlen;
+	compressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	compressedlen = LZ4_compressBound(srclen);
+	compressed = malloc(compressedlen);
+	if (compressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = LZ4_compress_default(src, compressed, srclen, compressedlen);
+	if (rc <= 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	*dst = compressed;
+	*dstlen = rc;
+	return 0;
+bail:	if (compressed != NULL) {
+		free(compressed);
+	}
+	return -1;
+}
+
+static int lz4_uncompress_data_to (void *dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	rc = LZ4_decompress_safe(src, dst, srclen, *dstlen);
+	if (rc < 0) {
+		mbus_errorf("can not uncompress data");
+		goto bail;
+	}
+	*dstlen = rc;
+	return 0;
+bail:	return -1;
+}
+
+static int lz4_uncompress_data (void **dst, int *dstlen, const void *src, int srclen)
+{
+	int rc;
+	char *uncompressed;
+	uncompressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	uncompressed = malloc(*dstlen);
+	if (uncompressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = lz4_uncompress_data_to(uncompressed, dstlen, src, srclen);
+	if (rc != 0) {
+		goto bail;
+	}
+	*dst = uncompressed;
+	return 0;
+bail:	if (uncompressed != NULL) {
+		free(uncompressed);
+	}
+	return -1;
+}
+
+#endif
+
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+
+static int zstd_compress_data (void **dst, int *dstlen, const void *src, int srclen)
+{
+	size_t rc;
+	void *compressed;
+	size_t compressedlen;
+	compressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	compressedlen = ZSTD_compressBound(srclen);
+	compressed = malloc(compressedlen);
+	if (compressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = ZSTD_compress(compressed, compressedlen, src, srclen, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(rc)) {
+		mbus_errorf("can not compress data: %s", ZSTD_getErrorName(rc));
+		goto bail;
+	}
+	*dst = compressed;
+	*dstlen = rc;
+	return 0;
+bail:	if (compressed != NULL) {
+		free(compressed);
+	}
+	return -1;
+}
+
+static int zstd_uncompress_data_to (void *dst, int *dstlen, const void *src, int srclen)
+{
+	size_t rc;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (src == NULL) {
+		mbus_errorf("src is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (srclen <= 0) {
+		mbus_errorf("srclen is invalid");
+		goto bail;
+	}
+	rc = ZSTD_decompress(dst, *dstlen, src, srclen);
+	if (ZSTD_isError(rc)) {
+		mbus_errorf("can not uncompress data: %s", ZSTD_getErrorName(rc));
+		goto bail;
+	}
+	*dstlen = rc;
+	return 0;
+bail:	return -1;
+}
+
+static int zstd_uncompress_data (void **dst, int *dstlen, const void *src, int srclen)
 {
 	int rc;
-	Bytef *compressed;
-	uLongf compressedlen;
+	void *uncompressed;
+	uncompressed = NULL;
+	if (dst == NULL) {
+		mbus_errorf("dst is invalid");
+		goto bail;
+	}
+	if (dstlen == NULL) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	if (*dstlen <= 0) {
+		mbus_errorf("dstlen is invalid");
+		goto bail;
+	}
+	uncompressed = malloc(*dstlen);
+	if (uncompressed == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	rc = zstd_uncompress_data_to(uncompressed, dstlen, src, srclen);
+	if (rc != 0) {
+		goto bail;
+	}
+	*dst = uncompressed;
+	return 0;
+bail:	if (uncompressed != NULL) {
+		free(uncompressed);
+	}
+	return -1;
+}
+
+/*
+ * a zstd stream is not a stream of history like zlib-stream, it holds the
+ * connection's reusable contexts and a trained dictionary. every message
+ * is still a self contained zstd frame, the dictionary stands in for the
+ * history that a single small message does not have.
+ */
+
+static int zstd_stream_compress_data (struct mbus_compress_stream *stream, void **dst, int *dstlen, const void *src, int srclen)
+{
+	size_t rc;
+	void *compressed;
+	size_t compressedlen;
 	compressed = NULL;
-	compressedlen = 0;
 	if (dst == NULL) {
 		mbus_errorf("dst is invalid");
 		goto bail;
@@ -55,26 +686,33 @@ static int zlib_compress_data (void **dst, int *dstlen, const void *src, int src
 		goto bail;
 	}
 	if (src == NULL) {
-		mbus_errorf("dst is invalid");
+		mbus_errorf("src is invalid");
 		goto bail;
 	}
 	if (srclen <= 0) {
 		mbus_errorf("srclen is invalid");
 		goto bail;
 	}
-	compressedlen = compressBound(srclen);
+	if (stream->cctx == NULL) {
+		stream->cctx = ZSTD_createCCtx();
+		if (stream->cctx == NULL) {
+			mbus_errorf("can not create compress context");
+			goto bail;
+		}
+	}
+	compressedlen = ZSTD_compressBound(srclen);
 	compressed = malloc(compressedlen);
 	if (compressed == NULL) {
 		mbus_errorf("can not allocate memory");
 		goto bail;
 	}
-	rc = compress2(compressed, &compressedlen, src, srclen, Z_DEFAULT_COMPRESSION);
-	if (rc != Z_OK) {
-		mbus_errorf("can not compress data");
+	rc = ZSTD_compress_usingCDict(stream->cctx, compressed, compressedlen, src, srclen, stream->dictionary->cdict);
+	if (ZSTD_isError(rc)) {
+		mbus_errorf("can not compress data: %s", ZSTD_getErrorName(rc));
 		goto bail;
 	}
 	*dst = compressed;
-	*dstlen = compressedlen;
+	*dstlen = rc;
 	return 0;
 bail:	if (compressed != NULL) {
 		free(compressed);
@@ -82,13 +720,9 @@ bail:	if (compressed != NULL) {
 	return -1;
 }
 
-static int zlib_uncompress_data (void **dst, int *dstlen, const void *src, int srclen)
+static int zstd_stream_uncompress_data_to (struct mbus_compress_stream *stream, void *dst, int *dstlen, const void *src, int srclen)
 {
-	int rc;
-	Bytef *uncompressed;
-	uLongf uncompressedlen;
-	uncompressed = NULL;
-	uncompressedlen = 0;
+	size_t rc;
 	if (dst == NULL) {
 		mbus_errorf("dst is invalid");
 		goto bail;
@@ -98,7 +732,7 @@ static int zlib_uncompress_data (void **dst, int *dstlen, const void *src, int s
 		goto bail;
 	}
 	if (src == NULL) {
-		mbus_errorf("dst is invalid");
+		mbus_errorf("src is invalid");
 		goto bail;
 	}
 	if (*dstlen <= 0) {
@@ -109,27 +743,58 @@ static int zlib_uncompress_data (void **dst, int *dstlen, const void *src, int s
 		mbus_errorf("srclen is invalid");
 		goto bail;
 	}
-	uncompressedlen = *dstlen;
-	uncompressed = malloc(uncompressedlen);
-	if (uncompressed == NULL) {
-		mbus_errorf("can not allocate memory");
-		goto bail;
+	if (stream->dctx == NULL) {
+		stream->dctx = ZSTD_createDCtx();
+		if (stream->dctx == NULL) {
+			mbus_errorf("can not create uncompress context");
+			goto bail;
+		}
 	}
-	rc = uncompress(uncompressed, &uncompressedlen, src, srclen);
-	if (rc != Z_OK) {
-		mbus_errorf("can not compress data");
+	rc = ZSTD_decompress_usingDDict(stream->dctx, dst, *dstlen, src, srclen, stream->dictionary->ddict);
+	if (ZSTD_isError(rc)) {
+		mbus_errorf("can not uncompress data: %s", ZSTD_getErrorName(rc));
 		goto bail;
 	}
-	*dst = uncompressed;
-	*dstlen = uncompressedlen;
+	*dstlen = rc;
 	return 0;
-bail:	if (uncompressed != NULL) {
-		free(uncompressed);
+bail:	return -1;
+}
+
+#endif
+
+int mbus_compress_data_prefix (enum mbus_compress_method compression, void **dst, int *dstlen, unsigned long *checksum, const void *src, int srclen)
+{
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (compression == mbus_compress_method_zlib) {
+		return zlib_compress_data_prefix(dst, dstlen, checksum, src, srclen);
 	}
+#else
+	(void) compression;
+	(void) dst;
+	(void) dstlen;
+	(void) checksum;
+	(void) src;
+	(void) srclen;
+#endif
 	return -1;
 }
 
+int mbus_compress_data_suffix (enum mbus_compress_method compression, void *dst, int *dstlen, unsigned long checksum, const void *src, int srclen)
+{
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (compression == mbus_compress_method_zlib) {
+		return zlib_compress_data_suffix(dst, dstlen, checksum, src, srclen);
+	}
+#else
+	(void) compression;
+	(void) dst;
+	(void) dstlen;
+	(void) checksum;
+	(void) src;
+	(void) srclen;
 #endif
+	return -1;
+}
 
 int mbus_compress_data (enum mbus_compress_method compression, void **dst, int *dstlen, const void *src, int srclen)
 {
@@ -137,13 +802,47 @@ int mbus_compress_data (enum mbus_compress_method compression, void **dst, int *
 	if (compression == mbus_compress_method_zlib) {
 		return zlib_compress_data(dst, dstlen, src, srclen);
 	}
-#else
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	if (compression == mbus_compress_method_lz4) {
+		return lz4_compress_data(dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (compression == mbus_compress_method_zstd) {
+		return zstd_compress_data(dst, dstlen, src, srclen);
+	}
+#endif
 	(void) compression;
 	(void) dst;
 	(void) dstlen;
 	(void) src;
 	(void) srclen;
+	return -1;
+}
+
+int mbus_uncompress_data_to (enum mbus_compress_method compression, void *dst, int *dstlen, const void *src, int srclen)
+{
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (compression == mbus_compress_method_zlib) {
+		return zlib_uncompress_data_to(dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	if (compression == mbus_compress_method_lz4) {
+		return lz4_uncompress_data_to(dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (compression == mbus_compress_method_zstd) {
+		return zstd_uncompress_data_to(dst, dstlen, src, srclen);
+	}
 #endif
+	(void) compression;
+	(void) dst;
+	(void) dstlen;
+	(void) src;
+	(void) srclen;
 	return -1;
 }
 
@@ -153,13 +852,22 @@ int mbus_uncompress_data (enum mbus_compress_method compression, void **dst, int
 	if (compression == mbus_compress_method_zlib) {
 		return zlib_uncompress_data(dst, dstlen, src, srclen);
 	}
-#else
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	if (compression == mbus_compress_method_lz4) {
+		return lz4_uncompress_data(dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (compression == mbus_compress_method_zstd) {
+		return zstd_uncompress_data(dst, dstlen, src, srclen);
+	}
+#endif
 	(void) compression;
 	(void) dst;
 	(void) dstlen;
 	(void) src;
 	(void) srclen;
-#endif
 	return -1;
 }
 
@@ -168,8 +876,13 @@ const char * mbus_compress_method_string (enum mbus_compress_method compression)
 	if (compression == mbus_compress_method_none) return "none";
 #if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
 	if (compression == mbus_compress_method_zlib) return "zlib";
-#else
-	(void) compression;
+	if (compression == mbus_compress_method_zlib_stream) return "zlib-stream";
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	if (compression == mbus_compress_method_lz4) return "lz4";
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (compression == mbus_compress_method_zstd) return "zstd";
 #endif
 	return "none";
 }
@@ -186,6 +899,288 @@ enum mbus_compress_method mbus_compress_method_value (const char *string)
 	if (strcmp(string, "zlib") == 0) {
 		return mbus_compress_method_zlib;
 	}
+	if (strcmp(string, "zlib-stream") == 0) {
+		return mbus_compress_method_zlib_stream;
+	}
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	if (strcmp(string, "lz4") == 0) {
+		return mbus_compress_method_lz4;
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (strcmp(string, "zstd") == 0) {
+		return mbus_compress_method_zstd;
+	}
 #endif
 	return mbus_compress_method_none;
 }
+
+int mbus_compress_method_is_stream (enum mbus_compress_method compression)
+{
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (compression == mbus_compress_method_zlib_stream) {
+		return 1;
+	}
+#else
+	(void) compression;
+#endif
+	return 0;
+}
+
+int mbus_compress_method_has_prefix (enum mbus_compress_method compression)
+{
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (compression == mbus_compress_method_zlib) {
+		return 1;
+	}
+#else
+	(void) compression;
+#endif
+	return 0;
+}
+
+struct mbus_compress_dictionary * mbus_compress_dictionary_create (enum mbus_compress_method compression, const void *data, int length)
+{
+	struct mbus_compress_dictionary *dictionary;
+	dictionary = NULL;
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		goto bail;
+	}
+	if (length <= 0) {
+		mbus_errorf("length is invalid");
+		goto bail;
+	}
+	dictionary = malloc(sizeof(struct mbus_compress_dictionary));
+	if (dictionary == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(dictionary, 0, sizeof(struct mbus_compress_dictionary));
+	dictionary->compression = compression;
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (compression == mbus_compress_method_zstd) {
+		dictionary->id = ZSTD_getDictID_fromDict(data, length);
+		if (dictionary->id == 0) {
+			mbus_errorf("dictionary is not a trained zstd dictionary");
+			goto bail;
+		}
+		dictionary->cdict = ZSTD_createCDict(data, length, ZSTD_CLEVEL_DEFAULT);
+		if (dictionary->cdict == NULL) {
+			mbus_errorf("can not create compress dictionary");
+			goto bail;
+		}
+		dictionary->ddict = ZSTD_createDDict(data, length);
+		if (dictionary->ddict == NULL) {
+			mbus_errorf("can not create uncompress dictionary");
+			goto bail;
+		}
+		return dictionary;
+	}
+#endif
+	mbus_errorf("compression: %s does not support dictionaries", mbus_compress_method_string(compression));
+bail:	if (dictionary != NULL) {
+		mbus_compress_dictionary_destroy(dictionary);
+	}
+	return NULL;
+}
+
+struct mbus_compress_dictionary * mbus_compress_dictionary_create_from_file (enum mbus_compress_method compression, const char *path)
+{
+	FILE *fp;
+	long length;
+	void *data;
+	struct mbus_compress_dictionary *dictionary;
+	fp = NULL;
+	data = NULL;
+	if (path == NULL) {
+		mbus_errorf("path is invalid");
+		goto bail;
+	}
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		mbus_errorf("can not open file: %s", path);
+		goto bail;
+	}
+	fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (length <= 0) {
+		mbus_errorf("file is invalid: %s", path);
+		goto bail;
+	}
+	data = malloc(length);
+	if (data == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	if (fread(data, 1, length, fp) != (size_t) length) {
+		mbus_errorf("can not read file: %s", path);
+		goto bail;
+	}
+	dictionary = mbus_compress_dictionary_create(compression, data, length);
+	if (dictionary == NULL) {
+		mbus_errorf("can not create dictionary from file: %s", path);
+		goto bail;
+	}
+	free(data);
+	fclose(fp);
+	return dictionary;
+bail:	if (data != NULL) {
+		free(data);
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return NULL;
+}
+
+void mbus_compress_dictionary_destroy (struct mbus_compress_dictionary *dictionary)
+{
+	if (dictionary == NULL) {
+		return;
+	}
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (dictionary->cdict != NULL) {
+		ZSTD_freeCDict(dictionary->cdict);
+	}
+	if (dictionary->ddict != NULL) {
+		ZSTD_freeDDict(dictionary->ddict);
+	}
+#endif
+	free(dictionary);
+}
+
+unsigned int mbus_compress_dictionary_get_id (struct mbus_compress_dictionary *dictionary)
+{
+	if (dictionary == NULL) {
+		return 0;
+	}
+	return dictionary->id;
+}
+
+struct mbus_compress_stream * mbus_compress_stream_create (enum mbus_compress_method compression)
+{
+	struct mbus_compress_stream *stream;
+	stream = NULL;
+	if (mbus_compress_method_is_stream(compression) == 0) {
+		mbus_errorf("compression is not a stream method");
+		goto bail;
+	}
+	stream = malloc(sizeof(struct mbus_compress_stream));
+	if (stream == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(stream, 0, sizeof(struct mbus_compress_stream));
+	stream->compression = compression;
+	return stream;
+bail:	if (stream != NULL) {
+		mbus_compress_stream_destroy(stream);
+	}
+	return NULL;
+}
+
+struct mbus_compress_stream * mbus_compress_stream_create_with_dictionary (struct mbus_compress_dictionary *dictionary)
+{
+	struct mbus_compress_stream *stream;
+	stream = NULL;
+	if (dictionary == NULL) {
+		mbus_errorf("dictionary is invalid");
+		goto bail;
+	}
+	stream = malloc(sizeof(struct mbus_compress_stream));
+	if (stream == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(stream, 0, sizeof(struct mbus_compress_stream));
+	stream->compression = dictionary->compression;
+	stream->dictionary = dictionary;
+	return stream;
+bail:	if (stream != NULL) {
+		mbus_compress_stream_destroy(stream);
+	}
+	return NULL;
+}
+
+void mbus_compress_stream_destroy (struct mbus_compress_stream *stream)
+{
+	if (stream == NULL) {
+		return;
+	}
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (stream->deflating) {
+		deflateEnd(&stream->deflate);
+	}
+	if (stream->inflating) {
+		inflateEnd(&stream->inflate);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (stream->cctx != NULL) {
+		ZSTD_freeCCtx(stream->cctx);
+	}
+	if (stream->dctx != NULL) {
+		ZSTD_freeDCtx(stream->dctx);
+	}
+#endif
+	free(stream);
+}
+
+enum mbus_compress_method mbus_compress_stream_get_method (struct mbus_compress_stream *stream)
+{
+	if (stream == NULL) {
+		return mbus_compress_method_none;
+	}
+	return stream->compression;
+}
+
+int mbus_compress_stream_data (struct mbus_compress_stream *stream, void **dst, int *dstlen, const void *src, int srclen)
+{
+	if (stream == NULL) {
+		mbus_errorf("stream is invalid");
+		return -1;
+	}
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (stream->compression == mbus_compress_method_zlib_stream) {
+		return zlib_stream_compress_data(stream, dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (stream->compression == mbus_compress_method_zstd &&
+	    stream->dictionary != NULL) {
+		return zstd_stream_compress_data(stream, dst, dstlen, src, srclen);
+	}
+#endif
+	(void) dst;
+	(void) dstlen;
+	(void) src;
+	(void) srclen;
+	return -1;
+}
+
+int mbus_uncompress_stream_data_to (struct mbus_compress_stream *stream, void *dst, int *dstlen, const void *src, int srclen)
+{
+	if (stream == NULL) {
+		mbus_errorf("stream is invalid");
+		return -1;
+	}
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	if (stream->compression == mbus_compress_method_zlib_stream) {
+		return zlib_stream_uncompress_data_to(stream, dst, dstlen, src, srclen);
+	}
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	if (stream->compression == mbus_compress_method_zstd &&
+	    stream->dictionary != NULL) {
+		return zstd_stream_uncompress_data_to(stream, dst, dstlen, src, srclen);
+	}
+#endif
+	(void) dst;
+	(void) dstlen;
+	(void) src;
+	(void) srclen;
+	return -1;
+}
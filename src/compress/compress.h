@@ -28,11 +28,35 @@
 
 enum mbus_compress_method {
 	mbus_compress_method_none,
-	mbus_compress_method_zlib
+	mbus_compress_method_zlib,
+	mbus_compress_method_zlib_stream,
+	mbus_compress_method_lz4,
+	mbus_compress_method_zstd
 };
 
+struct mbus_compress_stream;
+struct mbus_compress_dictionary;
+
 const char * mbus_compress_method_string (enum mbus_compress_method compression);
 enum mbus_compress_method mbus_compress_method_value (const char *string);
+int mbus_compress_method_is_stream (enum mbus_compress_method compression);
+int mbus_compress_method_has_prefix (enum mbus_compress_method compression);
 
 int mbus_compress_data (enum mbus_compress_method compression, void **dst, int *dstlen, const void *src, int srclen);
 int mbus_uncompress_data (enum mbus_compress_method compression, void **dst, int *dstlen, const void *src, int srclen);
+int mbus_uncompress_data_to (enum mbus_compress_method compression, void *dst, int *dstlen, const void *src, int srclen);
+
+int mbus_compress_data_prefix (enum mbus_compress_method compression, void **dst, int *dstlen, unsigned long *checksum, const void *src, int srclen);
+int mbus_compress_data_suffix (enum mbus_compress_method compression, void *dst, int *dstlen, unsigned long checksum, const void *src, int srclen);
+
+struct mbus_compress_dictionary * mbus_compress_dictionary_create (enum mbus_compress_method compression, const void *data, int length);
+struct mbus_compress_dictionary * mbus_compress_dictionary_create_from_file (enum mbus_compress_method compression, const char *path);
+void mbus_compress_dictionary_destroy (struct mbus_compress_dictionary *dictionary);
+unsigned int mbus_compress_dictionary_get_id (struct mbus_compress_dictionary *dictionary);
+
+struct mbus_compress_stream * mbus_compress_stream_create (enum mbus_compress_method compression);
+struct mbus_compress_stream * mbus_compress_stream_create_with_dictionary (struct mbus_compress_dictionary *dictionary);
+void mbus_compress_stream_destroy (struct mbus_compress_stream *stream);
+enum mbus_compress_method mbus_compress_stream_get_method (struct mbus_compress_stream *stream);
+int mbus_compress_stream_data (struct mbus_compress_stream *stream, void **dst, int *dstlen, const void *src, int srclen);
+int mbus_uncompress_stream_data_to (struct mbus_compress_stream *stream, void *dst, int *dstlen, const void *src, int srclen);
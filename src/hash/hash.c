@@ -0,0 +1,266 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MBUS_DEBUG_NAME	"mbus-hash"
+
+#include "mbus/debug.h"
+#include "hash.h"
+
+#define MBUS_HASH_DEFAULT_SIZE	64
+
+struct mbus_hash_entry {
+	struct mbus_hash_entry *next;
+	uint32_t hash;
+	unsigned int length;
+	void *value;
+	uint8_t key[];
+};
+
+struct mbus_hash {
+	unsigned int count;
+	unsigned int size;
+	struct mbus_hash_entry **buckets;
+};
+
+static uint32_t hash_key (const void *key, unsigned int length)
+{
+	uint32_t h;
+	const uint8_t *p;
+	const uint8_t *e;
+	h = 2166136261u;
+	p = key;
+	e = p + length;
+	while (p < e) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int hash_resize (struct mbus_hash *hash, unsigned int size)
+{
+	unsigned int i;
+	struct mbus_hash_entry *entry;
+	struct mbus_hash_entry *nentry;
+	struct mbus_hash_entry **buckets;
+	buckets = malloc(sizeof(struct mbus_hash_entry *) * size);
+	if (buckets == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(buckets, 0, sizeof(struct mbus_hash_entry *) * size);
+	for (i = 0; i < hash->size; i++) {
+		for (entry = hash->buckets[i]; entry != NULL; entry = nentry) {
+			nentry = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+	if (hash->buckets != NULL) {
+		free(hash->buckets);
+	}
+	hash->buckets = buckets;
+	hash->size = size;
+	return 0;
+bail:	return -1;
+}
+
+static struct mbus_hash_entry ** hash_find (struct mbus_hash *hash, uint32_t h, const void *key, unsigned int length)
+{
+	struct mbus_hash_entry **entry;
+	if (hash->size == 0) {
+		return NULL;
+	}
+	for (entry = &hash->buckets[h & (hash->size - 1)]; *entry != NULL; entry = &(*entry)->next) {
+		if ((*entry)->hash == h &&
+		    (*entry)->length == length &&
+		    memcmp((*entry)->key, key, length) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+struct mbus_hash * mbus_hash_create (void)
+{
+	struct mbus_hash *hash;
+	hash = malloc(sizeof(struct mbus_hash));
+	if (hash == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(hash, 0, sizeof(struct mbus_hash));
+	return hash;
+bail:	return NULL;
+}
+
+void mbus_hash_destroy (struct mbus_hash *hash)
+{
+	unsigned int i;
+	struct mbus_hash_entry *entry;
+	struct mbus_hash_entry *nentry;
+	if (hash == NULL) {
+		return;
+	}
+	for (i = 0; i < hash->size; i++) {
+		for (entry = hash->buckets[i]; entry != NULL; entry = nentry) {
+			nentry = entry->next;
+			free(entry);
+		}
+	}
+	if (hash->buckets != NULL) {
+		free(hash->buckets);
+	}
+	free(hash);
+}
+
+unsigned int mbus_hash_get_count (struct mbus_hash *hash)
+{
+	if (hash == NULL) {
+		return 0;
+	}
+	return hash->count;
+}
+
+int mbus_hash_put (struct mbus_hash *hash, const void *key, unsigned int length, void *value)
+{
+	int rc;
+	uint32_t h;
+	struct mbus_hash_entry *entry;
+	struct mbus_hash_entry **pentry;
+	if (hash == NULL) {
+		mbus_errorf("hash is invalid");
+		goto bail;
+	}
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		goto bail;
+	}
+	h = hash_key(key, length);
+	pentry = hash_find(hash, h, key, length);
+	if (pentry != NULL) {
+		(*pentry)->value = value;
+		return 0;
+	}
+	if (hash->count + 1 > hash->size) {
+		rc = hash_resize(hash, (hash->size == 0) ? MBUS_HASH_DEFAULT_SIZE : (hash->size * 2));
+		if (rc != 0) {
+			mbus_errorf("can not resize hash");
+			goto bail;
+		}
+	}
+	entry = malloc(sizeof(struct mbus_hash_entry) + length);
+	if (entry == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	entry->hash = h;
+	entry->length = length;
+	entry->value = value;
+	memcpy(entry->key, key, length);
+	entry->next = hash->buckets[h & (hash->size - 1)];
+	hash->buckets[h & (hash->size - 1)] = entry;
+	hash->count += 1;
+	return 0;
+bail:	return -1;
+}
+
+void * mbus_hash_get (struct mbus_hash *hash, const void *key, unsigned int length)
+{
+	struct mbus_hash_entry **pentry;
+	if (hash == NULL) {
+		mbus_errorf("hash is invalid");
+		goto bail;
+	}
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		goto bail;
+	}
+	pentry = hash_find(hash, hash_key(key, length), key, length);
+	if (pentry == NULL) {
+		return NULL;
+	}
+	return (*pentry)->value;
+bail:	return NULL;
+}
+
+int mbus_hash_del (struct mbus_hash *hash, const void *key, unsigned int length)
+{
+	struct mbus_hash_entry *entry;
+	struct mbus_hash_entry **pentry;
+	if (hash == NULL) {
+		mbus_errorf("hash is invalid");
+		goto bail;
+	}
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		goto bail;
+	}
+	pentry = hash_find(hash, hash_key(key, length), key, length);
+	if (pentry == NULL) {
+		return 0;
+	}
+	entry = *pentry;
+	*pentry = entry->next;
+	free(entry);
+	hash->count -= 1;
+	return 0;
+bail:	return -1;
+}
+
+int mbus_hash_put_string (struct mbus_hash *hash, const char *key, void *value)
+{
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		return -1;
+	}
+	return mbus_hash_put(hash, key, strlen(key), value);
+}
+
+void * mbus_hash_get_string (struct mbus_hash *hash, const char *key)
+{
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		return NULL;
+	}
+	return mbus_hash_get(hash, key, strlen(key));
+}
+
+int mbus_hash_del_string (struct mbus_hash *hash, const char *key)
+{
+	if (key == NULL) {
+		mbus_errorf("key is invalid");
+		return -1;
+	}
+	return mbus_hash_del(hash, key, strlen(key));
+}
@@ -47,6 +47,34 @@ struct mbus_json * mbus_json_parse_end (const char *string, const char **end)
 	return (struct mbus_json *) mbus_cJSON_ParseWithOpts(string, end, 0);
 }
 
+/*
+ * string must have at least length + 1 readable bytes. when the byte at
+ * length is already a terminator the slice is parsed in place, otherwise
+ * it is parsed from a terminated copy.
+ */
+struct mbus_json * mbus_json_parse_length (const char *string, unsigned int length)
+{
+	char *copy;
+	const char *end;
+	struct mbus_json *json;
+	if (string == NULL) {
+		return NULL;
+	}
+	/* local end pointer, the parser's global one is not thread safe */
+	if (string[length] == '\0') {
+		return (struct mbus_json *) mbus_cJSON_ParseWithOpts(string, &end, 0);
+	}
+	copy = malloc(length + 1);
+	if (copy == NULL) {
+		return NULL;
+	}
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	json = (struct mbus_json *) mbus_cJSON_ParseWithOpts(copy, &end, 0);
+	free(copy);
+	return json;
+}
+
 struct mbus_json * mbus_json_parse_file (const char *path)
 {
 	int rc;
@@ -41,6 +41,7 @@ struct mbus_json;
 
 struct mbus_json * mbus_json_parse (const char *string);
 struct mbus_json * mbus_json_parse_end (const char *string, const char **end);
+struct mbus_json * mbus_json_parse_length (const char *string, unsigned int length);
 struct mbus_json * mbus_json_parse_file (const char *path);
 struct mbus_json * mbus_json_create_object (void);
 struct mbus_json * mbus_json_create_array (void);
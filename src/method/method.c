@@ -0,0 +1,1201 @@
+
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define MBUS_DEBUG_NAME	"mbus-method"
+
+#include "mbus/debug.h"
+#include "mbus/json.h"
+#include "method.h"
+
+static const struct {
+	const char *name;
+	uint8_t value;
+} binary_types[] = {
+	{ MBUS_METHOD_TYPE_COMMAND, MBUS_METHOD_BINARY_TYPE_COMMAND },
+	{ MBUS_METHOD_TYPE_EVENT, MBUS_METHOD_BINARY_TYPE_EVENT },
+	{ MBUS_METHOD_TYPE_RESULT, MBUS_METHOD_BINARY_TYPE_RESULT },
+};
+
+static const struct {
+	const char *tag;
+	uint8_t flag;
+} binary_strings[] = {
+	{ MBUS_METHOD_TAG_SOURCE, MBUS_METHOD_BINARY_FLAG_SOURCE },
+	{ MBUS_METHOD_TAG_DESTINATION, MBUS_METHOD_BINARY_FLAG_DESTINATION },
+	{ MBUS_METHOD_TAG_IDENTIFIER, MBUS_METHOD_BINARY_FLAG_IDENTIFIER },
+};
+
+static const struct {
+	const char *tag;
+	uint8_t flag;
+} binary_numbers[] = {
+	{ MBUS_METHOD_TAG_TIMEOUT, MBUS_METHOD_BINARY_FLAG_TIMEOUT },
+	{ MBUS_METHOD_TAG_STATUS, MBUS_METHOD_BINARY_FLAG_STATUS },
+	{ MBUS_METHOD_TAG_PRIORITY, MBUS_METHOD_BINARY_FLAG_PRIORITY },
+	{ MBUS_METHOD_TAG_EXPIRED, MBUS_METHOD_BINARY_FLAG_EXPIRED },
+};
+
+#define JSON_NESTING_LIMIT	1000
+
+struct binary_reader {
+	const uint8_t *ptr;
+	const uint8_t *end;
+};
+
+struct json_reader {
+	const char *ptr;
+	const char *end;
+};
+
+static int binary_tag_known (const char *tag)
+{
+	unsigned int i;
+	if (tag == NULL) {
+		return 0;
+	}
+	if (strcmp(tag, MBUS_METHOD_TAG_TYPE) == 0 ||
+	    strcmp(tag, MBUS_METHOD_TAG_SEQUENCE) == 0 ||
+	    strcmp(tag, MBUS_METHOD_TAG_PAYLOAD) == 0) {
+		return 1;
+	}
+	for (i = 0; i < sizeof(binary_strings) / sizeof(binary_strings[0]); i++) {
+		if (strcmp(tag, binary_strings[i].tag) == 0) {
+			return 1;
+		}
+	}
+	for (i = 0; i < sizeof(binary_numbers) / sizeof(binary_numbers[0]); i++) {
+		if (strcmp(tag, binary_numbers[i].tag) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint8_t * binary_put_u16 (uint8_t *ptr, uint16_t value)
+{
+	value = htons(value);
+	memcpy(ptr, &value, sizeof(value));
+	return ptr + sizeof(value);
+}
+
+static uint8_t * binary_put_u32 (uint8_t *ptr, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(ptr, &value, sizeof(value));
+	return ptr + sizeof(value);
+}
+
+static uint8_t * binary_put_data (uint8_t *ptr, const void *data, unsigned int length)
+{
+	memcpy(ptr, data, length);
+	return ptr + length;
+}
+
+static int binary_get_u8 (struct binary_reader *reader, uint8_t *value)
+{
+	if (reader->end - reader->ptr < (int) sizeof(*value)) {
+		return -1;
+	}
+	*value = *reader->ptr;
+	reader->ptr += sizeof(*value);
+	return 0;
+}
+
+static int binary_get_u16 (struct binary_reader *reader, uint16_t *value)
+{
+	if (reader->end - reader->ptr < (int) sizeof(*value)) {
+		return -1;
+	}
+	memcpy(value, reader->ptr, sizeof(*value));
+	*value = ntohs(*value);
+	reader->ptr += sizeof(*value);
+	return 0;
+}
+
+static int binary_get_u32 (struct binary_reader *reader, uint32_t *value)
+{
+	if (reader->end - reader->ptr < (int) sizeof(*value)) {
+		return -1;
+	}
+	memcpy(value, reader->ptr, sizeof(*value));
+	*value = ntohl(*value);
+	reader->ptr += sizeof(*value);
+	return 0;
+}
+
+static void json_skip_space (struct json_reader *reader)
+{
+	while (reader->ptr < reader->end &&
+	       (*reader->ptr == ' ' || *reader->ptr == '\t' || *reader->ptr == '\r' || *reader->ptr == '\n')) {
+		reader->ptr++;
+	}
+}
+
+static int json_skip_hex4 (struct json_reader *reader, unsigned int *value)
+{
+	int i;
+	char c;
+	if (reader->end - reader->ptr < 4) {
+		return -1;
+	}
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		c = *reader->ptr++;
+		if (c >= '0' && c <= '9') {
+			*value = (*value << 4) | (c - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			*value = (*value << 4) | (c - 'a' + 10);
+		} else if (c >= 'A' && c <= 'F') {
+			*value = (*value << 4) | (c - 'A' + 10);
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* escapes are checked the way cJSON parses them, anything it would refuse
+ * must not reach the subscribers.
+ */
+static int json_skip_escape (struct json_reader *reader)
+{
+	unsigned int uc;
+	unsigned int uc2;
+	if (reader->ptr >= reader->end) {
+		return -1;
+	}
+	switch (*reader->ptr++) {
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			return 0;
+		case 'u':
+			break;
+		default:
+			return -1;
+	}
+	if (json_skip_hex4(reader, &uc) != 0) {
+		return -1;
+	}
+	if (uc == 0 || (uc >= 0xdc00 && uc <= 0xdfff)) {
+		return -1;
+	}
+	if (uc < 0xd800 || uc > 0xdbff) {
+		return 0;
+	}
+	if (reader->end - reader->ptr < 2 ||
+	    reader->ptr[0] != '\\' ||
+	    reader->ptr[1] != 'u') {
+		return -1;
+	}
+	reader->ptr += 2;
+	if (json_skip_hex4(reader, &uc2) != 0) {
+		return -1;
+	}
+	if (uc2 < 0xdc00 || uc2 > 0xdfff) {
+		return -1;
+	}
+	return 0;
+}
+
+static int json_skip_string (struct json_reader *reader)
+{
+	if (reader->ptr >= reader->end || *reader->ptr != '"') {
+		return -1;
+	}
+	reader->ptr++;
+	while (reader->ptr < reader->end) {
+		if (*reader->ptr == '"') {
+			reader->ptr++;
+			return 0;
+		}
+		if ((unsigned char) *reader->ptr < 0x20) {
+			return -1;
+		}
+		if (*reader->ptr == '\\') {
+			reader->ptr++;
+			if (json_skip_escape(reader) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		reader->ptr++;
+	}
+	return -1;
+}
+
+static int json_skip_digits (struct json_reader *reader)
+{
+	const char *ptr;
+	ptr = reader->ptr;
+	while (reader->ptr < reader->end &&
+	       *reader->ptr >= '0' && *reader->ptr <= '9') {
+		reader->ptr++;
+	}
+	return (reader->ptr == ptr) ? -1 : 0;
+}
+
+static int json_skip_number (struct json_reader *reader)
+{
+	if (reader->ptr < reader->end && *reader->ptr == '-') {
+		reader->ptr++;
+	}
+	if (json_skip_digits(reader) != 0) {
+		return -1;
+	}
+	if (reader->ptr < reader->end && *reader->ptr == '.') {
+		reader->ptr++;
+		if (json_skip_digits(reader) != 0) {
+			return -1;
+		}
+	}
+	if (reader->ptr < reader->end && (*reader->ptr == 'e' || *reader->ptr == 'E')) {
+		reader->ptr++;
+		if (reader->ptr < reader->end && (*reader->ptr == '+' || *reader->ptr == '-')) {
+			reader->ptr++;
+		}
+		if (json_skip_digits(reader) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int json_skip_literal (struct json_reader *reader, const char *literal)
+{
+	int length;
+	length = strlen(literal);
+	if (reader->end - reader->ptr < length ||
+	    strncmp(reader->ptr, literal, length) != 0) {
+		return -1;
+	}
+	reader->ptr += length;
+	return 0;
+}
+
+/*
+ * walks over one json value without building it, checking its syntax
+ * on the way, so that the payload can be routed as opaque text.
+ */
+
+static int json_skip_value (struct json_reader *reader, int depth)
+{
+	char close;
+	if (depth > JSON_NESTING_LIMIT) {
+		return -1;
+	}
+	json_skip_space(reader);
+	if (reader->ptr >= reader->end) {
+		return -1;
+	}
+	switch (*reader->ptr) {
+		case '"':
+			return json_skip_string(reader);
+		case 't':
+			return json_skip_literal(reader, "true");
+		case 'f':
+			return json_skip_literal(reader, "false");
+		case 'n':
+			return json_skip_literal(reader, "null");
+		case '{':
+		case '[':
+			close = (*reader->ptr == '{') ? '}' : ']';
+			reader->ptr++;
+			json_skip_space(reader);
+			if (reader->ptr < reader->end && *reader->ptr == close) {
+				reader->ptr++;
+				return 0;
+			}
+			while (1) {
+				if (close == '}') {
+					json_skip_space(reader);
+					if (json_skip_string(reader) != 0) {
+						return -1;
+					}
+					json_skip_space(reader);
+					if (reader->ptr >= reader->end || *reader->ptr != ':') {
+						return -1;
+					}
+					reader->ptr++;
+				}
+				if (json_skip_value(reader, depth + 1) != 0) {
+					return -1;
+				}
+				json_skip_space(reader);
+				if (reader->ptr >= reader->end) {
+					return -1;
+				}
+				if (*reader->ptr == close) {
+					reader->ptr++;
+					return 0;
+				}
+				if (*reader->ptr != ',') {
+					return -1;
+				}
+				reader->ptr++;
+			}
+		default:
+			return json_skip_number(reader);
+	}
+}
+
+static int json_validate (const char *data, int length)
+{
+	struct json_reader reader;
+	reader.ptr = data;
+	reader.end = data + length;
+	if (json_skip_value(&reader, 0) != 0) {
+		return -1;
+	}
+	json_skip_space(&reader);
+	return (reader.ptr == reader.end) ? 0 : -1;
+}
+
+static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int base64_encoded_length (int length)
+{
+	return ((length + 2) / 3) * 4;
+}
+
+static char * base64_encode (char *dst, const uint8_t *src, int length)
+{
+	int i;
+	uint32_t value;
+	for (i = 0; i + 2 < length; i += 3) {
+		value = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		*dst++ = base64_table[(value >> 18) & 0x3f];
+		*dst++ = base64_table[(value >> 12) & 0x3f];
+		*dst++ = base64_table[(value >> 6) & 0x3f];
+		*dst++ = base64_table[value & 0x3f];
+	}
+	if (i < length) {
+		value = src[i] << 16;
+		if (i + 1 < length) {
+			value |= src[i + 1] << 8;
+		}
+		*dst++ = base64_table[(value >> 18) & 0x3f];
+		*dst++ = base64_table[(value >> 12) & 0x3f];
+		*dst++ = (i + 1 < length) ? base64_table[(value >> 6) & 0x3f] : '=';
+		*dst++ = '=';
+	}
+	return dst;
+}
+
+static int base64_value (char c)
+{
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+static int base64_decode (uint8_t *dst, const char *src, int length)
+{
+	int i;
+	int j;
+	int v;
+	int pad;
+	uint32_t value;
+	uint8_t *ptr;
+	if (length % 4 != 0) {
+		return -1;
+	}
+	ptr = dst;
+	for (i = 0; i < length; i += 4) {
+		value = 0;
+		pad = 0;
+		for (j = 0; j < 4; j++) {
+			if (src[i + j] == '=' && i + 4 == length && j >= 2) {
+				pad += 1;
+				v = 0;
+			} else if (pad > 0) {
+				return -1;
+			} else {
+				v = base64_value(src[i + j]);
+				if (v < 0) {
+					return -1;
+				}
+			}
+			value = (value << 6) | v;
+		}
+		*ptr++ = (value >> 16) & 0xff;
+		if (pad < 2) {
+			*ptr++ = (value >> 8) & 0xff;
+		}
+		if (pad < 1) {
+			*ptr++ = value & 0xff;
+		}
+	}
+	return ptr - dst;
+}
+
+/*
+ * takes the attachments member out of a decoded json method, decoding
+ * its base64 strings into a single allocation when attachments is set.
+ */
+
+static int json_take_attachments (struct mbus_json *json, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int i;
+	int size;
+	int count;
+	int decoded;
+	uint8_t *ptr;
+	const char *string;
+	struct mbus_json *item;
+	struct mbus_method_attachment *array;
+	array = NULL;
+	item = mbus_json_get_object(json, MBUS_METHOD_TAG_ATTACHMENTS);
+	if (item == NULL) {
+		return 0;
+	}
+	if (attachments == NULL) {
+		mbus_json_delete_item_from_object(json, MBUS_METHOD_TAG_ATTACHMENTS);
+		return 0;
+	}
+	if (mbus_json_get_type(item) != mbus_json_type_array) {
+		mbus_errorf("method attachments is invalid");
+		goto bail;
+	}
+	count = mbus_json_get_array_size(item);
+	size = sizeof(struct mbus_method_attachment) * count;
+	for (i = 0; i < count; i++) {
+		string = mbus_json_get_value_string(mbus_json_get_array_item(item, i));
+		if (string == NULL) {
+			mbus_errorf("method attachment is invalid");
+			goto bail;
+		}
+		size += (strlen(string) / 4) * 3;
+	}
+	if (count > 0) {
+		array = malloc(size);
+		if (array == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		ptr = (uint8_t *) (array + count);
+		for (i = 0; i < count; i++) {
+			string = mbus_json_get_value_string(mbus_json_get_array_item(item, i));
+			decoded = base64_decode(ptr, string, strlen(string));
+			if (decoded < 0) {
+				mbus_errorf("method attachment is invalid");
+				goto bail;
+			}
+			array[i].data = ptr;
+			array[i].length = decoded;
+			ptr += decoded;
+		}
+	}
+	mbus_json_delete_item_from_object(json, MBUS_METHOD_TAG_ATTACHMENTS);
+	*attachments = array;
+	*nattachments = count;
+	return 0;
+bail:	if (array != NULL) {
+		free(array);
+	}
+	return -1;
+}
+
+static struct mbus_json * json_decode_header (const char *data, int length, const char **payload, int *payloadlength, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int rc;
+	int size;
+	char *copy;
+	const char *key;
+	const char *value;
+	unsigned int keylength;
+	struct json_reader reader;
+	struct mbus_json *json;
+	copy = NULL;
+	json = NULL;
+	*payload = NULL;
+	*payloadlength = 0;
+	reader.ptr = data;
+	reader.end = data + length;
+	json_skip_space(&reader);
+	if (reader.ptr >= reader.end || *reader.ptr != '{') {
+		goto bail;
+	}
+	reader.ptr++;
+	/* commas are only skipped here, the header parse below checks them */
+	while (1) {
+		json_skip_space(&reader);
+		if (reader.ptr < reader.end && *reader.ptr == '}') {
+			reader.ptr++;
+			break;
+		}
+		key = reader.ptr;
+		if (json_skip_string(&reader) != 0) {
+			goto bail;
+		}
+		keylength = reader.ptr - key;
+		json_skip_space(&reader);
+		if (reader.ptr >= reader.end || *reader.ptr != ':') {
+			goto bail;
+		}
+		reader.ptr++;
+		json_skip_space(&reader);
+		value = reader.ptr;
+		if (json_skip_value(&reader, 1) != 0) {
+			goto bail;
+		}
+		if (keylength == sizeof("\"" MBUS_METHOD_TAG_PAYLOAD "\"") - 1 &&
+		    strncmp(key, "\"" MBUS_METHOD_TAG_PAYLOAD "\"", keylength) == 0) {
+			*payload = value;
+			*payloadlength = reader.ptr - value;
+		}
+		json_skip_space(&reader);
+		if (reader.ptr < reader.end && *reader.ptr == ',') {
+			reader.ptr++;
+		}
+	}
+	json_skip_space(&reader);
+	if (reader.ptr != reader.end) {
+		goto bail;
+	}
+	if (*payload == NULL) {
+		json = mbus_json_parse_length(data, length);
+	} else {
+		/* parse the header with a placeholder in place of the payload value */
+		size = (*payload - data) + 1 + (data + length - (*payload + *payloadlength));
+		copy = malloc(size + 1);
+		if (copy == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		memcpy(copy, data, *payload - data);
+		copy[*payload - data] = '0';
+		memcpy(copy + (*payload - data) + 1, *payload + *payloadlength, data + length - (*payload + *payloadlength));
+		copy[size] = '\0';
+		json = mbus_json_parse_length(copy, size);
+		if (json != NULL) {
+			mbus_json_delete_item_from_object(json, MBUS_METHOD_TAG_PAYLOAD);
+		}
+		free(copy);
+		copy = NULL;
+	}
+	if (json == NULL) {
+		mbus_errorf("can not parse method");
+		goto bail;
+	}
+	rc = json_take_attachments(json, attachments, nattachments);
+	if (rc != 0) {
+		goto bail;
+	}
+	return json;
+bail:	if (copy != NULL) {
+		free(copy);
+	}
+	if (json != NULL) {
+		mbus_json_delete(json);
+	}
+	*payload = NULL;
+	*payloadlength = 0;
+	return NULL;
+}
+
+static int json_encode (const struct mbus_json *method, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments, void **data, int *length)
+{
+	int i;
+	int size;
+	int printedlength;
+	char *ptr;
+	char *buffer;
+	char *printed;
+	buffer = NULL;
+	printed = mbus_json_print_unformatted(method);
+	if (printed == NULL) {
+		mbus_errorf("can not print method");
+		goto bail;
+	}
+	if (payload == NULL &&
+	    nattachments <= 0) {
+		*data = printed;
+		*length = strlen(printed);
+		return 0;
+	}
+	printedlength = strlen(printed);
+	if (printedlength < 2 || printed[printedlength - 1] != '}') {
+		mbus_errorf("method is invalid");
+		goto bail;
+	}
+	/* splice the already printed payload and the attachments in as the last members */
+	size = printedlength + 1;
+	if (payload != NULL) {
+		size += 1 + sizeof("\"" MBUS_METHOD_TAG_PAYLOAD "\":") - 1 + payloadlength;
+	}
+	if (nattachments > 0) {
+		size += 1 + sizeof("\"" MBUS_METHOD_TAG_ATTACHMENTS "\":[]") - 1;
+		for (i = 0; i < nattachments; i++) {
+			size += 3 + base64_encoded_length(attachments[i].length);
+		}
+	}
+	buffer = malloc(size);
+	if (buffer == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	ptr = buffer;
+	memcpy(ptr, printed, printedlength - 1);
+	ptr += printedlength - 1;
+	if (payload != NULL) {
+		if (ptr - buffer > 1) {
+			*ptr++ = ',';
+		}
+		memcpy(ptr, "\"" MBUS_METHOD_TAG_PAYLOAD "\":", sizeof("\"" MBUS_METHOD_TAG_PAYLOAD "\":") - 1);
+		ptr += sizeof("\"" MBUS_METHOD_TAG_PAYLOAD "\":") - 1;
+		memcpy(ptr, payload, payloadlength);
+		ptr += payloadlength;
+	}
+	if (nattachments > 0) {
+		if (ptr - buffer > 1) {
+			*ptr++ = ',';
+		}
+		memcpy(ptr, "\"" MBUS_METHOD_TAG_ATTACHMENTS "\":[", sizeof("\"" MBUS_METHOD_TAG_ATTACHMENTS "\":[") - 1);
+		ptr += sizeof("\"" MBUS_METHOD_TAG_ATTACHMENTS "\":[") - 1;
+		for (i = 0; i < nattachments; i++) {
+			if (i > 0) {
+				*ptr++ = ',';
+			}
+			*ptr++ = '"';
+			ptr = base64_encode(ptr, attachments[i].data, attachments[i].length);
+			*ptr++ = '"';
+		}
+		*ptr++ = ']';
+	}
+	*ptr++ = '}';
+	*ptr = '\0';
+	*data = buffer;
+	*length = ptr - buffer;
+	free(printed);
+	return 0;
+bail:	if (printed != NULL) {
+		free(printed);
+	}
+	if (buffer != NULL) {
+		free(buffer);
+	}
+	return -1;
+}
+
+static int binary_encode (const struct mbus_json *method, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments, void **data, int *length)
+{
+	unsigned int i;
+	int size;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t *ptr;
+	uint8_t *buffer;
+	char *printed;
+	const char *string;
+	const struct mbus_json *item;
+	buffer = NULL;
+	printed = NULL;
+	for (item = mbus_json_get_child(method); item != NULL; item = mbus_json_get_next(item)) {
+		if (binary_tag_known(mbus_json_get_name(item)) == 0) {
+			mbus_errorf("method tag: %s can not be encoded", mbus_json_get_name(item));
+			goto bail;
+		}
+	}
+	string = mbus_json_get_string_value(method, MBUS_METHOD_TAG_TYPE, NULL);
+	if (string == NULL) {
+		mbus_errorf("method type is invalid");
+		goto bail;
+	}
+	for (i = 0; i < sizeof(binary_types) / sizeof(binary_types[0]); i++) {
+		if (strcmp(string, binary_types[i].name) == 0) {
+			break;
+		}
+	}
+	if (i >= sizeof(binary_types) / sizeof(binary_types[0])) {
+		mbus_errorf("method type: %s is invalid", string);
+		goto bail;
+	}
+	type = binary_types[i].value;
+	flags = 0;
+	size = sizeof(uint8_t) * 3;
+	for (i = 0; i < sizeof(binary_strings) / sizeof(binary_strings[0]); i++) {
+		string = mbus_json_get_string_value(method, binary_strings[i].tag, NULL);
+		if (string == NULL) {
+			continue;
+		}
+		if (strlen(string) > UINT16_MAX) {
+			mbus_errorf("method %s is too long", binary_strings[i].tag);
+			goto bail;
+		}
+		flags |= binary_strings[i].flag;
+		size += sizeof(uint16_t) + strlen(string);
+	}
+	for (i = 0; i < sizeof(binary_numbers) / sizeof(binary_numbers[0]); i++) {
+		if (mbus_json_get_object(method, binary_numbers[i].tag) == NULL) {
+			continue;
+		}
+		flags |= binary_numbers[i].flag;
+		size += sizeof(uint32_t);
+	}
+	if (payload == NULL) {
+		item = mbus_json_get_object(method, MBUS_METHOD_TAG_PAYLOAD);
+		if (item != NULL) {
+			printed = mbus_json_print_unformatted(item);
+			if (printed == NULL) {
+				mbus_errorf("can not print payload");
+				goto bail;
+			}
+			payload = printed;
+			payloadlength = strlen(printed);
+		} else {
+			payloadlength = 0;
+		}
+	}
+	size += sizeof(uint32_t) + payloadlength + sizeof(uint32_t);
+	if (nattachments > 0) {
+		flags |= MBUS_METHOD_BINARY_FLAG_ATTACHMENTS;
+		size += sizeof(uint32_t);
+		for (i = 0; i < (unsigned int) nattachments; i++) {
+			size += sizeof(uint32_t) + attachments[i].length;
+		}
+	}
+	buffer = malloc(size);
+	if (buffer == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	ptr = buffer;
+	*ptr++ = MBUS_METHOD_BINARY_VERSION;
+	*ptr++ = type;
+	*ptr++ = flags;
+	for (i = 0; i < sizeof(binary_strings) / sizeof(binary_strings[0]); i++) {
+		if ((flags & binary_strings[i].flag) == 0) {
+			continue;
+		}
+		string = mbus_json_get_string_value(method, binary_strings[i].tag, NULL);
+		ptr = binary_put_u16(ptr, strlen(string));
+		ptr = binary_put_data(ptr, string, strlen(string));
+	}
+	for (i = 0; i < sizeof(binary_numbers) / sizeof(binary_numbers[0]); i++) {
+		if ((flags & binary_numbers[i].flag) == 0) {
+			continue;
+		}
+		ptr = binary_put_u32(ptr, (int32_t) mbus_json_get_int_value(method, binary_numbers[i].tag, 0));
+	}
+	ptr = binary_put_u32(ptr, payloadlength);
+	if (payloadlength > 0) {
+		ptr = binary_put_data(ptr, payload, payloadlength);
+	}
+	if (flags & MBUS_METHOD_BINARY_FLAG_ATTACHMENTS) {
+		ptr = binary_put_u32(ptr, nattachments);
+		for (i = 0; i < (unsigned int) nattachments; i++) {
+			ptr = binary_put_u32(ptr, attachments[i].length);
+			ptr = binary_put_data(ptr, attachments[i].data, attachments[i].length);
+		}
+	}
+	ptr = binary_put_u32(ptr, (int32_t) mbus_json_get_int_value(method, MBUS_METHOD_TAG_SEQUENCE, -1));
+	*data = buffer;
+	*length = ptr - buffer;
+	if (printed != NULL) {
+		free(printed);
+	}
+	return 0;
+bail:	if (printed != NULL) {
+		free(printed);
+	}
+	if (buffer != NULL) {
+		free(buffer);
+	}
+	return -1;
+}
+
+static int binary_decode_attachments (struct binary_reader *reader, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int rc;
+	uint32_t i;
+	uint32_t count;
+	uint32_t value;
+	uint8_t *ptr;
+	const uint8_t *start;
+	struct mbus_method_attachment *array;
+	array = NULL;
+	rc = binary_get_u32(reader, &count);
+	if (rc != 0 ||
+	    count > (uint32_t) (reader->end - reader->ptr) / sizeof(uint32_t)) {
+		goto bail;
+	}
+	/* walk once to check the lengths, copy on the second pass */
+	start = reader->ptr;
+	for (i = 0; i < count; i++) {
+		rc = binary_get_u32(reader, &value);
+		if (rc != 0 ||
+		    reader->end - reader->ptr < (long) value) {
+			goto bail;
+		}
+		reader->ptr += value;
+	}
+	if (reader->ptr != reader->end) {
+		goto bail;
+	}
+	if (attachments == NULL ||
+	    count == 0) {
+		return 0;
+	}
+	array = malloc(sizeof(struct mbus_method_attachment) * count + ((reader->end - start) - sizeof(uint32_t) * count));
+	if (array == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	ptr = (uint8_t *) (array + count);
+	reader->ptr = start;
+	for (i = 0; i < count; i++) {
+		binary_get_u32(reader, &value);
+		memcpy(ptr, reader->ptr, value);
+		array[i].data = ptr;
+		array[i].length = value;
+		ptr += value;
+		reader->ptr += value;
+	}
+	*attachments = array;
+	*nattachments = count;
+	return 0;
+bail:	if (array != NULL) {
+		free(array);
+	}
+	return -1;
+}
+
+static struct mbus_json * binary_decode_header (const void *data, int length, const char **payload, int *payloadlength, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int rc;
+	unsigned int i;
+	uint8_t version;
+	uint8_t type;
+	uint8_t flags;
+	uint16_t stringlength;
+	uint32_t value;
+	char *string;
+	struct mbus_json *json;
+	struct binary_reader reader;
+	json = NULL;
+	*payload = NULL;
+	*payloadlength = 0;
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		goto bail;
+	}
+	if (length < (int) (sizeof(uint8_t) * 3 + sizeof(uint32_t) * 2)) {
+		mbus_errorf("length is invalid");
+		goto bail;
+	}
+	reader.ptr = data;
+	reader.end = reader.ptr + length;
+	rc  = binary_get_u8(&reader, &version);
+	rc |= binary_get_u8(&reader, &type);
+	rc |= binary_get_u8(&reader, &flags);
+	if (rc != 0) {
+		mbus_errorf("method is invalid");
+		goto bail;
+	}
+	if (version != MBUS_METHOD_BINARY_VERSION) {
+		mbus_errorf("method version: %d is invalid", version);
+		goto bail;
+	}
+	for (i = 0; i < sizeof(binary_types) / sizeof(binary_types[0]); i++) {
+		if (binary_types[i].value == type) {
+			break;
+		}
+	}
+	if (i >= sizeof(binary_types) / sizeof(binary_types[0])) {
+		mbus_errorf("method type: %d is invalid", type);
+		goto bail;
+	}
+	json = mbus_json_create_object();
+	if (json == NULL) {
+		mbus_errorf("can not create method object");
+		goto bail;
+	}
+	mbus_json_add_string_to_object_cs(json, MBUS_METHOD_TAG_TYPE, binary_types[i].name);
+	/* sequence is the last member */
+	reader.end -= sizeof(uint32_t);
+	memcpy(&value, reader.end, sizeof(value));
+	mbus_json_add_number_to_object_cs(json, MBUS_METHOD_TAG_SEQUENCE, (int32_t) ntohl(value));
+	for (i = 0; i < sizeof(binary_strings) / sizeof(binary_strings[0]); i++) {
+		if ((flags & binary_strings[i].flag) == 0) {
+			continue;
+		}
+		rc = binary_get_u16(&reader, &stringlength);
+		if (rc != 0 ||
+		    reader.end - reader.ptr < stringlength) {
+			mbus_errorf("method %s is invalid", binary_strings[i].tag);
+			goto bail;
+		}
+		string = strndup((const char *) reader.ptr, stringlength);
+		if (string == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		rc = mbus_json_add_string_to_object_cs(json, binary_strings[i].tag, string);
+		free(string);
+		if (rc != 0) {
+			mbus_errorf("can not add string to method object");
+			goto bail;
+		}
+		reader.ptr += stringlength;
+	}
+	for (i = 0; i < sizeof(binary_numbers) / sizeof(binary_numbers[0]); i++) {
+		if ((flags & binary_numbers[i].flag) == 0) {
+			continue;
+		}
+		rc = binary_get_u32(&reader, &value);
+		if (rc != 0) {
+			mbus_errorf("method %s is invalid", binary_numbers[i].tag);
+			goto bail;
+		}
+		mbus_json_add_number_to_object_cs(json, binary_numbers[i].tag, (int32_t) value);
+	}
+	rc = binary_get_u32(&reader, &value);
+	if (rc != 0 ||
+	    reader.end - reader.ptr < (int) value ||
+	    (!(flags & MBUS_METHOD_BINARY_FLAG_ATTACHMENTS) && reader.end - reader.ptr != (int) value)) {
+		mbus_errorf("method payload is invalid");
+		goto bail;
+	}
+	if (value > 0) {
+		rc = json_validate((const char *) reader.ptr, value);
+		if (rc != 0) {
+			mbus_errorf("method payload is invalid");
+			goto bail;
+		}
+		*payload = (const char *) reader.ptr;
+		*payloadlength = value;
+	}
+	reader.ptr += value;
+	if (flags & MBUS_METHOD_BINARY_FLAG_ATTACHMENTS) {
+		rc = binary_decode_attachments(&reader, attachments, nattachments);
+		if (rc != 0) {
+			mbus_errorf("method attachments is invalid");
+			goto bail;
+		}
+	}
+	return json;
+bail:	if (json != NULL) {
+		mbus_json_delete(json);
+	}
+	return NULL;
+}
+
+static struct mbus_json * binary_decode (const void *data, int length, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int rc;
+	int payloadlength;
+	const char *payload;
+	struct mbus_json *json;
+	struct mbus_json *item;
+	json = binary_decode_header(data, length, &payload, &payloadlength, attachments, nattachments);
+	if (json == NULL) {
+		goto bail;
+	}
+	if (payload != NULL) {
+		item = mbus_json_parse_length(payload, payloadlength);
+		if (item == NULL) {
+			mbus_errorf("can not parse method payload");
+			goto bail;
+		}
+		rc = mbus_json_add_item_to_object_cs(json, MBUS_METHOD_TAG_PAYLOAD, item);
+		if (rc != 0) {
+			mbus_errorf("can not add payload to method object");
+			mbus_json_delete(item);
+			goto bail;
+		}
+	}
+	return json;
+bail:	if (json != NULL) {
+		mbus_json_delete(json);
+	}
+	if (attachments != NULL &&
+	    *attachments != NULL) {
+		free(*attachments);
+		*attachments = NULL;
+		*nattachments = 0;
+	}
+	return NULL;
+}
+
+static struct mbus_json * json_decode (const void *data, int length, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	int rc;
+	struct mbus_json *json;
+	json = mbus_json_parse_length(data, length);
+	if (json == NULL) {
+		return NULL;
+	}
+	rc = json_take_attachments(json, attachments, nattachments);
+	if (rc != 0) {
+		mbus_json_delete(json);
+		return NULL;
+	}
+	return json;
+}
+
+const char * mbus_method_encoding_string (enum mbus_method_encoding encoding)
+{
+	if (encoding == mbus_method_encoding_json) return "json";
+	if (encoding == mbus_method_encoding_binary) return "binary";
+	return "json";
+}
+
+enum mbus_method_encoding mbus_method_encoding_value (const char *string)
+{
+	if (string == NULL) {
+		return mbus_method_encoding_json;
+	}
+	if (strcmp(string, "json") == 0) {
+		return mbus_method_encoding_json;
+	}
+	if (strcmp(string, "binary") == 0) {
+		return mbus_method_encoding_binary;
+	}
+	return mbus_method_encoding_json;
+}
+
+/*
+ * payload, when given, is the already printed payload and is used in
+ * place of the method's own payload member, which must then be absent.
+ * data is allocated, json data is also nul terminated.
+ */
+
+int mbus_method_encode_with_attachments (enum mbus_method_encoding encoding, const struct mbus_json *method, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments, void **data, int *length)
+{
+	if (method == NULL) {
+		mbus_errorf("method is invalid");
+		return -1;
+	}
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		return -1;
+	}
+	if (length == NULL) {
+		mbus_errorf("length is invalid");
+		return -1;
+	}
+	if (nattachments > 0 &&
+	    attachments == NULL) {
+		mbus_errorf("attachments is invalid");
+		return -1;
+	}
+	if (encoding == mbus_method_encoding_binary) {
+		return binary_encode(method, payload, payloadlength, attachments, nattachments, data, length);
+	}
+	return json_encode(method, payload, payloadlength, attachments, nattachments, data, length);
+}
+
+int mbus_method_encode (enum mbus_method_encoding encoding, const struct mbus_json *method, const char *payload, int payloadlength, void **data, int *length)
+{
+	return mbus_method_encode_with_attachments(encoding, method, payload, payloadlength, NULL, 0, data, length);
+}
+
+struct mbus_json * mbus_method_decode (enum mbus_method_encoding encoding, const void *data, int length, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		return NULL;
+	}
+	if (attachments != NULL) {
+		*attachments = NULL;
+		*nattachments = 0;
+	}
+	if (encoding == mbus_method_encoding_binary) {
+		return binary_decode(data, length, attachments, nattachments);
+	}
+	return json_decode(data, length, attachments, nattachments);
+}
+
+struct mbus_json * mbus_method_decode_header (enum mbus_method_encoding encoding, const void *data, int length, const char **payload, int *payloadlength, struct mbus_method_attachment **attachments, int *nattachments)
+{
+	if (data == NULL) {
+		mbus_errorf("data is invalid");
+		return NULL;
+	}
+	if (payload == NULL) {
+		mbus_errorf("payload is invalid");
+		return NULL;
+	}
+	if (payloadlength == NULL) {
+		mbus_errorf("payloadlength is invalid");
+		return NULL;
+	}
+	if (attachments != NULL) {
+		*attachments = NULL;
+		*nattachments = 0;
+	}
+	if (encoding == mbus_method_encoding_binary) {
+		return binary_decode_header(data, length, payload, payloadlength, attachments, nattachments);
+	}
+	return json_decode_header(data, length, payload, payloadlength, attachments, nattachments);
+}
+
+struct mbus_method_attachment * mbus_method_attachments_duplicate (const struct mbus_method_attachment *attachments, int nattachments)
+{
+	int i;
+	int size;
+	uint8_t *ptr;
+	struct mbus_method_attachment *duplicate;
+	if (attachments == NULL ||
+	    nattachments <= 0) {
+		return NULL;
+	}
+	size = sizeof(struct mbus_method_attachment) * nattachments;
+	for (i = 0; i < nattachments; i++) {
+		size += attachments[i].length;
+	}
+	duplicate = malloc(size);
+	if (duplicate == NULL) {
+		mbus_errorf("can not allocate memory");
+		return NULL;
+	}
+	ptr = (uint8_t *) (duplicate + nattachments);
+	for (i = 0; i < nattachments; i++) {
+		memcpy(ptr, attachments[i].data, attachments[i].length);
+		duplicate[i].data = ptr;
+		duplicate[i].length = attachments[i].length;
+		ptr += attachments[i].length;
+	}
+	return duplicate;
+}
@@ -33,6 +33,15 @@
 #define MBUS_METHOD_SEQUENCE_START				1
 #define MBUS_METHOD_SEQUENCE_END				9999
 
+/* sequence end of clients that negotiated "sequence" in command.create */
+#define MBUS_METHOD_SEQUENCE_WIDE_END				0x7fffffff
+
+/* result status of a command whose timeout passed on the server, such
+ * results also carry MBUS_METHOD_TAG_EXPIRED so that a callee returning
+ * the same status is not taken for a timeout.
+ */
+#define MBUS_METHOD_STATUS_TIMEOUT				-2
+
 #define MBUS_METHOD_EVENT_SOURCE_ALL				"org.mbus.method.event.source.all"
 
 #define MBUS_METHOD_EVENT_DESTINATION_ALL			"org.mbus.method.event.destination.all"
@@ -48,6 +57,16 @@
 #define MBUS_METHOD_TAG_TIMEOUT					"org.mbus.method.tag.timeout"
 #define MBUS_METHOD_TAG_PAYLOAD					"org.mbus.method.tag.payload"
 #define MBUS_METHOD_TAG_STATUS					"org.mbus.method.tag.status"
+#define MBUS_METHOD_TAG_ATTACHMENTS				"org.mbus.method.tag.attachments"
+#define MBUS_METHOD_TAG_PRIORITY				"org.mbus.method.tag.priority"
+#define MBUS_METHOD_TAG_EXPIRED					"org.mbus.method.tag.expired"
+
+/* outbound queue classes, drained by the server from control to bulk,
+ * control is only used by the server itself.
+ */
+#define MBUS_METHOD_PRIORITY_CONTROL				0
+#define MBUS_METHOD_PRIORITY_COMMAND				1
+#define MBUS_METHOD_PRIORITY_BULK				2
 
 /* event json model
  *
@@ -68,9 +87,13 @@
  *   "destination" : "unique identifier",
  *   "identifier"  : "unique identifier",
  *   "sequence"    : sequence number,
+ *   "priority"    : MBUS_METHOD_PRIORITY_*, optional, defaults to bulk
  *   "payload"     : {
  *     "comment": "event specific data object goes here"
- *   }
+ *   },
+ *   "attachments" : [
+ *     "base64 encoded binary data, optional"
+ *   ]
  * }
  */
 
@@ -109,6 +132,7 @@
  *   "source"      : "unique identifier",
  *   "identifier"  : "unique identifier",
  *   "sequence"    : sequence number,
+ *   "timeout"     : milliseconds left of the command timeout, if any,
  *   "payload"        : {
  *     "comment": "call specific data object goes here"
  *   }
@@ -138,4 +162,89 @@
  *     "comment": "result specific data object goes here"
  *   }
  * }
+ *
+ * a call that is not answered within its "timeout" milliseconds is
+ * answered by the server with MBUS_METHOD_STATUS_TIMEOUT and "expired"
+ * set to 1.
+ */
+
+/* binary model
+ *
+ * negotiated in command.create, see MBUS_SERVER_COMMAND_CREATE. the
+ * command.create request and its result are always json.
+ *
+ * method: {
+ *   uint8_t  version     : MBUS_METHOD_BINARY_VERSION
+ *   uint8_t  type        : MBUS_METHOD_BINARY_TYPE_*
+ *   uint8_t  flags       : MBUS_METHOD_BINARY_FLAG_*, optional members present
+ *   source, destination, identifier, if flagged, each as {
+ *     uint16_t length
+ *     char     string[length]
+ *   }
+ *   int32_t  timeout     : if flagged
+ *   int32_t  status      : if flagged
+ *   int32_t  priority    : if flagged
+ *   int32_t  expired     : if flagged
+ *   uint32_t length
+ *   char     payload[length] : json text, opaque to the header
+ *   attachments, if flagged, as {
+ *     uint32_t count
+ *     count times {
+ *       uint32_t length
+ *       uint8_t  data[length]
+ *     }
+ *   }
+ *   int32_t  sequence    : last, so a shared frame can patch it
+ * }
+ *
+ * integers are in network byte order.
  */
+
+#define MBUS_METHOD_BINARY_VERSION				1
+
+#define MBUS_METHOD_BINARY_TYPE_COMMAND				1
+#define MBUS_METHOD_BINARY_TYPE_EVENT				2
+#define MBUS_METHOD_BINARY_TYPE_RESULT				3
+
+#define MBUS_METHOD_BINARY_FLAG_SOURCE				0x01
+#define MBUS_METHOD_BINARY_FLAG_DESTINATION			0x02
+#define MBUS_METHOD_BINARY_FLAG_IDENTIFIER			0x04
+#define MBUS_METHOD_BINARY_FLAG_TIMEOUT				0x08
+#define MBUS_METHOD_BINARY_FLAG_STATUS				0x10
+#define MBUS_METHOD_BINARY_FLAG_ATTACHMENTS			0x20
+#define MBUS_METHOD_BINARY_FLAG_PRIORITY			0x40
+#define MBUS_METHOD_BINARY_FLAG_EXPIRED				0x80
+
+struct mbus_json;
+
+enum mbus_method_encoding {
+	mbus_method_encoding_json,
+	mbus_method_encoding_binary
+};
+
+struct mbus_method_attachment {
+	const void *data;
+	int length;
+};
+
+const char * mbus_method_encoding_string (enum mbus_method_encoding encoding);
+enum mbus_method_encoding mbus_method_encoding_value (const char *string);
+
+int mbus_method_encode (enum mbus_method_encoding encoding, const struct mbus_json *method, const char *payload, int payloadlength, void **data, int *length);
+int mbus_method_encode_with_attachments (enum mbus_method_encoding encoding, const struct mbus_json *method, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments, void **data, int *length);
+
+/*
+ * attachments, when asked for, are returned as a single allocation that
+ * also holds their data, release it with free. they are left out of the
+ * returned method either way.
+ */
+struct mbus_json * mbus_method_decode (enum mbus_method_encoding encoding, const void *data, int length, struct mbus_method_attachment **attachments, int *nattachments);
+
+/*
+ * decodes everything but the payload member. the payload is only syntax
+ * checked and returned as the range of its json text within data, so
+ * that it can be passed on without being parsed and printed again.
+ */
+struct mbus_json * mbus_method_decode_header (enum mbus_method_encoding encoding, const void *data, int length, const char **payload, int *payloadlength, struct mbus_method_attachment **attachments, int *nattachments);
+
+struct mbus_method_attachment * mbus_method_attachments_duplicate (const struct mbus_method_attachment *attachments, int nattachments);
@@ -0,0 +1,447 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define MBUS_DEBUG_NAME	"mbus-frame"
+
+#include "mbus/debug.h"
+#include "mbus/tailq.h"
+#include "mbus/json.h"
+#include "mbus/method.h"
+#include "mbus/compress.h"
+#include "mbus/buffer.h"
+
+#include "frame.h"
+
+/*
+ * a frame is a method encoded once per method encoding and shared by
+ * every recipient. the sequence member is rendered last, into a fixed
+ * width, space padded slot for json and into the trailing four bytes for
+ * binary, so the only per recipient work is writing the sequence over
+ * the tail of the frame.
+ */
+
+#define FRAME_SEQUENCE_WIDTH	10
+#define FRAME_TAIL_SIZE		(FRAME_SEQUENCE_WIDTH + 1)
+
+struct rendering {
+	char *data;
+	int length;
+	int slot;
+};
+
+struct encoding {
+	TAILQ_ENTRY(encoding) encodings;
+	struct rendering *rendering;
+	enum mbus_compress_method compression;
+	void *data;
+	int length;
+	unsigned long checksum;
+};
+TAILQ_HEAD(encodings, encoding);
+
+struct frame {
+	int refcount;
+	struct mbus_json *head;
+	char *payload;
+	int payloadlength;
+	struct mbus_method_attachment *attachments;
+	int nattachments;
+	struct rendering renderings[2];
+	struct encodings encodings;
+};
+
+static struct rendering * rendering_json (struct frame *frame)
+{
+	int rc;
+	int length;
+	char *data;
+	void *encoded;
+	struct rendering *rendering;
+	rendering = &frame->renderings[mbus_method_encoding_json];
+	rc = mbus_method_encode_with_attachments(mbus_method_encoding_json, frame->head, frame->payload, frame->payloadlength, frame->attachments, frame->nattachments, &encoded, &length);
+	if (rc != 0) {
+		mbus_errorf("can not encode method object");
+		return NULL;
+	}
+	/* the sequence goes last, into a padded slot */
+	data = realloc(encoded, length + sizeof(",\"" MBUS_METHOD_TAG_SEQUENCE "\":") + FRAME_SEQUENCE_WIDTH + 1);
+	if (data == NULL) {
+		mbus_errorf("can not allocate memory");
+		free(encoded);
+		return NULL;
+	}
+	length -= 1;
+	length += sprintf(data + length, ",\"%s\":%*s}", MBUS_METHOD_TAG_SEQUENCE, FRAME_SEQUENCE_WIDTH, "");
+	rendering->data = data;
+	rendering->length = length;
+	rendering->slot = rendering->length - FRAME_SEQUENCE_WIDTH - 1;
+	return rendering;
+}
+
+static struct rendering * rendering_binary (struct frame *frame)
+{
+	int rc;
+	void *data;
+	struct rendering *rendering;
+	rendering = &frame->renderings[mbus_method_encoding_binary];
+	rc = mbus_method_encode_with_attachments(mbus_method_encoding_binary, frame->head, frame->payload, frame->payloadlength, frame->attachments, frame->nattachments, &data, &rendering->length);
+	if (rc != 0) {
+		mbus_errorf("can not encode method object");
+		return NULL;
+	}
+	rendering->data = data;
+	rendering->slot = rendering->length - sizeof(uint32_t);
+	return rendering;
+}
+
+static struct rendering * frame_get_rendering (struct frame *frame, enum mbus_method_encoding encoding)
+{
+	if (encoding != mbus_method_encoding_binary) {
+		encoding = mbus_method_encoding_json;
+	}
+	if (frame->renderings[encoding].data != NULL) {
+		return &frame->renderings[encoding];
+	}
+	if (encoding == mbus_method_encoding_binary) {
+		return rendering_binary(frame);
+	}
+	return rendering_json(frame);
+}
+
+static int frame_get_tail (enum mbus_method_encoding encoding, int sequence, char *tail)
+{
+	uint32_t value;
+	if (encoding == mbus_method_encoding_binary) {
+		value = htonl(sequence);
+		memcpy(tail, &value, sizeof(value));
+		return sizeof(value);
+	}
+	if (snprintf(tail, FRAME_TAIL_SIZE + 1, "%*d}", FRAME_SEQUENCE_WIDTH, sequence) != FRAME_TAIL_SIZE) {
+		return -1;
+	}
+	return FRAME_TAIL_SIZE;
+}
+
+static void encoding_destroy (struct encoding *encoding)
+{
+	if (encoding == NULL) {
+		return;
+	}
+	if (encoding->data != NULL) {
+		free(encoding->data);
+	}
+	free(encoding);
+}
+
+static struct encoding * encoding_create (struct rendering *rendering, enum mbus_compress_method compression)
+{
+	int rc;
+	struct encoding *encoding;
+	encoding = NULL;
+	encoding = malloc(sizeof(struct encoding));
+	if (encoding == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(encoding, 0, sizeof(struct encoding));
+	encoding->rendering = rendering;
+	encoding->compression = compression;
+	rc = mbus_compress_data_prefix(compression, &encoding->data, &encoding->length, &encoding->checksum, rendering->data, rendering->slot);
+	if (rc != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	return encoding;
+bail:	encoding_destroy(encoding);
+	return NULL;
+}
+
+static struct encoding * frame_get_encoding (struct frame *frame, struct rendering *rendering, enum mbus_compress_method compression)
+{
+	struct encoding *encoding;
+	TAILQ_FOREACH(encoding, &frame->encodings, encodings) {
+		if (encoding->rendering == rendering &&
+		    encoding->compression == compression) {
+			return encoding;
+		}
+	}
+	encoding = encoding_create(rendering, compression);
+	if (encoding == NULL) {
+		mbus_errorf("can not create encoding");
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&frame->encodings, encoding, encodings);
+	return encoding;
+}
+
+int mbus_server_frame_push (struct frame *frame, struct mbus_buffer *buffer, enum mbus_compress_method compression, enum mbus_method_encoding method_encoding, int sequence)
+{
+	int rc;
+	int taillength;
+	int suffixlength;
+	uint8_t suffix[FRAME_TAIL_SIZE + 9];
+	char tail[FRAME_TAIL_SIZE + 1];
+	uint32_t length;
+	struct rendering *rendering;
+	struct encoding *encoding;
+	if (frame == NULL) {
+		mbus_errorf("frame is null");
+		goto bail;
+	}
+	if (buffer == NULL) {
+		mbus_errorf("buffer is null");
+		goto bail;
+	}
+	rendering = frame_get_rendering(frame, method_encoding);
+	if (rendering == NULL) {
+		mbus_errorf("can not render frame");
+		goto bail;
+	}
+	taillength = frame_get_tail(method_encoding, sequence, tail);
+	if (taillength != rendering->length - rendering->slot) {
+		mbus_errorf("sequence is invalid");
+		goto bail;
+	}
+	if (compression == mbus_compress_method_none) {
+		rc = mbus_buffer_reserve(buffer, mbus_buffer_get_length(buffer) + sizeof(length) + rendering->length);
+		if (rc != 0) {
+			mbus_errorf("can not reserve buffer");
+			goto bail;
+		}
+		length = htonl(rendering->length);
+		rc  = mbus_buffer_push(buffer, &length, sizeof(length));
+		rc |= mbus_buffer_push(buffer, rendering->data, rendering->slot);
+		rc |= mbus_buffer_push(buffer, tail, taillength);
+		if (rc != 0) {
+			mbus_errorf("can not push frame");
+			goto bail;
+		}
+		return 0;
+	}
+	if (mbus_compress_method_has_prefix(compression) == 0) {
+		/* no shared prefix for this method, compress the whole frame */
+		memcpy(rendering->data + rendering->slot, tail, taillength);
+		rc = mbus_buffer_push_data(buffer, compression, rendering->data, rendering->length);
+		if (rc != 0) {
+			mbus_errorf("can not push frame");
+			goto bail;
+		}
+		return 0;
+	}
+	encoding = frame_get_encoding(frame, rendering, compression);
+	if (encoding == NULL) {
+		mbus_errorf("can not get encoding");
+		goto bail;
+	}
+	suffixlength = sizeof(suffix);
+	rc = mbus_compress_data_suffix(compression, suffix, &suffixlength, encoding->checksum, tail, taillength);
+	if (rc != 0) {
+		mbus_errorf("can not compress data");
+		goto bail;
+	}
+	rc = mbus_buffer_reserve(buffer, mbus_buffer_get_length(buffer) + sizeof(length) * 2 + encoding->length + suffixlength);
+	if (rc != 0) {
+		mbus_errorf("can not reserve buffer");
+		goto bail;
+	}
+	length = htonl(sizeof(length) + encoding->length + suffixlength);
+	rc  = mbus_buffer_push(buffer, &length, sizeof(length));
+	length = htonl(rendering->length);
+	rc |= mbus_buffer_push(buffer, &length, sizeof(length));
+	rc |= mbus_buffer_push(buffer, encoding->data, encoding->length);
+	rc |= mbus_buffer_push(buffer, suffix, suffixlength);
+	if (rc != 0) {
+		mbus_errorf("can not push frame");
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+const char * mbus_server_frame_get_source (struct frame *frame)
+{
+	if (frame == NULL) {
+		return NULL;
+	}
+	return mbus_json_get_string_value(frame->head, MBUS_METHOD_TAG_SOURCE, NULL);
+}
+
+const char * mbus_server_frame_get_identifier (struct frame *frame)
+{
+	if (frame == NULL) {
+		return NULL;
+	}
+	return mbus_json_get_string_value(frame->head, MBUS_METHOD_TAG_IDENTIFIER, NULL);
+}
+
+int mbus_server_frame_get_length (struct frame *frame, enum mbus_method_encoding encoding)
+{
+	struct rendering *rendering;
+	if (frame == NULL) {
+		return -1;
+	}
+	rendering = frame_get_rendering(frame, encoding);
+	if (rendering == NULL) {
+		mbus_errorf("can not render frame");
+		return -1;
+	}
+	return rendering->length;
+}
+
+/*
+ * writes the sequence into the frame's own slot, the returned data is
+ * only valid for that sequence until the frame is rendered again.
+ */
+
+const void * mbus_server_frame_get_data (struct frame *frame, enum mbus_method_encoding encoding, int sequence)
+{
+	int taillength;
+	char tail[FRAME_TAIL_SIZE + 1];
+	struct rendering *rendering;
+	if (frame == NULL) {
+		mbus_errorf("frame is null");
+		return NULL;
+	}
+	rendering = frame_get_rendering(frame, encoding);
+	if (rendering == NULL) {
+		mbus_errorf("can not render frame");
+		return NULL;
+	}
+	taillength = frame_get_tail(encoding, sequence, tail);
+	if (taillength != rendering->length - rendering->slot) {
+		mbus_errorf("sequence is invalid");
+		return NULL;
+	}
+	memcpy(rendering->data + rendering->slot, tail, taillength);
+	return rendering->data;
+}
+
+struct frame * mbus_server_frame_ref (struct frame *frame)
+{
+	if (frame == NULL) {
+		return NULL;
+	}
+	frame->refcount += 1;
+	return frame;
+}
+
+void mbus_server_frame_unref (struct frame *frame)
+{
+	unsigned int i;
+	struct encoding *encoding;
+	if (frame == NULL) {
+		return;
+	}
+	frame->refcount -= 1;
+	if (frame->refcount > 0) {
+		return;
+	}
+	while (frame->encodings.tqh_first != NULL) {
+		encoding = frame->encodings.tqh_first;
+		TAILQ_REMOVE(&frame->encodings, frame->encodings.tqh_first, encodings);
+		encoding_destroy(encoding);
+	}
+	for (i = 0; i < sizeof(frame->renderings) / sizeof(frame->renderings[0]); i++) {
+		if (frame->renderings[i].data != NULL) {
+			free(frame->renderings[i].data);
+		}
+	}
+	if (frame->payload != NULL) {
+		free(frame->payload);
+	}
+	if (frame->attachments != NULL) {
+		free(frame->attachments);
+	}
+	if (frame->head != NULL) {
+		mbus_json_delete(frame->head);
+	}
+	free(frame);
+}
+
+struct frame * mbus_server_frame_create (const char *type, const char *source, const char *identifier, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments)
+{
+	struct frame *frame;
+	frame = NULL;
+	if (type == NULL) {
+		mbus_errorf("type is null");
+		goto bail;
+	}
+	if (source == NULL) {
+		mbus_errorf("source is null");
+		goto bail;
+	}
+	if (identifier == NULL) {
+		mbus_errorf("identifier is null");
+		goto bail;
+	}
+	frame = malloc(sizeof(struct frame));
+	if (frame == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(frame, 0, sizeof(struct frame));
+	TAILQ_INIT(&frame->encodings);
+	frame->refcount = 1;
+	frame->head = mbus_json_create_object();
+	if (frame->head == NULL) {
+		mbus_errorf("can not create method object");
+		goto bail;
+	}
+	mbus_json_add_string_to_object_cs(frame->head, MBUS_METHOD_TAG_TYPE, type);
+	mbus_json_add_string_to_object_cs(frame->head, MBUS_METHOD_TAG_SOURCE, source);
+	mbus_json_add_string_to_object_cs(frame->head, MBUS_METHOD_TAG_IDENTIFIER, identifier);
+	if (payload == NULL) {
+		payload = "{}";
+		payloadlength = 2;
+	}
+	frame->payload = malloc(payloadlength + 1);
+	if (frame->payload == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memcpy(frame->payload, payload, payloadlength);
+	frame->payload[payloadlength] = '\0';
+	frame->payloadlength = payloadlength;
+	if (nattachments > 0) {
+		frame->attachments = mbus_method_attachments_duplicate(attachments, nattachments);
+		if (frame->attachments == NULL) {
+			mbus_errorf("can not duplicate attachments");
+			goto bail;
+		}
+		frame->nattachments = nattachments;
+	}
+	return frame;
+bail:	mbus_server_frame_unref(frame);
+	return NULL;
+}
@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+struct frame;
+struct mbus_buffer;
+struct mbus_json;
+struct mbus_method_attachment;
+
+struct frame * mbus_server_frame_create (const char *type, const char *source, const char *identifier, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments);
+struct frame * mbus_server_frame_ref (struct frame *frame);
+void mbus_server_frame_unref (struct frame *frame);
+
+const char * mbus_server_frame_get_source (struct frame *frame);
+const char * mbus_server_frame_get_identifier (struct frame *frame);
+
+int mbus_server_frame_get_length (struct frame *frame, enum mbus_method_encoding encoding);
+const void * mbus_server_frame_get_data (struct frame *frame, enum mbus_method_encoding encoding, int sequence);
+
+int mbus_server_frame_push (struct frame *frame, struct mbus_buffer *buffer, enum mbus_compress_method compression, enum mbus_method_encoding encoding, int sequence);
@@ -61,6 +61,7 @@ static __attribute__((__unused__)) char __sizeof_check_buffer_out[BUFFER_OUT_CHU
 
 struct connection_private {
 	struct connection connection;
+	void *context;
 	int (*close) (struct connection *connection);
 	int (*get_fd) (struct connection *connection);
 	int (*wants_read) (struct connection *connection);
@@ -226,6 +227,10 @@ static int connection_tcp_read (struct connection *connection, struct mbus_buffe
 			mbus_errorf("can not reserve client buffer");
 			goto bail;
 		}
+		/* read returns 0 at end of file without touching errno, do not let a
+		 * stale EAGAIN from an earlier call hide the hangup.
+		 */
+		errno = 0;
 		read_rc = read(mbus_socket_get_fd(connection_tcp->socket),
 				mbus_buffer_get_base(buffer) + mbus_buffer_get_length(buffer),
 				mbus_buffer_get_size(buffer) - mbus_buffer_get_length(buffer));
@@ -506,6 +511,13 @@ struct listener * mbus_server_listener_tcp_create (const struct listener_tcp_opt
 		mbus_errorf("can not reuse socket: '%s:%s:%d'", "tcp", options->address, options->port);
 		goto bail;
 	}
+	if (options->reuseport) {
+		rc = mbus_socket_set_reuseport(listener_tcp->socket, 1);
+		if (rc != 0) {
+			mbus_errorf("can not reuse port: '%s:%s:%d'", "tcp", options->address, options->port);
+			goto bail;
+		}
+	}
 	mbus_socket_set_keepalive(listener_tcp->socket, 1);
 #if 0
 	mbus_socket_set_keepcnt(listener_tcp->socket, 5);
@@ -710,6 +722,10 @@ static int connection_uds_read (struct connection *connection, struct mbus_buffe
 			mbus_errorf("can not reserve client buffer");
 			goto bail;
 		}
+		/* read returns 0 at end of file without touching errno, do not let a
+		 * stale EAGAIN from an earlier call hide the hangup.
+		 */
+		errno = 0;
 		read_rc = read(mbus_socket_get_fd(connection_uds->socket),
 				mbus_buffer_get_base(buffer) + mbus_buffer_get_length(buffer),
 				mbus_buffer_get_size(buffer) - mbus_buffer_get_length(buffer));
@@ -1893,3 +1909,28 @@ int mbus_server_connection_write (struct connection *connection, struct mbus_buf
 	return private->write(connection, buffer);
 bail:	return -1;
 }
+
+int mbus_server_connection_set_context (struct connection *connection, void *context)
+{
+	struct connection_private *private;
+	if (connection == NULL) {
+		mbus_errorf("connection is invalid");
+		goto bail;
+	}
+	private = (struct connection_private *) connection;
+	private->context = context;
+	return 0;
+bail:	return -1;
+}
+
+void * mbus_server_connection_get_context (struct connection *connection)
+{
+	struct connection_private *private;
+	if (connection == NULL) {
+		mbus_errorf("connection is invalid");
+		goto bail;
+	}
+	private = (struct connection_private *) connection;
+	return private->context;
+bail:	return NULL;
+}
@@ -49,6 +49,7 @@ struct listener_tcp_options {
 	unsigned short port;
 	const char *certificate;
 	const char *privatekey;
+	int reuseport;
 };
 
 struct listener_uds_options {
@@ -97,3 +98,5 @@ int mbus_server_connection_wants_write (struct connection *connection);
 int mbus_server_connection_request_write (struct connection *connection);
 int mbus_server_connection_read (struct connection *connection, struct mbus_buffer *buffer);
 int mbus_server_connection_write (struct connection *connection, struct mbus_buffer *buffer);
+int mbus_server_connection_set_context (struct connection *connection, void *context);
+void * mbus_server_connection_get_context (struct connection *connection);
@@ -31,25 +31,93 @@
 #include <string.h>
 
 #include "mbus/debug.h"
+#include "mbus/clock.h"
 #include "mbus/tailq.h"
 #include "mbus/json.h"
 #include "mbus/method.h"
+#include "mbus/compress.h"
+#include "mbus/timer.h"
 
+#include "frame.h"
 #include "method.h"
 
 struct private {
 	struct method method;
 	struct {
 		struct mbus_json *json;
-		char *string;
+		void *data;
+		int length;
+		char *payload;
+		int payloadlength;
+		struct mbus_method_attachment *attachments;
+		int nattachments;
 	} request;
 	struct {
 		struct mbus_json *json;
-		char *string;
+		void *data;
+		int length;
 	} result;
+	struct {
+		enum method_type type;
+		const char *type_string;
+		const char *destination;
+		const char *identifier;
+		int sequence;
+		int priority;
+		int timeout;
+		unsigned long long deadline;
+		struct mbus_json *payload;
+		int parsed;
+	} header;
+	struct frame *frame;
 	struct client *source;
+	struct mbus_timer timer;
 };
 
+/*
+ * header fields are looked up once when the method is created. strings
+ * point into request.json, which lives as long as the method does.
+ */
+
+static enum method_type method_type_value (const char *type)
+{
+	if (type == NULL) {
+		return method_type_unknown;
+	}
+	if (strcmp(type, MBUS_METHOD_TYPE_COMMAND) == 0) {
+		return method_type_command;
+	}
+	if (strcmp(type, MBUS_METHOD_TYPE_EVENT) == 0) {
+		return method_type_event;
+	}
+	if (strcmp(type, MBUS_METHOD_TYPE_RESULT) == 0) {
+		return method_type_result;
+	}
+	return method_type_unknown;
+}
+
+static void method_parse_header (struct private *private)
+{
+	private->header.type_string = mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_TYPE, NULL);
+	private->header.type = method_type_value(private->header.type_string);
+	private->header.destination = mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_DESTINATION, NULL);
+	private->header.identifier = mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_IDENTIFIER, NULL);
+	private->header.sequence = mbus_json_get_int_value(private->request.json, MBUS_METHOD_TAG_SEQUENCE, -1);
+	private->header.priority = mbus_json_get_int_value(private->request.json, MBUS_METHOD_TAG_PRIORITY, -1);
+	private->header.timeout = mbus_json_get_int_value(private->request.json, MBUS_METHOD_TAG_TIMEOUT, -1);
+	private->header.payload = mbus_json_get_object(private->request.json, MBUS_METHOD_TAG_PAYLOAD);
+}
+
+enum method_type mbus_server_method_get_type (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return method_type_unknown;
+	}
+	private = (struct private *) method;
+	return private->header.type;
+}
+
 const char * mbus_server_method_get_request_type (struct method *method)
 {
 	struct private *private;
@@ -57,7 +125,7 @@ const char * mbus_server_method_get_request_type (struct method *method)
 		return NULL;
 	}
 	private = (struct private *) method;
-	return mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_TYPE, NULL);
+	return private->header.type_string;
 }
 
 const char * mbus_server_method_get_request_destination (struct method *method)
@@ -67,7 +135,7 @@ const char * mbus_server_method_get_request_destination (struct method *method)
 		return NULL;
 	}
 	private = (struct private *) method;
-	return mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_DESTINATION, NULL);
+	return private->header.destination;
 }
 
 const char * mbus_server_method_get_request_identifier (struct method *method)
@@ -77,7 +145,7 @@ const char * mbus_server_method_get_request_identifier (struct method *method)
 		return NULL;
 	}
 	private = (struct private *) method;
-	return mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_IDENTIFIER, NULL);
+	return private->header.identifier;
 }
 
 int mbus_server_method_get_request_sequence (struct method *method)
@@ -87,7 +155,48 @@ int mbus_server_method_get_request_sequence (struct method *method)
 		return -1;
 	}
 	private = (struct private *) method;
-	return mbus_json_get_int_value(private->request.json, MBUS_METHOD_TAG_SEQUENCE, -1);
+	return private->header.sequence;
+}
+
+int mbus_server_method_get_request_priority (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return -1;
+	}
+	private = (struct private *) method;
+	return private->header.priority;
+}
+
+int mbus_server_method_get_request_timeout (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return -1;
+	}
+	private = (struct private *) method;
+	return private->header.timeout;
+}
+
+unsigned long long mbus_server_method_get_request_deadline (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return 0;
+	}
+	private = (struct private *) method;
+	return private->header.deadline;
+}
+
+int mbus_server_method_set_request_deadline (struct method *method, unsigned long long deadline)
+{
+	struct private *private;
+	if (method == NULL) {
+		return -1;
+	}
+	private = (struct private *) method;
+	private->header.deadline = deadline;
+	return 0;
 }
 
 struct mbus_json * mbus_server_method_get_request_payload (struct method *method)
@@ -97,21 +206,68 @@ struct mbus_json * mbus_server_method_get_request_payload (struct method *method
 		return NULL;
 	}
 	private = (struct private *) method;
-	return mbus_json_get_object(private->request.json, MBUS_METHOD_TAG_PAYLOAD);
+	if (private->header.payload == NULL &&
+	    private->request.payload != NULL) {
+		/* received payloads are kept as text until someone looks inside */
+		private->header.payload = mbus_json_parse_length(private->request.payload, private->request.payloadlength);
+		if (private->header.payload == NULL) {
+			mbus_errorf("can not parse method payload");
+			return NULL;
+		}
+		private->header.parsed = 1;
+	}
+	return private->header.payload;
 }
 
-char * mbus_server_method_get_request_string (struct method *method)
+const char * mbus_server_method_get_request_payload_string (struct method *method, int *length)
 {
 	struct private *private;
 	if (method == NULL) {
 		return NULL;
 	}
 	private = (struct private *) method;
-	if (private->request.string != NULL) {
-		free(private->request.string);
+	*length = private->request.payloadlength;
+	return private->request.payload;
+}
+
+const struct mbus_method_attachment * mbus_server_method_get_request_attachments (struct method *method, int *nattachments)
+{
+	struct private *private;
+	if (method == NULL) {
+		return NULL;
 	}
-	private->request.string = mbus_json_print_unformatted(private->request.json);
-	return private->request.string;
+	private = (struct private *) method;
+	*nattachments = private->request.nattachments;
+	return private->request.attachments;
+}
+
+const void * mbus_server_method_get_request_data (struct method *method, enum mbus_method_encoding encoding, int *length)
+{
+	int rc;
+	int timeout;
+	unsigned long long current;
+	struct private *private;
+	if (method == NULL) {
+		return NULL;
+	}
+	private = (struct private *) method;
+	if (private->request.data != NULL) {
+		free(private->request.data);
+		private->request.data = NULL;
+	}
+	if (private->header.deadline != 0) {
+		/* the receiver gets what is left of the caller's timeout */
+		current = mbus_clock_monotonic();
+		timeout = mbus_clock_after(private->header.deadline, current) ? (int) (private->header.deadline - current) : 1;
+		mbus_json_delete_item_from_object(private->request.json, MBUS_METHOD_TAG_TIMEOUT);
+		mbus_json_add_number_to_object_cs(private->request.json, MBUS_METHOD_TAG_TIMEOUT, timeout);
+	}
+	rc = mbus_method_encode_with_attachments(encoding, private->request.json, private->request.payload, private->request.payloadlength, private->request.attachments, private->request.nattachments, &private->request.data, &private->request.length);
+	if (rc != 0) {
+		return NULL;
+	}
+	*length = private->request.length;
+	return private->request.data;
 }
 
 int mbus_server_method_set_result_code (struct method *method, int code)
@@ -125,6 +281,18 @@ int mbus_server_method_set_result_code (struct method *method, int code)
 	return 0;
 }
 
+int mbus_server_method_set_result_expired (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return -1;
+	}
+	private = (struct private *) method;
+	mbus_json_delete_item_from_object(private->result.json, MBUS_METHOD_TAG_EXPIRED);
+	mbus_json_add_number_to_object_cs(private->result.json, MBUS_METHOD_TAG_EXPIRED, 1);
+	return 0;
+}
+
 int mbus_server_method_set_result_payload (struct method *method, struct mbus_json *payload)
 {
 	struct private *private;
@@ -137,18 +305,34 @@ int mbus_server_method_set_result_payload (struct method *method, struct mbus_js
 	return 0;
 }
 
-char * mbus_server_method_get_result_string (struct method *method)
+const void * mbus_server_method_get_result_data (struct method *method, enum mbus_method_encoding encoding, int *length)
 {
+	int rc;
 	struct private *private;
 	if (method == NULL) {
 		return NULL;
 	}
 	private = (struct private *) method;
-	if (private->result.string != NULL) {
-		free(private->result.string);
+	if (private->result.data != NULL) {
+		free(private->result.data);
+		private->result.data = NULL;
+	}
+	rc = mbus_method_encode(encoding, private->result.json, NULL, 0, &private->result.data, &private->result.length);
+	if (rc != 0) {
+		return NULL;
+	}
+	*length = private->result.length;
+	return private->result.data;
+}
+
+struct frame * mbus_server_method_get_frame (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return NULL;
 	}
-	private->result.string = mbus_json_print_unformatted(private->result.json);
-	return private->result.string;
+	private = (struct private *) method;
+	return private->frame;
 }
 
 struct client * mbus_server_method_get_source (struct method *method)
@@ -161,6 +345,16 @@ struct client * mbus_server_method_get_source (struct method *method)
 	return private->source;
 }
 
+struct mbus_timer * mbus_server_method_get_timer (struct method *method)
+{
+	struct private *private;
+	if (method == NULL) {
+		return NULL;
+	}
+	private = (struct private *) method;
+	return &private->timer;
+}
+
 void mbus_server_method_destroy (struct method *method)
 {
 	struct private *private;
@@ -171,14 +365,26 @@ void mbus_server_method_destroy (struct method *method)
 	if (private->request.json != NULL) {
 		mbus_json_delete(private->request.json);
 	}
-	if (private->request.string != NULL) {
-		free(private->request.string);
+	if (private->request.data != NULL) {
+		free(private->request.data);
+	}
+	if (private->request.payload != NULL) {
+		free(private->request.payload);
+	}
+	if (private->request.attachments != NULL) {
+		free(private->request.attachments);
+	}
+	if (private->header.parsed) {
+		mbus_json_delete(private->header.payload);
 	}
 	if (private->result.json != NULL) {
 		mbus_json_delete(private->result.json);
 	}
-	if (private->result.string != NULL) {
-		free(private->result.string);
+	if (private->result.data != NULL) {
+		free(private->result.data);
+	}
+	if (private->frame != NULL) {
+		mbus_server_frame_unref(private->frame);
 	}
 	if (private->source != NULL) {
 		private->source = NULL;
@@ -186,8 +392,10 @@ void mbus_server_method_destroy (struct method *method)
 	free(private);
 }
 
-struct method * mbus_server_method_create_request (struct client *source, const char *string)
+struct method * mbus_server_method_create_request (struct client *source, enum mbus_method_encoding encoding, const char *string, unsigned int length)
 {
+	int payloadlength;
+	const char *payload;
 	struct private *private;
 	private = NULL;
 	if (string == NULL) {
@@ -200,38 +408,50 @@ struct method * mbus_server_method_create_request (struct client *source, const
 		goto bail;
 	}
 	memset(private, 0, sizeof(struct private));
-	private->request.json = mbus_json_parse(string);
+	private->request.json = mbus_method_decode_header(encoding, string, length, &payload, &payloadlength, &private->request.attachments, &private->request.nattachments);
 	if (private->request.json == NULL) {
 		mbus_errorf("can not parse method");
 		goto bail;
 	}
-	if (mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_TYPE, NULL) == NULL) {
-		mbus_errorf("invalid method type: '%s'", string);
+	method_parse_header(private);
+	if (private->header.timeout > 0) {
+		private->header.deadline = mbus_clock_monotonic() + private->header.timeout;
+	}
+	if (private->header.type_string == NULL) {
+		mbus_errorf("invalid method type: '%.*s'", (int) length, string);
+		goto bail;
+	}
+	if (private->header.destination == NULL) {
+		mbus_errorf("invalid method destination: '%.*s'", (int) length, string);
 		goto bail;
 	}
-	if (mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_DESTINATION, NULL) == NULL) {
-		mbus_errorf("invalid method destination: '%s'", string);
+	if (private->header.identifier == NULL) {
+		mbus_errorf("invalid method identifier: '%.*s'", (int) length, string);
 		goto bail;
 	}
-	if (mbus_json_get_string_value(private->request.json, MBUS_METHOD_TAG_IDENTIFIER, NULL) == NULL) {
-		mbus_errorf("invalid method identifier: '%s'", string);
+	if (private->header.sequence == -1) {
+		mbus_errorf("invalid method sequence: '%.*s'", (int) length, string);
 		goto bail;
 	}
-	if (mbus_json_get_int_value(private->request.json, MBUS_METHOD_TAG_SEQUENCE, -1) == -1) {
-		mbus_errorf("invalid method sequence: '%s'", string);
+	if (payload == NULL) {
+		mbus_errorf("invalid method payload: '%.*s'", (int) length, string);
 		goto bail;
 	}
-	if (mbus_json_get_object(private->request.json, MBUS_METHOD_TAG_PAYLOAD) == NULL) {
-		mbus_errorf("invalid method payload: '%s'", string);
+	private->request.payload = malloc(payloadlength + 1);
+	if (private->request.payload == NULL) {
+		mbus_errorf("can not allocate memory");
 		goto bail;
 	}
+	memcpy(private->request.payload, payload, payloadlength);
+	private->request.payload[payloadlength] = '\0';
+	private->request.payloadlength = payloadlength;
 	private->result.json = mbus_json_create_object();
 	if (private->result.json == NULL) {
 		mbus_errorf("can not create object");
 		goto bail;
 	}
 	mbus_json_add_string_to_object_cs(private->result.json, MBUS_METHOD_TAG_TYPE, MBUS_METHOD_TYPE_RESULT);
-	mbus_json_add_number_to_object_cs(private->result.json, MBUS_METHOD_TAG_SEQUENCE, mbus_server_method_get_request_sequence(&private->method));
+	mbus_json_add_number_to_object_cs(private->result.json, MBUS_METHOD_TAG_SEQUENCE, private->header.sequence);
 	mbus_json_add_item_to_object_cs(private->result.json, MBUS_METHOD_TAG_PAYLOAD, mbus_json_create_object());
 	private->source = source;
 	return &private->method;
@@ -241,7 +461,7 @@ bail:	if (private != NULL) {
 	return NULL;
 }
 
-struct method * mbus_server_method_create_response (const char *type, const char *source, const char *identifier, int sequence, const struct mbus_json *payload)
+struct method * mbus_server_method_create_response (const char *type, const char *source, const char *identifier, int sequence, const struct mbus_json *payload, const struct mbus_method_attachment *attachments, int nattachments)
 {
 	struct private *private;
 	struct mbus_json *data;
@@ -287,6 +507,46 @@ struct method * mbus_server_method_create_response (const char *type, const char
 	mbus_json_add_string_to_object_cs(private->request.json, MBUS_METHOD_TAG_IDENTIFIER, identifier);
 	mbus_json_add_number_to_object_cs(private->request.json, MBUS_METHOD_TAG_SEQUENCE, sequence);
 	mbus_json_add_item_to_object_cs(private->request.json, MBUS_METHOD_TAG_PAYLOAD, data);
+	if (nattachments > 0) {
+		private->request.attachments = mbus_method_attachments_duplicate(attachments, nattachments);
+		if (private->request.attachments == NULL) {
+			mbus_errorf("can not duplicate attachments");
+			goto bail;
+		}
+		private->request.nattachments = nattachments;
+	}
+	method_parse_header(private);
+	return &private->method;
+bail:	if (private != NULL) {
+		mbus_server_method_destroy(&private->method);
+	}
+	return NULL;
+}
+
+struct method * mbus_server_method_create_frame (struct frame *frame, int sequence)
+{
+	struct private *private;
+	private = NULL;
+	if (frame == NULL) {
+		mbus_errorf("frame is null");
+		goto bail;
+	}
+	if (sequence < 0) {
+		mbus_errorf("sequence is invalid");
+		goto bail;
+	}
+	private = malloc(sizeof(struct private));
+	if (private == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(private, 0, sizeof(struct private));
+	private->frame = mbus_server_frame_ref(frame);
+	private->header.type = method_type_event;
+	private->header.type_string = MBUS_METHOD_TYPE_EVENT;
+	private->header.sequence = sequence;
+	private->header.priority = -1;
+	private->header.timeout = -1;
 	return &private->method;
 bail:	if (private != NULL) {
 		mbus_server_method_destroy(&private->method);
@@ -27,24 +27,45 @@
  */
 
 struct client;
+struct frame;
 struct mbus_json;
+struct mbus_method_attachment;
+struct mbus_timer;
+
+enum method_type {
+	method_type_unknown,
+	method_type_command,
+	method_type_event,
+	method_type_result,
+};
 
 struct method {
 	TAILQ_ENTRY(method) methods;
 };
 TAILQ_HEAD(methods, method);
 
-struct method * mbus_server_method_create_request (struct client *source, const char *string);
-struct method * mbus_server_method_create_response (const char *type, const char *source, const char *identifier, int sequence, const struct mbus_json *payload);
+struct method * mbus_server_method_create_request (struct client *source, enum mbus_method_encoding encoding, const char *string, unsigned int length);
+struct method * mbus_server_method_create_response (const char *type, const char *source, const char *identifier, int sequence, const struct mbus_json *payload, const struct mbus_method_attachment *attachments, int nattachments);
+struct method * mbus_server_method_create_frame (struct frame *frame, int sequence);
 void mbus_server_method_destroy (struct method *method);
 
+enum method_type mbus_server_method_get_type (struct method *method);
 const char * mbus_server_method_get_request_type (struct method *method);
 const char * mbus_server_method_get_request_destination (struct method *method);
 const char * mbus_server_method_get_request_identifier (struct method *method);
 int mbus_server_method_get_request_sequence (struct method *method);
+int mbus_server_method_get_request_priority (struct method *method);
+int mbus_server_method_get_request_timeout (struct method *method);
+unsigned long long mbus_server_method_get_request_deadline (struct method *method);
+int mbus_server_method_set_request_deadline (struct method *method, unsigned long long deadline);
 struct mbus_json * mbus_server_method_get_request_payload (struct method *method);
-char * mbus_server_method_get_request_string (struct method *method);
+const char * mbus_server_method_get_request_payload_string (struct method *method, int *length);
+const struct mbus_method_attachment * mbus_server_method_get_request_attachments (struct method *method, int *nattachments);
+const void * mbus_server_method_get_request_data (struct method *method, enum mbus_method_encoding encoding, int *length);
 int mbus_server_method_set_result_code (struct method *method, int code);
+int mbus_server_method_set_result_expired (struct method *method);
 int mbus_server_method_set_result_payload (struct method *method, struct mbus_json *payload);
-char * mbus_server_method_get_result_string (struct method *method);
+const void * mbus_server_method_get_result_data (struct method *method, enum mbus_method_encoding encoding, int *length);
+struct frame * mbus_server_method_get_frame (struct method *method);
 struct client * mbus_server_method_get_source (struct method *method);
+struct mbus_timer * mbus_server_method_get_timer (struct method *method);
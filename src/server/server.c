@@ -36,6 +36,11 @@
 
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+#include <sys/epoll.h>
+#endif
 
 #include <arpa/inet.h>
 
@@ -54,15 +59,20 @@
 #include "mbus/compress.h"
 #include "mbus/buffer.h"
 #include "mbus/clock.h"
+#include "mbus/hash.h"
 #include "mbus/tailq.h"
 #include "mbus/json.h"
 #include "mbus/method.h"
 #include "mbus/socket.h"
+#include "mbus/timer.h"
 #include "mbus/version.h"
 #include "command.h"
 #include "subscription.h"
+#include "frame.h"
 #include "method.h"
 #include "listener.h"
+#include "shard.h"
+#include "worker.h"
 #include "server.h"
 
 enum client_status {
@@ -70,55 +80,177 @@ enum client_status {
 	client_status_connected		= 0x00000002,
 };
 
+/* why a client is on the server dirty list, each pass of the run loop
+ * walks only those clients.
+ */
+enum client_dirty {
+	client_dirty_out		= 0x00000001,
+	client_dirty_in			= 0x00000002,
+	client_dirty_status		= 0x00000004,
+	client_dirty_closed		= 0x00000008,
+};
+
 enum client_connection_close_code {
         client_connection_close_code_unknown            = 0,
         client_connection_close_code_close_comand       = 1,
         client_connection_close_code_ping_threshold     = 2,
         client_connection_close_code_connection_closed  = 3,
-        client_connection_close_code_internal_error     = 4
+        client_connection_close_code_internal_error     = 4,
+        client_connection_close_code_slow_consumer      = 5
 };
 
 static const struct {
 	const char *name;
 	enum mbus_compress_method value;
 } compression_methods[] = {
+#if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
+	{ "zlib-stream", mbus_compress_method_zlib_stream },
+#endif
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	{ "zstd", mbus_compress_method_zstd },
+#endif
+#if defined(LZ4_ENABLE) && (LZ4_ENABLE == 1)
+	{ "lz4", mbus_compress_method_lz4 },
+#endif
 #if defined(ZLIB_ENABLE) && (ZLIB_ENABLE == 1)
 	{ "zlib", mbus_compress_method_zlib },
 #endif
 	{ "none", mbus_compress_method_none },
 };
 
+static const struct {
+	const char *name;
+	enum mbus_method_encoding value;
+} encoding_methods[] = {
+	{ "binary", mbus_method_encoding_binary },
+	{ "json", mbus_method_encoding_json },
+};
+
+enum server_event_backend {
+	server_event_backend_poll,
+	server_event_backend_epoll,
+};
+
+static const struct {
+	const char *name;
+	enum server_event_backend value;
+} event_backends[] = {
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+	{ MBUS_SERVER_EVENT_BACKEND_EPOLL, server_event_backend_epoll },
+#endif
+	{ MBUS_SERVER_EVENT_BACKEND_POLL, server_event_backend_poll },
+};
+
+enum server_queue_policy {
+	server_queue_policy_drop_oldest,
+	server_queue_policy_drop_newest,
+	server_queue_policy_conflate,
+	server_queue_policy_disconnect,
+};
+
+static const struct {
+	const char *name;
+	enum server_queue_policy value;
+} queue_policies[] = {
+	{ MBUS_SERVER_QUEUE_POLICY_DROP_OLDEST, server_queue_policy_drop_oldest },
+	{ MBUS_SERVER_QUEUE_POLICY_DROP_NEWEST, server_queue_policy_drop_newest },
+	{ MBUS_SERVER_QUEUE_POLICY_CONFLATE, server_queue_policy_conflate },
+	{ MBUS_SERVER_QUEUE_POLICY_DISCONNECT, server_queue_policy_disconnect },
+};
+
+#define CLIENT_PRIORITY_COUNT			(MBUS_METHOD_PRIORITY_BULK + 1)
+
+/* the uncompressed length comes from the peer, cap what a frame may claim */
+#define CLIENT_UNCOMPRESSED_MAX			(64 * 1024 * 1024)
+
 struct client {
 	TAILQ_ENTRY(client) clients;
+	TAILQ_ENTRY(client) dirties;
+	unsigned int dirty;
+	int dirty_listed;
+	struct mbus_server *server;
 	char *identifier;
 	enum client_status status;
 	enum mbus_compress_method compression;
+	struct mbus_compress_stream *stream;
+	int uncompressed;
+	enum mbus_method_encoding encoding;
 	struct listener *listener;
 	struct connection *connection;
 	enum client_connection_close_code connection_close_code;
+	unsigned int connection_events;
 	struct mbus_buffer *buffer_in;
 	struct mbus_buffer *buffer_out;
+	struct mbus_buffer *buffer_scratch;
+	struct {
+		struct worker_jobs out;
+		struct worker_job *in;
+	} jobs;
+	struct {
+		int size;
+		unsigned int remaining;
+		struct mbus_buffer *out;
+		struct mbus_buffer *in;
+	} fragment;
 	int ping_enabled;
 	int ping_interval;
 	int ping_timeout;
 	int ping_threshold;
 	unsigned long long ping_recv_tsms;
 	int ping_missed_count;
+	struct mbus_timer ping_timer;
 	struct subscriptions subscriptions;
 	struct commands commands;
-	struct methods requests;
-	struct methods results;
-	struct methods events;
+	struct {
+		struct methods requests;
+		struct methods results;
+		struct methods events;
+		int credits;
+	} queues[CLIENT_PRIORITY_COUNT];
+	struct {
+		int count;
+		unsigned long long bytes;
+		unsigned long long dropped;
+		int congested;
+	} queued;
 	struct methods waits;
+	struct mbus_hash *wait_index;
 	int ssequence;
 	int esequence;
+	int sequence_end;
+	unsigned long long route_stamp;
 };
 TAILQ_HEAD(clients, client);
 
+struct route {
+	struct subscriptions subscriptions;
+};
+
+struct routes {
+	struct mbus_hash *events;
+};
+
+struct handler {
+	TAILQ_ENTRY(handler) handlers;
+	int (*builtin) (struct mbus_server *server, struct method *method);
+	int (*callback) (struct mbus_server *server, void *context, const char *source, struct mbus_json *payload, struct mbus_json *result);
+	void *context;
+};
+TAILQ_HEAD(handlers, handler);
+
+/* returned by a builtin whose result comes back from another shard */
+#define HANDLER_FORWARDED			1
+
 struct mbus_server {
 	struct mbus_server_options options;
 	struct listeners listeners;
 	struct clients clients;
+	struct clients dirties;
+	struct mbus_hash *identifiers;
+	struct mbus_hash *routes;
+	unsigned long long route_stamp;
+	struct handlers handlers;
+	struct mbus_hash *commands;
 	struct methods methods;
 	struct {
 		unsigned int length;
@@ -130,6 +262,34 @@ struct mbus_server {
 		unsigned int size;
 		struct pollfd *pollfds;
 	} ws_pollfds;
+	struct {
+		unsigned int size;
+		struct client **clients;
+	} fds;
+	struct {
+		enum server_event_backend backend;
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+		int fd;
+		unsigned int size;
+		struct epoll_event *events;
+#endif
+	} event;
+	struct mbus_timers *timers;
+	struct workers *workers;
+	struct mbus_compress_dictionary *dictionary;
+	struct shards *shards;
+	struct {
+		unsigned int index;
+		struct mbus_server **servers;
+		pthread_t thread;
+		int started;
+	} shard;
+	struct {
+		int weights[CLIENT_PRIORITY_COUNT];
+	} priority;
+	struct {
+		enum server_queue_policy policy;
+	} queue;
 	char *password;
 	int running;
 };
@@ -172,6 +332,28 @@ static struct mbus_server *g_server;
 
 #define OPTION_SERVER_PASSWORD                  0x801
 
+#define OPTION_SERVER_EVENT_BACKEND		0x901
+
+#define OPTION_SERVER_DRAIN_MESSAGES		0xA01
+#define OPTION_SERVER_DRAIN_BYTES		0xA02
+
+#define OPTION_SERVER_SHARDS			0xB01
+
+#define OPTION_SERVER_COMPRESS_WORKERS		0xC01
+#define OPTION_SERVER_COMPRESS_OFFLOAD		0xC02
+#define OPTION_SERVER_COMPRESS_MINIMUM		0xC03
+#define OPTION_SERVER_ZSTD_DICTIONARY		0xC04
+
+#define OPTION_SERVER_FRAGMENT_SIZE		0xD01
+
+#define OPTION_SERVER_PRIORITY_WEIGHTS		0xE01
+
+#define OPTION_SERVER_QUEUE_HIGH_BYTES		0xF01
+#define OPTION_SERVER_QUEUE_LOW_BYTES		0xF02
+#define OPTION_SERVER_QUEUE_HIGH_COUNT		0xF03
+#define OPTION_SERVER_QUEUE_LOW_COUNT		0xF04
+#define OPTION_SERVER_QUEUE_POLICY		0xF05
+
 static struct option longopts[] = {
 	{ "mbus-help",				no_argument,		NULL,	OPTION_HELP },
 	{ "mbus-debug-level",			required_argument,	NULL,	OPTION_DEBUG_LEVEL },
@@ -214,6 +396,28 @@ static struct option longopts[] = {
 
 	{ "mbus-server-password",               required_argument,      NULL,   OPTION_SERVER_PASSWORD },
 
+	{ "mbus-server-event-backend",		required_argument,	NULL,	OPTION_SERVER_EVENT_BACKEND },
+
+	{ "mbus-server-drain-messages",		required_argument,	NULL,	OPTION_SERVER_DRAIN_MESSAGES },
+	{ "mbus-server-drain-bytes",		required_argument,	NULL,	OPTION_SERVER_DRAIN_BYTES },
+
+	{ "mbus-server-shards",			required_argument,	NULL,	OPTION_SERVER_SHARDS },
+
+	{ "mbus-server-compress-workers",	required_argument,	NULL,	OPTION_SERVER_COMPRESS_WORKERS },
+	{ "mbus-server-compress-offload",	required_argument,	NULL,	OPTION_SERVER_COMPRESS_OFFLOAD },
+	{ "mbus-server-compress-minimum",	required_argument,	NULL,	OPTION_SERVER_COMPRESS_MINIMUM },
+	{ "mbus-server-zstd-dictionary",	required_argument,	NULL,	OPTION_SERVER_ZSTD_DICTIONARY },
+
+	{ "mbus-server-fragment-size",		required_argument,	NULL,	OPTION_SERVER_FRAGMENT_SIZE },
+
+	{ "mbus-server-priority-weights",	required_argument,	NULL,	OPTION_SERVER_PRIORITY_WEIGHTS },
+
+	{ "mbus-server-queue-high-bytes",	required_argument,	NULL,	OPTION_SERVER_QUEUE_HIGH_BYTES },
+	{ "mbus-server-queue-low-bytes",	required_argument,	NULL,	OPTION_SERVER_QUEUE_LOW_BYTES },
+	{ "mbus-server-queue-high-count",	required_argument,	NULL,	OPTION_SERVER_QUEUE_HIGH_COUNT },
+	{ "mbus-server-queue-low-count",	required_argument,	NULL,	OPTION_SERVER_QUEUE_LOW_COUNT },
+	{ "mbus-server-queue-policy",		required_argument,	NULL,	OPTION_SERVER_QUEUE_POLICY },
+
 	{ NULL,					0,			NULL,	0 },
 };
 
@@ -259,30 +463,120 @@ __attribute__ ((__visibility__("default"))) void mbus_server_usage (void)
 #endif
 
 	fprintf(stdout, "  --mbus-server-password        : server password (default: %s)\n", "(null)");
+	fprintf(stdout, "  --mbus-server-event-backend   : server event backend, poll or epoll (default: %s)\n", MBUS_SERVER_EVENT_BACKEND);
+	fprintf(stdout, "  --mbus-server-drain-messages  : max messages queued to a client per loop, 0 for no limit (default: %d)\n", MBUS_SERVER_DRAIN_MESSAGES);
+	fprintf(stdout, "  --mbus-server-drain-bytes     : max pending out bytes per client, 0 for no limit (default: %d)\n", MBUS_SERVER_DRAIN_BYTES);
+	fprintf(stdout, "  --mbus-server-shards          : number of event loop threads, tcp connections are balanced between them (default: %d)\n", MBUS_SERVER_SHARDS);
+	fprintf(stdout, "  --mbus-server-compress-workers: number of compression threads, 0 to compress in the event loop (default: %d)\n", MBUS_SERVER_COMPRESS_WORKERS);
+	fprintf(stdout, "  --mbus-server-compress-offload: messages at least this large are compressed by workers (default: %d)\n", MBUS_SERVER_COMPRESS_OFFLOAD);
+	fprintf(stdout, "  --mbus-server-compress-minimum: messages smaller than this are sent uncompressed to clients that allow it (default: %d)\n", MBUS_SERVER_COMPRESS_MINIMUM);
+#if defined(ZSTD_ENABLE) && (ZSTD_ENABLE == 1)
+	fprintf(stdout, "  --mbus-server-zstd-dictionary : trained zstd dictionary file, used with clients that have the same one (default: %s)\n", "(null)");
+#endif
+	fprintf(stdout, "  --mbus-server-fragment-size   : larger messages are sent in chunks of this size, 0 to disable (default: %d)\n", MBUS_SERVER_FRAGMENT_SIZE);
+	fprintf(stdout, "  --mbus-server-priority-weights: control,command,bulk share of each client queue, 0 to drain strictly first (default: %s)\n", MBUS_SERVER_PRIORITY_WEIGHTS);
+	fprintf(stdout, "  --mbus-server-queue-high-bytes: pending out bytes per client that start the queue policy, 0 for no limit (default: %d)\n", MBUS_SERVER_QUEUE_HIGH_BYTES);
+	fprintf(stdout, "  --mbus-server-queue-low-bytes : pending out bytes per client that end the queue policy (default: %d)\n", MBUS_SERVER_QUEUE_LOW_BYTES);
+	fprintf(stdout, "  --mbus-server-queue-high-count: queued messages per client that start the queue policy, 0 for no limit (default: %d)\n", MBUS_SERVER_QUEUE_HIGH_COUNT);
+	fprintf(stdout, "  --mbus-server-queue-low-count : queued messages per client that end the queue policy (default: %d)\n", MBUS_SERVER_QUEUE_LOW_COUNT);
+	fprintf(stdout, "  --mbus-server-queue-policy    : drop-oldest, drop-newest, conflate or disconnect (default: %s)\n", MBUS_SERVER_QUEUE_POLICY);
 	fprintf(stdout, "  --mbus-help                   : this text\n");
 }
 
-static size_t _strnlen (const char *s, size_t maxlen)
+enum server_event_op {
+	server_event_op_add,
+	server_event_op_mod,
+	server_event_op_del,
+};
+
+static int server_event_ctl (struct mbus_server *server, enum server_event_op op, int fd, unsigned int events)
 {
-	 size_t len;
-	for (len = 0; len < maxlen; len++, s++) {
-		if (!*s) {
-			break;
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+	int rc;
+	struct epoll_event event;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (server->event.backend != server_event_backend_epoll) {
+		return 0;
+	}
+	if (fd < 0) {
+		mbus_errorf("fd is invalid");
+		goto bail;
+	}
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.data.fd = fd;
+	if (events & POLLIN) {
+		event.events |= EPOLLIN;
+	}
+	if (events & POLLOUT) {
+		event.events |= EPOLLOUT;
+	}
+	if (op == server_event_op_add) {
+		rc = epoll_ctl(server->event.fd, EPOLL_CTL_ADD, fd, &event);
+	} else if (op == server_event_op_mod) {
+		rc = epoll_ctl(server->event.fd, EPOLL_CTL_MOD, fd, &event);
+	} else {
+		rc = epoll_ctl(server->event.fd, EPOLL_CTL_DEL, fd, &event);
+	}
+	if (rc != 0) {
+		mbus_errorf("can not control epoll, fd: %d, events: 0x%08x, %s", fd, events, strerror(errno));
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+#else
+	(void) server;
+	(void) op;
+	(void) fd;
+	(void) events;
+	return 0;
+#endif
+}
+
+static int server_set_client_fd (struct mbus_server *server, int fd, struct client *client)
+{
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (fd < 0) {
+		mbus_errorf("fd is invalid");
+		goto bail;
+	}
+	if ((unsigned int) fd >= server->fds.size) {
+		unsigned int size;
+		struct client **tmp;
+		size = server->fds.size;
+		while ((unsigned int) fd >= size) {
+			size += 1024;
+		}
+		tmp = realloc(server->fds.clients, sizeof(struct client *) * size);
+		if (tmp == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
 		}
+		memset(&tmp[server->fds.size], 0, sizeof(struct client *) * (size - server->fds.size));
+		server->fds.clients = tmp;
+		server->fds.size = size;
 	}
-	return (len);
+	server->fds.clients[fd] = client;
+	return 0;
+bail:	return -1;
 }
 
-static char * _strndup (const char *s, size_t n)
+static void server_del_client_fd (struct mbus_server *server, int fd, struct client *client)
 {
-	char *result;
-	size_t len = _strnlen(s, n);
-	result = (char *) malloc(len + 1);
-	if (result == NULL) {
-		return NULL;
+	if (server == NULL) {
+		return;
+	}
+	if (fd < 0 || (unsigned int) fd >= server->fds.size) {
+		return;
+	}
+	if (server->fds.clients[fd] == client) {
+		server->fds.clients[fd] = NULL;
 	}
-	result[len] = '\0';
-	return (char *) memcpy(result, s, len);
 }
 
 static const char * client_connection_close_code_string (enum client_connection_close_code close_code)
@@ -293,6 +587,7 @@ static const char * client_connection_close_code_string (enum client_connection_
                 case client_connection_close_code_ping_threshold:       return "ping_threshold";
                 case client_connection_close_code_connection_closed:    return "connection_closed";
                 case client_connection_close_code_internal_error:       return "internal_error";
+                case client_connection_close_code_slow_consumer:        return "slow_consumer";
         }
         return "unknown";
 }
@@ -325,6 +620,18 @@ static enum client_connection_close_code client_get_connection_close_code (struc
         return client->connection_close_code;
 }
 
+static void client_set_dirty (struct client *client, unsigned int dirty)
+{
+	if (client->server == NULL) {
+		return;
+	}
+	if (client->dirty_listed == 0) {
+		TAILQ_INSERT_TAIL(&client->server->dirties, client, dirties);
+		client->dirty_listed = 1;
+	}
+	client->dirty |= dirty;
+}
+
 static int client_set_connection (struct client *client, struct connection *connection, enum client_connection_close_code close_code)
 {
 	int rc;
@@ -334,6 +641,12 @@ static int client_set_connection (struct client *client, struct connection *conn
 	}
 	if (connection == NULL) {
 		if (client->connection != NULL) {
+			if (client->connection_events != 0) {
+				server_event_ctl(client->server, server_event_op_del, mbus_server_connection_get_fd(client->connection), 0);
+				client->connection_events = 0;
+			}
+			server_del_client_fd(client->server, mbus_server_connection_get_fd(client->connection), client);
+			mbus_server_connection_set_context(client->connection, NULL);
 			rc = mbus_server_connection_close(client->connection);
 			if (rc != 0) {
 				mbus_errorf("can not close connection");
@@ -341,6 +654,7 @@ static int client_set_connection (struct client *client, struct connection *conn
 			}
 			client->connection = NULL;
 		}
+		client_set_dirty(client, client_dirty_closed);
 	} else {
 		if (client->connection != NULL) {
 			mbus_errorf("client connection is not null");
@@ -353,6 +667,53 @@ static int client_set_connection (struct client *client, struct connection *conn
 bail:	return -1;
 }
 
+static int client_sync_connection_events (struct client *client)
+{
+	int rc;
+	unsigned int events;
+	enum listener_type listener_type;
+	if (client == NULL) {
+		mbus_errorf("client is null");
+		goto bail;
+	}
+	if (client->server == NULL ||
+	    client->server->event.backend != server_event_backend_epoll) {
+		return 0;
+	}
+	if (client->listener == NULL ||
+	    client->connection == NULL) {
+		return 0;
+	}
+	listener_type = mbus_server_listener_get_type(client->listener);
+	if (listener_type == listener_type_ws) {
+		/* the ws listener asks for more until the buffer drains */
+		if (mbus_buffer_get_length(client->buffer_out) > 0) {
+			mbus_server_connection_request_write(client->connection);
+		}
+		return 0;
+	}
+	if (listener_type != listener_type_tcp &&
+	    listener_type != listener_type_uds) {
+		return 0;
+	}
+	events = POLLIN;
+	if (mbus_buffer_get_length(client->buffer_out) > 0 ||
+	    mbus_server_connection_wants_write(client->connection) > 0) {
+		events |= POLLOUT;
+	}
+	if (events == client->connection_events) {
+		return 0;
+	}
+	rc = server_event_ctl(client->server, (client->connection_events == 0) ? server_event_op_add : server_event_op_mod, mbus_server_connection_get_fd(client->connection), events);
+	if (rc != 0) {
+		mbus_errorf("can not update connection events");
+		goto bail;
+	}
+	client->connection_events = events;
+	return 0;
+bail:	return -1;
+}
+
 static int client_set_status (struct client *client, enum client_status status)
 {
 	if (client == NULL) {
@@ -372,12 +733,31 @@ static enum client_status client_get_status (struct client *client)
 	return client->status;
 }
 
-static int client_set_compression (struct client *client, enum mbus_compress_method compression)
+static int client_set_compression (struct client *client, enum mbus_compress_method compression, struct mbus_compress_dictionary *dictionary)
 {
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		return -1;
 	}
+	if (client->stream != NULL) {
+		mbus_compress_stream_destroy(client->stream);
+		client->stream = NULL;
+	}
+	if (dictionary != NULL) {
+		client->stream = mbus_compress_stream_create_with_dictionary(dictionary);
+		if (client->stream == NULL) {
+			mbus_errorf("can not create compress stream");
+			client->compression = mbus_compress_method_none;
+			return -1;
+		}
+	} else if (mbus_compress_method_is_stream(compression)) {
+		client->stream = mbus_compress_stream_create(compression);
+		if (client->stream == NULL) {
+			mbus_errorf("can not create compress stream");
+			client->compression = mbus_compress_method_none;
+			return -1;
+		}
+	}
 	client->compression = compression;
 	return 0;
 }
@@ -393,6 +773,7 @@ static enum mbus_compress_method client_get_compression (struct client *client)
 
 static int client_set_identifier (struct client *client, const char *identifier)
 {
+	int rc;
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		goto bail;
@@ -402,6 +783,11 @@ static int client_set_identifier (struct client *client, const char *identifier)
 		goto bail;
 	}
 	if (client->identifier != NULL) {
+		if (client->server != NULL &&
+		    mbus_hash_get_string(client->server->identifiers, client->identifier) == client) {
+			mbus_hash_del_string(client->server->identifiers, client->identifier);
+			mbus_server_shards_del_identifier(client->server->shards, client->identifier, client->server->shard.index);
+		}
 		free(client->identifier);
 	}
 	client->identifier = strdup(identifier);
@@ -409,6 +795,26 @@ static int client_set_identifier (struct client *client, const char *identifier)
 		mbus_errorf("can not allocate memory");
 		goto bail;
 	}
+	if (client->server != NULL) {
+		if (client->server->shards != NULL) {
+			rc = mbus_server_shards_add_identifier(client->server->shards, client->identifier, client->server->shard.index);
+			if (rc != 0) {
+				mbus_errorf("can not add client identifier to shard index");
+				free(client->identifier);
+				client->identifier = NULL;
+				goto bail;
+			}
+		}
+		rc = mbus_hash_put_string(client->server->identifiers, client->identifier, client);
+		if (rc != 0) {
+			mbus_errorf("can not add client identifier to index");
+			mbus_server_shards_del_identifier(client->server->shards, client->identifier, client->server->shard.index);
+			free(client->identifier);
+			client->identifier = NULL;
+			goto bail;
+		}
+		client_set_dirty(client, client_dirty_status);
+	}
 	return 0;
 bail:	return -1;
 }
@@ -422,6 +828,130 @@ static const char * client_get_identifier (struct client *client)
 	return client->identifier;
 }
 
+static struct route * routes_find_route (struct routes *routes, const char *event)
+{
+	if (routes == NULL) {
+		return NULL;
+	}
+	return mbus_hash_get_string(routes->events, event);
+}
+
+static struct routes * server_find_routes (struct mbus_server *server, const char *source)
+{
+	return mbus_hash_get_string(server->routes, source);
+}
+
+static void server_del_route (struct mbus_server *server, struct subscription *subscription)
+{
+	struct route *route;
+	struct routes *routes;
+	const char *source;
+	const char *event;
+	if (server == NULL) {
+		return;
+	}
+	if (subscription == NULL) {
+		return;
+	}
+	source = mbus_server_subscription_get_source(subscription);
+	event = mbus_server_subscription_get_event(subscription);
+	routes = server_find_routes(server, source);
+	route = routes_find_route(routes, event);
+	if (route == NULL) {
+		return;
+	}
+	TAILQ_REMOVE(&route->subscriptions, subscription, routes);
+	if (route->subscriptions.tqh_first == NULL) {
+		mbus_hash_del_string(routes->events, event);
+		mbus_server_shards_del_route(server->shards, source, event, server->shard.index);
+		free(route);
+	}
+	if (mbus_hash_get_count(routes->events) == 0) {
+		mbus_hash_del_string(server->routes, source);
+		mbus_hash_destroy(routes->events);
+		free(routes);
+	}
+}
+
+static int server_add_route (struct mbus_server *server, struct subscription *subscription)
+{
+	int rc;
+	struct route *route;
+	struct routes *routes;
+	const char *source;
+	const char *event;
+	route = NULL;
+	routes = NULL;
+	source = NULL;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (subscription == NULL) {
+		mbus_errorf("subscription is null");
+		goto bail;
+	}
+	source = mbus_server_subscription_get_source(subscription);
+	event = mbus_server_subscription_get_event(subscription);
+	routes = server_find_routes(server, source);
+	if (routes == NULL) {
+		routes = malloc(sizeof(struct routes));
+		if (routes == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		memset(routes, 0, sizeof(struct routes));
+		routes->events = mbus_hash_create();
+		if (routes->events == NULL) {
+			mbus_errorf("can not create route index");
+			goto bail;
+		}
+		rc = mbus_hash_put_string(server->routes, source, routes);
+		if (rc != 0) {
+			mbus_errorf("can not put route index");
+			goto bail;
+		}
+	}
+	route = routes_find_route(routes, event);
+	if (route == NULL) {
+		route = malloc(sizeof(struct route));
+		if (route == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		memset(route, 0, sizeof(struct route));
+		TAILQ_INIT(&route->subscriptions);
+		rc = mbus_hash_put_string(routes->events, event, route);
+		if (rc != 0) {
+			mbus_errorf("can not put route");
+			goto bail;
+		}
+		if (server->shards != NULL) {
+			rc = mbus_server_shards_add_route(server->shards, source, event, server->shard.index);
+			if (rc != 0) {
+				mbus_errorf("can not put shard route");
+				mbus_hash_del_string(routes->events, event);
+				goto bail;
+			}
+		}
+	}
+	TAILQ_INSERT_TAIL(&route->subscriptions, subscription, routes);
+	return 0;
+bail:	if (route != NULL && route->subscriptions.tqh_first == NULL) {
+		free(route);
+	}
+	if (routes != NULL && (routes->events == NULL || mbus_hash_get_count(routes->events) == 0)) {
+		if (server_find_routes(server, source) == routes) {
+			mbus_hash_del_string(server->routes, source);
+		}
+		if (routes->events != NULL) {
+			mbus_hash_destroy(routes->events);
+		}
+		free(routes);
+	}
+	return -1;
+}
+
 static int client_del_subscription (struct client *client, const char *source, const char *event)
 {
 	struct subscription *subscription;
@@ -446,6 +976,7 @@ static int client_del_subscription (struct client *client, const char *source, c
 	}
 	if (subscription != NULL) {
 		TAILQ_REMOVE(&client->subscriptions, subscription, subscriptions);
+		server_del_route(client->server, subscription);
 		mbus_server_subscription_destroy(subscription);
 		mbus_infof("unsubscribed '%s' from '%s', '%s'", client_get_identifier(client), source, event);
 		return 0;
@@ -455,6 +986,7 @@ bail:	return -1;
 
 static int client_add_subscription (struct client *client, const char *source, const char *event)
 {
+	int rc;
 	struct subscription *subscription;
 	subscription = NULL;
 	if (client == NULL) {
@@ -480,6 +1012,12 @@ static int client_add_subscription (struct client *client, const char *source, c
 		mbus_errorf("can not create subscription");
 		goto bail;
 	}
+	mbus_server_subscription_set_context(subscription, client);
+	rc = server_add_route(client->server, subscription);
+	if (rc != 0) {
+		mbus_errorf("can not add route");
+		goto bail;
+	}
 	TAILQ_INSERT_TAIL(&client->subscriptions, subscription, subscriptions);
 	mbus_infof("subscribed '%s' to '%s', '%s'", client_get_identifier(client), source, event);
 out:	return 0;
@@ -541,13 +1079,13 @@ bail:	mbus_server_command_destroy(command);
 	return -1;
 }
 
-static int client_get_requests_count (struct client *client)
+static int client_get_requests_count (struct client *client, int priority)
 {
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		return 0;
 	}
-	return client->requests.count;
+	return client->queues[priority].requests.count;
 }
 
 static int client_push_request (struct client *client, struct method *request)
@@ -560,53 +1098,42 @@ static int client_push_request (struct client *client, struct method *request)
 		mbus_errorf("request is null");
 		goto bail;
 	}
-	TAILQ_INSERT_TAIL(&client->requests, request, methods);
+	TAILQ_INSERT_TAIL(&client->queues[MBUS_METHOD_PRIORITY_COMMAND].requests, request, methods);
+	client->queued.count += 1;
+	client_set_dirty(client, client_dirty_out);
 	return 0;
 bail:	return -1;
 }
 
-static struct method * client_pop_request (struct client *client)
+static struct method * client_pop_request (struct client *client, int priority)
 {
 	struct method *request;
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		goto bail;
 	}
-	if (client->requests.count <= 0) {
+	if (client->queues[priority].requests.count <= 0) {
 		goto bail;
 	}
-	request = client->requests.tqh_first;
-	TAILQ_REMOVE(&client->requests, client->requests.tqh_first, methods);
+	request = client->queues[priority].requests.tqh_first;
+	TAILQ_REMOVE(&client->queues[priority].requests, request, methods);
+	client->queued.count -= 1;
 	return request;
 bail:	return NULL;
 }
 
-static int client_get_results_count (struct client *client)
+static int client_get_results_count (struct client *client, int priority)
 {
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		return 0;
 	}
-	return client->results.count;
-}
-
-static int client_push_wait (struct client *client, struct method *wait)
-{
-	if (client == NULL) {
-		mbus_errorf("client is null");
-		goto bail;
-	}
-	if (wait == NULL) {
-		mbus_errorf("wait is null");
-		goto bail;
-	}
-	TAILQ_INSERT_TAIL(&client->waits, wait, methods);
-	return 0;
-bail:	return -1;
+	return client->queues[priority].results.count;
 }
 
 static int client_push_result (struct client *client, struct method *result)
 {
+	int priority;
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		goto bail;
@@ -615,37 +1142,186 @@ static int client_push_result (struct client *client, struct method *result)
 		mbus_errorf("result is null");
 		goto bail;
 	}
-	TAILQ_INSERT_TAIL(&client->results, result, methods);
+	priority = MBUS_METHOD_PRIORITY_COMMAND;
+	if (strcmp(mbus_server_method_get_request_destination(result), MBUS_SERVER_IDENTIFIER) == 0 &&
+	    strcmp(mbus_server_method_get_request_identifier(result), MBUS_SERVER_COMMAND_CREATE) == 0) {
+		priority = MBUS_METHOD_PRIORITY_CONTROL;
+	}
+	TAILQ_INSERT_TAIL(&client->queues[priority].results, result, methods);
+	client->queued.count += 1;
+	client_set_dirty(client, client_dirty_out);
 	return 0;
 bail:	return -1;
 }
 
-static struct method * client_pop_result (struct client *client)
+/*
+ * waits are keyed by the sequence the caller picked and the callee the
+ * call was routed to, which is what a command.result carries back.
+ */
+
+static char * client_wait_key (char *buffer, unsigned int size, const char *destination, int sequence, unsigned int *length)
 {
-	struct method *result;
-	if (client == NULL) {
-		mbus_errorf("client is null");
-		goto bail;
-	}
-	if (client->results.count <= 0) {
-		goto bail;
+	char *key;
+	unsigned int l;
+	l = strlen(destination);
+	*length = sizeof(sequence) + l;
+	key = buffer;
+	if (*length > size) {
+		key = malloc(*length);
+		if (key == NULL) {
+			mbus_errorf("can not allocate memory");
+			return NULL;
+		}
 	}
-	result = client->results.tqh_first;
-	TAILQ_REMOVE(&client->results, client->results.tqh_first, methods);
-	return result;
-bail:	return NULL;
+	memcpy(key, &sequence, sizeof(sequence));
+	memcpy(key + sizeof(sequence), destination, l);
+	return key;
 }
 
-static int client_get_events_count (struct client *client)
+static struct method * client_find_wait (struct client *client, const char *destination, int sequence)
 {
-	if (client == NULL) {
-		mbus_errorf("client is null");
+	char buffer[128];
+	char *key;
+	unsigned int length;
+	struct method *wait;
+	key = client_wait_key(buffer, sizeof(buffer), destination, sequence, &length);
+	if (key == NULL) {
+		return NULL;
+	}
+	wait = mbus_hash_get(client->wait_index, key, length);
+	if (key != buffer) {
+		free(key);
+	}
+	return wait;
+}
+
+static void client_remove_wait (struct client *client, struct method *wait)
+{
+	char buffer[128];
+	char *key;
+	unsigned int length;
+	TAILQ_REMOVE(&client->waits, wait, methods);
+	if (client->server != NULL) {
+		mbus_timers_del(client->server->timers, mbus_server_method_get_timer(wait));
+	}
+	key = client_wait_key(buffer, sizeof(buffer), mbus_server_method_get_request_destination(wait), mbus_server_method_get_request_sequence(wait), &length);
+	if (key == NULL) {
+		return;
+	}
+	if (mbus_hash_get(client->wait_index, key, length) == wait) {
+		mbus_hash_del(client->wait_index, key, length);
+	}
+	if (key != buffer) {
+		free(key);
+	}
+}
+
+static void client_expire_wait (struct client *client, struct method *wait)
+{
+	mbus_infof("%s call %s.%s timed out", client_get_identifier(client), mbus_server_method_get_request_destination(wait), mbus_server_method_get_request_identifier(wait));
+	client_remove_wait(client, wait);
+	mbus_server_method_set_result_code(wait, MBUS_METHOD_STATUS_TIMEOUT);
+	mbus_server_method_set_result_expired(wait);
+	client_push_result(client, wait);
+}
+
+static void client_wait_expired (struct mbus_timer *timer, void *context)
+{
+	struct method *wait;
+	(void) timer;
+	wait = context;
+	client_expire_wait(mbus_server_method_get_source(wait), wait);
+}
+
+static int client_push_wait (struct client *client, struct method *wait)
+{
+	int rc;
+	char buffer[128];
+	char *key;
+	unsigned int length;
+	struct method *stale;
+	struct mbus_timer *timer;
+	key = NULL;
+	if (client == NULL) {
+		mbus_errorf("client is null");
+		goto bail;
+	}
+	if (wait == NULL) {
+		mbus_errorf("wait is null");
+		goto bail;
+	}
+	key = client_wait_key(buffer, sizeof(buffer), mbus_server_method_get_request_destination(wait), mbus_server_method_get_request_sequence(wait), &length);
+	if (key == NULL) {
+		mbus_errorf("can not create wait key");
+		goto bail;
+	}
+	stale = mbus_hash_get(client->wait_index, key, length);
+	if (stale != NULL) {
+		/* the caller reused the sequence, it gave up on the earlier call */
+		client_expire_wait(client, stale);
+	}
+	rc = mbus_hash_put(client->wait_index, key, length, wait);
+	if (rc != 0) {
+		mbus_errorf("can not index wait");
+		goto bail;
+	}
+	if (key != buffer) {
+		free(key);
+	}
+	key = NULL;
+	TAILQ_INSERT_TAIL(&client->waits, wait, methods);
+	if (mbus_server_method_get_request_deadline(wait) != 0) {
+		timer = mbus_server_method_get_timer(wait);
+		timer->callback = client_wait_expired;
+		timer->context = wait;
+		rc = mbus_timers_add(client->server->timers, timer, mbus_server_method_get_request_deadline(wait));
+		if (rc != 0) {
+			mbus_errorf("can not arm wait timer");
+			client_remove_wait(client, wait);
+			goto bail;
+		}
+	}
+	return 0;
+bail:	if (key != NULL && key != buffer) {
+		free(key);
+	}
+	return -1;
+}
+
+static struct method * client_pop_result (struct client *client, int priority)
+{
+	struct method *result;
+	if (client == NULL) {
+		mbus_errorf("client is null");
+		goto bail;
+	}
+	if (client->queues[priority].results.count <= 0) {
+		goto bail;
+	}
+	result = client->queues[priority].results.tqh_first;
+	TAILQ_REMOVE(&client->queues[priority].results, result, methods);
+	client->queued.count -= 1;
+	return result;
+bail:	return NULL;
+}
+
+static int client_get_events_count (struct client *client, int priority)
+{
+	if (client == NULL) {
+		mbus_errorf("client is null");
 		return 0;
 	}
-	return client->events.count;
+	return client->queues[priority].events.count;
+}
+
+static unsigned int client_get_event_length (struct client *client, struct method *event)
+{
+	int length;
+	length = mbus_server_frame_get_length(mbus_server_method_get_frame(event), client->encoding);
+	return (length < 0) ? 0 : length;
 }
 
-static int client_push_event (struct client *client, struct method *event)
+static int client_push_event (struct client *client, int priority, struct method *event)
 {
 	if (client == NULL) {
 		mbus_errorf("client is null");
@@ -655,42 +1331,157 @@ static int client_push_event (struct client *client, struct method *event)
 		mbus_errorf("event is null");
 		goto bail;
 	}
-	TAILQ_INSERT_TAIL(&client->events, event, methods);
+	TAILQ_INSERT_TAIL(&client->queues[priority].events, event, methods);
+	client->queued.count += 1;
+	client->queued.bytes += client_get_event_length(client, event);
+	client_set_dirty(client, client_dirty_out);
 	return 0;
 bail:	return -1;
 }
 
-static struct method * client_pop_event (struct client *client)
+static void client_remove_event (struct client *client, int priority, struct method *event)
+{
+	TAILQ_REMOVE(&client->queues[priority].events, event, methods);
+	client->queued.count -= 1;
+	client->queued.bytes -= client_get_event_length(client, event);
+}
+
+static struct method * client_pop_event (struct client *client, int priority)
 {
 	struct method *event;
 	if (client == NULL) {
 		mbus_errorf("client is null");
 		goto bail;
 	}
-	if (client->events.count <= 0) {
+	if (client->queues[priority].events.count <= 0) {
 		goto bail;
 	}
-	event = client->events.tqh_first;
-	TAILQ_REMOVE(&client->events, client->events.tqh_first, methods);
+	event = client->queues[priority].events.tqh_first;
+	client_remove_event(client, priority, event);
 	return event;
 bail:	return NULL;
 }
 
+static int client_get_queued_count (struct client *client, int priority)
+{
+	return client_get_results_count(client, priority) +
+	       client_get_requests_count(client, priority) +
+	       client_get_events_count(client, priority);
+}
+
+/* classes with weight 0 are drained first, in order. the rest take
+ * turns, each sending up to its weight before the credits of all
+ * classes are refilled.
+ */
+static int client_select_priority (struct client *client)
+{
+	int p;
+	int refill;
+	int pending;
+	const int *weights;
+	weights = client->server->priority.weights;
+	pending = 0;
+	for (p = 0; p < CLIENT_PRIORITY_COUNT; p++) {
+		if (client_get_queued_count(client, p) <= 0) {
+			continue;
+		}
+		if (weights[p] <= 0) {
+			return p;
+		}
+		pending = 1;
+	}
+	if (pending == 0) {
+		return -1;
+	}
+	for (refill = 0; refill < 2; refill++) {
+		for (p = 0; p < CLIENT_PRIORITY_COUNT; p++) {
+			if (weights[p] <= 0 ||
+			    client->queues[p].credits <= 0 ||
+			    client_get_queued_count(client, p) <= 0) {
+				continue;
+			}
+			client->queues[p].credits -= 1;
+			return p;
+		}
+		for (p = 0; p < CLIENT_PRIORITY_COUNT; p++) {
+			client->queues[p].credits = weights[p];
+		}
+	}
+	return -1;
+}
+
+static int client_arm_ping (struct client *client)
+{
+	if (client == NULL) {
+		return -1;
+	}
+	if (client->server == NULL) {
+		return -1;
+	}
+	if (client->ping_enabled == 0 ||
+	    client->ping_interval <= 0) {
+		mbus_timers_del(client->server->timers, &client->ping_timer);
+		return 0;
+	}
+	return mbus_timers_add(client->server->timers, &client->ping_timer, client->ping_recv_tsms + client->ping_interval + client->ping_timeout);
+}
+
+static void client_ping_expired (struct mbus_timer *timer, void *context)
+{
+	struct client *client;
+	(void) timer;
+	client = context;
+	if (client_get_connection(client) == NULL) {
+		return;
+	}
+	if (client->ping_enabled == 0 ||
+	    client->ping_interval <= 0) {
+		return;
+	}
+	mbus_infof("%s ping timeout: %llu, %d, %d", client_get_identifier(client), client->ping_recv_tsms, client->ping_interval, client->ping_timeout);
+	client->ping_missed_count += 1;
+	client->ping_recv_tsms = client->ping_recv_tsms + client->ping_interval;
+	if (client->ping_missed_count > client->ping_threshold) {
+		mbus_errorf("%s missed too many pings, %d > %d. closing connection", client_get_identifier(client), client->ping_missed_count, client->ping_threshold);
+		client_set_connection(client, NULL, client_connection_close_code_ping_threshold);
+		return;
+	}
+	client_arm_ping(client);
+}
+
 static void client_destroy (struct client *client)
 {
+	int p;
 	struct method *result;
 	struct method *request;
 	struct method *event;
 	struct method *wait;
 	struct command *command;
+	struct worker_job *job;
 	struct subscription *subscription;
 	if (client == NULL) {
 		return;
 	}
+	if (client->server != NULL) {
+		mbus_timers_del(client->server->timers, &client->ping_timer);
+		if (client->dirty_listed != 0) {
+			TAILQ_REMOVE(&client->server->dirties, client, dirties);
+		}
+	}
 	if (client->connection != NULL) {
+		if (client->connection_events != 0) {
+			server_event_ctl(client->server, server_event_op_del, mbus_server_connection_get_fd(client->connection), 0);
+		}
+		server_del_client_fd(client->server, mbus_server_connection_get_fd(client->connection), client);
+		mbus_server_connection_set_context(client->connection, NULL);
 		mbus_server_connection_close(client_get_connection(client));
 	}
 	if (client->identifier != NULL) {
+		if (client->server != NULL &&
+		    mbus_hash_get_string(client->server->identifiers, client->identifier) == client) {
+			mbus_hash_del_string(client->server->identifiers, client->identifier);
+			mbus_server_shards_del_identifier(client->server->shards, client->identifier, client->server->shard.index);
+		}
 		free(client->identifier);
 	}
 	while (client->commands.tqh_first != NULL) {
@@ -701,39 +1492,71 @@ static void client_destroy (struct client *client)
 	while (client->subscriptions.tqh_first != NULL) {
 		subscription = client->subscriptions.tqh_first;
 		TAILQ_REMOVE(&client->subscriptions, client->subscriptions.tqh_first, subscriptions);
+		server_del_route(client->server, subscription);
 		mbus_server_subscription_destroy(subscription);
 	}
-	while (client->requests.tqh_first != NULL) {
-		request = client->requests.tqh_first;
-		TAILQ_REMOVE(&client->requests, client->requests.tqh_first, methods);
-		mbus_server_method_destroy(request);
-	}
-	while (client->results.tqh_first != NULL) {
-		result = client->results.tqh_first;
-		TAILQ_REMOVE(&client->results, client->results.tqh_first, methods);
-		mbus_server_method_destroy(result);
-	}
-	while (client->events.tqh_first != NULL) {
-		event = client->events.tqh_first;
-		TAILQ_REMOVE(&client->events, client->events.tqh_first, methods);
-		mbus_server_method_destroy(event);
+	for (p = 0; p < CLIENT_PRIORITY_COUNT; p++) {
+		while (client->queues[p].requests.tqh_first != NULL) {
+			request = client->queues[p].requests.tqh_first;
+			TAILQ_REMOVE(&client->queues[p].requests, request, methods);
+			mbus_server_method_destroy(request);
+		}
+		while (client->queues[p].results.tqh_first != NULL) {
+			result = client->queues[p].results.tqh_first;
+			TAILQ_REMOVE(&client->queues[p].results, result, methods);
+			mbus_server_method_destroy(result);
+		}
+		while (client->queues[p].events.tqh_first != NULL) {
+			event = client->queues[p].events.tqh_first;
+			TAILQ_REMOVE(&client->queues[p].events, event, methods);
+			mbus_server_method_destroy(event);
+		}
 	}
 	while (client->waits.tqh_first != NULL) {
 		wait = client->waits.tqh_first;
-		TAILQ_REMOVE(&client->waits, client->waits.tqh_first, methods);
+		client_remove_wait(client, wait);
 		mbus_server_method_destroy(wait);
 	}
+	if (client->wait_index != NULL) {
+		mbus_hash_destroy(client->wait_index);
+	}
 	if (client->buffer_in != NULL) {
 		mbus_buffer_destroy(client->buffer_in);
 	}
 	if (client->buffer_out != NULL) {
 		mbus_buffer_destroy(client->buffer_out);
 	}
+	if (client->buffer_scratch != NULL) {
+		mbus_buffer_destroy(client->buffer_scratch);
+	}
+	if (client->fragment.out != NULL) {
+		mbus_buffer_destroy(client->fragment.out);
+	}
+	if (client->fragment.in != NULL) {
+		mbus_buffer_destroy(client->fragment.in);
+	}
+	/* jobs still owned by a worker are released on completion */
+	while (client->jobs.out.tqh_first != NULL) {
+		job = client->jobs.out.tqh_first;
+		TAILQ_REMOVE(&client->jobs.out, client->jobs.out.tqh_first, pendings);
+		if (job->done) {
+			mbus_server_worker_job_destroy(job);
+		} else {
+			job->context = NULL;
+		}
+	}
+	if (client->jobs.in != NULL) {
+		client->jobs.in->context = NULL;
+	}
+	if (client->stream != NULL) {
+		mbus_compress_stream_destroy(client->stream);
+	}
 	free(client);
 }
 
 static struct client * client_create (struct listener *listener, struct connection *connection)
 {
+	int p;
 	struct client *client;
 	client = NULL;
 	if (listener == NULL) {
@@ -752,15 +1575,26 @@ static struct client * client_create (struct listener *listener, struct connecti
 	memset(client, 0, sizeof(struct client));
 	TAILQ_INIT(&client->subscriptions);
 	TAILQ_INIT(&client->commands);
-	TAILQ_INIT(&client->requests);
-	TAILQ_INIT(&client->results);
-	TAILQ_INIT(&client->events);
+	for (p = 0; p < CLIENT_PRIORITY_COUNT; p++) {
+		TAILQ_INIT(&client->queues[p].requests);
+		TAILQ_INIT(&client->queues[p].results);
+		TAILQ_INIT(&client->queues[p].events);
+	}
 	TAILQ_INIT(&client->waits);
+	TAILQ_INIT(&client->jobs.out);
+	client->ping_timer.callback = client_ping_expired;
+	client->ping_timer.context = client;
 	client->status = 0;
 	client->listener = listener;
 	client->connection = connection;
 	client->ssequence = MBUS_METHOD_SEQUENCE_START;
 	client->esequence = MBUS_METHOD_SEQUENCE_START;
+	client->sequence_end = MBUS_METHOD_SEQUENCE_END;
+	client->wait_index = mbus_hash_create();
+	if (client->wait_index == NULL) {
+		mbus_errorf("can not create wait index");
+		goto bail;
+	}
 	client->buffer_in = mbus_buffer_create();
 	if (client->buffer_in == NULL) {
 		mbus_errorf("can not create buffer");
@@ -771,6 +1605,21 @@ static struct client * client_create (struct listener *listener, struct connecti
 		mbus_errorf("can not create buffer");
 		goto bail;
 	}
+	client->buffer_scratch = mbus_buffer_create();
+	if (client->buffer_scratch == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
+	client->fragment.out = mbus_buffer_create();
+	if (client->fragment.out == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
+	client->fragment.in = mbus_buffer_create();
+	if (client->fragment.in == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
 	return client;
 bail:	client_destroy(client);
 	return NULL;
@@ -783,65 +1632,195 @@ static struct client * server_find_client_by_identifier (struct mbus_server *ser
 		mbus_errorf("identifier is null");
 		return NULL;
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_identifier(client) == NULL) {
-			continue;
-		}
-		if (strcmp(client_get_identifier(client), identifier) == 0) {
-			return client;
-		}
-	}
-	return NULL;
+	client = mbus_hash_get_string(server->identifiers, identifier);
+	return client;
 }
 
 static struct client * server_find_client_by_fd (struct mbus_server *server, int fd)
 {
-	int cfd;
 	struct client *client;
 	if (fd < 0) {
 		mbus_errorf("fd is invalid");
 		return NULL;
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_listener(client) == NULL) {
-			continue;
-		}
-		if (client_get_connection(client) == NULL) {
-			continue;
-		}
-		cfd = mbus_server_connection_get_fd(client_get_connection(client));
-		if (cfd < 0) {
-			mbus_errorf("connection fd is invalid");
-			continue;
-		}
-		if (cfd == fd) {
-			return client;
-		}
+	if ((unsigned int) fd >= server->fds.size) {
+		return NULL;
 	}
-	return NULL;
+	client = server->fds.clients[fd];
+	if (client == NULL) {
+		return NULL;
+	}
+	if (client_get_listener(client) == NULL) {
+		return NULL;
+	}
+	if (client_get_connection(client) == NULL) {
+		return NULL;
+	}
+	return client;
 }
 
-static __attribute__ ((__unused__)) struct client * server_find_client_by_connection (struct mbus_server *server, struct connection *connection)
+#if defined(WS_ENABLE) && (WS_ENABLE == 1)
+
+static struct client * server_find_client_by_connection (struct mbus_server *server, struct connection *connection)
 {
 	struct client *client;
 	if (connection == NULL) {
 		mbus_errorf("connection is null");
 		return NULL;
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_connection(client) == connection) {
-			return client;
+	client = mbus_server_connection_get_context(connection);
+	if (client == NULL) {
+		return NULL;
+	}
+	if (client_get_connection(client) != connection) {
+		return NULL;
+	}
+	return client;
+}
+
+#endif
+
+static unsigned long long client_get_pending_bytes (struct client *client)
+{
+	return client->queued.bytes +
+	       mbus_buffer_get_length(client->buffer_out) +
+	       mbus_buffer_get_length(client->fragment.out);
+}
+
+/* control is kept for frames the broker generates, clients may only ask
+ * for command or bulk.
+ */
+static int client_priority_value (int priority)
+{
+	if (priority == MBUS_METHOD_PRIORITY_COMMAND) {
+		return MBUS_METHOD_PRIORITY_COMMAND;
+	}
+	return MBUS_METHOD_PRIORITY_BULK;
+}
+
+static int client_check_congested (struct client *client)
+{
+	unsigned long long bytes;
+	const struct mbus_server_options *options;
+	options = &client->server->options;
+	bytes = client_get_pending_bytes(client);
+	if (client->queued.congested == 0) {
+		if ((options->queue.high.bytes > 0 && bytes >= (unsigned long long) options->queue.high.bytes) ||
+		    (options->queue.high.count > 0 && client->queued.count >= options->queue.high.count)) {
+			mbus_infof("%s reached high mark, bytes: %llu, count: %d", client_get_identifier(client), bytes, client->queued.count);
+			client->queued.congested = 1;
+		}
+	} else {
+		if ((options->queue.high.bytes <= 0 || bytes <= (unsigned long long) options->queue.low.bytes) &&
+		    (options->queue.high.count <= 0 || client->queued.count <= options->queue.low.count)) {
+			mbus_infof("%s reached low mark, bytes: %llu, count: %d, dropped: %llu", client_get_identifier(client), bytes, client->queued.count, client->queued.dropped);
+			client->queued.congested = 0;
 		}
 	}
-	return NULL;
+	return client->queued.congested;
+}
+
+static int client_drop_oldest_event (struct client *client)
+{
+	int p;
+	struct method *event;
+	for (p = CLIENT_PRIORITY_COUNT - 1; p > MBUS_METHOD_PRIORITY_CONTROL; p--) {
+		event = client_pop_event(client, p);
+		if (event != NULL) {
+			mbus_server_method_destroy(event);
+			client->queued.dropped += 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int client_conflate_event (struct client *client, int priority, struct frame *frame)
+{
+	const char *source;
+	const char *identifier;
+	struct frame *queued;
+	struct method *event;
+	source = mbus_server_frame_get_source(frame);
+	identifier = mbus_server_frame_get_identifier(frame);
+	for (event = TAILQ_LAST(&client->queues[priority].events, methods); event != NULL; event = TAILQ_PREV(event, methods, methods)) {
+		queued = mbus_server_method_get_frame(event);
+		if (queued == NULL) {
+			continue;
+		}
+		if (strcmp(mbus_server_frame_get_identifier(queued), identifier) != 0 ||
+		    strcmp(mbus_server_frame_get_source(queued), source) != 0) {
+			continue;
+		}
+		client_remove_event(client, priority, event);
+		mbus_server_method_destroy(event);
+		client->queued.dropped += 1;
+		return 1;
+	}
+	return 0;
 }
 
-static int server_send_event_to (struct mbus_server *server, const char *source, const char *destination, const char *identifier, struct mbus_json *payload)
+static int client_push_frame (struct client *client, int priority, struct frame *frame)
 {
 	int rc;
-	struct client *client;
 	struct method *method;
+	if (priority < 0 || priority >= CLIENT_PRIORITY_COUNT) {
+		priority = MBUS_METHOD_PRIORITY_BULK;
+	}
+	/* control events like pong are never held back by the queue policy */
+	if (priority != MBUS_METHOD_PRIORITY_CONTROL &&
+	    client_check_congested(client)) {
+		switch (client->server->queue.policy) {
+			case server_queue_policy_disconnect:
+				if (client_get_connection(client) != NULL) {
+					mbus_errorf("%s is too slow, %llu bytes and %d messages pending. closing connection", client_get_identifier(client), client_get_pending_bytes(client), client->queued.count);
+					client_set_connection(client, NULL, client_connection_close_code_slow_consumer);
+				}
+				client->queued.dropped += 1;
+				return 0;
+			case server_queue_policy_drop_newest:
+				client->queued.dropped += 1;
+				return 0;
+			case server_queue_policy_conflate:
+				if (client_conflate_event(client, priority, frame) == 1) {
+					break;
+				}
+				client_drop_oldest_event(client);
+				break;
+			case server_queue_policy_drop_oldest:
+				client_drop_oldest_event(client);
+				break;
+		}
+	}
+	method = mbus_server_method_create_frame(frame, client->esequence);
+	if (method == NULL) {
+		mbus_errorf("can not create method");
+		goto bail;
+	}
+	client->esequence += 1;
+	if (client->esequence >= MBUS_METHOD_SEQUENCE_END) {
+		client->esequence = MBUS_METHOD_SEQUENCE_START;
+	}
+	rc = client_push_event(client, priority, method);
+	if (rc != 0) {
+		mbus_errorf("can not push method");
+		mbus_server_method_destroy(method);
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_deliver_event (struct mbus_server *server, const char *source, const char *destination, const char *identifier, int priority, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments)
+{
+	int rc;
+	unsigned int r;
+	struct client *client;
+	struct frame *frame;
+	struct route *route[4];
+	struct routes *routes[2];
 	struct subscription *subscription;
+	frame = NULL;
 	if (server == NULL) {
 		mbus_errorf("server is null");
 		goto bail;
@@ -869,8 +1848,9 @@ static int server_send_event_to (struct mbus_server *server, const char *source,
 			client = server_find_client_by_identifier(server, source);
 			if (client != NULL) {
 				client->ping_recv_tsms = mbus_clock_monotonic();
+				client_arm_ping(client);
 			}
-			rc = server_send_event_to(server, MBUS_SERVER_IDENTIFIER, source, MBUS_SERVER_EVENT_PONG, NULL);
+			rc = server_deliver_event(server, MBUS_SERVER_IDENTIFIER, source, MBUS_SERVER_EVENT_PONG, MBUS_METHOD_PRIORITY_CONTROL, NULL, 0, NULL, 0);
 			if (rc != 0) {
 				mbus_errorf("can not send pong to: %s", source);
 				goto bail;
@@ -884,83 +1864,168 @@ static int server_send_event_to (struct mbus_server *server, const char *source,
 			if (strcmp(client_get_identifier(client), source) == 0) {
 				continue;
 			}
-			method = mbus_server_method_create_response(MBUS_METHOD_TYPE_EVENT, source, identifier, client->esequence, payload);
-			if (method == NULL) {
-				mbus_errorf("can not create method");
-				goto bail;
-			}
-			client->esequence += 1;
-			if (client->esequence >= MBUS_METHOD_SEQUENCE_END) {
-				client->esequence = MBUS_METHOD_SEQUENCE_START;
+			if (frame == NULL) {
+				frame = mbus_server_frame_create(MBUS_METHOD_TYPE_EVENT, source, identifier, payload, payloadlength, attachments, nattachments);
+				if (frame == NULL) {
+					mbus_errorf("can not create frame");
+					goto bail;
+				}
 			}
-			rc = client_push_event(client, method);
+			rc = client_push_frame(client, priority, frame);
 			if (rc != 0) {
-				mbus_errorf("can not push method");
-				mbus_server_method_destroy(method);
+				mbus_errorf("can not push frame");
 				goto bail;
 			}
 		}
 	} else if (strcmp(destination, MBUS_METHOD_EVENT_DESTINATION_SUBSCRIBERS) == 0) {
-		TAILQ_FOREACH(client, &server->clients, clients) {
-			TAILQ_FOREACH(subscription, &client->subscriptions, subscriptions) {
-				if (strcmp(mbus_server_subscription_get_source(subscription), MBUS_METHOD_EVENT_SOURCE_ALL) != 0) {
-					if (strcmp(mbus_server_subscription_get_source(subscription), source) != 0) {
-						continue;
-					}
+		routes[0] = server_find_routes(server, source);
+		routes[1] = server_find_routes(server, MBUS_METHOD_EVENT_SOURCE_ALL);
+		route[0] = routes_find_route(routes[0], identifier);
+		route[1] = routes_find_route(routes[0], MBUS_METHOD_EVENT_IDENTIFIER_ALL);
+		route[2] = routes_find_route(routes[1], identifier);
+		route[3] = routes_find_route(routes[1], MBUS_METHOD_EVENT_IDENTIFIER_ALL);
+		server->route_stamp += 1;
+		for (r = 0; r < sizeof(route) / sizeof(route[0]); r++) {
+			if (route[r] == NULL) {
+				continue;
+			}
+			TAILQ_FOREACH(subscription, &route[r]->subscriptions, routes) {
+				client = mbus_server_subscription_get_context(subscription);
+				if (client->route_stamp == server->route_stamp) {
+					continue;
 				}
-				if (strcmp(mbus_server_subscription_get_event(subscription), MBUS_METHOD_EVENT_IDENTIFIER_ALL) != 0) {
-					if (strcmp(mbus_server_subscription_get_event(subscription), identifier) != 0) {
-						continue;
+				client->route_stamp = server->route_stamp;
+				if (frame == NULL) {
+					frame = mbus_server_frame_create(MBUS_METHOD_TYPE_EVENT, source, identifier, payload, payloadlength, attachments, nattachments);
+					if (frame == NULL) {
+						mbus_errorf("can not create frame");
+						goto bail;
 					}
 				}
-				method = mbus_server_method_create_response(MBUS_METHOD_TYPE_EVENT, source, identifier, client->esequence, payload);
-				if (method == NULL) {
-					mbus_errorf("can not create method");
-					goto bail;
-				}
-				client->esequence += 1;
-				if (client->esequence >= MBUS_METHOD_SEQUENCE_END) {
-					client->esequence = MBUS_METHOD_SEQUENCE_START;
-				}
-				rc = client_push_event(client, method);
+				rc = client_push_frame(client, priority, frame);
 				if (rc != 0) {
-					mbus_errorf("can not push method");
-					mbus_server_method_destroy(method);
+					mbus_errorf("can not push frame");
 					goto bail;
 				}
-				break;
 			}
 		}
 	} else {
-		TAILQ_FOREACH(client, &server->clients, clients) {
-			if (client_get_identifier(client) == NULL) {
-				continue;
-			}
-			if (strcmp(client_get_identifier(client), destination) != 0) {
-				continue;
-			}
-			method = mbus_server_method_create_response(MBUS_METHOD_TYPE_EVENT, source, identifier, client->esequence, payload);
-			if (method == NULL) {
-				mbus_errorf("can not create method");
+		client = server_find_client_by_identifier(server, destination);
+		if (client != NULL) {
+			frame = mbus_server_frame_create(MBUS_METHOD_TYPE_EVENT, source, identifier, payload, payloadlength, attachments, nattachments);
+			if (frame == NULL) {
+				mbus_errorf("can not create frame");
 				goto bail;
 			}
-			client->esequence += 1;
-			if (client->esequence >= MBUS_METHOD_SEQUENCE_END) {
-				client->esequence = MBUS_METHOD_SEQUENCE_START;
-			}
-			rc = client_push_event(client, method);
+			rc = client_push_frame(client, priority, frame);
 			if (rc != 0) {
-				mbus_errorf("can not push method");
-				mbus_server_method_destroy(method);
+				mbus_errorf("can not push frame");
 				goto bail;
 			}
-			break;
+		}
+	}
+	mbus_server_frame_unref(frame);
+	return 0;
+bail:	mbus_server_frame_unref(frame);
+	return -1;
+}
+
+static int server_forward_event (struct mbus_server *server, const char *source, const char *destination, const char *identifier, int priority, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments)
+{
+	int rc;
+	int shard;
+	unsigned int s;
+	unsigned long long shards;
+	struct shard_message *message;
+	if (server->shards == NULL) {
+		return 0;
+	}
+	if (strcmp(destination, MBUS_SERVER_IDENTIFIER) == 0) {
+		return 0;
+	} else if (strcmp(destination, MBUS_METHOD_EVENT_DESTINATION_ALL) == 0) {
+		shards = ~0ULL;
+	} else if (strcmp(destination, MBUS_METHOD_EVENT_DESTINATION_SUBSCRIBERS) == 0) {
+		shards = mbus_server_shards_find_routes(server->shards, source, identifier);
+	} else {
+		if (server_find_client_by_identifier(server, destination) != NULL) {
+			return 0;
+		}
+		shard = mbus_server_shards_find_identifier(server->shards, destination);
+		if (shard < 0) {
+			return 0;
+		}
+		shards = 1ULL << shard;
+	}
+	shards &= ~(1ULL << server->shard.index);
+	for (s = 0; s < mbus_server_shards_get_count(server->shards); s++) {
+		if ((shards & (1ULL << s)) == 0) {
+			continue;
+		}
+		message = mbus_server_shard_message_create_event(server->shard.index, source, destination, identifier, payload, payloadlength);
+		if (message == NULL) {
+			mbus_errorf("can not create shard message");
+			goto bail;
+		}
+		message->priority = priority;
+		rc = mbus_server_shard_message_set_attachments(message, attachments, nattachments);
+		if (rc != 0) {
+			mbus_errorf("can not set shard message attachments");
+			mbus_server_shard_message_destroy(message);
+			goto bail;
+		}
+		rc = mbus_server_shards_push(server->shards, s, message);
+		if (rc != 0) {
+			mbus_errorf("can not push shard message");
+			mbus_server_shard_message_destroy(message);
+			goto bail;
 		}
 	}
 	return 0;
 bail:	return -1;
 }
 
+static int server_send_event_string (struct mbus_server *server, const char *source, const char *destination, const char *identifier, int priority, const char *payload, int payloadlength, const struct mbus_method_attachment *attachments, int nattachments)
+{
+	int rc;
+	rc = server_deliver_event(server, source, destination, identifier, priority, payload, payloadlength, attachments, nattachments);
+	if (rc != 0) {
+		goto bail;
+	}
+	rc = server_forward_event(server, source, destination, identifier, priority, payload, payloadlength, attachments, nattachments);
+	if (rc != 0) {
+		mbus_errorf("can not forward event");
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_send_event_to (struct mbus_server *server, const char *source, const char *destination, const char *identifier, const struct mbus_json *payload)
+{
+	int rc;
+	char *string;
+	string = NULL;
+	if (payload != NULL) {
+		string = mbus_json_print_unformatted(payload);
+		if (string == NULL) {
+			mbus_errorf("can not print payload");
+			goto bail;
+		}
+	}
+	rc = server_send_event_string(server, source, destination, identifier, MBUS_METHOD_PRIORITY_BULK, string, (string != NULL) ? (int) strlen(string) : 0, NULL, 0);
+	if (rc != 0) {
+		goto bail;
+	}
+	if (string != NULL) {
+		free(string);
+	}
+	return 0;
+bail:	if (string != NULL) {
+		free(string);
+	}
+	return -1;
+}
+
 static int server_send_event_connected (struct mbus_server *server, struct client *client)
 {
 	int rc;
@@ -1185,6 +2250,7 @@ bail:	if (payload != NULL) {
 
 static int server_client_connection_establish (struct mbus_server *server, struct listener *listener, struct connection *connection)
 {
+	int rc;
 	struct client *client;
 	client = NULL;
 	if (server == NULL) {
@@ -1204,7 +2270,23 @@ static int server_client_connection_establish (struct mbus_server *server, struc
 		mbus_errorf("can not create client");
 		goto bail;
 	}
+	client->server = server;
+	rc = client_sync_connection_events(client);
+	if (rc != 0) {
+		mbus_errorf("can not sync connection events");
+		client->connection = NULL;
+		goto bail;
+	}
+	rc = server_set_client_fd(server, mbus_server_connection_get_fd(connection), client);
+	if (rc != 0) {
+		mbus_errorf("can not set client fd");
+		server_event_ctl(server, server_event_op_del, mbus_server_connection_get_fd(connection), 0);
+		client->connection = NULL;
+		goto bail;
+	}
+	mbus_server_connection_set_context(connection, client);
 	TAILQ_INSERT_TAIL(&server->clients, client, clients);
+	client_set_dirty(client, client_dirty_status);
 	return 0;
 bail:	if (client != NULL) {
 		client_destroy(client);
@@ -1228,6 +2310,7 @@ static int server_listener_ws_callback_connection_receive (void *context, struct
 	if (client == NULL) {
 		return -1;
 	}
+	client_set_dirty(client, client_dirty_in);
 	return mbus_buffer_push(client->buffer_in, in, len);
 }
 
@@ -1257,6 +2340,7 @@ static int server_listener_ws_callback_connection_closed (void *context, struct
 
 static int server_listener_ws_callback_poll_add (void *context, struct listener *listener, int fd, unsigned int events)
 {
+	int rc;
 	struct mbus_server *server = (struct mbus_server *) context;
 	{
 		unsigned int i;
@@ -1267,7 +2351,7 @@ static int server_listener_ws_callback_poll_add (void *context, struct listener
 			}
 		}
 		if (i < server->ws_pollfds.length) {
-			return 0;
+			return server_event_ctl(server, server_event_op_mod, fd, events);
 		}
 	}
 	if (server->ws_pollfds.length + 1 > server->ws_pollfds.size) {
@@ -1291,6 +2375,12 @@ static int server_listener_ws_callback_poll_add (void *context, struct listener
 	server->ws_pollfds.pollfds[server->ws_pollfds.length].events = events;
 	server->ws_pollfds.pollfds[server->ws_pollfds.length].revents = 0;
 	server->ws_pollfds.length += 1;
+	rc = server_event_ctl(server, server_event_op_add, fd, events);
+	if (rc != 0) {
+		mbus_errorf("can not add ws fd: %d", fd);
+		server->ws_pollfds.length -= 1;
+		goto bail;
+	}
 	return 0;
 bail:	return -1;
 }
@@ -1304,7 +2394,7 @@ static int server_listener_ws_callback_poll_mod (void *context, struct listener
 			if (server->ws_pollfds.pollfds[i].fd == fd) {
 				server->ws_pollfds.pollfds[i].events = events;
 				server->ws_pollfds.pollfds[i].revents = 0;
-				break;
+				return server_event_ctl(server, server_event_op_mod, fd, events);
 			}
 		}
 	}
@@ -1320,7 +2410,7 @@ static int server_listener_ws_callback_poll_del (void *context, struct listener
 			if (server->ws_pollfds.pollfds[i].fd == fd) {
 				memmove(&server->ws_pollfds.pollfds[i], &server->ws_pollfds.pollfds[i + 1], sizeof(struct pollfd) * (server->ws_pollfds.length - i - 1));
 				server->ws_pollfds.length -= 1;
-				break;
+				return server_event_ctl(server, server_event_op_del, fd, 0);
 			}
 		}
 	}
@@ -1416,6 +2506,11 @@ static int server_handle_command_create (struct mbus_server *server, struct meth
 				client->ping_recv_tsms = mbus_clock_monotonic() - client->ping_interval;
 				client->ping_enabled = 1;
 			}
+			rc = client_arm_ping(client);
+			if (rc != 0) {
+				mbus_errorf("can not arm ping timer");
+				goto bail;
+			}
 		}
 		{
 			int i;
@@ -1436,17 +2531,68 @@ static int server_handle_command_create (struct mbus_server *server, struct meth
 				}
 			}
 			if (i < (int) (sizeof(compression_methods) / sizeof(compression_methods[0]))) {
-				mbus_debugf("compression: %s", compression_methods[i].name);
-				client_set_compression(mbus_server_method_get_source(method), compression_methods[i].value);
+				struct mbus_compress_dictionary *dictionary;
+				dictionary = NULL;
+				if (compression_methods[i].value == mbus_compress_method_zstd &&
+				    server->dictionary != NULL &&
+				    (unsigned int) mbus_json_get_number_value(payload, "dictionary", 0) == mbus_compress_dictionary_get_id(server->dictionary)) {
+					dictionary = server->dictionary;
+				}
+				mbus_debugf("compression: %s, dictionary: %u", compression_methods[i].name, mbus_compress_dictionary_get_id(dictionary));
+				client_set_compression(mbus_server_method_get_source(method), compression_methods[i].value, dictionary);
 			} else {
 				mbus_debugf("compression: %s", "none");
-				client_set_compression(mbus_server_method_get_source(method), mbus_compress_method_none);
+				client_set_compression(mbus_server_method_get_source(method), mbus_compress_method_none, NULL);
+			}
+			client->uncompressed = mbus_json_get_bool_value(payload, "uncompressed", 0);
+		}
+		{
+			int i;
+			int j;
+			struct mbus_json *encodings;
+			encodings = mbus_json_get_object(payload, "encodings");
+			for (i = 0; i < (int) (sizeof(encoding_methods) / sizeof(encoding_methods[0])); i++) {
+				for (j = 0; j < mbus_json_get_array_size(encodings); j++) {
+					if (mbus_json_get_value_string(mbus_json_get_array_item(encodings, j)) == NULL) {
+						continue;
+					}
+					if (strcmp(encoding_methods[i].name, mbus_json_get_value_string(mbus_json_get_array_item(encodings, j))) == 0) {
+						break;
+					}
+				}
+				if (j < mbus_json_get_array_size(encodings)) {
+					break;
+				}
+			}
+			if (i < (int) (sizeof(encoding_methods) / sizeof(encoding_methods[0]))) {
+				client->encoding = encoding_methods[i].value;
+			} else {
+				client->encoding = mbus_method_encoding_json;
+			}
+		}
+		{
+			int size;
+			size = mbus_json_get_number_value(payload, "fragment", 0);
+			if (size <= 0 || server->options.fragment.size <= 0) {
+				client->fragment.size = 0;
+			} else {
+				client->fragment.size = (size < server->options.fragment.size) ? size : server->options.fragment.size;
+			}
+		}
+		{
+			client->sequence_end = mbus_json_get_int_value(payload, "sequence", MBUS_METHOD_SEQUENCE_END);
+			if (client->sequence_end <= MBUS_METHOD_SEQUENCE_END ||
+			    client->sequence_end > MBUS_METHOD_SEQUENCE_WIDE_END) {
+				client->sequence_end = MBUS_METHOD_SEQUENCE_END;
 			}
 		}
 	}
 	mbus_infof("client created");
 	mbus_infof("  identifier : %s", client_get_identifier(mbus_server_method_get_source(method)));
 	mbus_infof("  compression: %s", mbus_compress_method_string(client_get_compression(mbus_server_method_get_source(method))));
+	mbus_infof("  encoding   : %s", mbus_method_encoding_string(client->encoding));
+	mbus_infof("  fragment   : %d", client->fragment.size);
+	mbus_infof("  sequence   : %d", client->sequence_end);
 	mbus_infof("  ping");
 	mbus_infof("    enabled  : %d", client->ping_enabled);
 	mbus_infof("    interval : %d", client->ping_interval);
@@ -1458,6 +2604,14 @@ static int server_handle_command_create (struct mbus_server *server, struct meth
 		payload = mbus_json_create_object();
 		mbus_json_add_string_to_object_cs(payload, "identifier", client_get_identifier(mbus_server_method_get_source(method)));
 		mbus_json_add_string_to_object_cs(payload, "compression", mbus_compress_method_string(client_get_compression(mbus_server_method_get_source(method))));
+		if (client->stream != NULL &&
+		    client->compression == mbus_compress_method_zstd) {
+			mbus_json_add_number_to_object_cs(payload, "dictionary", mbus_compress_dictionary_get_id(server->dictionary));
+		}
+		mbus_json_add_bool_to_object_cs(payload, "uncompressed", client->uncompressed);
+		mbus_json_add_string_to_object_cs(payload, "encoding", mbus_method_encoding_string(client->encoding));
+		mbus_json_add_number_to_object_cs(payload, "fragment", client->fragment.size);
+		mbus_json_add_number_to_object_cs(payload, "sequence", client->sequence_end);
 		ping = mbus_json_create_object();
 		mbus_json_add_number_to_object_cs(ping, "interval", client->ping_interval);
 		mbus_json_add_number_to_object_cs(ping, "timeout", client->ping_timeout);
@@ -1602,9 +2756,17 @@ bail:	return -1;
 static int server_handle_command_event (struct mbus_server *server, struct method *method)
 {
 	int rc;
+	int length;
+	int priority;
+	int payloadlength;
+	int nattachments;
+	const char *string;
 	const char *destination;
 	const char *identifier;
-	struct mbus_json *payload;
+	const char *payload;
+	const struct mbus_method_attachment *attachments;
+	struct mbus_json *request;
+	request = NULL;
 	if (server == NULL) {
 		mbus_errorf("server is null");
 		goto bail;
@@ -1613,122 +2775,60 @@ static int server_handle_command_event (struct mbus_server *server, struct metho
 		mbus_errorf("method is null");
 		goto bail;
 	}
-	destination = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_DESTINATION, NULL);
-	identifier = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_IDENTIFIER, NULL);
-	payload = mbus_json_get_object(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_PAYLOAD);
+	/* the command payload is shaped like a method, route its payload unparsed */
+	string = mbus_server_method_get_request_payload_string(method, &length);
+	if (string == NULL) {
+		mbus_errorf("invalid request");
+		goto bail;
+	}
+	request = mbus_method_decode_header(mbus_method_encoding_json, string, length, &payload, &payloadlength, NULL, NULL);
+	destination = mbus_json_get_string_value(request, MBUS_METHOD_TAG_DESTINATION, NULL);
+	identifier = mbus_json_get_string_value(request, MBUS_METHOD_TAG_IDENTIFIER, NULL);
+	priority = client_priority_value(mbus_json_get_int_value(request, MBUS_METHOD_TAG_PRIORITY, MBUS_METHOD_PRIORITY_BULK));
 	if ((destination == NULL) ||
 	    (identifier == NULL) ||
 	    (payload == NULL)) {
 		mbus_errorf("invalid request");
 		goto bail;
 	}
-	rc = server_send_event_to(server, client_get_identifier(mbus_server_method_get_source(method)), destination, identifier, payload);
+	attachments = mbus_server_method_get_request_attachments(method, &nattachments);
+	rc = server_send_event_string(server, client_get_identifier(mbus_server_method_get_source(method)), destination, identifier, priority, payload, payloadlength, attachments, nattachments);
 	if (rc != 0) {
 		mbus_errorf("can not send event");
 	}
+	mbus_json_delete(request);
 	return 0;
-bail:	return -1;
+bail:	if (request != NULL) {
+		mbus_json_delete(request);
+	}
+	return -1;
 }
 
-static int server_handle_command_status (struct mbus_server *server, struct method *method)
+static struct mbus_json * client_create_queue_status (struct client *client)
 {
-	char address[1024];
-	struct mbus_json *object;
-	struct mbus_json *source;
-	struct mbus_json *clients;
-	struct mbus_json *commands;
-	struct mbus_json *subscribes;
-	struct client *client;
-	struct command *command;
-	struct subscription *subscription;
-	clients = NULL;
-	if (server == NULL) {
-		mbus_errorf("server is null");
-		goto bail;
-	}
-	if (method == NULL) {
-		mbus_errorf("method is null");
-		goto bail;
-	}
-	clients = mbus_json_create_array();
-	if (clients == NULL) {
-		goto bail;
-	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		source = mbus_json_create_object();
-		if (source == NULL) {
-			goto bail;
-		}
-		mbus_json_add_item_to_array(clients, source);
-		mbus_json_add_string_to_object_cs(source, "source", client_get_identifier(client));
-		mbus_json_add_string_to_object_cs(source, "address", mbus_socket_fd_get_address(mbus_server_connection_get_fd(client_get_connection(client)), address, sizeof(address)));
-	        mbus_json_add_number_to_object_cs(source, "port", mbus_socket_fd_get_port(mbus_server_connection_get_fd(client_get_connection(client))));
-		subscribes = mbus_json_create_array();
-		if (subscribes == NULL) {
-			goto bail;
-		}
-		mbus_json_add_item_to_object_cs(source, "subscriptions", subscribes);
-		TAILQ_FOREACH(subscription, &client->subscriptions, subscriptions) {
-			object = mbus_json_create_object();
-			if (object == NULL) {
-				goto bail;
-			}
-			mbus_json_add_item_to_array(subscribes, object);
-			mbus_json_add_string_to_object_cs(object, "source", mbus_server_subscription_get_source(subscription));
-			mbus_json_add_string_to_object_cs(object, "identifier", mbus_server_subscription_get_event(subscription));
-		}
-		commands = mbus_json_create_array();
-		if (commands == NULL) {
-			goto bail;
-		}
-		mbus_json_add_item_to_object_cs(source, "commands", commands);
-		TAILQ_FOREACH(command, &client->commands, commands) {
-			object = mbus_json_create_object();
-			if (object == NULL) {
-				goto bail;
-			}
-			mbus_json_add_item_to_array(commands, object);
-			mbus_json_add_string_to_object_cs(object, "identifier", mbus_server_command_get_identifier(command));
-		}
-	}
-	mbus_server_method_set_result_payload(method, clients);
-	return 0;
-bail:	if (clients != NULL) {
-		mbus_json_delete(clients);
+	struct mbus_json *queue;
+	queue = mbus_json_create_object();
+	if (queue == NULL) {
+		return NULL;
 	}
-	return -1;
+	client_check_congested(client);
+	mbus_json_add_number_to_object_cs(queue, "count", client->queued.count);
+	mbus_json_add_number_to_object_cs(queue, "bytes", client_get_pending_bytes(client));
+	mbus_json_add_number_to_object_cs(queue, "dropped", client->queued.dropped);
+	mbus_json_add_bool_to_object_cs(queue, "congested", client->queued.congested);
+	return queue;
 }
 
-static int server_handle_command_client (struct mbus_server *server, struct method *method)
+static struct mbus_json * client_create_status (struct client *client)
 {
-	char address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
-	struct mbus_json *result;
+	char address[1024];
+	struct mbus_json *queue;
 	struct mbus_json *object;
+	struct mbus_json *result;
 	struct mbus_json *commands;
 	struct mbus_json *subscribes;
-	struct client *client;
 	struct command *command;
 	struct subscription *subscription;
-	const char *source;
-	result = NULL;
-	if (server == NULL) {
-		mbus_errorf("server is null");
-		goto bail;
-	}
-	if (method == NULL) {
-		mbus_errorf("method is null");
-		goto bail;
-	}
-	source = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), "source", NULL);
-	if (source == NULL) {
-		mbus_errorf("method request source is null");
-		goto bail;
-	}
-	client = server_find_client_by_identifier(server, source);
-	if (client == NULL) {
-		mbus_errorf("client: %s is not connected", source);
-		goto bail;
-	}
 	result = mbus_json_create_object();
 	if (result == NULL) {
 		goto bail;
@@ -1736,6 +2836,11 @@ static int server_handle_command_client (struct mbus_server *server, struct meth
 	mbus_json_add_string_to_object_cs(result, "source", client_get_identifier(client));
 	mbus_json_add_string_to_object_cs(result, "address", mbus_socket_fd_get_address(mbus_server_connection_get_fd(client_get_connection(client)), address, sizeof(address)));
         mbus_json_add_number_to_object_cs(result, "port", mbus_socket_fd_get_port(mbus_server_connection_get_fd(client_get_connection(client))));
+	queue = client_create_queue_status(client);
+	if (queue == NULL) {
+		goto bail;
+	}
+	mbus_json_add_item_to_object_cs(result, "queue", queue);
 	subscribes = mbus_json_create_array();
 	if (subscribes == NULL) {
 		goto bail;
@@ -1763,32 +2868,32 @@ static int server_handle_command_client (struct mbus_server *server, struct meth
 		mbus_json_add_item_to_array(commands, object);
 		mbus_json_add_string_to_object_cs(object, "identifier", mbus_server_command_get_identifier(command));
 	}
-	mbus_server_method_set_result_payload(method, result);
-	return 0;
+	return result;
 bail:	if (result != NULL) {
 		mbus_json_delete(result);
 	}
-	return -1;
+	return NULL;
 }
 
-static int server_handle_command_clients (struct mbus_server *server, struct method *method)
+static int server_add_status (struct mbus_server *server, struct mbus_json *clients)
 {
 	struct mbus_json *source;
-	struct mbus_json *clients;
 	struct client *client;
-	clients = NULL;
-	if (server == NULL) {
-		mbus_errorf("server is null");
-		goto bail;
-	}
-	if (method == NULL) {
-		mbus_errorf("method is null");
-		goto bail;
-	}
-	clients = mbus_json_create_array();
-	if (clients == NULL) {
-		goto bail;
+	TAILQ_FOREACH(client, &server->clients, clients) {
+		source = client_create_status(client);
+		if (source == NULL) {
+			goto bail;
+		}
+		mbus_json_add_item_to_array(clients, source);
 	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_add_clients (struct mbus_server *server, struct mbus_json *clients)
+{
+	struct mbus_json *source;
+	struct client *client;
 	TAILQ_FOREACH(client, &server->clients, clients) {
 		if (client_get_identifier(client) == NULL) {
 			continue;
@@ -1799,74 +2904,280 @@ static int server_handle_command_clients (struct mbus_server *server, struct met
 		}
 		mbus_json_add_item_to_array(clients, source);
 	}
-	mbus_server_method_set_result_payload(method, clients);
 	return 0;
-bail:	if (clients != NULL) {
-		mbus_json_delete(clients);
-	}
-	return -1;
+bail:	return -1;
 }
 
-static int server_handle_command_close (struct mbus_server *server, struct method *method)
+static int server_close_client (struct mbus_server *server, const char *source)
 {
 	struct client *client;
-	const char *source;
-	if (server == NULL) {
-		mbus_errorf("server is null");
-		goto bail;
-	}
-	if (method == NULL) {
-		mbus_errorf("method is null");
-		goto bail;
-	}
-	source = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), "source", NULL);
 	if (source == NULL) {
 		mbus_errorf("method request source is null");
 		goto bail;
 	}
 	if (strcmp(source, MBUS_SERVER_IDENTIFIER) == 0) {
 		server->running = 0;
-	} else {
-		TAILQ_FOREACH(client, &server->clients, clients) {
-			if (client_get_identifier(client) == NULL) {
-				continue;
-			}
-			if (strcmp(client_get_identifier(client), source) != 0) {
-				continue;
-			}
-			client_set_connection(client, NULL, client_connection_close_code_close_comand);
-			break;
-		}
-		if (client == NULL) {
-			mbus_errorf("could not find requested source: %s", source);
-			goto bail;
-		}
+		return 0;
+	}
+	client = server_find_client_by_identifier(server, source);
+	if (client == NULL) {
+		mbus_errorf("could not find requested source: %s", source);
+		goto bail;
 	}
+	client_set_connection(client, NULL, client_connection_close_code_close_comand);
 	return 0;
 bail:	return -1;
 }
 
-static int server_handle_command_call (struct mbus_server *server, struct method *method)
+static int server_forward_command (struct mbus_server *server, unsigned int shard, const char *source, const char *identifier, int sequence, unsigned long long deadline, const struct mbus_json *payload)
 {
-	struct method *request;
-	struct client *client;
-	struct command *command;
-	if (server == NULL) {
-		mbus_errorf("server is null");
+	int rc;
+	struct shard_message *message;
+	message = mbus_server_shard_message_create(shard_message_type_call, server->shard.index, source, MBUS_SERVER_IDENTIFIER, identifier, sequence, 0, payload);
+	if (message == NULL) {
+		mbus_errorf("can not create shard message");
 		goto bail;
 	}
-	if (method == NULL) {
-		mbus_errorf("method is null");
+	message->deadline = deadline;
+	rc = mbus_server_shards_push(server->shards, shard, message);
+	if (rc != 0) {
+		mbus_errorf("can not push shard message");
+		mbus_server_shard_message_destroy(message);
 		goto bail;
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_identifier(client) == NULL) {
-			continue;
+	return 0;
+bail:	return -1;
+}
+
+static int server_forward_method (struct mbus_server *server, struct method *method, unsigned int shard, const struct mbus_json *payload)
+{
+	return server_forward_command(server, shard,
+			client_get_identifier(mbus_server_method_get_source(method)),
+			mbus_server_method_get_request_identifier(method),
+			mbus_server_method_get_request_sequence(method),
+			mbus_server_method_get_request_deadline(method),
+			payload);
+}
+
+/* shards visited after shard by a command collecting from all of them, the
+ * caller's own shard starts the walk and is skipped.
+ */
+static int server_next_shard (struct mbus_server *server, unsigned int origin, int shard)
+{
+	unsigned int s;
+	if (server->shards == NULL) {
+		return -1;
+	}
+	for (s = shard + 1; s < mbus_server_shards_get_count(server->shards); s++) {
+		if (s != origin) {
+			return s;
 		}
-		if (strcmp(mbus_server_method_get_request_destination(method), client_get_identifier(client)) != 0) {
-			continue;
+	}
+	return -1;
+}
+
+/* the client a command is about lives on the shard its identifier is
+ * registered to, -1 when it is this one or nobody knows it.
+ */
+static int server_owner_shard (struct mbus_server *server, const char *source)
+{
+	int shard;
+	if (server->shards == NULL ||
+	    source == NULL) {
+		return -1;
+	}
+	if (strcmp(source, MBUS_SERVER_IDENTIFIER) == 0) {
+		shard = 0;
+	} else {
+		shard = mbus_server_shards_find_identifier(server->shards, source);
+	}
+	if (shard == (int) server->shard.index) {
+		return -1;
+	}
+	return shard;
+}
+
+static int server_handle_command_collect (struct mbus_server *server, struct method *method, int (*add) (struct mbus_server *server, struct mbus_json *clients))
+{
+	int rc;
+	int shard;
+	struct mbus_json *clients;
+	clients = NULL;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (method == NULL) {
+		mbus_errorf("method is null");
+		goto bail;
+	}
+	clients = mbus_json_create_array();
+	if (clients == NULL) {
+		goto bail;
+	}
+	rc = add(server, clients);
+	if (rc != 0) {
+		goto bail;
+	}
+	shard = server_next_shard(server, server->shard.index, -1);
+	if (shard >= 0) {
+		/* the list travels through the other shards and comes back as a result */
+		rc = server_forward_method(server, method, shard, clients);
+		if (rc != 0) {
+			mbus_errorf("can not forward command");
+			goto bail;
+		}
+		mbus_json_delete(clients);
+		return HANDLER_FORWARDED;
+	}
+	mbus_server_method_set_result_payload(method, clients);
+	return 0;
+bail:	if (clients != NULL) {
+		mbus_json_delete(clients);
+	}
+	return -1;
+}
+
+static int server_handle_command_status (struct mbus_server *server, struct method *method)
+{
+	return server_handle_command_collect(server, method, server_add_status);
+}
+
+static int server_handle_command_client (struct mbus_server *server, struct method *method)
+{
+	int rc;
+	int shard;
+	struct mbus_json *result;
+	struct client *client;
+	const char *source;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (method == NULL) {
+		mbus_errorf("method is null");
+		goto bail;
+	}
+	source = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), "source", NULL);
+	if (source == NULL) {
+		mbus_errorf("method request source is null");
+		goto bail;
+	}
+	client = server_find_client_by_identifier(server, source);
+	if (client == NULL) {
+		shard = server_owner_shard(server, source);
+		if (shard >= 0) {
+			rc = server_forward_method(server, method, shard, mbus_server_method_get_request_payload(method));
+			if (rc != 0) {
+				mbus_errorf("can not forward command");
+				goto bail;
+			}
+			return HANDLER_FORWARDED;
+		}
+		mbus_errorf("client: %s is not connected", source);
+		goto bail;
+	}
+	result = client_create_status(client);
+	if (result == NULL) {
+		goto bail;
+	}
+	mbus_server_method_set_result_payload(method, result);
+	return 0;
+bail:	return -1;
+}
+
+static int server_handle_command_clients (struct mbus_server *server, struct method *method)
+{
+	return server_handle_command_collect(server, method, server_add_clients);
+}
+
+static int server_handle_command_close (struct mbus_server *server, struct method *method)
+{
+	int rc;
+	int shard;
+	const char *source;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (method == NULL) {
+		mbus_errorf("method is null");
+		goto bail;
+	}
+	source = mbus_json_get_string_value(mbus_server_method_get_request_payload(method), "source", NULL);
+	if (source == NULL) {
+		mbus_errorf("method request source is null");
+		goto bail;
+	}
+	shard = server_owner_shard(server, source);
+	if (shard >= 0) {
+		rc = server_forward_method(server, method, shard, mbus_server_method_get_request_payload(method));
+		if (rc != 0) {
+			mbus_errorf("can not forward command");
+			goto bail;
+		}
+		return HANDLER_FORWARDED;
+	}
+	return server_close_client(server, source);
+bail:	return -1;
+}
+
+static int server_handle_command_call (struct mbus_server *server, struct method *method)
+{
+	int rc;
+	int shard;
+	int nattachments;
+	unsigned long long deadline;
+	const struct mbus_method_attachment *attachments;
+	struct method *request;
+	struct client *client;
+	struct command *command;
+	struct shard_message *message;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (method == NULL) {
+		mbus_errorf("method is null");
+		goto bail;
+	}
+	deadline = mbus_server_method_get_request_deadline(method);
+	if (deadline != 0 &&
+	    !mbus_clock_after(deadline, mbus_clock_monotonic())) {
+		mbus_infof("%s call %s.%s expired before it was forwarded", client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_destination(method), mbus_server_method_get_request_identifier(method));
+		return MBUS_METHOD_STATUS_TIMEOUT;
+	}
+	client = server_find_client_by_identifier(server, mbus_server_method_get_request_destination(method));
+	if (client == NULL && server->shards != NULL) {
+		shard = mbus_server_shards_find_identifier(server->shards, mbus_server_method_get_request_destination(method));
+		if (shard >= 0) {
+			message = mbus_server_shard_message_create(shard_message_type_call, server->shard.index,
+					client_get_identifier(mbus_server_method_get_source(method)),
+					mbus_server_method_get_request_destination(method),
+					mbus_server_method_get_request_identifier(method),
+					mbus_server_method_get_request_sequence(method),
+					0,
+					mbus_server_method_get_request_payload(method));
+			if (message == NULL) {
+				mbus_errorf("can not create shard message");
+				goto bail;
+			}
+			message->deadline = deadline;
+			attachments = mbus_server_method_get_request_attachments(method, &nattachments);
+			rc = mbus_server_shard_message_set_attachments(message, attachments, nattachments);
+			if (rc != 0) {
+				mbus_errorf("can not set shard message attachments");
+				mbus_server_shard_message_destroy(message);
+				goto bail;
+			}
+			rc = mbus_server_shards_push(server->shards, shard, message);
+			if (rc != 0) {
+				mbus_errorf("can not push shard message");
+				mbus_server_shard_message_destroy(message);
+				goto bail;
+			}
+			return 0;
 		}
-		break;
 	}
 	if (client == NULL) {
 		mbus_errorf("client %s does not exists", mbus_server_method_get_request_destination(method));
@@ -1881,25 +3192,54 @@ static int server_handle_command_call (struct mbus_server *server, struct method
 		mbus_errorf("client: %s does not have such command: %s", mbus_server_method_get_request_destination(method), mbus_server_method_get_request_identifier(method));
 		goto bail;
 	}
-	request = mbus_server_method_create_response(MBUS_METHOD_TYPE_COMMAND, client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_identifier(method), mbus_server_method_get_request_sequence(method), mbus_server_method_get_request_payload(method));
+	attachments = mbus_server_method_get_request_attachments(method, &nattachments);
+	request = mbus_server_method_create_response(MBUS_METHOD_TYPE_COMMAND, client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_identifier(method), mbus_server_method_get_request_sequence(method), mbus_server_method_get_request_payload(method), attachments, nattachments);
 	if (request == NULL) {
 		mbus_errorf("can not create call method");
 		goto bail;
 	}
+	mbus_server_method_set_request_deadline(request, deadline);
 	client_push_request(client, request);
 	return 0;
 bail:	return -1;
 }
 
+static void client_complete_wait (struct client *client, const char *source, const char *identifier, int sequence, int status, struct mbus_json *payload)
+{
+	struct method *wait;
+	if (client == NULL) {
+		return;
+	}
+	if (sequence < MBUS_METHOD_SEQUENCE_START ||
+	    sequence >= client->sequence_end) {
+		mbus_errorf("sequence: %d is invalid for %s", sequence, client_get_identifier(client));
+		return;
+	}
+	wait = client_find_wait(client, source, sequence);
+	if (wait == NULL) {
+		mbus_debugf("%s has no wait for %s, sequence: %d", client_get_identifier(client), source, sequence);
+		return;
+	}
+	if (strcmp(mbus_server_method_get_request_identifier(wait), identifier) != 0) {
+		return;
+	}
+	client_remove_wait(client, wait);
+	mbus_server_method_set_result_code(wait, status);
+	mbus_server_method_set_result_payload(wait, mbus_json_duplicate(payload, 1));
+	client_push_result(client, wait);
+}
+
 static int server_handle_command_result (struct mbus_server *server, struct method *method)
 {
 	struct client *client;
-	struct method *wait;
-	struct method *nwait;
+	struct mbus_json *payload;
+	struct shard_message *message;
 	const char *source;
 	const char *destination;
 	const char *identifier;
 	int sequence;
+	int status;
+	int shard;
 	int rc;
 	source = client_get_identifier(mbus_server_method_get_source(method));
 	if (source == NULL) {
@@ -1916,48 +3256,117 @@ static int server_handle_command_result (struct mbus_server *server, struct meth
 		mbus_errorf("identifier is invalid");
 		goto bail;
 	}
+	/* the sequence belongs to the destination, its shard checks the range */
 	sequence = mbus_json_get_int_value(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_SEQUENCE, -1);
-	if (sequence < MBUS_METHOD_SEQUENCE_START ||
-	    sequence >= MBUS_METHOD_SEQUENCE_END) {
-		mbus_errorf("sequence is invalid");
-		goto bail;
-	}
-	rc = mbus_json_get_int_value(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_STATUS, -1);
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_identifier(client) == NULL) {
-			continue;
-		}
-		if (strcmp(client_get_identifier(client), destination) != 0) {
-			continue;
-		}
-		TAILQ_FOREACH_SAFE(wait, &client->waits, methods, nwait) {
-			if (sequence != mbus_server_method_get_request_sequence(wait)) {
-				continue;
-			}
-			if (strcmp(mbus_server_method_get_request_destination(wait), source) != 0) {
-				continue;
+	status = mbus_json_get_int_value(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_STATUS, -1);
+	payload = mbus_json_get_object(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_PAYLOAD);
+	client = server_find_client_by_identifier(server, destination);
+	if (client == NULL && server->shards != NULL) {
+		shard = mbus_server_shards_find_identifier(server->shards, destination);
+		if (shard >= 0) {
+			message = mbus_server_shard_message_create(shard_message_type_result, server->shard.index, source, destination, identifier, sequence, status, payload);
+			if (message == NULL) {
+				mbus_errorf("can not create shard message");
+				goto bail;
 			}
-			if (strcmp(mbus_server_method_get_request_identifier(wait), identifier) != 0) {
-				continue;
+			rc = mbus_server_shards_push(server->shards, shard, message);
+			if (rc != 0) {
+				mbus_errorf("can not push shard message");
+				mbus_server_shard_message_destroy(message);
+				goto bail;
 			}
-			TAILQ_REMOVE(&client->waits, wait, methods);
-			mbus_server_method_set_result_code(wait, rc);
-			mbus_server_method_set_result_payload(wait, mbus_json_duplicate(mbus_json_get_object(mbus_server_method_get_request_payload(method), MBUS_METHOD_TAG_PAYLOAD), 1));
-			client_push_result(client, wait);
-			break;
 		}
-		break;
+		return 0;
 	}
+	client_complete_wait(client, source, identifier, sequence, status, payload);
 	return 0;
 bail:	return -1;
 }
 
+static int server_add_handler (struct mbus_server *server, const char *identifier,
+		int (*builtin) (struct mbus_server *server, struct method *method),
+		int (*callback) (struct mbus_server *server, void *context, const char *source, struct mbus_json *payload, struct mbus_json *result),
+		void *context)
+{
+	int rc;
+	struct handler *handler;
+	handler = NULL;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (identifier == NULL) {
+		mbus_errorf("identifier is null");
+		goto bail;
+	}
+	if (builtin == NULL && callback == NULL) {
+		mbus_errorf("handler is null");
+		goto bail;
+	}
+	if (mbus_hash_get_string(server->commands, identifier) != NULL) {
+		mbus_errorf("command: %s is already registered", identifier);
+		goto bail;
+	}
+	handler = malloc(sizeof(struct handler));
+	if (handler == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(handler, 0, sizeof(struct handler));
+	handler->builtin = builtin;
+	handler->callback = callback;
+	handler->context = context;
+	rc = mbus_hash_put_string(server->commands, identifier, handler);
+	if (rc != 0) {
+		mbus_errorf("can not add command: %s to index", identifier);
+		goto bail;
+	}
+	TAILQ_INSERT_TAIL(&server->handlers, handler, handlers);
+	return 0;
+bail:	if (handler != NULL) {
+		free(handler);
+	}
+	return -1;
+}
+
+static int server_handle_command_handler (struct mbus_server *server, struct handler *handler, struct method *method)
+{
+	int rc;
+	struct mbus_json *result;
+	result = NULL;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (handler == NULL) {
+		mbus_errorf("handler is null");
+		goto bail;
+	}
+	if (method == NULL) {
+		mbus_errorf("method is null");
+		goto bail;
+	}
+	result = mbus_json_create_object();
+	if (result == NULL) {
+		mbus_errorf("can not create result");
+		goto bail;
+	}
+	rc = handler->callback(server, handler->context, client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_payload(method), result);
+	mbus_server_method_set_result_payload(method, result);
+	return rc;
+bail:	if (result != NULL) {
+		mbus_json_delete(result);
+	}
+	return -1;
+}
+
 static int server_handle_methods (struct mbus_server *server)
 {
 	int rc;
 	int response;
 	struct method *method;
 	struct method *nmethod;
+	struct handler *handler;
 	if (server == NULL) {
 		mbus_errorf("server is null");
 		goto bail;
@@ -1965,39 +3374,34 @@ static int server_handle_methods (struct mbus_server *server)
 	TAILQ_FOREACH_SAFE(method, &server->methods, methods, nmethod) {
 		mbus_debugf("handle method: %s, %s, %s", mbus_server_method_get_request_type(method), mbus_server_method_get_request_identifier(method), mbus_server_method_get_request_destination(method));
 		TAILQ_REMOVE(&server->methods, method, methods);
-		if (strcmp(mbus_server_method_get_request_type(method), MBUS_METHOD_TYPE_COMMAND) == 0) {
+		if (mbus_server_method_get_type(method) == method_type_command) {
 			if (strcmp(mbus_server_method_get_request_destination(method), MBUS_SERVER_IDENTIFIER) == 0) {
 				response = 1;
-				if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CREATE) == 0) {
-					rc = server_handle_command_create(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_SUBSCRIBE) == 0) {
-					rc = server_handle_command_subscribe(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_UNSUBSCRIBE) == 0) {
-					rc = server_handle_command_unsubscribe(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_REGISTER) == 0) {
-					rc = server_handle_command_register(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_UNREGISTER) == 0) {
-					rc = server_handle_command_unregister(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_RESULT) == 0) {
-					rc = server_handle_command_result(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_EVENT) == 0) {
-					rc = server_handle_command_event(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_STATUS) == 0) {
-					rc = server_handle_command_status(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CLIENT) == 0) {
-					rc = server_handle_command_client(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CLIENTS) == 0) {
-					rc = server_handle_command_clients(server, method);
-				} else if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CLOSE) == 0) {
-					rc = server_handle_command_close(server, method);
-				} else {
+				handler = mbus_hash_get_string(server->commands, mbus_server_method_get_request_identifier(method));
+				if (handler == NULL &&
+				    server->shards != NULL &&
+				    server->shard.index != 0) {
+					/* commands registered by the application live on the first shard */
+					rc = server_forward_method(server, method, 0, mbus_server_method_get_request_payload(method));
+					if (rc == 0) {
+						response = 0;
+					}
+				} else if (handler == NULL) {
 					rc = -1;
+				} else if (handler->builtin != NULL) {
+					rc = handler->builtin(server, method);
+					if (rc == HANDLER_FORWARDED) {
+						response = 0;
+						rc = 0;
+					}
+				} else {
+					rc = server_handle_command_handler(server, handler, method);
 				}
 			} else {
 				response = 0;
 				rc = server_handle_command_call(server, method);
 			}
-			if (rc != 0) {
+			if (rc != 0 && rc != MBUS_METHOD_STATUS_TIMEOUT) {
 				mbus_errorf("can not execute method type: '%s', destination: '%s', identifier: '%s'",
 						mbus_server_method_get_request_type(method),
 						mbus_server_method_get_request_destination(method),
@@ -2006,15 +3410,30 @@ static int server_handle_methods (struct mbus_server *server)
 			if (response == 1 || rc != 0) {
 				mbus_debugf("  push to result");
 				mbus_server_method_set_result_code(method, rc);
+				if (response == 0 &&
+				    rc == MBUS_METHOD_STATUS_TIMEOUT) {
+					mbus_server_method_set_result_expired(method);
+				}
 				client_push_result(mbus_server_method_get_source(method), method);
 			} else {
 				mbus_debugf("  push to wait");
-				client_push_wait(mbus_server_method_get_source(method), method);
+				rc = client_push_wait(mbus_server_method_get_source(method), method);
+				if (rc != 0) {
+					mbus_errorf("can not push method to wait");
+					mbus_server_method_set_result_code(method, -1);
+					client_push_result(mbus_server_method_get_source(method), method);
+				}
 			}
 		}
-		if (strcmp(mbus_server_method_get_request_type(method), MBUS_METHOD_TYPE_EVENT) == 0) {
+		if (mbus_server_method_get_type(method) == method_type_event) {
+			int payloadlength;
+			int nattachments;
+			const char *payload;
+			const struct mbus_method_attachment *attachments;
 			mbus_debugf("  push to trash");
-			rc = server_send_event_to(server, client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_destination(method), mbus_server_method_get_request_identifier(method), mbus_server_method_get_request_payload(method));
+			payload = mbus_server_method_get_request_payload_string(method, &payloadlength);
+			attachments = mbus_server_method_get_request_attachments(method, &nattachments);
+			rc = server_send_event_string(server, client_get_identifier(mbus_server_method_get_source(method)), mbus_server_method_get_request_destination(method), mbus_server_method_get_request_identifier(method), client_priority_value(mbus_server_method_get_request_priority(method)), payload, payloadlength, attachments, nattachments);
 			if (rc != 0) {
 				mbus_errorf("can not send event: %s", mbus_server_method_get_source(method));
 			}
@@ -2037,18 +3456,23 @@ static int server_handle_method_event (struct mbus_server *server, struct method
 	return 0;
 }
 
-static int server_handle_method (struct mbus_server *server, struct client *client, const char *string)
+static int server_handle_method (struct mbus_server *server, struct client *client, const char *string, unsigned int length)
 {
 	int rc;
 	struct method *method;
-	method = mbus_server_method_create_request(client, string);
+	method = mbus_server_method_create_request(client, client->encoding, string, length);
 	if (method == NULL) {
 		mbus_errorf("invalid method");
 		goto bail;
 	}
-	if (strcmp(mbus_server_method_get_request_type(method), MBUS_METHOD_TYPE_COMMAND) == 0) {
+	if (mbus_server_method_get_request_sequence(method) < MBUS_METHOD_SEQUENCE_START ||
+	    mbus_server_method_get_request_sequence(method) >= client->sequence_end) {
+		mbus_errorf("invalid method sequence: %d", mbus_server_method_get_request_sequence(method));
+		goto bail;
+	}
+	if (mbus_server_method_get_type(method) == method_type_command) {
 		rc = server_handle_method_command(server, method);
-	} else if (strcmp(mbus_server_method_get_request_type(method), MBUS_METHOD_TYPE_EVENT) == 0) {
+	} else if (mbus_server_method_get_type(method) == method_type_event) {
 		rc = server_handle_method_event(server, method);
 	} else {
 		mbus_errorf("invalid method");
@@ -2065,124 +3489,551 @@ bail:	if (method != NULL) {
 	return -1;
 }
 
-__attribute__ ((__visibility__("default"))) int mbus_server_run_timeout (struct mbus_server *server, int milliseconds)
+static int client_offload (struct client *client, enum mbus_compress_method compression, unsigned int length)
+{
+	if (client->server->workers == NULL) {
+		return 0;
+	}
+	if (compression == mbus_compress_method_none) {
+		return 0;
+	}
+	if (client->stream != NULL) {
+		/* stream state is shared by all messages of the connection */
+		return 0;
+	}
+	return length >= (unsigned int) client->server->options.compress.offload;
+}
+
+static int client_skip_compression (struct client *client, enum mbus_compress_method compression, unsigned int length)
+{
+	if (compression == mbus_compress_method_none) {
+		return 0;
+	}
+	if (client->uncompressed == 0) {
+		return 0;
+	}
+	return length < (unsigned int) client->server->options.compress.minimum;
+}
+
+static struct mbus_buffer * client_get_buffer_out (struct client *client, enum mbus_compress_method compression, unsigned int length)
+{
+	if (client->fragment.size <= 0) {
+		return client->buffer_out;
+	}
+	if (length > (unsigned int) client->fragment.size) {
+		return client->fragment.out;
+	}
+	if (mbus_buffer_get_length(client->fragment.out) > 0 &&
+	    compression != mbus_compress_method_none &&
+	    client->stream != NULL &&
+	    !client_skip_compression(client, compression, length)) {
+		/* stream state must be consumed in the order it was produced */
+		return client->fragment.out;
+	}
+	return client->buffer_out;
+}
+
+static int client_push_fragments (struct client *client)
 {
 	int rc;
-	char *string;
-	unsigned int c;
-	unsigned int n;
-	unsigned long long current;
-	struct client *client;
-	struct client *nclient;
-	struct client *wclient;
-	struct client *nwclient;
-	struct method *method;
-	struct method *nmethod;
-	struct listener *listener;
-	enum listener_type listener_type;
-	struct connection *connection;
-	current = mbus_clock_monotonic();
-	if (server == NULL) {
-		mbus_errorf("server is null");
+	while (mbus_buffer_get_length(client->fragment.out) > 0 &&
+	       mbus_buffer_get_length(client->buffer_out) < (unsigned int) client->fragment.size) {
+		rc = mbus_buffer_push_fragment(client->buffer_out, client->fragment.out, &client->fragment.remaining, client->fragment.size);
+		if (rc != 0) {
+			mbus_errorf("can not push fragment");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int client_write_frame (struct client *client, struct mbus_buffer *buffer, enum mbus_compress_method compression, struct method *method)
+{
+	int length;
+	const void *data;
+	struct frame *frame;
+	frame = mbus_server_method_get_frame(method);
+	length = mbus_server_frame_get_length(frame, client->encoding);
+	if (length < 0) {
+		mbus_errorf("can not get frame length");
 		return -1;
 	}
-	mbus_debugf("running server");
-	if (server->running == 0) {
-		goto out;
+	if (client_skip_compression(client, compression, length) ||
+	    (compression != mbus_compress_method_none && client->stream != NULL)) {
+		/* shared encodings can not be used, render this recipient's copy */
+		data = mbus_server_frame_get_data(frame, client->encoding, mbus_server_method_get_request_sequence(method));
+		if (data == NULL) {
+			mbus_errorf("can not get frame data");
+			return -1;
+		}
+		if (client_skip_compression(client, compression, length)) {
+			return mbus_buffer_push_uncompressed(buffer, data, length);
+		}
+		return mbus_buffer_push_stream(buffer, client->stream, data, length);
 	}
-	rc = server_handle_methods(server);
-	if (rc != 0) {
-		mbus_errorf("can not handle methods");
+	return mbus_server_frame_push(frame, buffer, compression, client->encoding, mbus_server_method_get_request_sequence(method));
+}
+
+static int client_push_job (struct client *client, enum worker_job_type type, enum mbus_compress_method compression, const void *data, unsigned int length)
+{
+	int rc;
+	struct worker_job *job;
+	job = mbus_server_worker_job_create(type, compression, data, length, 0);
+	if (job == NULL) {
+		mbus_errorf("can not create job");
 		goto bail;
 	}
-	if (milliseconds < 0 || milliseconds > MBUS_SERVER_DEFAULT_TIMEOUT) {
-		milliseconds = MBUS_SERVER_DEFAULT_TIMEOUT;
+	job->context = client;
+	TAILQ_INSERT_TAIL(&client->jobs.out, job, pendings);
+	if (type == worker_job_type_compress &&
+	    client_offload(client, compression, length)) {
+		rc = mbus_server_workers_submit(client->server->workers, job);
+		if (rc != 0) {
+			mbus_errorf("can not submit job");
+			TAILQ_REMOVE(&client->jobs.out, job, pendings);
+			mbus_server_worker_job_destroy(job);
+			goto bail;
+		}
+	} else {
+		job->status = mbus_server_worker_job_run(job);
+		job->done = 1;
 	}
-	mbus_debugf("  check ping timeout");
-	TAILQ_FOREACH_SAFE(client, &server->clients, clients, nclient) {
-		if (client_get_connection(client) == NULL) {
+	return 0;
+bail:	return -1;
+}
+
+static int client_flush_jobs (struct client *client)
+{
+	int rc;
+	int empty;
+	struct worker_job *job;
+	empty = (mbus_buffer_get_length(client->buffer_out) == 0);
+	while (client->jobs.out.tqh_first != NULL &&
+	       client->jobs.out.tqh_first->done) {
+		job = client->jobs.out.tqh_first;
+		TAILQ_REMOVE(&client->jobs.out, job, pendings);
+		if (job->status != 0) {
+			mbus_errorf("can not encode message");
+			mbus_server_worker_job_destroy(job);
+			goto bail;
+		}
+		rc = mbus_buffer_push(client_get_buffer_out(client, mbus_compress_method_none, mbus_buffer_get_length(job->output)), mbus_buffer_get_base(job->output), mbus_buffer_get_length(job->output));
+		mbus_server_worker_job_destroy(job);
+		if (rc != 0) {
+			mbus_errorf("can not push message");
+			goto bail;
+		}
+	}
+	if (empty &&
+	    mbus_buffer_get_length(client->buffer_out) > 0) {
+		rc = client_sync_connection_events(client);
+		if (rc != 0) {
+			mbus_errorf("can not sync connection events");
+			goto bail;
+		}
+	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_handle_worker_jobs (struct mbus_server *server)
+{
+	int rc;
+	struct client *client;
+	struct worker_job *job;
+	struct worker_jobs jobs;
+	TAILQ_INIT(&jobs);
+	rc = mbus_server_workers_complete(server->workers, &jobs);
+	if (rc != 0) {
+		mbus_errorf("can not complete jobs");
+		goto bail;
+	}
+	while (jobs.tqh_first != NULL) {
+		job = jobs.tqh_first;
+		TAILQ_REMOVE(&jobs, jobs.tqh_first, jobs);
+		client = job->context;
+		if (client == NULL) {
+			mbus_server_worker_job_destroy(job);
 			continue;
 		}
-		if (client->ping_interval <= 0) {
+		if (job->type == worker_job_type_uncompress) {
+			/* input held back behind the job can be parsed again */
+			client->jobs.in = NULL;
+			client_set_dirty(client, client_dirty_in);
+			if (job->status != 0) {
+				mbus_errorf("can not uncompress data, closing client: '%s' connection", client_get_identifier(client));
+				client_set_connection(client, NULL, client_connection_close_code_internal_error);
+			} else {
+				rc = server_handle_method(server, client, (const char *) mbus_buffer_get_base(job->output), mbus_buffer_get_length(job->output));
+				if (rc != 0) {
+					mbus_errorf("can not handle request, closing client: '%s' connection", client_get_identifier(client));
+					client_set_connection(client, NULL, client_connection_close_code_internal_error);
+				}
+			}
+			mbus_server_worker_job_destroy(job);
 			continue;
 		}
-		if (client->ping_enabled == 0) {
+		job->done = 1;
+		rc = client_flush_jobs(client);
+		if (rc != 0) {
+			mbus_errorf("can not flush jobs, closing client: '%s' connection", client_get_identifier(client));
+			client_set_connection(client, NULL, client_connection_close_code_internal_error);
+		}
+	}
+	return 0;
+bail:	return -1;
+}
+
+static void server_fail_waits (struct mbus_server *server, const char *destination)
+{
+	struct client *client;
+	struct method *wait;
+	struct method *nwait;
+	TAILQ_FOREACH(client, &server->clients, clients) {
+		TAILQ_FOREACH_SAFE(wait, &client->waits, methods, nwait) {
+			if (strcmp(mbus_server_method_get_request_destination(wait), destination) != 0) {
+				continue;
+			}
+			client_remove_wait(client, wait);
+			mbus_server_method_set_result_code(wait, -1);
+			client_push_result(client, wait);
+		}
+	}
+}
+
+static int server_forward_closed (struct mbus_server *server, const char *identifier)
+{
+	int rc;
+	unsigned int s;
+	struct shard_message *message;
+	if (server->shards == NULL) {
+		return 0;
+	}
+	for (s = 0; s < mbus_server_shards_get_count(server->shards); s++) {
+		if (s == server->shard.index) {
 			continue;
 		}
-		mbus_debugf("    client: %s, recv: %lu, interval: %d, timeout: %d, missed: %d, threshold: %d",
-				client_get_identifier(client),
-				client->ping_recv_tsms,
-				client->ping_interval,
-				client->ping_timeout,
-				client->ping_missed_count,
-				client->ping_threshold);
-		if (mbus_clock_after(current, client->ping_recv_tsms + client->ping_interval + client->ping_timeout)) {
-			mbus_infof("%s ping timeout: %ld, %ld, %d, %d", client_get_identifier(client), current, client->ping_recv_tsms, client->ping_interval, client->ping_timeout);
-			client->ping_missed_count += 1;
-			client->ping_recv_tsms = client->ping_recv_tsms + client->ping_interval;
+		message = mbus_server_shard_message_create(shard_message_type_closed, server->shard.index, identifier, NULL, NULL, 0, 0, NULL);
+		if (message == NULL) {
+			mbus_errorf("can not create shard message");
+			goto bail;
 		}
-		if (client->ping_missed_count > client->ping_threshold) {
-			mbus_errorf("%s missed too many pings, %d > %d. closing connection", client_get_identifier(client), client->ping_missed_count, client->ping_threshold);
-			client_set_connection(client, NULL, client_connection_close_code_ping_threshold);
+		rc = mbus_server_shards_push(server->shards, s, message);
+		if (rc != 0) {
+			mbus_errorf("can not push shard message");
+			mbus_server_shard_message_destroy(message);
+			goto bail;
 		}
 	}
-	mbus_debugf("  prepare out buffer");
-	TAILQ_FOREACH_SAFE(client, &server->clients, clients, nclient) {
-		enum mbus_compress_method compression;
-		mbus_debugf("    client: %s", client_get_identifier(client));
-		connection = client_get_connection(client);
-		if (connection == NULL) {
+	return 0;
+bail:	return -1;
+}
+
+static int server_push_shard_result (struct mbus_server *server, unsigned int shard, struct shard_message *message, int status, const struct mbus_json *payload)
+{
+	int rc;
+	struct shard_message *result;
+	result = mbus_server_shard_message_create(shard_message_type_result, server->shard.index, message->destination, message->source, message->identifier, message->sequence, status, payload);
+	if (result == NULL) {
+		mbus_errorf("can not create shard message");
+		goto bail;
+	}
+	rc = mbus_server_shards_push(server->shards, shard, result);
+	if (rc != 0) {
+		mbus_errorf("can not push shard message");
+		mbus_server_shard_message_destroy(result);
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_handle_shard_collect (struct mbus_server *server, struct shard_message *message)
+{
+	int rc;
+	int shard;
+	int origin;
+	origin = mbus_server_shards_find_identifier(server->shards, message->source);
+	if (origin < 0) {
+		mbus_debugf("%s is gone, dropping %s", message->source, message->identifier);
+		return 0;
+	}
+	if (message->payload == NULL) {
+		mbus_errorf("payload is invalid");
+		goto fail;
+	}
+	if (strcmp(message->identifier, MBUS_SERVER_COMMAND_STATUS) == 0) {
+		rc = server_add_status(server, message->payload);
+	} else {
+		rc = server_add_clients(server, message->payload);
+	}
+	if (rc != 0) {
+		mbus_errorf("can not collect %s", message->identifier);
+		goto fail;
+	}
+	shard = server_next_shard(server, origin, server->shard.index);
+	if (shard < 0) {
+		return server_push_shard_result(server, origin, message, 0, message->payload);
+	}
+	rc = server_forward_command(server, shard, message->source, message->identifier, message->sequence, message->deadline, message->payload);
+	if (rc != 0) {
+		mbus_errorf("can not forward command");
+		goto fail;
+	}
+	return 0;
+fail:	return server_push_shard_result(server, origin, message, -1, NULL);
+}
+
+static int server_handle_shard_command (struct mbus_server *server, struct shard_message *message)
+{
+	int rc;
+	const char *source;
+	struct client *client;
+	struct handler *handler;
+	struct mbus_json *result;
+	result = NULL;
+	if (strcmp(message->identifier, MBUS_SERVER_COMMAND_STATUS) == 0 ||
+	    strcmp(message->identifier, MBUS_SERVER_COMMAND_CLIENTS) == 0) {
+		return server_handle_shard_collect(server, message);
+	}
+	source = mbus_json_get_string_value(message->payload, "source", NULL);
+	handler = mbus_hash_get_string(server->commands, message->identifier);
+	if (strcmp(message->identifier, MBUS_SERVER_COMMAND_CLIENT) == 0) {
+		client = server_find_client_by_identifier(server, source);
+		if (client == NULL) {
+			mbus_errorf("client: %s is not connected", source);
+			rc = -1;
+		} else {
+			result = client_create_status(client);
+			rc = (result == NULL) ? -1 : 0;
+		}
+	} else if (strcmp(message->identifier, MBUS_SERVER_COMMAND_CLOSE) == 0) {
+		rc = server_close_client(server, source);
+	} else if (handler == NULL ||
+		   handler->callback == NULL) {
+		mbus_errorf("command: %s is not registered", message->identifier);
+		rc = -1;
+	} else {
+		result = mbus_json_create_object();
+		if (result == NULL) {
+			mbus_errorf("can not create result");
+			rc = -1;
+		} else {
+			rc = handler->callback(server, handler->context, message->source, message->payload, result);
+		}
+	}
+	rc = server_push_shard_result(server, message->shard, message, rc, result);
+	if (result != NULL) {
+		mbus_json_delete(result);
+	}
+	return rc;
+}
+
+static int server_handle_shard_call (struct mbus_server *server, struct shard_message *message)
+{
+	struct client *client;
+	struct command *command;
+	struct method *request;
+	if (strcmp(message->destination, MBUS_SERVER_IDENTIFIER) == 0) {
+		return server_handle_shard_command(server, message);
+	}
+	client = server_find_client_by_identifier(server, message->destination);
+	if (client == NULL) {
+		mbus_errorf("client %s does not exists", message->destination);
+		goto fail;
+	}
+	TAILQ_FOREACH(command, &client->commands, commands) {
+		if (strcmp(message->identifier, mbus_server_command_get_identifier(command)) == 0) {
+			break;
+		}
+	}
+	if (command == NULL) {
+		mbus_errorf("client: %s does not have such command: %s", message->destination, message->identifier);
+		goto fail;
+	}
+	request = mbus_server_method_create_response(MBUS_METHOD_TYPE_COMMAND, message->source, message->identifier, message->sequence, message->payload, message->attachments, message->nattachments);
+	if (request == NULL) {
+		mbus_errorf("can not create call method");
+		goto fail;
+	}
+	mbus_server_method_set_request_deadline(request, message->deadline);
+	client_push_request(client, request);
+	return 0;
+fail:	return server_push_shard_result(server, message->shard, message, -1, NULL);
+}
+
+static int server_handle_shard_messages (struct mbus_server *server)
+{
+	int rc;
+	struct shard_message *message;
+	struct shard_message *nmessage;
+	rc = 0;
+	for (message = mbus_server_shards_pop(server->shards, server->shard.index); message != NULL; message = nmessage) {
+		nmessage = message->next;
+		if (rc != 0) {
+			mbus_server_shard_message_destroy(message);
 			continue;
 		}
-		compression = client_get_compression(client);
-		if (client_get_results_count(client) > 0) {
-			method = client_pop_result(client);
-			if (method == NULL) {
-				mbus_errorf("could not pop result from client");
+		if (message->type == shard_message_type_event) {
+			rc = server_deliver_event(server, message->source, message->destination, message->identifier, message->priority, message->data, message->length, message->attachments, message->nattachments);
+		} else if (message->type == shard_message_type_call) {
+			rc = server_handle_shard_call(server, message);
+		} else if (message->type == shard_message_type_result) {
+			client_complete_wait(server_find_client_by_identifier(server, message->destination), message->source, message->identifier, message->sequence, message->status, message->payload);
+		} else if (message->type == shard_message_type_closed) {
+			server_fail_waits(server, message->source);
+		} else if (message->type == shard_message_type_stop) {
+			server->running = 0;
+		}
+		if (rc != 0) {
+			mbus_errorf("can not handle shard message");
+		}
+		mbus_server_shard_message_destroy(message);
+	}
+	return rc;
+}
+
+static int server_handle_fd_events (struct mbus_server *server, int fd, unsigned int events, unsigned int revents)
+{
+	int rc;
+	struct client *client;
+	struct listener *listener;
+	enum listener_type listener_type;
+	struct connection *connection;
+	if (revents == 0) {
+		return 0;
+	}
+	mbus_debugf("    fd: %d, events: 0x%08x, revents: 0x%08x", fd, events, revents);
+	if (server->shards != NULL &&
+	    fd == mbus_server_shards_get_fd(server->shards, server->shard.index)) {
+		mbus_debugf("      shard: %u", server->shard.index);
+		rc = server_handle_shard_messages(server);
+		if (rc != 0) {
+			mbus_errorf("can not handle shard messages");
+			goto bail;
+		}
+		return 0;
+	}
+	if (server->workers != NULL &&
+	    fd == mbus_server_workers_get_fd(server->workers)) {
+		mbus_debugf("      workers");
+		rc = server_handle_worker_jobs(server);
+		if (rc != 0) {
+			mbus_errorf("can not handle worker jobs");
+			goto bail;
+		}
+		return 0;
+	}
+	if (mbus_debug_level >= mbus_debug_level_debug) {
+		TAILQ_FOREACH(listener, &server->listeners, listeners) {
+			if (fd == mbus_server_listener_get_fd(listener)) {
+				mbus_debugf("      listener: %s", mbus_server_listener_get_name(listener));
+			}
+		}
+		TAILQ_FOREACH(client, &server->clients, clients) {
+			listener = client_get_listener(client);
+			if (listener == NULL) {
 				continue;
 			}
-			if (strcmp(mbus_server_method_get_request_destination(method), MBUS_SERVER_IDENTIFIER) == 0) {
-				if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CREATE) == 0) {
-					compression = mbus_compress_method_none;
-				}
+			connection = client_get_connection(client);
+			if (connection == NULL) {
+				continue;
 			}
-			string = mbus_server_method_get_result_string(method);
-		} else if (client_get_requests_count(client) > 0) {
-			method = client_pop_request(client);
-			if (method == NULL) {
-				mbus_errorf("could not pop request from client");
+			mbus_debugf("      client: %s, connection: %s, %d", client_get_identifier(client), mbus_server_listener_get_name(listener), mbus_server_connection_get_fd(connection));
+		}
+	}
+	{
+		TAILQ_FOREACH(listener, &server->listeners, listeners) {
+			if (fd != mbus_server_listener_get_fd(listener)) {
 				continue;
 			}
-			string = mbus_server_method_get_request_string(method);
-		} else if (client_get_events_count(client) > 0) {
-			method = client_pop_event(client);
-			if (method == NULL) {
-				mbus_errorf("could not pop event from client");
+			connection = mbus_server_listener_accept(listener);
+			if (connection == NULL) {
+				mbus_errorf("can not accept new connection on listener: %s", mbus_server_listener_get_name(listener));
 				continue;
 			}
-			string = mbus_server_method_get_request_string(method);
-		} else {
-			continue;
+			rc = server_client_connection_establish(server, listener, connection);
+			if (rc != 0) {
+				mbus_errorf("can not establish new connection on listener: %s", mbus_server_listener_get_name(listener));
+				mbus_server_connection_close(connection);
+				goto bail;
+			}
+			mbus_infof("accepted new connection on listener: %s", mbus_server_listener_get_name(listener));
 		}
-		if (string == NULL) {
-			mbus_errorf("can not build string from method event");
-			mbus_server_method_destroy(method);
-			goto bail;
+	}
+	client = server_find_client_by_fd(server, fd);
+	if (client == NULL) {
+		return 0;
+	}
+	listener = client_get_listener(client);
+	if (listener == NULL) {
+		mbus_errorf("client listener is invalid");
+		goto bail;
+	}
+	connection = client_get_connection(client);
+	if (connection == NULL) {
+		mbus_errorf("client_connection is invalid");
+		goto bail;
+	}
+	listener_type = mbus_server_listener_get_type(listener);
+	if (listener_type == listener_type_ws) {
+		return 0;
+	}
+	if (revents & POLLIN) {
+		client_set_dirty(client, client_dirty_in);
+		rc = mbus_server_connection_read(connection, client->buffer_in);
+		if ((rc <= 0) &&
+		    ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			mbus_debugf("can not read data from client");
+			mbus_infof("client: '%s' connection reset by peer", client_get_identifier(client));
+			client_set_connection(client, NULL, client_connection_close_code_connection_closed);
+			return 0;
 		}
-		mbus_debugf("      message: %s, %s", mbus_compress_method_string(compression), string);
-		rc = mbus_buffer_push_string(client->buffer_out, compression, string);
-		if (rc != 0) {
-			mbus_errorf("can not push string");
-			mbus_server_method_destroy(method);
+	}
+	if (revents & POLLOUT) {
+		if (mbus_buffer_get_length(client->buffer_out) <= 0) {
+			mbus_errorf("logic error");
 			goto bail;
 		}
-		mbus_server_method_destroy(method);
+		rc = mbus_server_connection_write(connection, client->buffer_out);
+		if ((rc <= 0) &&
+		    ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			mbus_debugf("can not write string to client");
+			mbus_infof("client: '%s' connection reset by server", client_get_identifier(client));
+			client_set_connection(client, NULL, client_connection_close_code_connection_closed);
+			return 0;
+		}
+	}
+	if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		mbus_infof("client: '%s' connection reset by server", client_get_identifier(client));
+		client_set_connection(client, NULL, client_connection_close_code_connection_closed);
+		return 0;
+	}
+	rc = client_sync_connection_events(client);
+	if (rc != 0) {
+		mbus_errorf("can not sync connection events");
+		goto bail;
 	}
+	return 0;
+bail:	return -1;
+}
+
+static int server_run_poll (struct mbus_server *server, int milliseconds)
+{
+	int rc;
+	unsigned int c;
+	unsigned int n;
+	struct client *client;
+	struct listener *listener;
+	enum listener_type listener_type;
+	struct connection *connection;
 	mbus_debugf("  prepare pollfds (count)");
 	n  = 0;
 	n += server->listeners.count;
 	n += server->clients.count;
 	n += server->ws_pollfds.length;
+	n += (server->shards != NULL) ? 1 : 0;
+	n += (server->workers != NULL) ? 1 : 0;
 	if (n > server->pollfds.size) {
 		struct pollfd *tmp;
 		while (n > server->pollfds.size) {
@@ -2216,6 +4067,20 @@ __attribute__ ((__visibility__("default"))) int mbus_server_run_timeout (struct
 			n += 1;
 		}
 	}
+	if (server->shards != NULL) {
+		server->pollfds.pollfds[n].events = POLLIN;
+		server->pollfds.pollfds[n].revents = 0;
+		server->pollfds.pollfds[n].fd = mbus_server_shards_get_fd(server->shards, server->shard.index);
+		mbus_debugf("    in : shard %u", server->shard.index);
+		n += 1;
+	}
+	if (server->workers != NULL) {
+		server->pollfds.pollfds[n].events = POLLIN;
+		server->pollfds.pollfds[n].revents = 0;
+		server->pollfds.pollfds[n].fd = mbus_server_workers_get_fd(server->workers);
+		mbus_debugf("    in : workers");
+		n += 1;
+	}
 	mbus_debugf("  prepare pollfds (fill clients)");
 	{
 		TAILQ_FOREACH(client, &server->clients, clients) {
@@ -2265,7 +4130,7 @@ __attribute__ ((__visibility__("default"))) int mbus_server_run_timeout (struct
 	}
 	rc = poll(server->pollfds.pollfds, n, milliseconds);
 	if (rc == 0) {
-		goto out;
+		return 0;
 	}
 	if (rc < 0) {
 		mbus_errorf("poll error");
@@ -2273,97 +4138,284 @@ __attribute__ ((__visibility__("default"))) int mbus_server_run_timeout (struct
 	}
 	mbus_debugf("  check poll events");
 	for (c = 0; c < n; c++) {
-		if (server->pollfds.pollfds[c].revents == 0) {
-			continue;
+		rc = server_handle_fd_events(server, server->pollfds.pollfds[c].fd, server->pollfds.pollfds[c].events, server->pollfds.pollfds[c].revents);
+		if (rc != 0) {
+			goto bail;
 		}
-		mbus_debugf("    fd: %d, events: 0x%08x, revents: 0x%08x", server->pollfds.pollfds[c].fd, server->pollfds.pollfds[c].events, server->pollfds.pollfds[c].revents);
-		if (mbus_debug_level >= mbus_debug_level_debug) {
-			TAILQ_FOREACH(listener, &server->listeners, listeners) {
-				if (server->pollfds.pollfds[c].fd == mbus_server_listener_get_fd(listener)) {
-					mbus_debugf("      listener: %s", mbus_server_listener_get_name(listener));
-				}
-			}
-			TAILQ_FOREACH(client, &server->clients, clients) {
-				listener = client_get_listener(client);
-				if (listener == NULL) {
-					continue;
-				}
-				connection = client_get_connection(client);
-				if (connection == NULL) {
-					continue;
-				}
-				mbus_debugf("      client: %s, connection: %s, %d", client_get_identifier(client), mbus_server_listener_get_name(listener), mbus_server_connection_get_fd(connection));
-			}
+	}
+	return 0;
+bail:	return -1;
+}
+
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+
+static int server_run_epoll (struct mbus_server *server, int milliseconds)
+{
+	int rc;
+	int c;
+	unsigned int n;
+	unsigned int events;
+	mbus_debugf("  prepare epoll events (count)");
+	n  = 0;
+	n += server->listeners.count;
+	n += server->clients.count;
+	n += server->ws_pollfds.length;
+	n += (server->shards != NULL) ? 1 : 0;
+	n += (server->workers != NULL) ? 1 : 0;
+	if (n > server->event.size) {
+		struct epoll_event *tmp;
+		while (n > server->event.size) {
+			server->event.size += 1024;
 		}
-		{
-			TAILQ_FOREACH(listener, &server->listeners, listeners) {
-				if (server->pollfds.pollfds[c].fd != mbus_server_listener_get_fd(listener)) {
-					continue;
-				}
-				connection = mbus_server_listener_accept(listener);
-				if (connection == NULL) {
-					mbus_errorf("can not accept new connection on listener: %s", mbus_server_listener_get_name(listener));
-					continue;
-				}
-				rc = server_client_connection_establish(server, listener, connection);
-				if (rc != 0) {
-					mbus_errorf("can not establish new connection on listener: %s", mbus_server_listener_get_name(listener));
-					mbus_server_connection_close(connection);
-					goto bail;
-				}
-				mbus_infof("accepted new connection on listener: %s", mbus_server_listener_get_name(listener));
+		tmp = realloc(server->event.events, sizeof(struct epoll_event) * server->event.size);
+		if (tmp == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		server->event.events = tmp;
+	}
+	rc = epoll_wait(server->event.fd, server->event.events, server->event.size, milliseconds);
+	if (rc == 0) {
+		return 0;
+	}
+	if (rc < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		mbus_errorf("epoll error");
+		goto bail;
+	}
+	mbus_debugf("  check epoll events");
+	for (c = 0; c < rc; c++) {
+		events = 0;
+		if (server->event.events[c].events & EPOLLIN) {
+			events |= POLLIN;
+		}
+		if (server->event.events[c].events & EPOLLOUT) {
+			events |= POLLOUT;
+		}
+		if (server->event.events[c].events & EPOLLERR) {
+			events |= POLLERR;
+		}
+		if (server->event.events[c].events & EPOLLHUP) {
+			events |= POLLHUP;
+		}
+		if (server_handle_fd_events(server, server->event.events[c].data.fd, events, events) != 0) {
+			goto bail;
+		}
+	}
+	return 0;
+bail:	return -1;
+}
+
+#endif
+
+static int client_prepare_out (struct client *client)
+{
+	int rc;
+	int length;
+	int priority;
+	const void *data;
+	struct method *method;
+	struct mbus_buffer *buffer;
+	enum mbus_compress_method compression;
+	enum mbus_method_encoding encoding;
+	compression = client_get_compression(client);
+	encoding = client->encoding;
+	priority = client_select_priority(client);
+	if (priority < 0) {
+		return 0;
+	}
+	if (client_get_results_count(client, priority) > 0) {
+		method = client_pop_result(client, priority);
+		if (method == NULL) {
+			mbus_errorf("could not pop result from client");
+			goto bail;
+		}
+		if (strcmp(mbus_server_method_get_request_destination(method), MBUS_SERVER_IDENTIFIER) == 0) {
+			if (strcmp(mbus_server_method_get_request_identifier(method), MBUS_SERVER_COMMAND_CREATE) == 0) {
+				compression = mbus_compress_method_none;
+				encoding = mbus_method_encoding_json;
 			}
 		}
-		client = server_find_client_by_fd(server, server->pollfds.pollfds[c].fd);
-		if (client == NULL) {
-			continue;
-			mbus_errorf("can not find client by socket");
+		data = mbus_server_method_get_result_data(method, encoding, &length);
+	} else if (client_get_requests_count(client, priority) > 0) {
+		method = client_pop_request(client, priority);
+		if (method == NULL) {
+			mbus_errorf("could not pop request from client");
 			goto bail;
 		}
-		listener = client_get_listener(client);
-		if (listener == NULL) {
-			mbus_errorf("client listener is invalid");
+		if (mbus_server_method_get_request_deadline(method) != 0 &&
+		    !mbus_clock_after(mbus_server_method_get_request_deadline(method), mbus_clock_monotonic())) {
+			/* the caller's wait times out on its own, nobody reads this call's result */
+			mbus_infof("%s call %s expired before it was sent", client_get_identifier(client), mbus_server_method_get_request_identifier(method));
+			mbus_server_method_destroy(method);
+			return 1;
+		}
+		data = mbus_server_method_get_request_data(method, encoding, &length);
+	} else if (client_get_events_count(client, priority) > 0) {
+		method = client_pop_event(client, priority);
+		if (method == NULL) {
+			mbus_errorf("could not pop event from client");
 			goto bail;
 		}
+		if (mbus_server_method_get_frame(method) != NULL) {
+			mbus_debugf("      frame: %s, %d", mbus_compress_method_string(compression), mbus_server_method_get_request_sequence(method));
+			if (client->jobs.out.tqh_first != NULL) {
+				/* queue behind messages still being compressed */
+				mbus_buffer_reset(client->buffer_scratch);
+				rc = client_write_frame(client, client->buffer_scratch, compression, method);
+				if (rc == 0) {
+					rc = client_push_job(client, worker_job_type_data, mbus_compress_method_none, mbus_buffer_get_base(client->buffer_scratch), mbus_buffer_get_length(client->buffer_scratch));
+				}
+			} else {
+				length = mbus_server_frame_get_length(mbus_server_method_get_frame(method), client->encoding);
+				buffer = client_get_buffer_out(client, compression, (length < 0) ? 0 : length);
+				rc = client_write_frame(client, buffer, compression, method);
+			}
+			if (rc != 0) {
+				mbus_errorf("can not push frame");
+				mbus_server_method_destroy(method);
+				goto bail;
+			}
+			mbus_server_method_destroy(method);
+			return 1;
+		}
+		data = mbus_server_method_get_request_data(method, encoding, &length);
+	} else {
+		return 0;
+	}
+	if (data == NULL) {
+		mbus_errorf("can not encode method");
+		mbus_server_method_destroy(method);
+		goto bail;
+	}
+	mbus_debugf("      message: %s, %s, %d", mbus_compress_method_string(compression), mbus_method_encoding_string(encoding), length);
+	buffer = client_get_buffer_out(client, compression, length);
+	if (client->jobs.out.tqh_first != NULL ||
+	    client_offload(client, compression, length)) {
+		rc = client_push_job(client, worker_job_type_compress, compression, data, length);
+	} else if (client_skip_compression(client, compression, length)) {
+		rc = mbus_buffer_push_uncompressed(buffer, data, length);
+	} else if (compression != mbus_compress_method_none &&
+		   client->stream != NULL) {
+		rc = mbus_buffer_push_stream(buffer, client->stream, data, length);
+	} else {
+		rc = mbus_buffer_push_data(buffer, compression, data, length);
+	}
+	if (rc != 0) {
+		mbus_errorf("can not push data");
+		mbus_server_method_destroy(method);
+		goto bail;
+	}
+	mbus_server_method_destroy(method);
+	return 1;
+bail:	return -1;
+}
+
+__attribute__ ((__visibility__("default"))) int mbus_server_run_timeout (struct mbus_server *server, int milliseconds)
+{
+	int rc;
+	int empty;
+	int messages;
+	unsigned long long current;
+	struct mbus_timer *timer;
+	struct client *client;
+	struct client *nclient;
+	struct method *method;
+	struct method *nmethod;
+	struct listener *listener;
+	struct connection *connection;
+	current = mbus_clock_monotonic();
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		return -1;
+	}
+	mbus_debugf("running server");
+	if (server->running == 0) {
+		goto out;
+	}
+	rc = server_handle_methods(server);
+	if (rc != 0) {
+		mbus_errorf("can not handle methods");
+		goto bail;
+	}
+	if (milliseconds < 0 || milliseconds > MBUS_SERVER_DEFAULT_TIMEOUT) {
+		milliseconds = MBUS_SERVER_DEFAULT_TIMEOUT;
+	}
+	mbus_debugf("  check timers");
+	while ((timer = mbus_timers_pop(server->timers, current)) != NULL) {
+		timer->callback(timer, timer->context);
+	}
+	timer = mbus_timers_peek(server->timers);
+	if (timer != NULL) {
+		if (!mbus_clock_after(timer->expires, current)) {
+			milliseconds = 0;
+		} else if (timer->expires - current < (unsigned long long) milliseconds) {
+			milliseconds = timer->expires - current;
+		}
+	}
+	mbus_debugf("  prepare out buffer");
+	TAILQ_FOREACH(client, &server->dirties, dirties) {
+		if ((client->dirty & client_dirty_out) == 0) {
+			continue;
+		}
+		mbus_debugf("    client: %s", client_get_identifier(client));
 		connection = client_get_connection(client);
 		if (connection == NULL) {
-			mbus_errorf("client_connection is invalid");
-			goto bail;
-		}
-		listener_type = mbus_server_listener_get_type(listener);
-		if (listener_type == listener_type_ws) {
+			client->dirty &= ~client_dirty_out;
 			continue;
 		}
-		if (server->pollfds.pollfds[c].revents & POLLIN) {
-			rc = mbus_server_connection_read(connection, client->buffer_in);
-			if ((rc <= 0) &&
-			    ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
-				mbus_debugf("can not read data from client");
-				mbus_infof("client: '%s' connection reset by peer", client_get_identifier(client));
-				client_set_connection(client, NULL, client_connection_close_code_connection_closed);
-				continue;
+		empty = (mbus_buffer_get_length(client->buffer_out) == 0);
+		for (messages = 0; server->options.drain.messages <= 0 || messages < server->options.drain.messages; messages++) {
+			/* the frame being sent in chunks does not hold back smaller messages */
+			if (server->options.drain.bytes > 0 &&
+			    (mbus_buffer_get_length(client->buffer_out) >= (unsigned int) server->options.drain.bytes ||
+			     mbus_buffer_get_length(client->fragment.out) - client->fragment.remaining >= (unsigned int) server->options.drain.bytes)) {
+				break;
 			}
-		}
-		if (server->pollfds.pollfds[c].revents & POLLOUT) {
-			if (mbus_buffer_get_length(client->buffer_out) <= 0) {
-				mbus_errorf("logic error");
+			rc = client_prepare_out(client);
+			if (rc < 0) {
+				mbus_errorf("can not prepare out buffer");
 				goto bail;
 			}
-			rc = mbus_server_connection_write(connection, client->buffer_out);
-			if ((rc <= 0) &&
-			    ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) {
-				mbus_debugf("can not write string to client");
-				mbus_infof("client: '%s' connection reset by server", client_get_identifier(client));
-				client_set_connection(client, NULL, client_connection_close_code_connection_closed);
-				continue;
+			if (rc == 0) {
+				break;
 			}
 		}
-		if (server->pollfds.pollfds[c].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-			mbus_infof("client: '%s' connection reset by server", client_get_identifier(client));
-			client_set_connection(client, NULL, client_connection_close_code_connection_closed);
-			continue;
+		rc = client_push_fragments(client);
+		if (rc != 0) {
+			mbus_errorf("can not prepare out buffer");
+			goto bail;
+		}
+		if (empty &&
+		    mbus_buffer_get_length(client->buffer_out) > 0) {
+			/* writes drained it before, POLLOUT has to be asked for again */
+			rc = client_sync_connection_events(client);
+			if (rc != 0) {
+				mbus_errorf("can not sync connection events");
+				goto bail;
+			}
+		}
+		/* held back by the drain limits, look again on the next pass */
+		if (client->queued.count == 0 &&
+		    mbus_buffer_get_length(client->fragment.out) == 0) {
+			client->dirty &= ~client_dirty_out;
 		}
 	}
+	if (server->event.backend == server_event_backend_epoll) {
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+		rc = server_run_epoll(server, milliseconds);
+#else
+		rc = -1;
+#endif
+	} else {
+		rc = server_run_poll(server, milliseconds);
+	}
+	if (rc != 0) {
+		mbus_errorf("can not run %s event backend", (server->event.backend == server_event_backend_epoll) ? MBUS_SERVER_EVENT_BACKEND_EPOLL : MBUS_SERVER_EVENT_BACKEND_POLL);
+		goto bail;
+	}
 out:
 	{
 		TAILQ_FOREACH(listener, &server->listeners, listeners) {
@@ -2372,12 +4424,17 @@ out:
 			}
 		}
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
+	TAILQ_FOREACH(client, &server->dirties, dirties) {
 		uint8_t *ptr;
 		uint8_t *end;
 		uint8_t *data;
 		uint32_t expected;
 		uint32_t uncompressed;
+		struct mbus_buffer *source;
+		if ((client->dirty & client_dirty_in) == 0) {
+			continue;
+		}
+		client->dirty &= ~client_dirty_in;
 		if (mbus_buffer_get_length(client->buffer_in) < sizeof(expected)) {
 			continue;
 		}
@@ -2385,9 +4442,32 @@ out:
 		mbus_debugf("  length  : %d", mbus_buffer_get_length(client->buffer_in));
 		mbus_debugf("  size    : %d", mbus_buffer_get_size(client->buffer_in));
 		while (1) {
-			char *string;
-			ptr = mbus_buffer_get_base(client->buffer_in);
-			end = ptr + mbus_buffer_get_length(client->buffer_in);
+			uint8_t sentinel;
+			struct worker_job *job;
+			if (client->jobs.in != NULL) {
+				break;
+			}
+			rc = mbus_buffer_assemble_fragment(client->buffer_in, client->fragment.in, &source);
+			if (rc != 0) {
+				mbus_errorf("can not assemble fragments, closing client: '%s' connection", client_get_identifier(client));
+				client_set_connection(client, NULL, client_connection_close_code_internal_error);
+				break;
+			}
+			if (source == NULL) {
+				break;
+			}
+			/*
+			 * frames are parsed in place, keep one spare byte after the
+			 * data so the frame can be terminated for the json parser.
+			 */
+			rc = mbus_buffer_reserve(source, mbus_buffer_get_length(source) + 1);
+			if (rc != 0) {
+				mbus_errorf("can not reserve buffer, closing client: '%s' connection", client_get_identifier(client));
+				client_set_connection(client, NULL, client_connection_close_code_internal_error);
+				break;
+			}
+			ptr = mbus_buffer_get_base(source);
+			end = ptr + mbus_buffer_get_length(source);
 			if (end - ptr < (int32_t) sizeof(expected)) {
 				break;
 			}
@@ -2398,82 +4478,110 @@ out:
 			if (end - ptr < (int32_t) expected) {
 				break;
 			}
-			data = ptr;
+			if (client_get_compression(client) != mbus_compress_method_none) {
+				memcpy(&uncompressed, ptr, sizeof(uncompressed));
+				uncompressed = ntohl(uncompressed);
+			}
 			if (client_get_compression(client) == mbus_compress_method_none) {
 				data = ptr;
 				uncompressed = expected;
+			} else if (client->uncompressed &&
+				   (uncompressed & MBUS_BUFFER_UNCOMPRESSED)) {
+				uncompressed &= ~MBUS_BUFFER_UNCOMPRESSED;
+				if (uncompressed != expected - sizeof(uncompressed)) {
+					mbus_errorf("uncompressed length is invalid, closing client: '%s' connection", client_get_identifier(client));
+					client_set_connection(client, NULL, client_connection_close_code_internal_error);
+					break;
+				}
+				data = ptr + sizeof(uncompressed);
 			} else {
 				int uncompressedlen;
-				memcpy(&uncompressed, ptr, sizeof(uncompressed));
-				uncompressed = ntohl(uncompressed);
 				mbus_debugf("        uncompressed: %d", uncompressed);
-				uncompressedlen = uncompressed;
-				rc = mbus_uncompress_data(client_get_compression(client), (void **) &data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				if (uncompressed > CLIENT_UNCOMPRESSED_MAX) {
+					mbus_errorf("uncompressed length: %u is invalid, closing client: '%s' connection", uncompressed, client_get_identifier(client));
+					client_set_connection(client, NULL, client_connection_close_code_internal_error);
+					break;
+				}
+				if (client_offload(client, client_get_compression(client), uncompressed)) {
+					/* the rest of this client's input waits for the job */
+					job = mbus_server_worker_job_create(worker_job_type_uncompress, client_get_compression(client), ptr + sizeof(uncompressed), expected - sizeof(uncompressed), uncompressed);
+					if (job == NULL) {
+						mbus_errorf("can not create job, closing client: '%s' connection", client_get_identifier(client));
+						client_set_connection(client, NULL, client_connection_close_code_internal_error);
+						break;
+					}
+					job->context = client;
+					rc = mbus_server_workers_submit(server->workers, job);
+					if (rc != 0) {
+						mbus_errorf("can not submit job, closing client: '%s' connection", client_get_identifier(client));
+						mbus_server_worker_job_destroy(job);
+						client_set_connection(client, NULL, client_connection_close_code_internal_error);
+						break;
+					}
+					client->jobs.in = job;
+					rc = mbus_buffer_shift(source, sizeof(uint32_t) + expected);
+					if (rc != 0) {
+						mbus_errorf("can not shift in, closing client: '%s' connection", client_get_identifier(client));
+						client_set_connection(client, NULL, client_connection_close_code_internal_error);
+					}
+					break;
+				}
+				rc = mbus_buffer_reserve(client->buffer_scratch, uncompressed + 1);
 				if (rc != 0) {
-					mbus_errorf("can not uncompress data");
-					goto bail;
+					mbus_errorf("can not reserve buffer, closing client: '%s' connection", client_get_identifier(client));
+					client_set_connection(client, NULL, client_connection_close_code_internal_error);
+					break;
 				}
-				if (uncompressedlen != (int) uncompressed) {
-					mbus_errorf("can not uncompress data");
-					goto bail;
+				data = mbus_buffer_get_base(client->buffer_scratch);
+				uncompressedlen = uncompressed;
+				if (client->stream != NULL) {
+					rc = mbus_uncompress_stream_data_to(client->stream, data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				} else {
+					rc = mbus_uncompress_data_to(client_get_compression(client), data, &uncompressedlen, ptr + sizeof(uncompressed), expected - sizeof(uncompressed));
+				}
+				if (rc != 0 ||
+				    uncompressedlen != (int) uncompressed) {
+					mbus_errorf("can not uncompress data, closing client: '%s' connection", client_get_identifier(client));
+					client_set_connection(client, NULL, client_connection_close_code_internal_error);
+					break;
 				}
 			}
+			sentinel = data[uncompressed];
+			data[uncompressed] = '\0';
 			mbus_debugf("        message: %s, e: %d, u: %d, '%.*s'", mbus_compress_method_string(client_get_compression(client)), expected, uncompressed, uncompressed, data);
-			string = _strndup((char *) data, uncompressed);
-			if (string == NULL) {
-				mbus_errorf("can not allocate memory, closing client: '%s' connection", client_get_identifier(client));
-				client_set_connection(client, NULL, client_connection_close_code_internal_error);
-				goto bail;
-			}
-			rc = server_handle_method(server, client, string);
+			rc = server_handle_method(server, client, (const char *) data, uncompressed);
+			data[uncompressed] = sentinel;
 			if (rc != 0) {
 				mbus_errorf("can not handle request, closing client: '%s' connection", client_get_identifier(client));
 				client_set_connection(client, NULL, client_connection_close_code_internal_error);
-				free(string);
-				if (data != ptr) {
-					free(data);
-				}
 				break;
 			}
-			rc = mbus_buffer_shift(client->buffer_in, sizeof(uint32_t) + expected);
+			rc = mbus_buffer_shift(source, sizeof(uint32_t) + expected);
 			if (rc != 0) {
 				mbus_errorf("can not shift in, closing client: '%s' connection", client_get_identifier(client));
 				client_set_connection(client, NULL, client_connection_close_code_internal_error);
-				free(string);
-				if (data != ptr) {
-					free(data);
-				}
-				goto bail;
-			}
-			free(string);
-			if (data != ptr) {
-				free(data);
+				break;
 			}
 		}
 	}
-	rc = server_handle_methods(server);
-	if (rc != 0) {
-		mbus_errorf("can not handle methods");
-		goto bail;
-	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_connection(client) == NULL) {
-			continue;
-		}
-		if ((client_get_status(client) & client_status_accepted) != 0) {
-			continue;
-		}
-		client_set_status(client, client_get_status(client) | client_status_accepted);
-		mbus_infof("client: '%s' accepted to server", client_get_identifier(client));
+	rc = server_handle_methods(server);
+	if (rc != 0) {
+		mbus_errorf("can not handle methods");
+		goto bail;
 	}
-	TAILQ_FOREACH(client, &server->clients, clients) {
-		if (client_get_connection(client) == NULL) {
+	TAILQ_FOREACH(client, &server->dirties, dirties) {
+		if ((client->dirty & client_dirty_status) == 0) {
 			continue;
 		}
-		if (client_get_identifier(client) == NULL) {
+		client->dirty &= ~client_dirty_status;
+		if (client_get_connection(client) == NULL) {
 			continue;
 		}
 		if ((client_get_status(client) & client_status_accepted) == 0) {
+			client_set_status(client, client_get_status(client) | client_status_accepted);
+			mbus_infof("client: '%s' accepted to server", client_get_identifier(client));
+		}
+		if (client_get_identifier(client) == NULL) {
 			continue;
 		}
 		if ((client_get_status(client) & client_status_connected) != 0) {
@@ -2487,8 +4595,14 @@ out:
 			goto bail;
 		}
 	}
-	TAILQ_FOREACH_SAFE(client, &server->clients, clients, nclient) {
-		if (client_get_connection(client) != NULL) {
+	TAILQ_FOREACH_SAFE(client, &server->dirties, dirties, nclient) {
+		if ((client->dirty & client_dirty_closed) == 0 ||
+		    client_get_connection(client) != NULL) {
+			client->dirty &= ~client_dirty_closed;
+			if (client->dirty == 0) {
+				TAILQ_REMOVE(&server->dirties, client, dirties);
+				client->dirty_listed = 0;
+			}
 			continue;
 		}
 		mbus_infof("client: '%s' disconnected from server", client_get_identifier(client));
@@ -2497,20 +4611,18 @@ out:
 			if (mbus_server_method_get_source(method) != client) {
 				continue;
 			}
-			if (strcmp(mbus_server_method_get_request_type(method), MBUS_METHOD_TYPE_EVENT) == 0) {
+			if (mbus_server_method_get_type(method) == method_type_event) {
 				continue;
 			}
 			TAILQ_REMOVE(&server->methods, method, methods);
 			mbus_server_method_destroy(method);
 		}
-		TAILQ_FOREACH_SAFE(wclient, &server->clients, clients, nwclient) {
-			TAILQ_FOREACH_SAFE(method, &wclient->waits, methods, nmethod) {
-				if (client_get_identifier(client) != NULL &&
-				    strcmp(mbus_server_method_get_request_destination(method), client_get_identifier(client)) == 0) {
-					TAILQ_REMOVE(&wclient->waits, method, methods);
-					mbus_server_method_set_result_code(method, -1);
-					client_push_result(wclient, method);
-				}
+		if (client_get_identifier(client) != NULL) {
+			server_fail_waits(server, client_get_identifier(client));
+			rc = server_forward_closed(server, client_get_identifier(client));
+			if (rc != 0) {
+				mbus_errorf("can not forward closed client");
+				goto bail;
 			}
 		}
 		if ((client_get_status(client) & client_status_connected) != 0) {
@@ -2548,15 +4660,135 @@ __attribute__ ((__visibility__("default"))) int mbus_server_run (struct mbus_ser
 bail:	return -1;
 }
 
+__attribute__ ((__visibility__("default"))) int mbus_server_register_command (struct mbus_server *server, const char *identifier, int (*callback) (struct mbus_server *server, void *context, const char *source, struct mbus_json *payload, struct mbus_json *result), void *context)
+{
+	int rc;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (callback == NULL) {
+		mbus_errorf("callback is null");
+		goto bail;
+	}
+	rc = server_add_handler(server, identifier, NULL, callback, context);
+	if (rc != 0) {
+		mbus_errorf("can not register command: %s", identifier);
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+__attribute__ ((__visibility__("default"))) int mbus_server_unregister_command (struct mbus_server *server, const char *identifier)
+{
+	struct handler *handler;
+	if (server == NULL) {
+		mbus_errorf("server is null");
+		goto bail;
+	}
+	if (identifier == NULL) {
+		mbus_errorf("identifier is null");
+		goto bail;
+	}
+	handler = mbus_hash_get_string(server->commands, identifier);
+	if (handler == NULL) {
+		mbus_errorf("command: %s is not registered", identifier);
+		goto bail;
+	}
+	if (handler->builtin != NULL) {
+		mbus_errorf("command: %s is builtin", identifier);
+		goto bail;
+	}
+	mbus_hash_del_string(server->commands, identifier);
+	TAILQ_REMOVE(&server->handlers, handler, handlers);
+	free(handler);
+	return 0;
+bail:	return -1;
+}
+
+static void * server_shard_thread (void *arg)
+{
+	int rc;
+	struct mbus_server *server;
+	server = arg;
+	mbus_infof("running shard: %u", server->shard.index);
+	rc = mbus_server_run(server);
+	if (rc != 0) {
+		mbus_errorf("can not run shard: %u", server->shard.index);
+	}
+	return NULL;
+}
+
+static int server_start_shards (struct mbus_server *server)
+{
+	int rc;
+	unsigned int s;
+	sigset_t mask;
+	sigset_t omask;
+	struct mbus_server *shard;
+	/* signals are for the application's thread, not the shards */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	for (s = 1; s < mbus_server_shards_get_count(server->shards); s++) {
+		shard = server->shard.servers[s];
+		rc = pthread_create(&shard->shard.thread, NULL, server_shard_thread, shard);
+		if (rc != 0) {
+			mbus_errorf("can not create shard: %u thread", s);
+			goto bail;
+		}
+		shard->shard.started = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	return 0;
+bail:	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	return -1;
+}
+
+static void server_stop_shards (struct mbus_server *server)
+{
+	int rc;
+	unsigned int s;
+	struct mbus_server *shard;
+	struct shard_message *message;
+	for (s = 1; s < mbus_server_shards_get_count(server->shards); s++) {
+		shard = server->shard.servers[s];
+		if (shard == NULL) {
+			continue;
+		}
+		if (shard->shard.started == 1) {
+			message = mbus_server_shard_message_create(shard_message_type_stop, server->shard.index, NULL, NULL, NULL, 0, 0, NULL);
+			if (message == NULL) {
+				mbus_errorf("can not create shard message, leaving shard: %u running", s);
+				continue;
+			}
+			rc = mbus_server_shards_push(server->shards, s, message);
+			if (rc != 0) {
+				mbus_errorf("can not push shard message, leaving shard: %u running", s);
+				mbus_server_shard_message_destroy(message);
+				continue;
+			}
+			pthread_join(shard->shard.thread, NULL);
+		}
+		mbus_server_destroy(shard);
+		server->shard.servers[s] = NULL;
+	}
+}
+
 __attribute__ ((__visibility__("default"))) void mbus_server_destroy (struct mbus_server *server)
 {
 	struct client *client;
 	struct method *method;
+	struct handler *handler;
 	struct listener *listener;
 	if (server == NULL) {
 		return;
 	}
 	mbus_infof("destroying server");
+	if (server->shard.servers != NULL) {
+		server_stop_shards(server);
+		free(server->shard.servers);
+	}
 	while (server->methods.tqh_first != NULL) {
 		method = server->methods.tqh_first;
 		TAILQ_REMOVE(&server->methods, server->methods.tqh_first, methods);
@@ -2572,17 +4804,56 @@ __attribute__ ((__visibility__("default"))) void mbus_server_destroy (struct mbu
 		TAILQ_REMOVE(&server->clients, server->clients.tqh_first, clients);
 		client_destroy(client);
 	}
+	if (server->timers != NULL) {
+		mbus_timers_destroy(server->timers);
+	}
+	if (server->workers != NULL) {
+		mbus_server_workers_destroy(server->workers);
+	}
+	if (server->dictionary != NULL) {
+		mbus_compress_dictionary_destroy(server->dictionary);
+	}
 	if (server->pollfds.pollfds != NULL) {
 		free(server->pollfds.pollfds);
 	}
 	if (server->ws_pollfds.pollfds != NULL) {
 		free(server->ws_pollfds.pollfds);
 	}
+	if (server->fds.clients != NULL) {
+		free(server->fds.clients);
+	}
+	if (server->identifiers != NULL) {
+		mbus_hash_destroy(server->identifiers);
+	}
+	if (server->routes != NULL) {
+		mbus_hash_destroy(server->routes);
+	}
+	while (server->handlers.tqh_first != NULL) {
+		handler = server->handlers.tqh_first;
+		TAILQ_REMOVE(&server->handlers, server->handlers.tqh_first, handlers);
+		free(handler);
+	}
+	if (server->commands != NULL) {
+		mbus_hash_destroy(server->commands);
+	}
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+	if (server->event.fd >= 0) {
+		close(server->event.fd);
+	}
+	if (server->event.events != NULL) {
+		free(server->event.events);
+	}
+#endif
 	if (server->password != NULL) {
 	        free(server->password);
 	}
+	if (server->shards != NULL && server->shard.index == 0) {
+		mbus_server_shards_destroy(server->shards);
+	}
 #if defined(SSL_ENABLE) && (SSL_ENABLE == 1)
-	EVP_cleanup();
+	if (server->shard.index == 0) {
+		EVP_cleanup();
+	}
 #endif
 	free(server);
 }
@@ -2633,6 +4904,28 @@ __attribute__ ((__visibility__("default"))) int mbus_server_options_default (str
 
 	options->password = NULL;
 
+	options->event_backend = MBUS_SERVER_EVENT_BACKEND;
+
+	options->drain.messages = MBUS_SERVER_DRAIN_MESSAGES;
+	options->drain.bytes = MBUS_SERVER_DRAIN_BYTES;
+
+	options->shards = MBUS_SERVER_SHARDS;
+
+	options->compress.workers = MBUS_SERVER_COMPRESS_WORKERS;
+	options->compress.offload = MBUS_SERVER_COMPRESS_OFFLOAD;
+	options->compress.minimum = MBUS_SERVER_COMPRESS_MINIMUM;
+	options->compress.dictionary = NULL;
+
+	options->fragment.size = MBUS_SERVER_FRAGMENT_SIZE;
+
+	options->priority.weights = MBUS_SERVER_PRIORITY_WEIGHTS;
+
+	options->queue.high.bytes = MBUS_SERVER_QUEUE_HIGH_BYTES;
+	options->queue.low.bytes = MBUS_SERVER_QUEUE_LOW_BYTES;
+	options->queue.high.count = MBUS_SERVER_QUEUE_HIGH_COUNT;
+	options->queue.low.count = MBUS_SERVER_QUEUE_LOW_COUNT;
+	options->queue.policy = MBUS_SERVER_QUEUE_POLICY;
+
 	return 0;
 bail:	return -1;
 }
@@ -2745,6 +5038,51 @@ __attribute__ ((__visibility__("default"))) int mbus_server_options_from_argv (s
                         case OPTION_SERVER_PASSWORD:
                                 options->password = optarg;
                                 break;
+			case OPTION_SERVER_EVENT_BACKEND:
+				options->event_backend = optarg;
+				break;
+			case OPTION_SERVER_DRAIN_MESSAGES:
+				options->drain.messages = atoi(optarg);
+				break;
+			case OPTION_SERVER_DRAIN_BYTES:
+				options->drain.bytes = atoi(optarg);
+				break;
+			case OPTION_SERVER_SHARDS:
+				options->shards = atoi(optarg);
+				break;
+			case OPTION_SERVER_COMPRESS_WORKERS:
+				options->compress.workers = atoi(optarg);
+				break;
+			case OPTION_SERVER_COMPRESS_OFFLOAD:
+				options->compress.offload = atoi(optarg);
+				break;
+			case OPTION_SERVER_COMPRESS_MINIMUM:
+				options->compress.minimum = atoi(optarg);
+				break;
+			case OPTION_SERVER_ZSTD_DICTIONARY:
+				options->compress.dictionary = optarg;
+				break;
+			case OPTION_SERVER_FRAGMENT_SIZE:
+				options->fragment.size = atoi(optarg);
+				break;
+			case OPTION_SERVER_PRIORITY_WEIGHTS:
+				options->priority.weights = optarg;
+				break;
+			case OPTION_SERVER_QUEUE_HIGH_BYTES:
+				options->queue.high.bytes = atoi(optarg);
+				break;
+			case OPTION_SERVER_QUEUE_LOW_BYTES:
+				options->queue.low.bytes = atoi(optarg);
+				break;
+			case OPTION_SERVER_QUEUE_HIGH_COUNT:
+				options->queue.high.count = atoi(optarg);
+				break;
+			case OPTION_SERVER_QUEUE_LOW_COUNT:
+				options->queue.low.count = atoi(optarg);
+				break;
+			case OPTION_SERVER_QUEUE_POLICY:
+				options->queue.policy = optarg;
+				break;
 			case OPTION_HELP:
 				mbus_server_usage();
 				goto bail;
@@ -2789,39 +5127,74 @@ bail:	if (server != NULL) {
 	return NULL;
 }
 
-__attribute__ ((__visibility__("default"))) struct mbus_server * mbus_server_create_with_options (const struct mbus_server_options *_options)
+static struct mbus_server * server_create (const struct mbus_server_options *options, struct shards *shards, unsigned int index)
 {
 	struct mbus_server *server;
 
 	server = NULL;
 
-	{
-		struct sigaction sa;
-		memset(&sa, 0, sizeof(struct sigaction));
-		sa.sa_handler = SIG_IGN;
-		sa.sa_flags = 0;
-		sigaction(SIGPIPE, &sa, 0);
-	}
-
-#if defined(SSL_ENABLE) && (SSL_ENABLE == 1)
-	SSL_library_init();
-	SSL_load_error_strings();
-#endif
 	server = malloc(sizeof(struct mbus_server));
 	if (server == NULL) {
 		mbus_errorf("can not allocate memory");
 		goto bail;
 	}
-	g_server = server;
 	memset(server, 0, sizeof(struct mbus_server));
+	server->shard.index = index;
 	TAILQ_INIT(&server->clients);
+	TAILQ_INIT(&server->dirties);
 	TAILQ_INIT(&server->methods);
 	TAILQ_INIT(&server->listeners);
-
-	mbus_server_options_default(&server->options);
-	if (_options != NULL) {
-		memcpy(&server->options, _options, sizeof(struct mbus_server_options));
+	server->identifiers = mbus_hash_create();
+	if (server->identifiers == NULL) {
+		mbus_errorf("can not create identifier index");
+		goto bail;
+	}
+	server->routes = mbus_hash_create();
+	if (server->routes == NULL) {
+		mbus_errorf("can not create route index");
+		goto bail;
+	}
+	server->timers = mbus_timers_create();
+	if (server->timers == NULL) {
+		mbus_errorf("can not create timers");
+		goto bail;
+	}
+	TAILQ_INIT(&server->handlers);
+	server->commands = mbus_hash_create();
+	if (server->commands == NULL) {
+		mbus_errorf("can not create command index");
+		goto bail;
+	}
+	{
+		unsigned int i;
+		static const struct {
+			const char *identifier;
+			int (*builtin) (struct mbus_server *server, struct method *method);
+		} builtins[] = {
+			{ MBUS_SERVER_COMMAND_CREATE,		server_handle_command_create },
+			{ MBUS_SERVER_COMMAND_SUBSCRIBE,	server_handle_command_subscribe },
+			{ MBUS_SERVER_COMMAND_UNSUBSCRIBE,	server_handle_command_unsubscribe },
+			{ MBUS_SERVER_COMMAND_REGISTER,		server_handle_command_register },
+			{ MBUS_SERVER_COMMAND_UNREGISTER,	server_handle_command_unregister },
+			{ MBUS_SERVER_COMMAND_RESULT,		server_handle_command_result },
+			{ MBUS_SERVER_COMMAND_EVENT,		server_handle_command_event },
+			{ MBUS_SERVER_COMMAND_STATUS,		server_handle_command_status },
+			{ MBUS_SERVER_COMMAND_CLIENT,		server_handle_command_client },
+			{ MBUS_SERVER_COMMAND_CLIENTS,		server_handle_command_clients },
+			{ MBUS_SERVER_COMMAND_CLOSE,		server_handle_command_close },
+		};
+		for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+			if (server_add_handler(server, builtins[i].identifier, builtins[i].builtin, NULL, NULL) != 0) {
+				mbus_errorf("can not add builtin command: %s", builtins[i].identifier);
+				goto bail;
+			}
+		}
 	}
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+	server->event.fd = -1;
+#endif
+
+	memcpy(&server->options, options, sizeof(struct mbus_server_options));
 
 	if (server->options.tcp.enabled == 0 &&
 	    server->options.uds.enabled == 0 &&
@@ -2850,6 +5223,82 @@ __attribute__ ((__visibility__("default"))) struct mbus_server * mbus_server_cre
 	        server->password = NULL;
 	}
 
+	{
+		unsigned int i;
+		const char *event_backend;
+		event_backend = server->options.event_backend;
+		if (event_backend == NULL) {
+			event_backend = MBUS_SERVER_EVENT_BACKEND;
+		}
+		for (i = 0; i < sizeof(event_backends) / sizeof(event_backends[0]); i++) {
+			if (strcmp(event_backends[i].name, event_backend) == 0) {
+				break;
+			}
+		}
+		if (i >= sizeof(event_backends) / sizeof(event_backends[0])) {
+			mbus_errorf("event backend: %s is invalid", event_backend);
+			goto bail;
+		}
+		server->event.backend = event_backends[i].value;
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+		if (server->event.backend == server_event_backend_epoll) {
+			server->event.fd = epoll_create1(EPOLL_CLOEXEC);
+			if (server->event.fd < 0) {
+				mbus_errorf("can not create epoll: %s", strerror(errno));
+				goto bail;
+			}
+		}
+#endif
+		mbus_infof("using event backend: '%s'", event_backends[i].name);
+	}
+
+	{
+		int n;
+		const char *weights;
+		weights = server->options.priority.weights;
+		if (weights == NULL) {
+			weights = MBUS_SERVER_PRIORITY_WEIGHTS;
+		}
+		n = sscanf(weights, "%d,%d,%d",
+				&server->priority.weights[MBUS_METHOD_PRIORITY_CONTROL],
+				&server->priority.weights[MBUS_METHOD_PRIORITY_COMMAND],
+				&server->priority.weights[MBUS_METHOD_PRIORITY_BULK]);
+		if (n != CLIENT_PRIORITY_COUNT ||
+		    server->priority.weights[MBUS_METHOD_PRIORITY_CONTROL] < 0 ||
+		    server->priority.weights[MBUS_METHOD_PRIORITY_COMMAND] < 0 ||
+		    server->priority.weights[MBUS_METHOD_PRIORITY_BULK] < 0) {
+			mbus_errorf("priority weights: %s is invalid", weights);
+			goto bail;
+		}
+	}
+
+	{
+		unsigned int i;
+		const char *policy;
+		policy = server->options.queue.policy;
+		if (policy == NULL) {
+			policy = MBUS_SERVER_QUEUE_POLICY;
+		}
+		for (i = 0; i < sizeof(queue_policies) / sizeof(queue_policies[0]); i++) {
+			if (strcmp(queue_policies[i].name, policy) == 0) {
+				break;
+			}
+		}
+		if (i >= sizeof(queue_policies) / sizeof(queue_policies[0])) {
+			mbus_errorf("queue policy: %s is invalid", policy);
+			goto bail;
+		}
+		server->queue.policy = queue_policies[i].value;
+		if (server->options.queue.low.bytes <= 0 ||
+		    server->options.queue.low.bytes > server->options.queue.high.bytes) {
+			server->options.queue.low.bytes = server->options.queue.high.bytes;
+		}
+		if (server->options.queue.low.count <= 0 ||
+		    server->options.queue.low.count > server->options.queue.high.count) {
+			server->options.queue.low.count = server->options.queue.high.count;
+		}
+	}
+
 	if (server->options.tcp.enabled == 1) {
 		struct listener *listener;
 		struct listener_tcp_options listener_tcp_options;
@@ -2859,6 +5308,7 @@ __attribute__ ((__visibility__("default"))) struct mbus_server * mbus_server_cre
 		listener_tcp_options.port        = server->options.tcp.port;
 		listener_tcp_options.certificate = NULL;
 		listener_tcp_options.privatekey  = NULL;
+		listener_tcp_options.reuseport   = (shards != NULL);
 		listener = mbus_server_listener_tcp_create(&listener_tcp_options);
 		if (listener == NULL) {
 			mbus_errorf("can not create listener: tcp");
@@ -2986,12 +5436,151 @@ __attribute__ ((__visibility__("default"))) struct mbus_server * mbus_server_cre
 			goto bail;
 		}
 	}
+	{
+		int rc;
+		int lfd;
+		struct listener *listener;
+		TAILQ_FOREACH(listener, &server->listeners, listeners) {
+			lfd = mbus_server_listener_get_fd(listener);
+			if (lfd < 0) {
+				continue;
+			}
+			rc = server_event_ctl(server, server_event_op_add, lfd, POLLIN);
+			if (rc != 0) {
+				mbus_errorf("can not add listener: %s", mbus_server_listener_get_name(listener));
+				goto bail;
+			}
+		}
+	}
+	if (server->options.compress.workers > 0) {
+		int rc;
+		server->workers = mbus_server_workers_create(server->options.compress.workers);
+		if (server->workers == NULL) {
+			mbus_errorf("can not create compression workers");
+			goto bail;
+		}
+		rc = server_event_ctl(server, server_event_op_add, mbus_server_workers_get_fd(server->workers), POLLIN);
+		if (rc != 0) {
+			mbus_errorf("can not add compression workers");
+			goto bail;
+		}
+		mbus_infof("using %d compression workers", server->options.compress.workers);
+	}
+	if (server->options.compress.dictionary != NULL) {
+		server->dictionary = mbus_compress_dictionary_create_from_file(mbus_compress_method_zstd, server->options.compress.dictionary);
+		if (server->dictionary == NULL) {
+			mbus_errorf("can not load zstd dictionary: %s", server->options.compress.dictionary);
+			goto bail;
+		}
+		mbus_infof("using zstd dictionary: %u", mbus_compress_dictionary_get_id(server->dictionary));
+	}
+	if (shards != NULL) {
+		int rc;
+		rc = server_event_ctl(server, server_event_op_add, mbus_server_shards_get_fd(shards, index), POLLIN);
+		if (rc != 0) {
+			mbus_errorf("can not add shard: %u", index);
+			goto bail;
+		}
+	}
+	server->shards = shards;
 	server->running = 1;
 	return server;
 bail:	mbus_server_destroy(server);
 	return NULL;
 }
 
+__attribute__ ((__visibility__("default"))) struct mbus_server * mbus_server_create_with_options (const struct mbus_server_options *_options)
+{
+	int rc;
+	unsigned int s;
+	struct shards *shards;
+	struct mbus_server *server;
+	struct mbus_server_options options;
+
+	server = NULL;
+	shards = NULL;
+
+	{
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(struct sigaction));
+		sa.sa_handler = SIG_IGN;
+		sa.sa_flags = 0;
+		sigaction(SIGPIPE, &sa, 0);
+	}
+
+#if defined(SSL_ENABLE) && (SSL_ENABLE == 1)
+	SSL_library_init();
+	SSL_load_error_strings();
+#endif
+
+	mbus_server_options_default(&options);
+	if (_options != NULL) {
+		memcpy(&options, _options, sizeof(struct mbus_server_options));
+	}
+
+	if (options.shards <= 0 || options.shards > MBUS_SERVER_SHARDS_MAX) {
+		mbus_errorf("shard count: %d is invalid", options.shards);
+		goto bail;
+	}
+	if (options.shards > 1) {
+		if (options.tcp.enabled == 0) {
+			mbus_errorf("shards need tcp protocol enabled");
+			goto bail;
+		}
+		shards = mbus_server_shards_create(options.shards);
+		if (shards == NULL) {
+			mbus_errorf("can not create shards");
+			goto bail;
+		}
+	}
+
+	server = server_create(&options, shards, 0);
+	if (server == NULL) {
+		mbus_errorf("can not create server");
+		goto bail;
+	}
+	g_server = server;
+
+	if (shards != NULL) {
+		/*
+		 * primary shard owns every listener, the others accept from
+		 * the tcp port only, which the kernel balances between them.
+		 */
+		options.uds.enabled = 0;
+		options.ws.enabled = 0;
+		options.tcps.enabled = 0;
+		options.udss.enabled = 0;
+		options.wss.enabled = 0;
+		server->shard.servers = malloc(sizeof(struct mbus_server *) * options.shards);
+		if (server->shard.servers == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		memset(server->shard.servers, 0, sizeof(struct mbus_server *) * options.shards);
+		server->shard.servers[0] = server;
+		for (s = 1; s < (unsigned int) options.shards; s++) {
+			server->shard.servers[s] = server_create(&options, shards, s);
+			if (server->shard.servers[s] == NULL) {
+				mbus_errorf("can not create shard: %u", s);
+				goto bail;
+			}
+		}
+		rc = server_start_shards(server);
+		if (rc != 0) {
+			mbus_errorf("can not start shards");
+			goto bail;
+		}
+		mbus_infof("running %d shards", options.shards);
+	}
+	return server;
+bail:	if (server != NULL) {
+		mbus_server_destroy(server);
+	} else if (shards != NULL) {
+		mbus_server_shards_destroy(shards);
+	}
+	return NULL;
+}
+
 __attribute__ ((__visibility__("default"))) int mbus_server_tcp_enabled (struct mbus_server *server)
 {
 	if (server == NULL) {
@@ -68,6 +68,43 @@
 
 #define MBUS_SERVER_DEFAULT_TIMEOUT		10000
 
+#define MBUS_SERVER_EVENT_BACKEND_POLL		"poll"
+#define MBUS_SERVER_EVENT_BACKEND_EPOLL		"epoll"
+
+#if defined(EPOLL_ENABLE) && (EPOLL_ENABLE == 1)
+#define MBUS_SERVER_EVENT_BACKEND		MBUS_SERVER_EVENT_BACKEND_EPOLL
+#else
+#define MBUS_SERVER_EVENT_BACKEND		MBUS_SERVER_EVENT_BACKEND_POLL
+#endif
+
+#define MBUS_SERVER_DRAIN_MESSAGES		256
+#define MBUS_SERVER_DRAIN_BYTES			262144
+
+#define MBUS_SERVER_SHARDS			1
+
+#define MBUS_SERVER_COMPRESS_WORKERS		0
+#define MBUS_SERVER_COMPRESS_OFFLOAD		16384
+#define MBUS_SERVER_COMPRESS_MINIMUM		0
+
+#define MBUS_SERVER_FRAGMENT_SIZE		65536
+
+/* control, command and bulk weights, 0 drains the class strictly first */
+#define MBUS_SERVER_PRIORITY_WEIGHTS		"0,4,1"
+
+#define MBUS_SERVER_QUEUE_POLICY_DROP_OLDEST	"drop-oldest"
+#define MBUS_SERVER_QUEUE_POLICY_DROP_NEWEST	"drop-newest"
+#define MBUS_SERVER_QUEUE_POLICY_CONFLATE	"conflate"
+#define MBUS_SERVER_QUEUE_POLICY_DISCONNECT	"disconnect"
+
+/* per client outbound limits, 0 disables a mark. the policy applies
+ * from a high mark until both low marks are reached again.
+ */
+#define MBUS_SERVER_QUEUE_HIGH_BYTES		67108864
+#define MBUS_SERVER_QUEUE_LOW_BYTES		33554432
+#define MBUS_SERVER_QUEUE_HIGH_COUNT		65536
+#define MBUS_SERVER_QUEUE_LOW_COUNT		32768
+#define MBUS_SERVER_QUEUE_POLICY		MBUS_SERVER_QUEUE_POLICY_DISCONNECT
+
 #define MBUS_SERVER_IDENTIFIER			"org.mbus.server"
 #define MBUS_SERVER_CLIENT_IDENTIFIER_PREFIX	"org.mbus.client."
 
@@ -83,8 +120,19 @@
  *   },
  *   "compressions": {
  *     "none",
- *     "zlib"
+ *     "zlib",
+ *     "zlib-stream",
+ *     "lz4",
+ *     "zstd"
+ *   },
+ *   "dictionary": zstd dictionary id, optional
+ *   "uncompressed": true if small messages may be sent uncompressed
+ *   "encodings": {
+ *     "binary",
+ *     "json"
  *   }
+ *   "fragment": largest chunk size, 0 or missing if fragments are not supported
+ *   "sequence": largest sequence end, missing for MBUS_METHOD_SEQUENCE_END
  * }
  *
  * output:
@@ -95,7 +143,12 @@
  *     "timeout": timeout
  *     "threshold": threshold
  *   },
- *   "compression": compression
+ *   "compression": compression,
+ *   "dictionary": zstd dictionary id, if both sides have it
+ *   "uncompressed": uncompressed,
+ *   "encoding": encoding,
+ *   "fragment": chunk size used by both sides, 0 if disabled
+ *   "sequence": sequence end the client wraps at
  * }
  */
 #define MBUS_SERVER_COMMAND_CREATE		"command.create"
@@ -106,6 +159,7 @@
  * {
  *   "destination": "destination",
  *   "identifier": "identifier",
+ *   "priority": MBUS_METHOD_PRIORITY_*, optional
  *   "payload"     : {
  *     "comment": "event specific data object goes here"
  *   }
@@ -201,6 +255,12 @@
  *   "clients": [
  *     {
  *       "source": "application name",
+ *       "queue": {
+ *         "count": queued messages,
+ *         "bytes": pending out bytes,
+ *         "dropped": messages dropped by the queue policy,
+ *         "congested": true between the high and low marks
+ *       },
  *       "subscriptions": [
  *         {
  *           "source": "application name",
@@ -252,6 +312,12 @@
  * {
  *   "source": "application name",
  *   "address": "address",
+ *   "queue": {
+ *     "count": queued messages,
+ *     "bytes": pending out bytes,
+ *     "dropped": messages dropped by the queue policy,
+ *     "congested": true between the high and low marks
+ *   },
  *   "subscriptions": [
  *     {
  *       "source": "application name",
@@ -363,6 +429,7 @@
  */
 #define MBUS_SERVER_EVENT_UNREGISTERED		"org.mbus.server.event.unregistered"
 
+struct mbus_json;
 struct mbus_server;
 
 struct mbus_server_options {
@@ -403,6 +470,35 @@ struct mbus_server_options {
 		const char *privatekey;
 	} wss;
 	char *password;
+	const char *event_backend;
+	struct {
+		int messages;
+		int bytes;
+	} drain;
+	int shards;
+	struct {
+		int workers;
+		int offload;
+		int minimum;
+		const char *dictionary;
+	} compress;
+	struct {
+		int size;
+	} fragment;
+	struct {
+		const char *weights;
+	} priority;
+	struct {
+		struct {
+			int bytes;
+			int count;
+		} high;
+		struct {
+			int bytes;
+			int count;
+		} low;
+		const char *policy;
+	} queue;
 };
 
 void mbus_server_usage (void);
@@ -417,6 +513,16 @@ void mbus_server_destroy (struct mbus_server *server);
 int mbus_server_run (struct mbus_server *server);
 int mbus_server_run_timeout (struct mbus_server *server, int milliseconds);
 
+/* registers a command served by the server itself, reachable with
+ * destination MBUS_SERVER_IDENTIFIER. callback is called with the
+ * request payload and an empty result object to fill, return value
+ * is sent as the result status. builtin commands can not be replaced.
+ * with shards, calls arriving on any shard are served by the thread
+ * running mbus_server_run.
+ */
+int mbus_server_register_command (struct mbus_server *server, const char *identifier, int (*callback) (struct mbus_server *server, void *context, const char *source, struct mbus_json *payload, struct mbus_json *result), void *context);
+int mbus_server_unregister_command (struct mbus_server *server, const char *identifier);
+
 int mbus_server_tcp_enabled (struct mbus_server *server);
 const char * mbus_server_tcp_address (struct mbus_server *server);
 int mbus_server_tcp_port (struct mbus_server *server);
@@ -0,0 +1,579 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MBUS_DEBUG_NAME	"mbus-shard"
+
+#include "mbus/debug.h"
+#include "mbus/tailq.h"
+#include "mbus/hash.h"
+#include "mbus/json.h"
+#include "mbus/method.h"
+
+#include "shard.h"
+
+/*
+ * every shard has an inbox other shards push messages to. the inbox is a
+ * lock free stack, producers link messages with compare and swap and the
+ * owner takes the whole stack with a single exchange, then reverses it
+ * back into push order. a pipe wakes the owner's event loop, it is written
+ * only when the inbox goes from idle to signalled.
+ *
+ * identifier and route indexes are shared by all shards, they are read on
+ * every forwarded message and written on connect, subscribe and their
+ * reverse, so they are kept behind a read write lock.
+ */
+
+struct inbox {
+	struct shard_message *head;
+	int signalled;
+	int fds[2];
+};
+
+TAILQ_HEAD(routes, route);
+struct route {
+	TAILQ_ENTRY(route) routes;
+	unsigned long long shards;
+};
+
+struct shards {
+	unsigned int count;
+	struct inbox *inboxes;
+	pthread_rwlock_t lock;
+	struct mbus_hash *identifiers;
+	struct mbus_hash *routes;
+	struct routes route_list;
+};
+
+static char * route_key (char *buffer, unsigned int size, const char *source, const char *event, unsigned int *length)
+{
+	char *key;
+	unsigned int slength;
+	unsigned int elength;
+	slength = strlen(source);
+	elength = strlen(event);
+	*length = slength + 1 + elength;
+	key = buffer;
+	if (*length > size) {
+		key = malloc(*length);
+		if (key == NULL) {
+			mbus_errorf("can not allocate memory");
+			return NULL;
+		}
+	}
+	memcpy(key, source, slength);
+	key[slength] = '\0';
+	memcpy(key + slength + 1, event, elength);
+	return key;
+}
+
+static unsigned long long route_find (struct shards *shards, const char *source, const char *event)
+{
+	char buffer[256];
+	char *key;
+	unsigned int length;
+	struct route *route;
+	key = route_key(buffer, sizeof(buffer), source, event, &length);
+	if (key == NULL) {
+		return 0;
+	}
+	route = mbus_hash_get(shards->routes, key, length);
+	if (key != buffer) {
+		free(key);
+	}
+	return (route == NULL) ? 0 : route->shards;
+}
+
+struct shard_message * mbus_server_shard_message_create (enum shard_message_type type, unsigned int shard, const char *source, const char *destination, const char *identifier, int sequence, int status, const struct mbus_json *payload)
+{
+	struct shard_message *message;
+	message = malloc(sizeof(struct shard_message));
+	if (message == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(message, 0, sizeof(struct shard_message));
+	message->type = type;
+	message->shard = shard;
+	message->sequence = sequence;
+	message->status = status;
+	if (source != NULL) {
+		message->source = strdup(source);
+		if (message->source == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+	}
+	if (destination != NULL) {
+		message->destination = strdup(destination);
+		if (message->destination == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+	}
+	if (identifier != NULL) {
+		message->identifier = strdup(identifier);
+		if (message->identifier == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+	}
+	if (payload != NULL) {
+		message->payload = mbus_json_duplicate(payload, 1);
+		if (message->payload == NULL) {
+			mbus_errorf("can not duplicate payload");
+			goto bail;
+		}
+	}
+	return message;
+bail:	if (message != NULL) {
+		mbus_server_shard_message_destroy(message);
+	}
+	return NULL;
+}
+
+struct shard_message * mbus_server_shard_message_create_event (unsigned int shard, const char *source, const char *destination, const char *identifier, const char *payload, int payloadlength)
+{
+	struct shard_message *message;
+	message = mbus_server_shard_message_create(shard_message_type_event, shard, source, destination, identifier, 0, 0, NULL);
+	if (message == NULL) {
+		goto bail;
+	}
+	if (payload != NULL) {
+		message->data = malloc(payloadlength + 1);
+		if (message->data == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		memcpy(message->data, payload, payloadlength);
+		message->data[payloadlength] = '\0';
+		message->length = payloadlength;
+	}
+	return message;
+bail:	if (message != NULL) {
+		mbus_server_shard_message_destroy(message);
+	}
+	return NULL;
+}
+
+int mbus_server_shard_message_set_attachments (struct shard_message *message, const struct mbus_method_attachment *attachments, int nattachments)
+{
+	if (message == NULL) {
+		mbus_errorf("message is invalid");
+		return -1;
+	}
+	if (nattachments <= 0) {
+		return 0;
+	}
+	message->attachments = mbus_method_attachments_duplicate(attachments, nattachments);
+	if (message->attachments == NULL) {
+		mbus_errorf("can not duplicate attachments");
+		return -1;
+	}
+	message->nattachments = nattachments;
+	return 0;
+}
+
+void mbus_server_shard_message_destroy (struct shard_message *message)
+{
+	if (message == NULL) {
+		return;
+	}
+	if (message->source != NULL) {
+		free(message->source);
+	}
+	if (message->destination != NULL) {
+		free(message->destination);
+	}
+	if (message->identifier != NULL) {
+		free(message->identifier);
+	}
+	if (message->payload != NULL) {
+		mbus_json_delete(message->payload);
+	}
+	if (message->data != NULL) {
+		free(message->data);
+	}
+	if (message->attachments != NULL) {
+		free(message->attachments);
+	}
+	free(message);
+}
+
+struct shards * mbus_server_shards_create (unsigned int count)
+{
+	int rc;
+	unsigned int i;
+	struct shards *shards;
+	shards = NULL;
+	if (count == 0 || count > MBUS_SERVER_SHARDS_MAX) {
+		mbus_errorf("shard count: %u is invalid", count);
+		goto bail;
+	}
+	shards = malloc(sizeof(struct shards));
+	if (shards == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(shards, 0, sizeof(struct shards));
+	TAILQ_INIT(&shards->route_list);
+	rc = pthread_rwlock_init(&shards->lock, NULL);
+	if (rc != 0) {
+		mbus_errorf("can not create lock");
+		free(shards);
+		shards = NULL;
+		goto bail;
+	}
+	shards->inboxes = malloc(sizeof(struct inbox) * count);
+	if (shards->inboxes == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	for (i = 0; i < count; i++) {
+		shards->inboxes[i].head = NULL;
+		shards->inboxes[i].signalled = 0;
+		shards->inboxes[i].fds[0] = -1;
+		shards->inboxes[i].fds[1] = -1;
+	}
+	shards->count = count;
+	for (i = 0; i < count; i++) {
+		rc = pipe(shards->inboxes[i].fds);
+		if (rc != 0) {
+			mbus_errorf("can not create pipe: %s", strerror(errno));
+			shards->inboxes[i].fds[0] = -1;
+			shards->inboxes[i].fds[1] = -1;
+			goto bail;
+		}
+		fcntl(shards->inboxes[i].fds[0], F_SETFL, fcntl(shards->inboxes[i].fds[0], F_GETFL) | O_NONBLOCK);
+		fcntl(shards->inboxes[i].fds[1], F_SETFL, fcntl(shards->inboxes[i].fds[1], F_GETFL) | O_NONBLOCK);
+		fcntl(shards->inboxes[i].fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(shards->inboxes[i].fds[1], F_SETFD, FD_CLOEXEC);
+	}
+	shards->identifiers = mbus_hash_create();
+	if (shards->identifiers == NULL) {
+		mbus_errorf("can not create identifier index");
+		goto bail;
+	}
+	shards->routes = mbus_hash_create();
+	if (shards->routes == NULL) {
+		mbus_errorf("can not create route index");
+		goto bail;
+	}
+	return shards;
+bail:	if (shards != NULL) {
+		mbus_server_shards_destroy(shards);
+	}
+	return NULL;
+}
+
+void mbus_server_shards_destroy (struct shards *shards)
+{
+	unsigned int i;
+	struct route *route;
+	struct shard_message *message;
+	struct shard_message *nmessage;
+	if (shards == NULL) {
+		return;
+	}
+	if (shards->inboxes != NULL) {
+		for (i = 0; i < shards->count; i++) {
+			for (message = shards->inboxes[i].head; message != NULL; message = nmessage) {
+				nmessage = message->next;
+				mbus_server_shard_message_destroy(message);
+			}
+			if (shards->inboxes[i].fds[0] >= 0) {
+				close(shards->inboxes[i].fds[0]);
+			}
+			if (shards->inboxes[i].fds[1] >= 0) {
+				close(shards->inboxes[i].fds[1]);
+			}
+		}
+		free(shards->inboxes);
+	}
+	if (shards->identifiers != NULL) {
+		mbus_hash_destroy(shards->identifiers);
+	}
+	if (shards->routes != NULL) {
+		mbus_hash_destroy(shards->routes);
+	}
+	/* routes still subscribed when the shards go down */
+	while (shards->route_list.tqh_first != NULL) {
+		route = shards->route_list.tqh_first;
+		TAILQ_REMOVE(&shards->route_list, route, routes);
+		free(route);
+	}
+	pthread_rwlock_destroy(&shards->lock);
+	free(shards);
+}
+
+unsigned int mbus_server_shards_get_count (struct shards *shards)
+{
+	if (shards == NULL) {
+		return 0;
+	}
+	return shards->count;
+}
+
+int mbus_server_shards_get_fd (struct shards *shards, unsigned int shard)
+{
+	if (shards == NULL) {
+		return -1;
+	}
+	if (shard >= shards->count) {
+		return -1;
+	}
+	return shards->inboxes[shard].fds[0];
+}
+
+int mbus_server_shards_push (struct shards *shards, unsigned int shard, struct shard_message *message)
+{
+	int rc;
+	struct inbox *inbox;
+	struct shard_message *head;
+	if (shards == NULL) {
+		mbus_errorf("shards is null");
+		goto bail;
+	}
+	if (shard >= shards->count) {
+		mbus_errorf("shard: %u is invalid", shard);
+		goto bail;
+	}
+	if (message == NULL) {
+		mbus_errorf("message is null");
+		goto bail;
+	}
+	inbox = &shards->inboxes[shard];
+	head = __atomic_load_n(&inbox->head, __ATOMIC_SEQ_CST);
+	do {
+		message->next = head;
+	} while (!__atomic_compare_exchange_n(&inbox->head, &head, message, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	if (__atomic_exchange_n(&inbox->signalled, 1, __ATOMIC_SEQ_CST) == 0) {
+		do {
+			rc = write(inbox->fds[1], "", 1);
+		} while (rc < 0 && errno == EINTR);
+	}
+	return 0;
+bail:	return -1;
+}
+
+struct shard_message * mbus_server_shards_pop (struct shards *shards, unsigned int shard)
+{
+	int rc;
+	char buffer[64];
+	struct inbox *inbox;
+	struct shard_message *head;
+	struct shard_message *next;
+	struct shard_message *messages;
+	if (shards == NULL) {
+		return NULL;
+	}
+	if (shard >= shards->count) {
+		return NULL;
+	}
+	inbox = &shards->inboxes[shard];
+	do {
+		rc = read(inbox->fds[0], buffer, sizeof(buffer));
+	} while (rc > 0 || (rc < 0 && errno == EINTR));
+	__atomic_store_n(&inbox->signalled, 0, __ATOMIC_SEQ_CST);
+	head = __atomic_exchange_n(&inbox->head, NULL, __ATOMIC_SEQ_CST);
+	messages = NULL;
+	while (head != NULL) {
+		next = head->next;
+		head->next = messages;
+		messages = head;
+		head = next;
+	}
+	return messages;
+}
+
+int mbus_server_shards_add_identifier (struct shards *shards, const char *identifier, unsigned int shard)
+{
+	int rc;
+	if (shards == NULL) {
+		mbus_errorf("shards is null");
+		goto bail;
+	}
+	if (identifier == NULL) {
+		mbus_errorf("identifier is null");
+		goto bail;
+	}
+	pthread_rwlock_wrlock(&shards->lock);
+	if (mbus_hash_get_string(shards->identifiers, identifier) != NULL) {
+		pthread_rwlock_unlock(&shards->lock);
+		mbus_errorf("identifier: %s already exists", identifier);
+		goto bail;
+	}
+	rc = mbus_hash_put_string(shards->identifiers, identifier, (void *) (uintptr_t) (shard + 1));
+	pthread_rwlock_unlock(&shards->lock);
+	if (rc != 0) {
+		mbus_errorf("can not add identifier: %s", identifier);
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+void mbus_server_shards_del_identifier (struct shards *shards, const char *identifier, unsigned int shard)
+{
+	if (shards == NULL) {
+		return;
+	}
+	if (identifier == NULL) {
+		return;
+	}
+	pthread_rwlock_wrlock(&shards->lock);
+	if (mbus_hash_get_string(shards->identifiers, identifier) == (void *) (uintptr_t) (shard + 1)) {
+		mbus_hash_del_string(shards->identifiers, identifier);
+	}
+	pthread_rwlock_unlock(&shards->lock);
+}
+
+int mbus_server_shards_find_identifier (struct shards *shards, const char *identifier)
+{
+	uintptr_t shard;
+	if (shards == NULL) {
+		return -1;
+	}
+	if (identifier == NULL) {
+		return -1;
+	}
+	pthread_rwlock_rdlock(&shards->lock);
+	shard = (uintptr_t) mbus_hash_get_string(shards->identifiers, identifier);
+	pthread_rwlock_unlock(&shards->lock);
+	return (int) shard - 1;
+}
+
+int mbus_server_shards_add_route (struct shards *shards, const char *source, const char *event, unsigned int shard)
+{
+	int rc;
+	char buffer[256];
+	char *key;
+	unsigned int length;
+	struct route *route;
+	key = NULL;
+	if (shards == NULL) {
+		mbus_errorf("shards is null");
+		goto bail;
+	}
+	if (source == NULL || event == NULL) {
+		mbus_errorf("route is invalid");
+		goto bail;
+	}
+	key = route_key(buffer, sizeof(buffer), source, event, &length);
+	if (key == NULL) {
+		goto bail;
+	}
+	pthread_rwlock_wrlock(&shards->lock);
+	route = mbus_hash_get(shards->routes, key, length);
+	if (route == NULL) {
+		route = malloc(sizeof(struct route));
+		if (route == NULL) {
+			pthread_rwlock_unlock(&shards->lock);
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		route->shards = 0;
+		rc = mbus_hash_put(shards->routes, key, length, route);
+		if (rc != 0) {
+			pthread_rwlock_unlock(&shards->lock);
+			free(route);
+			mbus_errorf("can not add route");
+			goto bail;
+		}
+		TAILQ_INSERT_TAIL(&shards->route_list, route, routes);
+	}
+	route->shards |= 1ULL << shard;
+	pthread_rwlock_unlock(&shards->lock);
+	if (key != buffer) {
+		free(key);
+	}
+	return 0;
+bail:	if (key != NULL && key != buffer) {
+		free(key);
+	}
+	return -1;
+}
+
+void mbus_server_shards_del_route (struct shards *shards, const char *source, const char *event, unsigned int shard)
+{
+	char buffer[256];
+	char *key;
+	unsigned int length;
+	struct route *route;
+	if (shards == NULL) {
+		return;
+	}
+	if (source == NULL || event == NULL) {
+		return;
+	}
+	key = route_key(buffer, sizeof(buffer), source, event, &length);
+	if (key == NULL) {
+		return;
+	}
+	pthread_rwlock_wrlock(&shards->lock);
+	route = mbus_hash_get(shards->routes, key, length);
+	if (route != NULL) {
+		route->shards &= ~(1ULL << shard);
+		if (route->shards == 0) {
+			mbus_hash_del(shards->routes, key, length);
+			TAILQ_REMOVE(&shards->route_list, route, routes);
+			free(route);
+		}
+	}
+	pthread_rwlock_unlock(&shards->lock);
+	if (key != buffer) {
+		free(key);
+	}
+}
+
+unsigned long long mbus_server_shards_find_routes (struct shards *shards, const char *source, const char *event)
+{
+	unsigned long long mask;
+	if (shards == NULL) {
+		return 0;
+	}
+	if (source == NULL || event == NULL) {
+		return 0;
+	}
+	mask = 0;
+	pthread_rwlock_rdlock(&shards->lock);
+	mask |= route_find(shards, source, event);
+	mask |= route_find(shards, source, MBUS_METHOD_EVENT_IDENTIFIER_ALL);
+	mask |= route_find(shards, MBUS_METHOD_EVENT_SOURCE_ALL, event);
+	mask |= route_find(shards, MBUS_METHOD_EVENT_SOURCE_ALL, MBUS_METHOD_EVENT_IDENTIFIER_ALL);
+	pthread_rwlock_unlock(&shards->lock);
+	return mask;
+}
@@ -0,0 +1,81 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+struct mbus_json;
+struct mbus_method_attachment;
+struct shards;
+
+enum shard_message_type {
+	shard_message_type_event,
+	shard_message_type_call,
+	shard_message_type_result,
+	shard_message_type_closed,
+	shard_message_type_stop,
+};
+
+struct shard_message {
+	struct shard_message *next;
+	enum shard_message_type type;
+	unsigned int shard;
+	char *source;
+	char *destination;
+	char *identifier;
+	int sequence;
+	int status;
+	int priority;
+	unsigned long long deadline;
+	struct mbus_json *payload;
+	char *data;
+	int length;
+	struct mbus_method_attachment *attachments;
+	int nattachments;
+};
+
+#define MBUS_SERVER_SHARDS_MAX	64
+
+struct shard_message * mbus_server_shard_message_create (enum shard_message_type type, unsigned int shard, const char *source, const char *destination, const char *identifier, int sequence, int status, const struct mbus_json *payload);
+struct shard_message * mbus_server_shard_message_create_event (unsigned int shard, const char *source, const char *destination, const char *identifier, const char *payload, int payloadlength);
+int mbus_server_shard_message_set_attachments (struct shard_message *message, const struct mbus_method_attachment *attachments, int nattachments);
+void mbus_server_shard_message_destroy (struct shard_message *message);
+
+struct shards * mbus_server_shards_create (unsigned int count);
+void mbus_server_shards_destroy (struct shards *shards);
+
+unsigned int mbus_server_shards_get_count (struct shards *shards);
+int mbus_server_shards_get_fd (struct shards *shards, unsigned int shard);
+
+int mbus_server_shards_push (struct shards *shards, unsigned int shard, struct shard_message *message);
+struct shard_message * mbus_server_shards_pop (struct shards *shards, unsigned int shard);
+
+int mbus_server_shards_add_identifier (struct shards *shards, const char *identifier, unsigned int shard);
+void mbus_server_shards_del_identifier (struct shards *shards, const char *identifier, unsigned int shard);
+int mbus_server_shards_find_identifier (struct shards *shards, const char *identifier);
+
+int mbus_server_shards_add_route (struct shards *shards, const char *source, const char *event, unsigned int shard);
+void mbus_server_shards_del_route (struct shards *shards, const char *source, const char *event, unsigned int shard);
+unsigned long long mbus_server_shards_find_routes (struct shards *shards, const char *source, const char *event);
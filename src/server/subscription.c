@@ -38,6 +38,7 @@ struct private {
 	struct subscription subscription;
 	char *source;
 	char *event;
+	void *context;
 };
 
 const char * mbus_server_subscription_get_source (const struct subscription *subscription)
@@ -60,6 +61,28 @@ const char * mbus_server_subscription_get_event (const struct subscription *subs
 	return private->event;
 }
 
+int mbus_server_subscription_set_context (struct subscription *subscription, void *context)
+{
+	struct private *private;
+	if (subscription == NULL) {
+		mbus_errorf("subscription is null");
+		return -1;
+	}
+	private = (struct private *) subscription;
+	private->context = context;
+	return 0;
+}
+
+void * mbus_server_subscription_get_context (const struct subscription *subscription)
+{
+	const struct private *private;
+	if (subscription == NULL) {
+		return NULL;
+	}
+	private = (const struct private *) subscription;
+	return private->context;
+}
+
 void mbus_server_subscription_destroy (struct subscription *subscription)
 {
 	struct private *private;
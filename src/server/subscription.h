@@ -28,6 +28,7 @@
 
 struct subscription {
 	TAILQ_ENTRY(subscription) subscriptions;
+	TAILQ_ENTRY(subscription) routes;
 };
 TAILQ_HEAD(subscriptions, subscription);
 
@@ -36,3 +37,6 @@ void mbus_server_subscription_destroy (struct subscription *subscription);
 
 const char * mbus_server_subscription_get_source (const struct subscription *subscription);
 const char * mbus_server_subscription_get_event (const struct subscription *subscription);
+
+int mbus_server_subscription_set_context (struct subscription *subscription, void *context);
+void * mbus_server_subscription_get_context (const struct subscription *subscription);
@@ -0,0 +1,338 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MBUS_DEBUG_NAME	"mbus-worker"
+
+#include "mbus/debug.h"
+#include "mbus/tailq.h"
+#include "mbus/compress.h"
+#include "mbus/buffer.h"
+
+#include "worker.h"
+
+/*
+ * compression jobs are taken from the event loop by a fixed set of
+ * threads. finished jobs are moved to a completion list and the loop is
+ * woken through a pipe, which is written only when that list goes from
+ * empty to non empty. ordering is left to the caller, jobs complete in
+ * any order.
+ */
+
+struct workers {
+	int count;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct worker_jobs queued;
+	struct worker_jobs completed;
+	int fds[2];
+	int stop;
+};
+
+static void * workers_thread (void *arg)
+{
+	int rc;
+	struct workers *workers;
+	struct worker_job *job;
+	workers = arg;
+	pthread_mutex_lock(&workers->mutex);
+	while (1) {
+		while (workers->stop == 0 &&
+		       workers->queued.tqh_first == NULL) {
+			pthread_cond_wait(&workers->cond, &workers->mutex);
+		}
+		if (workers->stop != 0) {
+			break;
+		}
+		job = workers->queued.tqh_first;
+		TAILQ_REMOVE(&workers->queued, job, jobs);
+		pthread_mutex_unlock(&workers->mutex);
+		job->status = mbus_server_worker_job_run(job);
+		pthread_mutex_lock(&workers->mutex);
+		if (workers->completed.tqh_first == NULL) {
+			do {
+				rc = write(workers->fds[1], "", 1);
+			} while (rc < 0 && errno == EINTR);
+		}
+		TAILQ_INSERT_TAIL(&workers->completed, job, jobs);
+	}
+	pthread_mutex_unlock(&workers->mutex);
+	return NULL;
+}
+
+struct worker_job * mbus_server_worker_job_create (enum worker_job_type type, enum mbus_compress_method compression, const void *input, unsigned int inputlen, unsigned int uncompressed)
+{
+	struct worker_job *job;
+	job = malloc(sizeof(struct worker_job));
+	if (job == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(job, 0, sizeof(struct worker_job));
+	job->type = type;
+	job->compression = compression;
+	job->uncompressed = uncompressed;
+	job->status = -1;
+	job->input = malloc(inputlen + 1);
+	if (job->input == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memcpy(job->input, input, inputlen);
+	((char *) job->input)[inputlen] = '\0';
+	job->inputlen = inputlen;
+	job->output = mbus_buffer_create();
+	if (job->output == NULL) {
+		mbus_errorf("can not create buffer");
+		goto bail;
+	}
+	return job;
+bail:	if (job != NULL) {
+		mbus_server_worker_job_destroy(job);
+	}
+	return NULL;
+}
+
+void mbus_server_worker_job_destroy (struct worker_job *job)
+{
+	if (job == NULL) {
+		return;
+	}
+	if (job->input != NULL) {
+		free(job->input);
+	}
+	if (job->output != NULL) {
+		mbus_buffer_destroy(job->output);
+	}
+	free(job);
+}
+
+int mbus_server_worker_job_run (struct worker_job *job)
+{
+	int rc;
+	int length;
+	uint8_t *base;
+	if (job == NULL) {
+		mbus_errorf("job is null");
+		goto bail;
+	}
+	if (job->type == worker_job_type_data) {
+		rc = mbus_buffer_push(job->output, job->input, job->inputlen);
+		if (rc != 0) {
+			mbus_errorf("can not push data");
+			goto bail;
+		}
+	} else if (job->type == worker_job_type_compress) {
+		rc = mbus_buffer_push_data(job->output, job->compression, job->input, job->inputlen);
+		if (rc != 0) {
+			mbus_errorf("can not push data");
+			goto bail;
+		}
+	} else if (job->type == worker_job_type_uncompress) {
+		rc = mbus_buffer_reserve(job->output, job->uncompressed + 1);
+		if (rc != 0) {
+			mbus_errorf("can not reserve buffer");
+			goto bail;
+		}
+		base = mbus_buffer_get_base(job->output);
+		length = job->uncompressed;
+		rc = mbus_uncompress_data_to(job->compression, base, &length, job->input, job->inputlen);
+		if (rc != 0) {
+			mbus_errorf("can not uncompress data");
+			goto bail;
+		}
+		if (length != (int) job->uncompressed) {
+			mbus_errorf("can not uncompress data");
+			goto bail;
+		}
+		base[length] = '\0';
+		rc = mbus_buffer_set_length(job->output, length);
+		if (rc != 0) {
+			mbus_errorf("can not set buffer length");
+			goto bail;
+		}
+	} else {
+		mbus_errorf("job type: %d is invalid", job->type);
+		goto bail;
+	}
+	return 0;
+bail:	return -1;
+}
+
+struct workers * mbus_server_workers_create (int count)
+{
+	int i;
+	int rc;
+	struct workers *workers;
+	workers = NULL;
+	if (count <= 0) {
+		mbus_errorf("worker count: %d is invalid", count);
+		goto bail;
+	}
+	workers = malloc(sizeof(struct workers));
+	if (workers == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(workers, 0, sizeof(struct workers));
+	pthread_mutex_init(&workers->mutex, NULL);
+	pthread_cond_init(&workers->cond, NULL);
+	TAILQ_INIT(&workers->queued);
+	TAILQ_INIT(&workers->completed);
+	workers->fds[0] = -1;
+	workers->fds[1] = -1;
+	rc = pipe(workers->fds);
+	if (rc != 0) {
+		mbus_errorf("can not create pipe: %s", strerror(errno));
+		workers->fds[0] = -1;
+		workers->fds[1] = -1;
+		goto bail;
+	}
+	fcntl(workers->fds[0], F_SETFL, fcntl(workers->fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(workers->fds[1], F_SETFL, fcntl(workers->fds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(workers->fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(workers->fds[1], F_SETFD, FD_CLOEXEC);
+	workers->threads = malloc(sizeof(pthread_t) * count);
+	if (workers->threads == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	for (i = 0; i < count; i++) {
+		rc = pthread_create(&workers->threads[i], NULL, workers_thread, workers);
+		if (rc != 0) {
+			mbus_errorf("can not create worker thread");
+			goto bail;
+		}
+		workers->count += 1;
+	}
+	return workers;
+bail:	if (workers != NULL) {
+		mbus_server_workers_destroy(workers);
+	}
+	return NULL;
+}
+
+void mbus_server_workers_destroy (struct workers *workers)
+{
+	int i;
+	struct worker_job *job;
+	if (workers == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&workers->mutex);
+	workers->stop = 1;
+	pthread_cond_broadcast(&workers->cond);
+	pthread_mutex_unlock(&workers->mutex);
+	for (i = 0; i < workers->count; i++) {
+		pthread_join(workers->threads[i], NULL);
+	}
+	if (workers->threads != NULL) {
+		free(workers->threads);
+	}
+	while (workers->queued.tqh_first != NULL) {
+		job = workers->queued.tqh_first;
+		TAILQ_REMOVE(&workers->queued, job, jobs);
+		mbus_server_worker_job_destroy(job);
+	}
+	while (workers->completed.tqh_first != NULL) {
+		job = workers->completed.tqh_first;
+		TAILQ_REMOVE(&workers->completed, job, jobs);
+		mbus_server_worker_job_destroy(job);
+	}
+	if (workers->fds[0] >= 0) {
+		close(workers->fds[0]);
+	}
+	if (workers->fds[1] >= 0) {
+		close(workers->fds[1]);
+	}
+	pthread_cond_destroy(&workers->cond);
+	pthread_mutex_destroy(&workers->mutex);
+	free(workers);
+}
+
+int mbus_server_workers_get_fd (struct workers *workers)
+{
+	if (workers == NULL) {
+		return -1;
+	}
+	return workers->fds[0];
+}
+
+int mbus_server_workers_submit (struct workers *workers, struct worker_job *job)
+{
+	if (workers == NULL) {
+		mbus_errorf("workers is null");
+		goto bail;
+	}
+	if (job == NULL) {
+		mbus_errorf("job is null");
+		goto bail;
+	}
+	pthread_mutex_lock(&workers->mutex);
+	TAILQ_INSERT_TAIL(&workers->queued, job, jobs);
+	pthread_cond_signal(&workers->cond);
+	pthread_mutex_unlock(&workers->mutex);
+	return 0;
+bail:	return -1;
+}
+
+int mbus_server_workers_complete (struct workers *workers, struct worker_jobs *jobs)
+{
+	int rc;
+	char buffer[64];
+	struct worker_job *job;
+	if (workers == NULL) {
+		mbus_errorf("workers is null");
+		goto bail;
+	}
+	if (jobs == NULL) {
+		mbus_errorf("jobs is null");
+		goto bail;
+	}
+	pthread_mutex_lock(&workers->mutex);
+	do {
+		rc = read(workers->fds[0], buffer, sizeof(buffer));
+	} while (rc > 0 || (rc < 0 && errno == EINTR));
+	while (workers->completed.tqh_first != NULL) {
+		job = workers->completed.tqh_first;
+		TAILQ_REMOVE(&workers->completed, job, jobs);
+		TAILQ_INSERT_TAIL(jobs, job, jobs);
+	}
+	pthread_mutex_unlock(&workers->mutex);
+	return 0;
+bail:	return -1;
+}
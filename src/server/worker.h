@@ -0,0 +1,61 @@
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+struct workers;
+
+enum worker_job_type {
+	worker_job_type_data,
+	worker_job_type_compress,
+	worker_job_type_uncompress,
+};
+
+struct worker_job {
+	TAILQ_ENTRY(worker_job) jobs;
+	TAILQ_ENTRY(worker_job) pendings;
+	enum worker_job_type type;
+	enum mbus_compress_method compression;
+	void *input;
+	unsigned int inputlen;
+	unsigned int uncompressed;
+	struct mbus_buffer *output;
+	int status;
+	int done;
+	void *context;
+};
+TAILQ_HEAD(worker_jobs, worker_job);
+
+struct worker_job * mbus_server_worker_job_create (enum worker_job_type type, enum mbus_compress_method compression, const void *input, unsigned int inputlen, unsigned int uncompressed);
+void mbus_server_worker_job_destroy (struct worker_job *job);
+int mbus_server_worker_job_run (struct worker_job *job);
+
+struct workers * mbus_server_workers_create (int count);
+void mbus_server_workers_destroy (struct workers *workers);
+
+int mbus_server_workers_get_fd (struct workers *workers);
+int mbus_server_workers_submit (struct workers *workers, struct worker_job *job);
+int mbus_server_workers_complete (struct workers *workers, struct worker_jobs *jobs);
@@ -204,6 +204,30 @@ int mbus_socket_get_reuseaddr (struct mbus_socket *socket)
 	return !!opt;
 }
 
+int mbus_socket_set_reuseport (struct mbus_socket *socket, int on)
+{
+#if defined(SO_REUSEPORT)
+	int rc;
+	int opt;
+	if (socket == NULL) {
+		mbus_errorf("socket is null");
+		return -1;
+	}
+	opt = !!on;
+	rc = setsockopt(socket->fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+	if (rc < 0) {
+		mbus_errorf("setsockopt reuseport failed");
+		return -1;
+	}
+	return 0;
+#else
+	(void) socket;
+	(void) on;
+	mbus_errorf("reuseport is not supported");
+	return -1;
+#endif
+}
+
 int mbus_socket_set_blocking (struct mbus_socket *socket, int on)
 {
 	int rc;
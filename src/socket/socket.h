@@ -58,6 +58,8 @@ int mbus_socket_get_error (struct mbus_socket *socket);
 int mbus_socket_set_reuseaddr (struct mbus_socket *socket, int on);
 int mbus_socket_get_reuseaddr (struct mbus_socket *socket);
 
+int mbus_socket_set_reuseport (struct mbus_socket *socket, int on);
+
 int mbus_socket_set_blocking (struct mbus_socket *socket, int on);
 int mbus_socket_get_blocking (struct mbus_socket *socket);
 
@@ -0,0 +1,203 @@
+
+
+/*
+ * Copyright (c) 2017, Alper Akcan <alper.akcan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the copyright holder nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MBUS_DEBUG_NAME	"mbus-timer"
+
+#include "mbus/debug.h"
+#include "mbus/clock.h"
+
+#include "mbus/timer.h"
+
+/*
+ * binary min heap of armed timers ordered by expiry. every timer keeps
+ * its own slot, so it can be moved or removed without a search.
+ */
+
+struct mbus_timers {
+	unsigned int count;
+	unsigned int size;
+	struct mbus_timer **timers;
+};
+
+static void timers_set (struct mbus_timers *timers, unsigned int slot, struct mbus_timer *timer)
+{
+	timers->timers[slot] = timer;
+	timer->index = slot + 1;
+}
+
+static void timers_sift_up (struct mbus_timers *timers, unsigned int slot)
+{
+	unsigned int parent;
+	struct mbus_timer *timer;
+	timer = timers->timers[slot];
+	while (slot > 0) {
+		parent = (slot - 1) / 2;
+		if (!mbus_clock_before(timer->expires, timers->timers[parent]->expires)) {
+			break;
+		}
+		timers_set(timers, slot, timers->timers[parent]);
+		slot = parent;
+	}
+	timers_set(timers, slot, timer);
+}
+
+static void timers_sift_down (struct mbus_timers *timers, unsigned int slot)
+{
+	unsigned int child;
+	struct mbus_timer *timer;
+	timer = timers->timers[slot];
+	while ((child = slot * 2 + 1) < timers->count) {
+		if (child + 1 < timers->count &&
+		    mbus_clock_before(timers->timers[child + 1]->expires, timers->timers[child]->expires)) {
+			child += 1;
+		}
+		if (!mbus_clock_before(timers->timers[child]->expires, timer->expires)) {
+			break;
+		}
+		timers_set(timers, slot, timers->timers[child]);
+		slot = child;
+	}
+	timers_set(timers, slot, timer);
+}
+
+int mbus_timers_add (struct mbus_timers *timers, struct mbus_timer *timer, unsigned long long expires)
+{
+	struct mbus_timer **tmp;
+	if (timers == NULL) {
+		mbus_errorf("timers is null");
+		goto bail;
+	}
+	if (timer == NULL) {
+		mbus_errorf("timer is null");
+		goto bail;
+	}
+	if (timer->index != 0) {
+		timer->expires = expires;
+		timers_sift_up(timers, timer->index - 1);
+		timers_sift_down(timers, timer->index - 1);
+		return 0;
+	}
+	if (timers->count >= timers->size) {
+		tmp = realloc(timers->timers, sizeof(struct mbus_timer *) * (timers->size + 64));
+		if (tmp == NULL) {
+			mbus_errorf("can not allocate memory");
+			goto bail;
+		}
+		timers->timers = tmp;
+		timers->size += 64;
+	}
+	timer->expires = expires;
+	timers->timers[timers->count] = timer;
+	timers->count += 1;
+	timers_sift_up(timers, timers->count - 1);
+	return 0;
+bail:	return -1;
+}
+
+void mbus_timers_del (struct mbus_timers *timers, struct mbus_timer *timer)
+{
+	unsigned int slot;
+	struct mbus_timer *last;
+	if (timers == NULL) {
+		return;
+	}
+	if (timer == NULL) {
+		return;
+	}
+	if (timer->index == 0) {
+		return;
+	}
+	slot = timer->index - 1;
+	timer->index = 0;
+	timers->count -= 1;
+	if (slot == timers->count) {
+		return;
+	}
+	last = timers->timers[timers->count];
+	timers_set(timers, slot, last);
+	timers_sift_up(timers, slot);
+	timers_sift_down(timers, last->index - 1);
+}
+
+struct mbus_timer * mbus_timers_peek (struct mbus_timers *timers)
+{
+	if (timers == NULL) {
+		return NULL;
+	}
+	if (timers->count == 0) {
+		return NULL;
+	}
+	return timers->timers[0];
+}
+
+struct mbus_timer * mbus_timers_pop (struct mbus_timers *timers, unsigned long long current)
+{
+	struct mbus_timer *timer;
+	timer = mbus_timers_peek(timers);
+	if (timer == NULL) {
+		return NULL;
+	}
+	if (mbus_clock_after(timer->expires, current)) {
+		return NULL;
+	}
+	mbus_timers_del(timers, timer);
+	return timer;
+}
+
+struct mbus_timers * mbus_timers_create (void)
+{
+	struct mbus_timers *timers;
+	timers = malloc(sizeof(struct mbus_timers));
+	if (timers == NULL) {
+		mbus_errorf("can not allocate memory");
+		goto bail;
+	}
+	memset(timers, 0, sizeof(struct mbus_timers));
+	return timers;
+bail:	return NULL;
+}
+
+void mbus_timers_destroy (struct mbus_timers *timers)
+{
+	unsigned int i;
+	if (timers == NULL) {
+		return;
+	}
+	for (i = 0; i < timers->count; i++) {
+		timers->timers[i]->index = 0;
+	}
+	if (timers->timers != NULL) {
+		free(timers->timers);
+	}
+	free(timers);
+}
@@ -136,6 +136,8 @@ static int mbus_client_receiver_callback_command_put (struct mbus_client *client
 	const char *s;
 	const char *d;
 	const char *e;
+	const void *data;
+	int length;
 	char *fname;
 	char *decoded;
 	size_t decoded_length;
@@ -154,15 +156,29 @@ static int mbus_client_receiver_callback_command_put (struct mbus_client *client
 		fprintf(stderr, "destination is invalid\n");
 		goto bail;
 	}
-	e = mbus_json_get_string_value(mbus_client_message_routine_request_payload(message), "encoded", NULL);
-	if (d == NULL) {
-		fprintf(stderr, "encoded is invalid\n");
-		goto bail;
-	}
-	decoded = (char *) base64_decode((unsigned char *) e, strlen(e), &decoded_length);
-	if (decoded == NULL) {
-		fprintf(stderr, "can not decode source: %s\n", s);
-		goto bail;
+	if (mbus_client_message_routine_request_attachments(message) > 0) {
+		data = mbus_client_message_routine_request_attachment(message, 0, &length);
+		if (data == NULL) {
+			fprintf(stderr, "attachment is invalid\n");
+			goto bail;
+		}
+	} else {
+		/*
+		 * clients without attachment support, like the browser page,
+		 * still send the file base64 encoded within the payload.
+		 */
+		e = mbus_json_get_string_value(mbus_client_message_routine_request_payload(message), "encoded", NULL);
+		if (e == NULL) {
+			fprintf(stderr, "encoded is invalid\n");
+			goto bail;
+		}
+		decoded = (char *) base64_decode((unsigned char *) e, strlen(e), &decoded_length);
+		if (decoded == NULL) {
+			fprintf(stderr, "can not decode source: %s\n", s);
+			goto bail;
+		}
+		data = decoded;
+		length = decoded_length;
 	}
 	fname = malloc(strlen(param->prefix) + strlen(d) + 1);
 	if (fname == NULL) {
@@ -175,14 +191,16 @@ static int mbus_client_receiver_callback_command_put (struct mbus_client *client
 		fprintf(stderr, "can not open file: %s\n", fname);
 		goto bail;
 	}
-	rc = write(fd, decoded, decoded_length);
-	if (rc != (int) decoded_length) {
+	rc = write(fd, data, length);
+	if (rc != length) {
 		fprintf(stderr, "can not write destination: %s\n", d);
 		goto bail;
 	}
 	close(fd);
 	free(fname);
-	free(decoded);
+	if (decoded != NULL) {
+		free(decoded);
+	}
 	return 0;
 bail:	if (decoded != NULL) {
 		free(decoded);
@@ -239,14 +257,12 @@ static void mbus_client_sender_callback_connect (struct mbus_client *client, voi
 	struct stat st;
 	char *buffer;
 	size_t buffer_length;
-	char *encoded;
-	size_t encoded_length;
 	struct mbus_json *request;
+	struct mbus_client_attachment attachment;
 	struct sender_param *param = context;
 	(void) client;
 	fd = -1;
 	buffer = NULL;
-	encoded = NULL;
 	request = NULL;
 	if (status != mbus_client_connect_status_success) {
 		goto bail;
@@ -273,11 +289,6 @@ static void mbus_client_sender_callback_connect (struct mbus_client *client, voi
 		goto bail;
 	}
 	buffer[rc] = '\0';
-	encoded = (char *) base64_encode((unsigned char *) buffer, buffer_length, &encoded_length);
-	if (encoded == NULL) {
-		fprintf(stderr, "can not encode source: %s\n", param->source);
-		goto bail;
-	}
 	request = mbus_json_create_object();
 	if (request == NULL) {
 		fprintf(stderr, "can not create request\n");
@@ -293,16 +304,15 @@ static void mbus_client_sender_callback_connect (struct mbus_client *client, voi
 		fprintf(stderr, "can not create request\n");
 		goto bail;
 	}
-	rc = mbus_json_add_string_to_object_cs(request, "encoded", encoded);
-	if (rc != 0) {
-		fprintf(stderr, "can not create request\n");
-		goto bail;
-	}
+	attachment.data = buffer;
+	attachment.length = buffer_length;
 	struct mbus_client_command_options command_options;
 	mbus_client_command_options_default(&command_options);
 	command_options.destination = param->identifier;
 	command_options.command = "command.put";
 	command_options.payload = request;
+	command_options.attachments = &attachment;
+	command_options.nattachments = 1;
 	command_options.callback = mbus_client_sender_callback_command_put_result;
 	command_options.context = param;
 	command_options.timeout = param->timeout;
@@ -312,15 +322,11 @@ static void mbus_client_sender_callback_connect (struct mbus_client *client, voi
 		goto bail;
 	}
 	mbus_json_delete(request);
-	free(encoded);
 	free(buffer);
 	return;
 bail:	if (request != NULL) {
 		mbus_json_delete(request);
 	}
-	if (encoded != NULL) {
-		free(encoded);
-	}
 	if (buffer != NULL) {
 		free(buffer);
 	}